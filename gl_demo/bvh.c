@@ -0,0 +1,235 @@
+#include "bvh.h"
+#include <string.h>
+
+typedef enum {
+  OUTSIDE,
+  INSIDE,
+  INTERSECTING,
+} containment_t;
+
+static void build(bvh_t* bvh, const bvh_box_t* boxes);
+static int build_node(bvh_t* bvh, const bvh_box_t* boxes, int first, int count);
+static void select_median(int* items,
+                          int count,
+                          int k,
+                          const bvh_box_t* boxes,
+                          int axis);
+static float centroid(const bvh_box_t* box, int axis);
+static void box_union(bvh_box_t* out, const bvh_box_t* box);
+static float box_area(const bvh_box_t* box);
+static float total_area(const bvh_t* bvh);
+static containment_t classify(const bvh_box_t* box, const frustum_t* frustum);
+
+bvh_t* bvh_new() {
+  return g_new0(bvh_t, 1);
+}
+
+void bvh_update(bvh_t* bvh, const bvh_box_t* boxes, int count) {
+  if (count != bvh->num_items) {
+    bvh->num_items = count;
+    bvh->items = g_renew(int, bvh->items, count);
+    // A binary tree with leaves of at least one item.
+    bvh->nodes = g_renew(bvh_node_t, bvh->nodes, MAX(1, count * 2));
+    build(bvh, boxes);
+    return;
+  }
+
+  // Children come after their parents, so walking the
+  // nodes backwards refits every child before its parent.
+  for (int i = bvh->num_nodes - 1; i >= 0; --i) {
+    bvh_node_t* node = &bvh->nodes[i];
+    if (node->left < 0) {
+      node->box = boxes[bvh->items[node->first]];
+      for (int j = 1; j < node->count; ++j) {
+        box_union(&node->box, &boxes[bvh->items[node->first + j]]);
+      }
+    } else {
+      node->box = bvh->nodes[node->left].box;
+      box_union(&node->box, &bvh->nodes[node->right].box);
+    }
+  }
+  if (total_area(bvh) > bvh->built_area * BVH_REBUILD_GROWTH) {
+    build(bvh, boxes);
+  }
+}
+
+int bvh_cull(const bvh_t* bvh, const frustum_t* frustum, int* visible) {
+  if (!bvh->num_nodes) {
+    return 0;
+  }
+  int stack[64];
+  int depth = 0;
+  int num_visible = 0;
+  stack[depth++] = 0;
+  while (depth) {
+    const bvh_node_t* node = &bvh->nodes[stack[--depth]];
+    containment_t c = classify(&node->box, frustum);
+    if (c == OUTSIDE) {
+      continue;
+    }
+    if (c == INSIDE || node->left < 0) {
+      memcpy(&visible[num_visible], &bvh->items[node->first],
+             sizeof(int) * node->count);
+      num_visible += node->count;
+      continue;
+    }
+    stack[depth++] = node->right;
+    stack[depth++] = node->left;
+  }
+  return num_visible;
+}
+
+void bvh_free(bvh_t* bvh) {
+  g_free(bvh->nodes);
+  g_free(bvh->items);
+  g_free(bvh);
+}
+
+void frustum_from_matrix(frustum_t* frustum, const float* m) {
+  // Each plane is the last row of the matrix plus or minus
+  // one of the others.
+  for (int i = 0; i < 6; ++i) {
+    int row = i / 2;
+    float sign = i % 2 ? -1 : 1;
+    for (int j = 0; j < 4; ++j) {
+      frustum->planes[i][j] = m[j * 4 + 3] + sign * m[j * 4 + row];
+    }
+  }
+}
+
+static void build(bvh_t* bvh, const bvh_box_t* boxes) {
+  for (int i = 0; i < bvh->num_items; ++i) {
+    bvh->items[i] = i;
+  }
+  bvh->num_nodes = 0;
+  if (bvh->num_items) {
+    build_node(bvh, boxes, 0, bvh->num_items);
+  }
+  bvh->built_area = total_area(bvh);
+  bvh->rebuilds++;
+}
+
+// Split the items at the median of their centers along
+// the longest axis of the node's box. Balanced splits keep
+// the depth, and so the cull's stack, logarithmic.
+static int build_node(bvh_t* bvh,
+                      const bvh_box_t* boxes,
+                      int first,
+                      int count) {
+  int index = bvh->num_nodes++;
+  bvh_node_t* node = &bvh->nodes[index];
+  node->first = first;
+  node->count = count;
+  node->box = boxes[bvh->items[first]];
+  for (int i = 1; i < count; ++i) {
+    box_union(&node->box, &boxes[bvh->items[first + i]]);
+  }
+  if (count <= BVH_LEAF_SIZE) {
+    node->left = node->right = -1;
+    return index;
+  }
+
+  int axis = 0;
+  for (int i = 1; i < 3; ++i) {
+    if (node->box.max[i] - node->box.min[i] >
+        node->box.max[axis] - node->box.min[axis]) {
+      axis = i;
+    }
+  }
+  int half = count / 2;
+  select_median(&bvh->items[first], count, half, boxes, axis);
+  node->left = build_node(bvh, boxes, first, half);
+  node->right = build_node(bvh, boxes, first + half, count - half);
+  return index;
+}
+
+// Partially sort items so that item k is where it would be
+// if sorted by center, with smaller ones before it.
+static void select_median(int* items,
+                          int count,
+                          int k,
+                          const bvh_box_t* boxes,
+                          int axis) {
+  int lo = 0;
+  int hi = count - 1;
+  while (lo < hi) {
+    float pivot = centroid(&boxes[items[(lo + hi) / 2]], axis);
+    int i = lo;
+    int j = hi;
+    while (i <= j) {
+      while (centroid(&boxes[items[i]], axis) < pivot) {
+        i++;
+      }
+      while (centroid(&boxes[items[j]], axis) > pivot) {
+        j--;
+      }
+      if (i <= j) {
+        int swap = items[i];
+        items[i] = items[j];
+        items[j] = swap;
+        i++;
+        j--;
+      }
+    }
+    if (k <= j) {
+      hi = j;
+    } else if (k >= i) {
+      lo = i;
+    } else {
+      return;
+    }
+  }
+}
+
+// Twice the center, which orders boxes the same.
+static float centroid(const bvh_box_t* box, int axis) {
+  return box->min[axis] + box->max[axis];
+}
+
+static void box_union(bvh_box_t* out, const bvh_box_t* box) {
+  for (int i = 0; i < 3; ++i) {
+    out->min[i] = MIN(out->min[i], box->min[i]);
+    out->max[i] = MAX(out->max[i], box->max[i]);
+  }
+}
+
+static float box_area(const bvh_box_t* box) {
+  float x = box->max[0] - box->min[0];
+  float y = box->max[1] - box->min[1];
+  float z = box->max[2] - box->min[2];
+  return 2 * (x * y + y * z + z * x);
+}
+
+static float total_area(const bvh_t* bvh) {
+  float area = 0;
+  for (int i = 0; i < bvh->num_nodes; ++i) {
+    area += box_area(&bvh->nodes[i].box);
+  }
+  return area;
+}
+
+static containment_t classify(const bvh_box_t* box, const frustum_t* frustum) {
+  containment_t result = INSIDE;
+  for (int i = 0; i < 6; ++i) {
+    const float* p = frustum->planes[i];
+    // The corners furthest along and against the normal.
+    float far = p[3];
+    float near = p[3];
+    for (int j = 0; j < 3; ++j) {
+      if (p[j] > 0) {
+        far += p[j] * box->max[j];
+        near += p[j] * box->min[j];
+      } else {
+        far += p[j] * box->min[j];
+        near += p[j] * box->max[j];
+      }
+    }
+    if (far < 0) {
+      return OUTSIDE;
+    }
+    if (near < 0) {
+      result = INTERSECTING;
+    }
+  }
+  return result;
+}
@@ -0,0 +1,63 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <glib.h>
+
+// Objects per leaf.
+#define BVH_LEAF_SIZE 4
+
+// Refitting lets boxes grow as objects move apart; once
+// their total area is this many times what it was when
+// built, the tree is built again.
+#define BVH_REBUILD_GROWTH 2.0f
+
+typedef struct {
+  float min[3];
+  float max[3];
+} bvh_box_t;
+
+// Every node covers a contiguous run of items, so a node
+// that is wholly visible can hand them all over at once.
+// Children always come after their parent.
+typedef struct {
+  bvh_box_t box;
+  int left;
+  int right;
+  int first;
+  int count;
+} bvh_node_t;
+
+// A bounding volume hierarchy over objects' boxes.
+typedef struct {
+  bvh_node_t* nodes;
+  int num_nodes;
+  int* items;
+  int num_items;
+  float built_area;
+  int rebuilds;
+} bvh_t;
+
+// The six planes of a view frustum, each as (a, b, c, d)
+// with ax + by + cz + d >= 0 on the inside.
+typedef struct {
+  float planes[6][4];
+} frustum_t;
+
+bvh_t* bvh_new();
+
+// Bring the tree up to date with the objects' current
+// boxes. The same objects only refit the boxes bottom up,
+// unless they have spread too far, and a different number
+// of objects builds the tree from scratch.
+void bvh_update(bvh_t* bvh, const bvh_box_t* boxes, int count);
+
+// Write the indices of the objects whose boxes touch the
+// frustum and return how many there are.
+int bvh_cull(const bvh_t* bvh, const frustum_t* frustum, int* visible);
+void bvh_free(bvh_t* bvh);
+
+// Take the planes of a frustum from a column-major view
+// projection matrix.
+void frustum_from_matrix(frustum_t* frustum, const float* m);
+
+#endif
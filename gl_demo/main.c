@@ -2,132 +2,134 @@
 // http://www.opengl-tutorial.org/beginners-tutorials/tutorial-2-the-first-triangle/
 // https://stackoverflow.com/questions/13403807/glvertexattribpointer-raising-gl-invalid-operation
 
-#define GL_GLEXT_PROTOTYPES 1
-
-#include <GL/gl.h>
 #include <gtk/gtk.h>
 #include <math.h>
+#include "bvh.h"
+#include "matrix.h"
+#include "model.h"
+#include "program.h"
+#include "timing.h"
 
 static GLfloat vertices[] = {
     // Front face.
     -0.25f,
     0.25f,
-    -1.0f,
+    0.25f,
     -0.25f,
     -0.25f,
-    -1.0f,
+    0.25f,
     0.25f,
     -0.25f,
-    -1.0f,
+    0.25f,
     0.25f,
     -0.25f,
-    -1.0f,
     0.25f,
     0.25f,
-    -1.0f,
+    0.25f,
+    0.25f,
     -0.25f,
     0.25f,
-    -1.0f,
+    0.25f,
 
     // Back face.
     -0.25f,
     0.25f,
-    -1.5f,
     -0.25f,
     -0.25f,
-    -1.5f,
+    -0.25f,
+    -0.25f,
     0.25f,
     -0.25f,
-    -1.5f,
+    -0.25f,
     0.25f,
     -0.25f,
-    -1.5f,
+    -0.25f,
     0.25f,
     0.25f,
-    -1.5f,
+    -0.25f,
     -0.25f,
     0.25f,
-    -1.5f,
+    -0.25f,
 
     // Right face.
     0.25f,
     -0.25f,
-    -1.0f,
+    0.25f,
     0.25f,
     -0.25f,
-    -1.5f,
+    -0.25f,
     0.25f,
     0.25f,
-    -1.5f,
+    -0.25f,
     0.25f,
     0.25f,
-    -1.5f,
+    -0.25f,
+    0.25f,
     0.25f,
     0.25f,
-    -1.0f,
     0.25f,
     -0.25f,
-    -1.0f,
+    0.25f,
 
     // Left face.
     -0.25f,
     -0.25f,
-    -1.0f,
+    0.25f,
+    -0.25f,
     -0.25f,
     -0.25f,
-    -1.5f,
     -0.25f,
     0.25f,
-    -1.5f,
+    -0.25f,
     -0.25f,
     0.25f,
-    -1.5f,
     -0.25f,
+    -0.25f,
+    0.25f,
     0.25f,
-    -1.0f,
     -0.25f,
     -0.25f,
-    -1.0f,
+    0.25f,
 
     // Bottom face.
     -0.25f,
     -0.25f,
-    -1.0f,
+    0.25f,
     0.25f,
     -0.25f,
-    -1.0f,
     0.25f,
+    0.25f,
+    -0.25f,
     -0.25f,
-    -1.5f,
     0.25f,
     -0.25f,
-    -1.5f,
     -0.25f,
     -0.25f,
-    -1.5f,
     -0.25f,
     -0.25f,
-    -1.0f,
+    -0.25f,
+    -0.25f,
+    0.25f,
 
     // Top face.
     -0.25f,
     0.25f,
-    -1.0f,
     0.25f,
     0.25f,
-    -1.0f,
     0.25f,
     0.25f,
-    -1.5f,
     0.25f,
     0.25f,
-    -1.5f,
     -0.25f,
     0.25f,
-    -1.5f,
+    0.25f,
+    -0.25f,
+    -0.25f,
+    0.25f,
     -0.25f,
+    -0.25f,
+    0.25f,
     0.25f,
-    -1.0f,
 };
 
 static GLfloat normals[] = {
@@ -150,117 +152,536 @@ static GLfloat normals[] = {
     0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 0.0f,
 };
 
+// Cubes sit on a square grid this far apart, each
+// circling its own spot and spinning about its own axis.
+#define CUBE_SPACING 1.5f
+#define CUBE_ORBIT 0.3f
+#define MAX_CUBES 100000
+
+// Loaded models are scaled to fit a cube this big.
+#define MODEL_SIZE 0.8f
+
+// Objects switch to the first coarser level of detail this
+// many of their radii away, and to each further one at
+// twice the distance of the last. Coarser levels merge
+// vertices on grids with these many cells per side, and
+// are only kept if they at least halve the triangles.
+#define MAX_LODS 4
+#define LOD_DISTANCE 12.0f
+static const int lod_cells[MAX_LODS - 1] = {48, 16, 6};
+
+// Radians the cubes turn per second.
+#define ANIMATION_SPEED 1.2f
+
+// How often the frame time readout is refreshed.
+#define STATS_INTERVAL 500000
+
+// GPU timer queries in flight. Results arrive a frame or
+// two late, and a frame is left untimed rather than wait
+// when they are all still pending.
+#define GPU_QUERIES 4
+
+#define HISTOGRAM_WIDTH 240
+#define HISTOGRAM_HEIGHT 100
+
+typedef struct {
+  float x;
+  float y;
+  float z;
+  float phase;
+  float axis[3];
+} cube_t;
+
 GtkWidget* gl_area;
-static GLuint program;
+GtkWidget* stats_label;
+GtkWidget* histogram_area;
+static program_t program;
 static GLuint vao;
 static GLuint vertex_buffer;
-static GLuint normal_buffer;
+static GLuint index_buffer;
+static GLuint instance_buffer;
 static float current_time = 0;
-
-static GLuint load_shaders() {
-  GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-  GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-  GLuint program = glCreateProgram();
-  glAttachShader(program, vertex_shader);
-  glAttachShader(program, fragment_shader);
-
-  const char* vertex_shader_code =
-      "\
+static gint64 start_time = 0;
+
+// The shape every cube is drawn with, at decreasing
+// levels of detail, and whether it has changed since it
+// was last copied into the GL buffers. All the levels
+// share one vertex and one index buffer.
+static model_t* lods[MAX_LODS];
+static int num_lods = 0;
+static GLint lod_base_vertex[MAX_LODS];
+static gsize lod_first_index[MAX_LODS];
+static float object_radius = 0;
+static gboolean model_changed = FALSE;
+static gchar* model_path = NULL;
+
+static int num_cubes = 0;
+static cube_t* cubes = NULL;
+static float scene_size = 0;
+
+// Each cube's bounds this frame, the cubes that may be in
+// view, and the level of detail of each of those.
+static bvh_t* bvh = NULL;
+static bvh_box_t* boxes = NULL;
+static int* visible = NULL;
+static int* visible_lods = NULL;
+static gboolean culling = TRUE;
+static gboolean fly_through = FALSE;
+
+// What the last frame submitted.
+static int frame_visible = 0;
+static int frame_draw_calls = 0;
+static gint64 frame_triangles = 0;
+
+// Frames rendered since the readout was last refreshed.
+static gint64 stats_start = 0;
+static int stats_frames = 0;
+
+// The CPU time render takes, and the GPU time its commands
+// take, for recent frames.
+static timing_history_t cpu_history;
+static timing_history_t gpu_history;
+static GLuint gpu_queries[GPU_QUERIES];
+static int gpu_query_next = 0;
+static int gpu_queries_pending = 0;
+
+static const char* vertex_shader_code =
+    "\
     #version 400 core\n \
     layout(location = 0) in vec3 pos; \n \
     layout(location = 1) in vec3 normal; \n \
-    uniform vec3 translation; \n \
+    layout(location = 2) in mat4 model; \n \
+    uniform mat4 view_projection; \n \
     out vec3 vertex_normal; \n \
     void main() { \n \
-      gl_Position.xyz = pos + translation; \n \
-      gl_Position.w = -gl_Position.z; \n \
-      gl_Position.z = gl_Position.z * gl_Position.z / 20; \n \
-      vertex_normal = normal; \n \
+      gl_Position = view_projection * model * vec4(pos, 1); \n \
+      vertex_normal = mat3(model) * normal; \n \
     }";
 
-  const char* fragment_shader_code =
-      "\
+static const char* fragment_shader_code =
+    "\
     #version 400 core \n \
     in vec3 vertex_normal; \n \
     out vec3 color; \n \
     void main() { \n \
-      float bn = dot(vertex_normal, normalize(vec3(0.3, 0.4, 0.5))); \n \
+      float bn = dot(normalize(vertex_normal), \n \
+                     normalize(vec3(0.3, 0.4, 0.5))); \n \
       if (bn < 0) { \n \
         bn = -bn; \n \
       } \n \
       color = vec3(bn, 0, 0); \n \
     }";
 
-  GLint result = GL_FALSE;
+// Uniforms of the program, in the order of uniform_names.
+enum {
+  UNIFORM_VIEW_PROJECTION,
+  NUM_UNIFORMS,
+};
+
+static const char* const uniform_names[] = {
+    "view_projection",
+};
+
+static void load_shaders() {
+  if (!program_load(&program, vertex_shader_code, fragment_shader_code,
+                    uniform_names, NUM_UNIFORMS)) {
+    printf("failed to create shaders.\n");
+    exit(1);
+  }
+  if (program.cached) {
+    printf("shaders loaded from cache in %.1f ms (compiling took %.1f ms)\n",
+           program.load_time / 1000.0, program.compile_time / 1000.0);
+  } else {
+    printf("shaders compiled in %.1f ms\n", program.load_time / 1000.0);
+  }
+}
 
-  glShaderSource(vertex_shader, 1, &vertex_shader_code, NULL);
-  glCompileShader(vertex_shader);
-  glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &result);
-  if (!result) {
-    goto fail;
+// Lay the cubes out on a square grid in the XZ plane,
+// centered on the origin.
+static void set_num_cubes(int count) {
+  num_cubes = count;
+  cubes = g_renew(cube_t, cubes, count);
+  boxes = g_renew(bvh_box_t, boxes, count);
+  visible = g_renew(int, visible, count);
+  visible_lods = g_renew(int, visible_lods, count);
+  int side = (int)ceil(sqrt(count));
+  scene_size = side * CUBE_SPACING;
+  GRand* rand = g_rand_new_with_seed(1);
+  for (int i = 0; i < count; ++i) {
+    cube_t* cube = &cubes[i];
+    cube->x = (i % side - (side - 1) / 2.0f) * CUBE_SPACING;
+    cube->y = 0;
+    cube->z = (i / side - (side - 1) / 2.0f) * CUBE_SPACING;
+    cube->phase = g_rand_double_range(rand, 0, 2 * M_PI);
+    float axis[3];
+    float length;
+    do {
+      length = 0;
+      for (int j = 0; j < 3; ++j) {
+        axis[j] = g_rand_double_range(rand, -1, 1);
+        length += axis[j] * axis[j];
+      }
+    } while (length < 0.01 || length > 1);
+    for (int j = 0; j < 3; ++j) {
+      cube->axis[j] = axis[j] / sqrtf(length);
+    }
   }
+  g_rand_free(rand);
+}
 
-  glShaderSource(fragment_shader, 1, &fragment_shader_code, NULL);
-  glCompileShader(fragment_shader);
-  glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &result);
-  if (!result) {
-    goto fail;
+static int choose_lod(const float* center, const float* eye) {
+  float dx = center[0] - eye[0];
+  float dy = center[1] - eye[1];
+  float dz = center[2] - eye[2];
+  float distance = sqrtf(dx * dx + dy * dy + dz * dz);
+  float threshold = object_radius * LOD_DISTANCE;
+  int lod = 0;
+  while (lod + 1 < num_lods && distance > threshold) {
+    lod++;
+    threshold *= 2;
   }
+  return lod;
+}
 
-  glLinkProgram(program);
-  glGetProgramiv(program, GL_LINK_STATUS, &result);
-  if (!result) {
-    goto fail;
+// Move the cubes, find the ones that may be in view and
+// write their model matrices into the instance buffer,
+// grouped by level of detail, with each level's first
+// instance in first_instance. The old contents are
+// orphaned rather than overwritten, so the driver can hand
+// back fresh storage instead of waiting for the last
+// frame's draw.
+static void update_instances(const float* view_projection,
+                             const float* eye,
+                             int* lod_counts,
+                             int* first_instance) {
+  for (int i = 0; i < num_cubes; ++i) {
+    const cube_t* cube = &cubes[i];
+    float angle = current_time + cube->phase;
+    float center[3] = {cube->x + cosf(angle) * CUBE_ORBIT,
+                       cube->y + sinf(angle) * CUBE_ORBIT, cube->z};
+    for (int j = 0; j < 3; ++j) {
+      boxes[i].min[j] = center[j] - object_radius;
+      boxes[i].max[j] = center[j] + object_radius;
+    }
   }
 
-  glDetachShader(program, vertex_shader);
-  glDetachShader(program, fragment_shader);
-  glDeleteShader(vertex_shader);
-  glDeleteShader(fragment_shader);
+  memset(lod_counts, 0, sizeof(int) * MAX_LODS);
+  if (culling) {
+    frustum_t frustum;
+    frustum_from_matrix(&frustum, view_projection);
+    bvh_update(bvh, boxes, num_cubes);
+    frame_visible = bvh_cull(bvh, &frustum, visible);
+    for (int i = 0; i < frame_visible; ++i) {
+      float center[3];
+      for (int j = 0; j < 3; ++j) {
+        center[j] = boxes[visible[i]].min[j] + object_radius;
+      }
+      visible_lods[i] = choose_lod(center, eye);
+      lod_counts[visible_lods[i]]++;
+    }
+  } else {
+    frame_visible = num_cubes;
+    for (int i = 0; i < num_cubes; ++i) {
+      visible[i] = i;
+      visible_lods[i] = 0;
+    }
+    lod_counts[0] = num_cubes;
+  }
+  int next[MAX_LODS];
+  for (int i = 0, total = 0; i < MAX_LODS; ++i) {
+    first_instance[i] = next[i] = total;
+    total += lod_counts[i];
+  }
 
-  return program;
+  glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+  if (!frame_visible) {
+    return;
+  }
+  GLsizeiptr size = (GLsizeiptr)frame_visible * 16 * sizeof(float);
+  glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+  float* matrices = glMapBufferRange(
+      GL_ARRAY_BUFFER, 0, size,
+      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (!matrices) {
+    memset(lod_counts, 0, sizeof(int) * MAX_LODS);
+    return;
+  }
+  for (int i = 0; i < frame_visible; ++i) {
+    const cube_t* cube = &cubes[visible[i]];
+    float* matrix = &matrices[next[visible_lods[i]]++ * 16];
+    float angle = current_time + cube->phase;
+    mat4_rotation(matrix, angle, cube->axis[0], cube->axis[1], cube->axis[2]);
+    for (int j = 0; j < 3; ++j) {
+      matrix[12 + j] = boxes[visible[i]].min[j] + object_radius;
+    }
+  }
+  glUnmapBuffer(GL_ARRAY_BUFFER);
+}
 
-fail:
-  glDetachShader(program, vertex_shader);
-  glDetachShader(program, fragment_shader);
-  glDeleteShader(vertex_shader);
-  glDeleteShader(fragment_shader);
-  glDeleteProgram(program);
+// The position of the eye of a view matrix made of only a
+// rotation and a translation.
+static void view_eye(const float* view, float* eye) {
+  for (int i = 0; i < 3; ++i) {
+    eye[i] = -(view[i * 4] * view[12] + view[i * 4 + 1] * view[13] +
+               view[i * 4 + 2] * view[14]);
+  }
+}
 
-  printf("failed to create shaders.\n");
-  exit(1);
+// Look down at the grid from far enough away to fit all of
+// it, slowly circling its center, or fly through it just
+// above the cubes, slowly turning.
+static void camera(float* view_projection, float* eye) {
+  int width = gtk_widget_get_allocated_width(gl_area);
+  int height = gtk_widget_get_allocated_height(gl_area);
+  float distance = scene_size + 2;
+  float projection[16];
+  mat4_perspective(projection, M_PI / 3, (float)width / MAX(1, height), 0.1f,
+                   distance * 2 + scene_size);
+
+  float tilt[16];
+  float spin[16];
+  float move[16];
+  if (fly_through) {
+    mat4_rotation(tilt, M_PI / 12, 1, 0, 0);
+    mat4_translation(move, 0, -1, 0);
+  } else {
+    mat4_rotation(tilt, M_PI / 6, 1, 0, 0);
+    mat4_translation(move, 0, 0, -distance);
+  }
+  mat4_rotation(spin, current_time * 0.1f, 0, 1, 0);
+
+  float view[16];
+  if (fly_through) {
+    mat4_multiply(view, spin, move);
+    mat4_multiply(view, tilt, view);
+  } else {
+    mat4_multiply(view, tilt, spin);
+    mat4_multiply(view, move, view);
+  }
+  view_eye(view, eye);
+  mat4_multiply(view_projection, projection, view);
+}
+
+// Take over a model and make its coarser levels of detail.
+static void set_model(model_t* model) {
+  for (int i = 0; i < num_lods; ++i) {
+    model_free(lods[i]);
+  }
+  gint64 start = g_get_monotonic_time();
+  lods[0] = model;
+  num_lods = 1;
+  for (int i = 0; i < MAX_LODS - 1; ++i) {
+    // Thin parts such as rods collapse entirely on a coarse
+    // grid, which would make distant objects vanish.
+    model_t* lod = model_simplify(model, lod_cells[i]);
+    if (!lod->num_indices ||
+        lod->num_indices * 2 > lods[num_lods - 1]->num_indices) {
+      model_free(lod);
+      break;
+    }
+    lods[num_lods++] = lod;
+  }
+  if (num_lods > 1) {
+    printf("  levels of detail in %.1f ms:",
+           (g_get_monotonic_time() - start) / 1000.0);
+    for (int i = 0; i < num_lods; ++i) {
+      printf(" %d", lods[i]->num_indices / 3);
+    }
+    printf(" triangles\n");
+  }
+  object_radius = model_radius(model);
+  model_changed = TRUE;
+  if (gl_area) {
+    gtk_gl_area_queue_render(GTK_GL_AREA(gl_area));
+  }
+}
+
+static void load_model(const char* path) {
+  model_timing_t timing;
+  model_t* loaded = model_load(path, 0, &timing);
+  if (!loaded) {
+    printf("failed to load model %s\n", path);
+    return;
+  }
+  printf("loaded %s: %d vertices, %d triangles\n", path, loaded->num_vertices,
+         loaded->num_indices / 3);
+  printf("  map %.1f ms, parse %.1f ms, index %.1f ms, normals %.1f ms\n",
+         timing.map_time / 1000.0, timing.parse_time / 1000.0,
+         timing.index_time / 1000.0, timing.normal_time / 1000.0);
+  model_fit(loaded, MODEL_SIZE);
+  set_model(loaded);
+}
+
+// Needs the GL context to be current.
+static void upload_model() {
+  gint64 start = g_get_monotonic_time();
+  gsize num_vertices = 0;
+  gsize num_indices = 0;
+  for (int i = 0; i < num_lods; ++i) {
+    lod_base_vertex[i] = num_vertices;
+    lod_first_index[i] = num_indices;
+    num_vertices += lods[i]->num_vertices;
+    num_indices += lods[i]->num_indices;
+  }
+  glBindVertexArray(vao);
+  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+  glBufferData(GL_ARRAY_BUFFER, num_vertices * 6 * sizeof(float), NULL,
+               GL_STATIC_DRAW);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, num_indices * sizeof(guint32), NULL,
+               GL_STATIC_DRAW);
+  for (int i = 0; i < num_lods; ++i) {
+    glBufferSubData(GL_ARRAY_BUFFER,
+                    lod_base_vertex[i] * 6 * sizeof(float),
+                    (GLsizeiptr)lods[i]->num_vertices * 6 * sizeof(float),
+                    lods[i]->vertices);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER,
+                    lod_first_index[i] * sizeof(guint32),
+                    (GLsizeiptr)lods[i]->num_indices * sizeof(guint32),
+                    lods[i]->indices);
+  }
+  glFinish();
+  model_changed = FALSE;
+  printf("  upload %.1f ms\n", (g_get_monotonic_time() - start) / 1000.0);
+}
+
+static void update_stats(gint64 cpu_time) {
+  timing_history_add(&cpu_history, cpu_time / 1000.0f);
+  gint64 now = g_get_monotonic_time();
+  stats_frames++;
+  if (now - stats_start < STATS_INTERVAL) {
+    return;
+  }
+  gchar* text = g_strdup_printf(
+      "%d of %d cubes, %d draw calls, %.2fM triangles\n"
+      "%.1f fps, %.2f ms CPU, %.2f ms GPU per frame",
+      frame_visible, num_cubes, frame_draw_calls, frame_triangles / 1e6,
+      stats_frames * 1e6 / (now - stats_start),
+      timing_history_mean(&cpu_history), timing_history_mean(&gpu_history));
+  gtk_label_set_text(GTK_LABEL(stats_label), text);
+  g_free(text);
+  stats_start = now;
+  stats_frames = 0;
+}
+
+// Collect the results of finished GPU timer queries, in
+// the order they were issued.
+static void read_gpu_queries() {
+  while (gpu_queries_pending) {
+    int oldest = (gpu_query_next - gpu_queries_pending + GPU_QUERIES) %
+                 GPU_QUERIES;
+    GLint available = 0;
+    glGetQueryObjectiv(gpu_queries[oldest], GL_QUERY_RESULT_AVAILABLE,
+                       &available);
+    if (!available) {
+      break;
+    }
+    GLuint64 elapsed = 0;
+    glGetQueryObjectui64v(gpu_queries[oldest], GL_QUERY_RESULT, &elapsed);
+    timing_history_add(&gpu_history, elapsed / 1e6f);
+    gpu_queries_pending--;
+  }
+}
+
+static void draw_histogram_bars(cairo_t* cr,
+                                const timing_history_t* h,
+                                int max,
+                                double offset) {
+  double bar_width = (double)HISTOGRAM_WIDTH / TIMING_BUCKETS / 2;
+  for (int i = 0; i < TIMING_BUCKETS; ++i) {
+    double height = (HISTOGRAM_HEIGHT - 20) * h->buckets[i] / (double)max;
+    cairo_rectangle(cr, (i * 2 + offset) * bar_width,
+                    HISTOGRAM_HEIGHT - height, bar_width, height);
+  }
+  cairo_fill(cr);
+}
+
+// Draw the CPU (green) and GPU (orange) frame time
+// histograms over the scene, with their 95th percentiles.
+static gboolean histogram_draw(GtkWidget* widget,
+                               cairo_t* cr,
+                               gpointer userData) {
+  cairo_set_source_rgba(cr, 0, 0, 0, 0.6);
+  cairo_paint(cr);
+
+  int max = MAX(1, MAX(timing_history_max_bucket(&cpu_history),
+                       timing_history_max_bucket(&gpu_history)));
+  cairo_set_source_rgb(cr, 0.3, 0.9, 0.3);
+  draw_histogram_bars(cr, &cpu_history, max, 0);
+  cairo_set_source_rgb(cr, 1, 0.6, 0.2);
+  draw_histogram_bars(cr, &gpu_history, max, 1);
+
+  gchar* text = g_strdup_printf(
+      "95%%: CPU %.0f ms, GPU %.0f ms (0-%.0f ms)",
+      timing_history_percentile(&cpu_history, 0.95f),
+      timing_history_percentile(&gpu_history, 0.95f),
+      TIMING_BUCKETS * TIMING_BUCKET_MS);
+  cairo_set_source_rgb(cr, 1, 1, 1);
+  cairo_set_font_size(cr, 11);
+  cairo_move_to(cr, 4, 13);
+  cairo_show_text(cr, text);
+  g_free(text);
+  return FALSE;
 }
 
 static gboolean render(GtkGLArea* area, GdkGLContext* ctx) {
+  gint64 start = g_get_monotonic_time();
+
   glClearColor(0, 0, 0, 0);
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
   glClearDepth(1.0);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
   glEnable(GL_DEPTH_TEST);
 
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  glFrustum(-1.0f, 1.0f, -1.0f, 1.0f, 1.0f, 20.0f);
-  glMatrixMode(GL_MODELVIEW);
-
-  glUseProgram(program);
-
-  glEnableVertexAttribArray(0);
-  glEnableVertexAttribArray(1);
+  if (model_changed) {
+    upload_model();
+  }
 
-  glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
-  glBindBuffer(GL_ARRAY_BUFFER, normal_buffer);
-  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+  read_gpu_queries();
+  gboolean timed = gpu_queries_pending < GPU_QUERIES;
+  if (timed) {
+    glBeginQuery(GL_TIME_ELAPSED, gpu_queries[gpu_query_next]);
+  }
 
-  current_time += 0.05;
-  glUniform3f(glGetUniformLocation(program, "translation"),
-              cos(current_time) * 0.7, sin(current_time) * 0.7, 0);
+  float view_projection[16];
+  float eye[3];
+  camera(view_projection, eye);
+  glBindVertexArray(vao);
+  int lod_counts[MAX_LODS];
+  int first_instance[MAX_LODS];
+  update_instances(view_projection, eye, lod_counts, first_instance);
+
+  glUseProgram(program.id);
+  glUniformMatrix4fv(program.uniforms[UNIFORM_VIEW_PROJECTION], 1, GL_FALSE,
+                     view_projection);
+
+  // One draw per level of detail in use, with the instance
+  // attributes pointed at that level's matrices.
+  frame_draw_calls = 0;
+  frame_triangles = 0;
+  for (int i = 0; i < num_lods; ++i) {
+    if (!lod_counts[i]) {
+      continue;
+    }
+    for (int j = 0; j < 4; ++j) {
+      glVertexAttribPointer(
+          2 + j, 4, GL_FLOAT, GL_FALSE, sizeof(float) * 16,
+          (void*)(sizeof(float) * (16 * (gsize)first_instance[i] + 4 * j)));
+    }
+    glDrawElementsInstancedBaseVertex(
+        GL_TRIANGLES, lods[i]->num_indices, GL_UNSIGNED_INT,
+        (void*)(lod_first_index[i] * sizeof(guint32)), lod_counts[i],
+        lod_base_vertex[i]);
+    frame_draw_calls++;
+    frame_triangles += (gint64)lods[i]->num_indices / 3 * lod_counts[i];
+  }
 
-  glDrawArrays(GL_TRIANGLES, 0, 36);
-  glDisableVertexAttribArray(0);
-  glDisableVertexAttribArray(1);
+  if (timed) {
+    glEndQuery(GL_TIME_ELAPSED);
+    gpu_query_next = (gpu_query_next + 1) % GPU_QUERIES;
+    gpu_queries_pending++;
+  }
 
+  update_stats(g_get_monotonic_time() - start);
   return TRUE;
 }
 
@@ -268,23 +689,93 @@ static void realize(GtkGLArea* area) {
   gtk_gl_area_make_current(area);
   gtk_gl_area_set_has_depth_buffer(area, TRUE);
 
-  program = load_shaders();
+  load_shaders();
 
   glGenVertexArrays(1, &vao);
   glBindVertexArray(vao);
 
+  // Positions and normals are interleaved in one buffer.
   glGenBuffers(1, &vertex_buffer);
   glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 6, NULL);
+  glEnableVertexAttribArray(1);
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 6,
+                        (void*)(sizeof(float) * 3));
+
+  glGenBuffers(1, &index_buffer);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+
+  // A mat4 attribute takes four consecutive locations, one
+  // per column, each advancing once per instance.
+  glGenBuffers(1, &instance_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+  for (int i = 0; i < 4; ++i) {
+    glEnableVertexAttribArray(2 + i);
+    glVertexAttribPointer(2 + i, 4, GL_FLOAT, GL_FALSE, sizeof(float) * 16,
+                          (void*)(sizeof(float) * 4 * i));
+    glVertexAttribDivisor(2 + i, 1);
+  }
 
-  glGenBuffers(1, &normal_buffer);
-  glBindBuffer(GL_ARRAY_BUFFER, normal_buffer);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(normals), normals, GL_STATIC_DRAW);
+  glGenQueries(GPU_QUERIES, gpu_queries);
+  stats_start = g_get_monotonic_time();
 }
 
-static gboolean perform_step(gpointer data) {
-  gtk_gl_area_queue_render(GTK_GL_AREA(gl_area));
-  return TRUE;
+// Animate by the time the frame will be shown, so the
+// speed doesn't depend on how often frames are drawn.
+static gboolean tick(GtkWidget* widget,
+                     GdkFrameClock* clock,
+                     gpointer userData) {
+  gint64 frame_time = gdk_frame_clock_get_frame_time(clock);
+  if (!start_time) {
+    start_time = frame_time;
+  }
+  current_time = (frame_time - start_time) / 1e6 * ANIMATION_SPEED;
+  gtk_gl_area_queue_render(GTK_GL_AREA(widget));
+  if (gtk_widget_get_visible(histogram_area)) {
+    gtk_widget_queue_draw(histogram_area);
+  }
+  return G_SOURCE_CONTINUE;
+}
+
+static void cubes_changed(GtkSpinButton* button, gpointer userData) {
+  set_num_cubes(gtk_spin_button_get_value_as_int(button));
+}
+
+static void choose_model(GtkWidget* button, gpointer userData) {
+  GtkWidget* dialog = gtk_file_chooser_dialog_new(
+      "Open Model", GTK_WINDOW(gtk_widget_get_toplevel(button)),
+      GTK_FILE_CHOOSER_ACTION_OPEN, "_Cancel", GTK_RESPONSE_CANCEL, "_Open",
+      GTK_RESPONSE_ACCEPT, NULL);
+  GtkFileFilter* filter = gtk_file_filter_new();
+  gtk_file_filter_set_name(filter, "OBJ and PLY models");
+  gtk_file_filter_add_pattern(filter, "*.obj");
+  gtk_file_filter_add_pattern(filter, "*.ply");
+  gtk_file_chooser_add_filter(GTK_FILE_CHOOSER(dialog), filter);
+  gchar* filename = NULL;
+  if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+    filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
+  }
+  gtk_widget_destroy(dialog);
+  if (!filename) {
+    return;
+  }
+
+  load_model(filename);
+  g_free(filename);
+}
+
+static void culling_toggled(GtkToggleButton* button, gpointer userData) {
+  culling = gtk_toggle_button_get_active(button);
+}
+
+static void fly_through_toggled(GtkToggleButton* button, gpointer userData) {
+  fly_through = gtk_toggle_button_get_active(button);
+}
+
+static void histogram_toggled(GtkToggleButton* button, gpointer userData) {
+  gtk_widget_set_visible(histogram_area,
+                         gtk_toggle_button_get_active(button));
 }
 
 static void activate(GtkApplication* app, gpointer userData) {
@@ -292,19 +783,82 @@ static void activate(GtkApplication* app, gpointer userData) {
   gtk_window_set_title(GTK_WINDOW(window), "GL Demo");
   gtk_window_set_default_size(GTK_WINDOW(window), 400, 400);
 
+  bvh = bvh_new();
+  set_num_cubes(1);
+  set_model(model_new(vertices, normals, 36));
+  if (model_path) {
+    load_model(model_path);
+  }
+
   gl_area = gtk_gl_area_new();
   g_signal_connect(gl_area, "render", G_CALLBACK(render), NULL);
   g_signal_connect(gl_area, "realize", G_CALLBACK(realize), NULL);
-  gtk_container_add(GTK_CONTAINER(window), gl_area);
-
-  gdk_threads_add_timeout(42, perform_step, NULL);
+  gtk_widget_add_tick_callback(gl_area, tick, NULL, NULL);
+
+  histogram_area = gtk_drawing_area_new();
+  gtk_widget_set_no_show_all(histogram_area, TRUE);
+  gtk_widget_set_size_request(histogram_area, HISTOGRAM_WIDTH,
+                              HISTOGRAM_HEIGHT);
+  gtk_widget_set_halign(histogram_area, GTK_ALIGN_START);
+  gtk_widget_set_valign(histogram_area, GTK_ALIGN_START);
+  g_signal_connect(histogram_area, "draw", G_CALLBACK(histogram_draw), NULL);
+
+  GtkWidget* overlay = gtk_overlay_new();
+  gtk_widget_set_vexpand(overlay, TRUE);
+  gtk_container_add(GTK_CONTAINER(overlay), gl_area);
+  gtk_overlay_add_overlay(GTK_OVERLAY(overlay), histogram_area);
+  gtk_overlay_set_overlay_pass_through(GTK_OVERLAY(overlay), histogram_area,
+                                       TRUE);
+
+  GtkWidget* cubes_button = gtk_spin_button_new_with_range(1, MAX_CUBES, 1);
+  gtk_spin_button_set_value(GTK_SPIN_BUTTON(cubes_button), num_cubes);
+  gtk_widget_set_tooltip_text(cubes_button, "Cubes");
+  g_signal_connect(cubes_button, "value-changed", G_CALLBACK(cubes_changed),
+                   NULL);
+
+  GtkWidget* model_button = gtk_button_new_with_label("Open Model...");
+  g_signal_connect(model_button, "clicked", G_CALLBACK(choose_model), NULL);
+
+  GtkWidget* culling_button = gtk_check_button_new_with_label("Cull and LOD");
+  gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(culling_button), culling);
+  g_signal_connect(culling_button, "toggled", G_CALLBACK(culling_toggled),
+                   NULL);
+
+  GtkWidget* fly_button = gtk_check_button_new_with_label("Fly through");
+  g_signal_connect(fly_button, "toggled", G_CALLBACK(fly_through_toggled),
+                   NULL);
+
+  GtkWidget* histogram_button = gtk_check_button_new_with_label("Timings");
+  g_signal_connect(histogram_button, "toggled", G_CALLBACK(histogram_toggled),
+                   NULL);
+
+  stats_label = gtk_label_new("");
+
+  GtkWidget* controls = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+  gtk_container_add(GTK_CONTAINER(controls), model_button);
+  gtk_container_add(GTK_CONTAINER(controls), cubes_button);
+  gtk_container_add(GTK_CONTAINER(controls), culling_button);
+  gtk_container_add(GTK_CONTAINER(controls), fly_button);
+  gtk_container_add(GTK_CONTAINER(controls), histogram_button);
+  gtk_container_add(GTK_CONTAINER(controls), stats_label);
+
+  GtkWidget* container = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
+  gtk_container_add(GTK_CONTAINER(container), overlay);
+  gtk_container_add(GTK_CONTAINER(container), controls);
+  gtk_container_add(GTK_CONTAINER(window), container);
 
   gtk_widget_show_all(window);
 }
 
 int main(int argc, char** argv) {
+  GOptionEntry entries[] = {
+      {"model", 0, 0, G_OPTION_ARG_FILENAME, &model_path,
+       "OBJ or binary PLY model to draw in place of the cube", "PATH"},
+      {NULL}};
+
   GtkApplication* app = gtk_application_new("com.aqnichol.button_catcher",
                                             G_APPLICATION_FLAGS_NONE);
+  g_application_add_main_option_entries(G_APPLICATION(app), entries);
   g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
   int status = g_application_run(G_APPLICATION(app), argc, argv);
   g_object_unref(app);
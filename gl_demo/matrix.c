@@ -0,0 +1,59 @@
+#include "matrix.h"
+#include <math.h>
+#include <string.h>
+
+void mat4_identity(float* m) {
+  memset(m, 0, sizeof(float) * 16);
+  m[0] = m[5] = m[10] = m[15] = 1;
+}
+
+void mat4_multiply(float* out, const float* a, const float* b) {
+  float result[16];
+  for (int col = 0; col < 4; ++col) {
+    for (int row = 0; row < 4; ++row) {
+      float sum = 0;
+      for (int i = 0; i < 4; ++i) {
+        sum += a[i * 4 + row] * b[col * 4 + i];
+      }
+      result[col * 4 + row] = sum;
+    }
+  }
+  memcpy(out, result, sizeof(result));
+}
+
+void mat4_translation(float* m, float x, float y, float z) {
+  mat4_identity(m);
+  m[12] = x;
+  m[13] = y;
+  m[14] = z;
+}
+
+void mat4_rotation(float* m, float angle, float x, float y, float z) {
+  float c = cosf(angle);
+  float s = sinf(angle);
+  float t = 1 - c;
+  mat4_identity(m);
+  m[0] = t * x * x + c;
+  m[1] = t * x * y + s * z;
+  m[2] = t * x * z - s * y;
+  m[4] = t * x * y - s * z;
+  m[5] = t * y * y + c;
+  m[6] = t * y * z + s * x;
+  m[8] = t * x * z + s * y;
+  m[9] = t * y * z - s * x;
+  m[10] = t * z * z + c;
+}
+
+void mat4_perspective(float* m,
+                      float fovy,
+                      float aspect,
+                      float near,
+                      float far) {
+  float f = 1 / tanf(fovy / 2);
+  memset(m, 0, sizeof(float) * 16);
+  m[0] = f / aspect;
+  m[5] = f;
+  m[10] = (far + near) / (near - far);
+  m[11] = -1;
+  m[14] = 2 * far * near / (near - far);
+}
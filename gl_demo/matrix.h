@@ -0,0 +1,19 @@
+#ifndef __MATRIX_H__
+#define __MATRIX_H__
+
+// 4x4 matrices are 16 floats in column-major order, as
+// glUniformMatrix4fv and matrix vertex attributes expect.
+
+void mat4_identity(float* m);
+void mat4_multiply(float* out, const float* a, const float* b);
+void mat4_translation(float* m, float x, float y, float z);
+
+// A rotation of angle radians about the unit axis (x, y, z).
+void mat4_rotation(float* m, float angle, float x, float y, float z);
+void mat4_perspective(float* m,
+                      float fovy,
+                      float aspect,
+                      float near,
+                      float far);
+
+#endif
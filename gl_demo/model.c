@@ -0,0 +1,1240 @@
+#include "model.h"
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Files are only split into chunks at least this big, as
+// smaller ones parse faster than threads start.
+#define MODEL_MIN_CHUNK (1 << 20)
+
+#define PLY_MAX_ELEMENTS 8
+#define PLY_MAX_PROPERTIES 32
+
+typedef struct {
+  int position;
+  int normal;
+} corner_t;
+
+// A run of whole lines of an OBJ file. Chunks are first
+// scanned to count their positions and normals, so each
+// can then parse straight into its place in the shared
+// arrays, knowing the global index of its first line.
+typedef struct {
+  const char* start;
+  const char* end;
+  int num_positions;
+  int num_normals;
+  int position_offset;
+  int normal_offset;
+
+  // Shared by every chunk.
+  int total_positions;
+  int total_normals;
+  float* positions;
+  float* normals;
+
+  // Three corners per triangle, with any face of more
+  // than three sides split into a fan.
+  GArray* corners;
+  gboolean missing_normals;
+  gboolean failed;
+} obj_chunk_t;
+
+typedef enum {
+  LINE_OTHER,
+  LINE_POSITION,
+  LINE_NORMAL,
+  LINE_FACE,
+} line_kind_t;
+
+typedef enum {
+  PLY_INT8,
+  PLY_UINT8,
+  PLY_INT16,
+  PLY_UINT16,
+  PLY_INT32,
+  PLY_UINT32,
+  PLY_FLOAT32,
+  PLY_FLOAT64,
+} ply_type_t;
+
+typedef struct {
+  char name[32];
+  ply_type_t type;
+  gboolean is_list;
+  ply_type_t count_type;
+  int offset;
+} ply_property_t;
+
+typedef struct {
+  char name[32];
+  gint64 count;
+  ply_property_t properties[PLY_MAX_PROPERTIES];
+  int num_properties;
+
+  // The size of each item, if no property is a list.
+  int stride;
+} ply_element_t;
+
+typedef struct {
+  gboolean swap;
+  ply_element_t elements[PLY_MAX_ELEMENTS];
+  int num_elements;
+  const guchar* body;
+} ply_header_t;
+
+// A range of the vertices of a binary PLY file. Every
+// vertex is the same size, so ranges can be split evenly.
+typedef struct {
+  const guchar* data;
+  const ply_element_t* element;
+  int props[6];
+  gboolean swap;
+  int start;
+  int end;
+  float* vertices;
+} ply_vertex_chunk_t;
+
+// A range of the faces of a binary PLY file, read on the
+// guess that all of them are triangles, which makes them
+// all the same size.
+typedef struct {
+  const guchar* data;
+  int stride;
+  int count_offset;
+  ply_type_t count_type;
+  int index_offset;
+  ply_type_t index_type;
+  gboolean swap;
+  int num_vertices;
+  gint64 start;
+  gint64 end;
+  guint32* indices;
+  gboolean failed;
+} ply_face_chunk_t;
+
+static const char* map_file(const char* path, gsize* size);
+static void run_chunks(void* (*func)(void*),
+                       void* chunks,
+                       gsize chunk_size,
+                       int count);
+static int split_count(gsize size, int threads);
+static model_t* load_obj(const char* data,
+                         gsize size,
+                         int threads,
+                         model_timing_t* timing);
+static void* obj_count_thread(void* arg);
+static void* obj_parse_thread(void* arg);
+static line_kind_t line_kind(const char** p, const char* end);
+static gboolean parse_face(obj_chunk_t* c,
+                           const char* p,
+                           const char* end,
+                           int seen_positions,
+                           int seen_normals);
+static model_t* index_obj(obj_chunk_t* chunks,
+                          int count,
+                          const float* positions,
+                          int num_positions,
+                          const float* normals,
+                          gboolean use_normals);
+static model_t* load_ply(const guchar* data,
+                         gsize size,
+                         int threads,
+                         model_timing_t* timing);
+static gboolean parse_ply_header(const guchar* data,
+                                 gsize size,
+                                 ply_header_t* header);
+static int ply_type_size(ply_type_t type);
+static gboolean ply_type_from_name(const char* name, ply_type_t* type);
+static double ply_read(const guchar* p, ply_type_t type, gboolean swap);
+static int ply_find(const ply_element_t* element, const char* name);
+static void* ply_vertex_thread(void* arg);
+static void* ply_face_thread(void* arg);
+static gboolean ply_read_faces(const guchar* data,
+                               const guchar* end,
+                               const ply_element_t* element,
+                               int list,
+                               gboolean swap,
+                               int num_vertices,
+                               GArray* indices);
+static void compute_normals(model_t* model);
+static const char* skip_space(const char* p, const char* end);
+static const char* parse_float(const char* p, const char* end, float* out);
+static const char* parse_int(const char* p, const char* end, int* out);
+static void model_bounds(const model_t* model, float* min, float* max);
+static guint vertex_hash(gconstpointer key);
+static gboolean vertex_equal(gconstpointer a, gconstpointer b);
+
+model_t* model_new(const float* positions, const float* normals, int count) {
+  model_t* model = g_new0(model_t, 1);
+  // Room for every vertex, so the hash table's keys, which
+  // point into the array, never move.
+  model->vertices = g_new(float, (gsize)count * 6);
+  model->indices = g_new(guint32, count);
+  model->num_indices = count;
+  GHashTable* seen = g_hash_table_new(vertex_hash, vertex_equal);
+  for (int i = 0; i < count; ++i) {
+    float* v = &model->vertices[model->num_vertices * 6];
+    memcpy(v, &positions[i * 3], sizeof(float) * 3);
+    memcpy(v + 3, &normals[i * 3], sizeof(float) * 3);
+    gpointer index;
+    if (g_hash_table_lookup_extended(seen, v, NULL, &index)) {
+      model->indices[i] = GPOINTER_TO_UINT(index);
+    } else {
+      model->indices[i] = model->num_vertices;
+      g_hash_table_insert(seen, v, GUINT_TO_POINTER(model->num_vertices));
+      model->num_vertices++;
+    }
+  }
+  g_hash_table_destroy(seen);
+  model->vertices =
+      g_renew(float, model->vertices, (gsize)model->num_vertices * 6);
+  return model;
+}
+
+model_t* model_load(const char* path, int threads, model_timing_t* timing) {
+  memset(timing, 0, sizeof(*timing));
+  if (threads <= 0) {
+    threads = g_get_num_processors();
+  }
+  gint64 start = g_get_monotonic_time();
+  gsize size;
+  const char* data = map_file(path, &size);
+  if (!data) {
+    return NULL;
+  }
+  timing->map_time = g_get_monotonic_time() - start;
+
+  model_t* model;
+  if (size >= 4 && !memcmp(data, "ply", 3) &&
+      (data[3] == '\n' || data[3] == '\r')) {
+    model = load_ply((const guchar*)data, size, threads, timing);
+  } else {
+    model = load_obj(data, size, threads, timing);
+  }
+  munmap((void*)data, size);
+
+  // Any text file parses as an OBJ with nothing in it.
+  if (model && !model->num_indices) {
+    model_free(model);
+    model = NULL;
+  }
+  return model;
+}
+
+void model_fit(model_t* model, float size) {
+  if (!model->num_vertices) {
+    return;
+  }
+  float min[3];
+  float max[3];
+  model_bounds(model, min, max);
+  float extent = MAX(max[0] - min[0], MAX(max[1] - min[1], max[2] - min[2]));
+  float scale = extent > 0 ? size / extent : 1;
+  for (int i = 0; i < model->num_vertices; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      float* v = &model->vertices[i * 6 + j];
+      *v = (*v - (min[j] + max[j]) / 2) * scale;
+    }
+  }
+}
+
+float model_radius(const model_t* model) {
+  float radius = 0;
+  for (int i = 0; i < model->num_vertices; ++i) {
+    const float* v = &model->vertices[i * 6];
+    radius = MAX(radius, v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+  }
+  return sqrtf(radius);
+}
+
+model_t* model_simplify(const model_t* model, int cells) {
+  model_t* simple = g_new0(model_t, 1);
+  if (!model->num_vertices) {
+    return simple;
+  }
+  float min[3];
+  float max[3];
+  model_bounds(model, min, max);
+  float scale[3];
+  for (int i = 0; i < 3; ++i) {
+    scale[i] = max[i] > min[i] ? cells / (max[i] - min[i]) : 0;
+  }
+
+  // Each cell's vertex is the average of the positions in
+  // it, lit by the sum of their normals.
+  gint64* keys = g_new(gint64, model->num_vertices);
+  guint32* remap = g_new(guint32, model->num_vertices);
+  GHashTable* cell_vertex = g_hash_table_new(g_int64_hash, g_int64_equal);
+  float* sums = g_new0(float, (gsize)model->num_vertices * 6);
+  int* counts = g_new0(int, model->num_vertices);
+  for (int i = 0; i < model->num_vertices; ++i) {
+    const float* v = &model->vertices[i * 6];
+    gint64 cell[3];
+    for (int j = 0; j < 3; ++j) {
+      cell[j] = MIN(cells - 1, (gint64)((v[j] - min[j]) * scale[j]));
+    }
+    keys[i] = (cell[2] * cells + cell[1]) * cells + cell[0];
+    gpointer index;
+    if (!g_hash_table_lookup_extended(cell_vertex, &keys[i], NULL, &index)) {
+      index = GUINT_TO_POINTER(simple->num_vertices++);
+      g_hash_table_insert(cell_vertex, &keys[i], index);
+    }
+    remap[i] = GPOINTER_TO_UINT(index);
+    float* sum = &sums[remap[i] * 6];
+    for (int j = 0; j < 6; ++j) {
+      sum[j] += v[j];
+    }
+    counts[remap[i]]++;
+  }
+  g_hash_table_destroy(cell_vertex);
+
+  simple->vertices = g_new(float, (gsize)simple->num_vertices * 6);
+  for (int i = 0; i < simple->num_vertices; ++i) {
+    const float* sum = &sums[i * 6];
+    float* v = &simple->vertices[i * 6];
+    float length =
+        sqrtf(sum[3] * sum[3] + sum[4] * sum[4] + sum[5] * sum[5]);
+    for (int j = 0; j < 3; ++j) {
+      v[j] = sum[j] / counts[i];
+      v[j + 3] = length > 0 ? sum[j + 3] / length : 0;
+    }
+  }
+
+  simple->indices = g_new(guint32, model->num_indices);
+  for (int i = 0; i + 2 < model->num_indices; i += 3) {
+    guint32 a = remap[model->indices[i]];
+    guint32 b = remap[model->indices[i + 1]];
+    guint32 c = remap[model->indices[i + 2]];
+    if (a != b && b != c && c != a) {
+      simple->indices[simple->num_indices++] = a;
+      simple->indices[simple->num_indices++] = b;
+      simple->indices[simple->num_indices++] = c;
+    }
+  }
+  simple->indices =
+      g_renew(guint32, simple->indices, MAX(1, simple->num_indices));
+  g_free(keys);
+  g_free(remap);
+  g_free(sums);
+  g_free(counts);
+  return simple;
+}
+
+void model_free(model_t* model) {
+  if (!model) {
+    return;
+  }
+  g_free(model->vertices);
+  g_free(model->indices);
+  g_free(model);
+}
+
+static const char* map_file(const char* path, gsize* size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat info;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && info.st_size > 0) {
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+  // Every chunk is read at once, so fault it all in ahead.
+  madvise(data, info.st_size, MADV_WILLNEED);
+  *size = info.st_size;
+  return data;
+}
+
+// Call func on each of count chunks, the first on this
+// thread and the rest on their own.
+static void run_chunks(void* (*func)(void*),
+                       void* chunks,
+                       gsize chunk_size,
+                       int count) {
+  pthread_t* ids = g_new(pthread_t, count);
+  for (int i = 1; i < count; ++i) {
+    pthread_create(&ids[i], NULL, func, (char*)chunks + chunk_size * i);
+  }
+  func(chunks);
+  for (int i = 1; i < count; ++i) {
+    pthread_join(ids[i], NULL);
+  }
+  g_free(ids);
+}
+
+static int split_count(gsize size, int threads) {
+  return (int)MAX(1, MIN((gsize)threads, size / MODEL_MIN_CHUNK));
+}
+
+static model_t* load_obj(const char* data,
+                         gsize size,
+                         int threads,
+                         model_timing_t* timing) {
+  gint64 start = g_get_monotonic_time();
+  int count = split_count(size, threads);
+  obj_chunk_t* chunks = g_new0(obj_chunk_t, count);
+  const char* end = data + size;
+  const char* chunk_start = data;
+  for (int i = 0; i < count; ++i) {
+    const char* chunk_end = MAX(chunk_start, data + size * (i + 1) / count);
+    if (i < count - 1) {
+      const char* newline = memchr(chunk_end, '\n', end - chunk_end);
+      chunk_end = newline ? newline + 1 : end;
+    } else {
+      chunk_end = end;
+    }
+    chunks[i].start = chunk_start;
+    chunks[i].end = chunk_end;
+    chunk_start = chunks[i].end;
+  }
+  run_chunks(obj_count_thread, chunks, sizeof(obj_chunk_t), count);
+
+  int num_positions = 0;
+  int num_normals = 0;
+  for (int i = 0; i < count; ++i) {
+    chunks[i].position_offset = num_positions;
+    chunks[i].normal_offset = num_normals;
+    num_positions += chunks[i].num_positions;
+    num_normals += chunks[i].num_normals;
+  }
+  float* positions = g_new(float, (gsize)num_positions * 3);
+  float* normals = g_new(float, (gsize)num_normals * 3);
+  for (int i = 0; i < count; ++i) {
+    chunks[i].total_positions = num_positions;
+    chunks[i].total_normals = num_normals;
+    chunks[i].positions = positions;
+    chunks[i].normals = normals;
+    chunks[i].corners = g_array_sized_new(
+        FALSE, FALSE, sizeof(corner_t),
+        (chunks[i].end - chunks[i].start) / 8);
+  }
+  run_chunks(obj_parse_thread, chunks, sizeof(obj_chunk_t), count);
+  timing->parse_time = g_get_monotonic_time() - start;
+
+  model_t* model = NULL;
+  gboolean use_normals = num_normals > 0;
+  for (int i = 0; i < count; ++i) {
+    if (chunks[i].failed) {
+      goto done;
+    }
+    use_normals = use_normals && !chunks[i].missing_normals;
+  }
+
+  start = g_get_monotonic_time();
+  model = index_obj(chunks, count, positions, num_positions, normals,
+                    use_normals);
+  timing->index_time = g_get_monotonic_time() - start;
+
+  if (!use_normals) {
+    start = g_get_monotonic_time();
+    compute_normals(model);
+    timing->normal_time = g_get_monotonic_time() - start;
+  }
+
+done:
+  for (int i = 0; i < count; ++i) {
+    if (chunks[i].corners) {
+      g_array_free(chunks[i].corners, TRUE);
+    }
+  }
+  g_free(chunks);
+  g_free(positions);
+  g_free(normals);
+  return model;
+}
+
+static void* obj_count_thread(void* arg) {
+  obj_chunk_t* c = (obj_chunk_t*)arg;
+  const char* p = c->start;
+  while (p < c->end) {
+    const char* line_end = memchr(p, '\n', c->end - p);
+    if (!line_end) {
+      line_end = c->end;
+    }
+    switch (line_kind(&p, line_end)) {
+      case LINE_POSITION:
+        c->num_positions++;
+        break;
+      case LINE_NORMAL:
+        c->num_normals++;
+        break;
+      default:
+        break;
+    }
+    p = line_end + 1;
+  }
+  return NULL;
+}
+
+static void* obj_parse_thread(void* arg) {
+  obj_chunk_t* c = (obj_chunk_t*)arg;
+  float* position = &c->positions[(gsize)c->position_offset * 3];
+  float* normal = &c->normals[(gsize)c->normal_offset * 3];
+  const char* p = c->start;
+  while (p < c->end) {
+    const char* line_end = memchr(p, '\n', c->end - p);
+    if (!line_end) {
+      line_end = c->end;
+    }
+    line_kind_t kind = line_kind(&p, line_end);
+    if (kind == LINE_POSITION || kind == LINE_NORMAL) {
+      float* out = kind == LINE_POSITION ? position : normal;
+      for (int i = 0; i < 3 && p; ++i) {
+        p = parse_float(skip_space(p, line_end), line_end, &out[i]);
+      }
+      if (!p) {
+        c->failed = TRUE;
+        return NULL;
+      }
+      if (kind == LINE_POSITION) {
+        position += 3;
+      } else {
+        normal += 3;
+      }
+    } else if (kind == LINE_FACE) {
+      int seen_positions = (position - c->positions) / 3;
+      int seen_normals = (normal - c->normals) / 3;
+      if (!parse_face(c, p, line_end, seen_positions, seen_normals)) {
+        c->failed = TRUE;
+        return NULL;
+      }
+    }
+    p = line_end + 1;
+  }
+  return NULL;
+}
+
+// Classify a line, leaving p after its keyword.
+static line_kind_t line_kind(const char** p, const char* end) {
+  const char* s = skip_space(*p, end);
+  line_kind_t kind = LINE_OTHER;
+  int length = 0;
+  if (end - s >= 2 && s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+    kind = LINE_POSITION;
+    length = 1;
+  } else if (end - s >= 3 && s[0] == 'v' && s[1] == 'n' &&
+             (s[2] == ' ' || s[2] == '\t')) {
+    kind = LINE_NORMAL;
+    length = 2;
+  } else if (end - s >= 2 && s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+    kind = LINE_FACE;
+    length = 1;
+  }
+  *p = s + length;
+  return kind;
+}
+
+// Indices count from 1, or back from -1 for the latest
+// line of their kind before the face.
+static gboolean parse_face(obj_chunk_t* c,
+                           const char* p,
+                           const char* end,
+                           int seen_positions,
+                           int seen_normals) {
+  corner_t first;
+  corner_t last;
+  int sides = 0;
+  while ((p = skip_space(p, end)) < end && *p != '\r' && *p != '#') {
+    int position;
+    int normal = 0;
+    p = parse_int(p, end, &position);
+    if (!p) {
+      return FALSE;
+    }
+    if (p < end && *p == '/') {
+      // Skip the texture coordinate.
+      int unused;
+      p++;
+      if (p < end && *p != '/') {
+        p = parse_int(p, end, &unused);
+        if (!p) {
+          return FALSE;
+        }
+      }
+      if (p < end && *p == '/') {
+        p = parse_int(p + 1, end, &normal);
+        if (!p) {
+          return FALSE;
+        }
+      }
+    }
+
+    corner_t corner;
+    corner.position = position < 0 ? seen_positions + position : position - 1;
+    corner.normal = normal < 0 ? seen_normals + normal : normal - 1;
+    if (position == 0 || corner.position < 0 ||
+        corner.position >= c->total_positions ||
+        corner.normal >= c->total_normals || (normal && corner.normal < 0)) {
+      return FALSE;
+    }
+    if (!normal) {
+      corner.normal = -1;
+      c->missing_normals = TRUE;
+    }
+
+    if (sides == 0) {
+      first = corner;
+    } else if (sides >= 2) {
+      g_array_append_val(c->corners, first);
+      g_array_append_val(c->corners, last);
+      g_array_append_val(c->corners, corner);
+    }
+    last = corner;
+    sides++;
+  }
+  return sides >= 3;
+}
+
+// Give each distinct position and normal pair a vertex.
+// Pairs are chained off their position, and positions
+// rarely have more than a few normals, so the search is
+// short. Without normals, each position is a vertex, and
+// its normal is left for compute_normals.
+static model_t* index_obj(obj_chunk_t* chunks,
+                          int count,
+                          const float* positions,
+                          int num_positions,
+                          const float* normals,
+                          gboolean use_normals) {
+  model_t* model = g_new0(model_t, 1);
+  gsize num_corners = 0;
+  for (int i = 0; i < count; ++i) {
+    num_corners += chunks[i].corners->len;
+  }
+  model->num_indices = (int)num_corners;
+  model->indices = g_new(guint32, num_corners);
+
+  if (!use_normals) {
+    guint32* out = model->indices;
+    for (int i = 0; i < count; ++i) {
+      const corner_t* corners = (const corner_t*)chunks[i].corners->data;
+      for (guint j = 0; j < chunks[i].corners->len; ++j) {
+        *out++ = corners[j].position;
+      }
+    }
+    model->num_vertices = num_positions;
+    model->vertices = g_new0(float, (gsize)num_positions * 6);
+    for (int i = 0; i < num_positions; ++i) {
+      memcpy(&model->vertices[i * 6], &positions[i * 3], sizeof(float) * 3);
+    }
+    return model;
+  }
+
+  int* first = g_new(int, num_positions);
+  memset(first, 0xff, sizeof(int) * num_positions);
+  int capacity = num_positions + num_positions / 2 + 16;
+  corner_t* pairs = g_new(corner_t, capacity);
+  int* next = g_new(int, capacity);
+  int num_vertices = 0;
+  guint32* out = model->indices;
+  for (int i = 0; i < count; ++i) {
+    const corner_t* corners = (const corner_t*)chunks[i].corners->data;
+    for (guint j = 0; j < chunks[i].corners->len; ++j) {
+      const corner_t* corner = &corners[j];
+      int v = first[corner->position];
+      while (v >= 0 && pairs[v].normal != corner->normal) {
+        v = next[v];
+      }
+      if (v < 0) {
+        if (num_vertices == capacity) {
+          capacity *= 2;
+          pairs = g_renew(corner_t, pairs, capacity);
+          next = g_renew(int, next, capacity);
+        }
+        v = num_vertices++;
+        pairs[v] = *corner;
+        next[v] = first[corner->position];
+        first[corner->position] = v;
+      }
+      *out++ = v;
+    }
+  }
+
+  model->num_vertices = num_vertices;
+  model->vertices = g_new(float, (gsize)num_vertices * 6);
+  for (int i = 0; i < num_vertices; ++i) {
+    float* v = &model->vertices[i * 6];
+    memcpy(v, &positions[pairs[i].position * 3], sizeof(float) * 3);
+    memcpy(v + 3, &normals[pairs[i].normal * 3], sizeof(float) * 3);
+  }
+  g_free(first);
+  g_free(pairs);
+  g_free(next);
+  return model;
+}
+
+static model_t* load_ply(const guchar* data,
+                         gsize size,
+                         int threads,
+                         model_timing_t* timing) {
+  gint64 start = g_get_monotonic_time();
+  ply_header_t header;
+  if (!parse_ply_header(data, size, &header)) {
+    return NULL;
+  }
+
+  // Find the vertices and faces. Anything before them must
+  // be fixed size to be skipped.
+  const ply_element_t* vertex_element = NULL;
+  const ply_element_t* face_element = NULL;
+  const guchar* vertex_data = NULL;
+  const guchar* face_data = NULL;
+  const guchar* p = header.body;
+  const guchar* end = data + size;
+  for (int i = 0; i < header.num_elements && !face_element; ++i) {
+    const ply_element_t* element = &header.elements[i];
+    if (!strcmp(element->name, "vertex")) {
+      vertex_element = element;
+      vertex_data = p;
+    } else if (!strcmp(element->name, "face")) {
+      face_element = element;
+      face_data = p;
+      break;
+    }
+    if (element->stride < 0 ||
+        (element->stride > 0 &&
+         (gsize)(end - p) / element->stride < (gsize)element->count)) {
+      return NULL;
+    }
+    p += element->stride * element->count;
+  }
+  if (!vertex_element || !face_element || vertex_element->count > G_MAXINT32 ||
+      face_element->count > G_MAXINT32 / 3) {
+    return NULL;
+  }
+
+  ply_vertex_chunk_t base;
+  const char* names[] = {"x", "y", "z", "nx", "ny", "nz"};
+  for (int i = 0; i < 6; ++i) {
+    base.props[i] = ply_find(vertex_element, names[i]);
+  }
+  gboolean has_normals =
+      base.props[3] >= 0 && base.props[4] >= 0 && base.props[5] >= 0;
+  if (base.props[0] < 0 || base.props[1] < 0 || base.props[2] < 0) {
+    return NULL;
+  }
+
+  model_t* model = g_new0(model_t, 1);
+  model->num_vertices = (int)vertex_element->count;
+  model->vertices = g_new0(float, (gsize)model->num_vertices * 6);
+  int count = split_count(vertex_element->count * vertex_element->stride,
+                          threads);
+  ply_vertex_chunk_t* vertex_chunks = g_new(ply_vertex_chunk_t, count);
+  for (int i = 0; i < count; ++i) {
+    vertex_chunks[i] = base;
+    vertex_chunks[i].data = vertex_data;
+    vertex_chunks[i].element = vertex_element;
+    vertex_chunks[i].swap = header.swap;
+    vertex_chunks[i].start = (int)(vertex_element->count * i / count);
+    vertex_chunks[i].end = (int)(vertex_element->count * (i + 1) / count);
+    vertex_chunks[i].vertices = model->vertices;
+  }
+  run_chunks(ply_vertex_thread, vertex_chunks, sizeof(ply_vertex_chunk_t),
+             count);
+  g_free(vertex_chunks);
+
+  int list = -1;
+  int before = 0;
+  int after = 0;
+  for (int i = 0; i < face_element->num_properties; ++i) {
+    const ply_property_t* prop = &face_element->properties[i];
+    if (prop->is_list) {
+      if (list >= 0) {
+        goto fail;
+      }
+      list = i;
+    } else if (list < 0) {
+      before += ply_type_size(prop->type);
+    } else {
+      after += ply_type_size(prop->type);
+    }
+  }
+  if (list < 0) {
+    goto fail;
+  }
+
+  // All triangles makes every face the same size, so try
+  // that first, in parallel, and fall back to walking the
+  // faces one by one if any face has some other number of
+  // sides.
+  const ply_property_t* list_prop = &face_element->properties[list];
+  ply_face_chunk_t face_base;
+  face_base.data = face_data;
+  face_base.count_offset = before;
+  face_base.count_type = list_prop->count_type;
+  face_base.index_offset = before + ply_type_size(list_prop->count_type);
+  face_base.index_type = list_prop->type;
+  face_base.stride =
+      face_base.index_offset + ply_type_size(list_prop->type) * 3 + after;
+  face_base.swap = header.swap;
+  face_base.num_vertices = model->num_vertices;
+  face_base.failed = FALSE;
+  gboolean triangles =
+      (gsize)(end - face_data) / face_base.stride >= (gsize)face_element->count;
+  if (triangles) {
+    model->num_indices = (int)face_element->count * 3;
+    model->indices = g_new(guint32, model->num_indices);
+    count = split_count(face_element->count * face_base.stride, threads);
+    ply_face_chunk_t* face_chunks = g_new(ply_face_chunk_t, count);
+    for (int i = 0; i < count; ++i) {
+      face_chunks[i] = face_base;
+      face_chunks[i].start = face_element->count * i / count;
+      face_chunks[i].end = face_element->count * (i + 1) / count;
+      face_chunks[i].indices = model->indices;
+    }
+    run_chunks(ply_face_thread, face_chunks, sizeof(ply_face_chunk_t),
+               count);
+    for (int i = 0; i < count; ++i) {
+      triangles = triangles && !face_chunks[i].failed;
+    }
+    g_free(face_chunks);
+  }
+  if (!triangles) {
+    g_free(model->indices);
+    GArray* indices = g_array_new(FALSE, FALSE, sizeof(guint32));
+    if (!ply_read_faces(face_data, end, face_element, list, header.swap,
+                        model->num_vertices, indices)) {
+      g_array_free(indices, TRUE);
+      model->indices = NULL;
+      goto fail;
+    }
+    model->num_indices = indices->len;
+    model->indices = (guint32*)g_array_free(indices, FALSE);
+  }
+  timing->parse_time = g_get_monotonic_time() - start;
+
+  if (!has_normals) {
+    start = g_get_monotonic_time();
+    compute_normals(model);
+    timing->normal_time = g_get_monotonic_time() - start;
+  }
+  return model;
+
+fail:
+  model_free(model);
+  return NULL;
+}
+
+static gboolean parse_ply_header(const guchar* data,
+                                 gsize size,
+                                 ply_header_t* header) {
+  memset(header, 0, sizeof(*header));
+  const char* text = (const char*)data;
+  const char* end = g_strstr_len(text, MIN(size, 1 << 16), "end_header");
+  if (!end) {
+    return FALSE;
+  }
+  const char* body = memchr(end, '\n', text + size - end);
+  if (!body) {
+    return FALSE;
+  }
+  header->body = (const guchar*)body + 1;
+
+  gchar* copy = g_strndup(text, end - text);
+  gchar** lines = g_strsplit(copy, "\n", -1);
+  g_free(copy);
+  gboolean ok = FALSE;
+  gboolean has_format = FALSE;
+  ply_element_t* element = NULL;
+  for (int i = 1; lines[i]; ++i) {
+    g_strstrip(lines[i]);
+    char word[32];
+    char a[32];
+    char b[32];
+    char c[32];
+    long long count;
+    if (sscanf(lines[i], "format %31s", word) == 1) {
+      if (!strcmp(word, "binary_little_endian")) {
+        header->swap = G_BYTE_ORDER != G_LITTLE_ENDIAN;
+      } else if (!strcmp(word, "binary_big_endian")) {
+        header->swap = G_BYTE_ORDER != G_BIG_ENDIAN;
+      } else {
+        goto done;
+      }
+      has_format = TRUE;
+    } else if (sscanf(lines[i], "element %31s %lld", word, &count) == 2) {
+      if (header->num_elements == PLY_MAX_ELEMENTS || count < 0) {
+        goto done;
+      }
+      element = &header->elements[header->num_elements++];
+      g_strlcpy(element->name, word, sizeof(element->name));
+      element->count = count;
+    } else if (sscanf(lines[i], "property list %31s %31s %31s", a, b, c) ==
+               3) {
+      if (!element || element->num_properties == PLY_MAX_PROPERTIES) {
+        goto done;
+      }
+      ply_property_t* prop = &element->properties[element->num_properties++];
+      prop->is_list = TRUE;
+      g_strlcpy(prop->name, c, sizeof(prop->name));
+      if (!ply_type_from_name(a, &prop->count_type) ||
+          !ply_type_from_name(b, &prop->type)) {
+        goto done;
+      }
+    } else if (sscanf(lines[i], "property %31s %31s", a, b) == 2) {
+      if (!element || element->num_properties == PLY_MAX_PROPERTIES) {
+        goto done;
+      }
+      ply_property_t* prop = &element->properties[element->num_properties++];
+      g_strlcpy(prop->name, b, sizeof(prop->name));
+      if (!ply_type_from_name(a, &prop->type)) {
+        goto done;
+      }
+    }
+  }
+
+  for (int i = 0; i < header->num_elements; ++i) {
+    ply_element_t* e = &header->elements[i];
+    int offset = 0;
+    for (int j = 0; j < e->num_properties && offset >= 0; ++j) {
+      e->properties[j].offset = offset;
+      offset = e->properties[j].is_list
+                   ? -1
+                   : offset + ply_type_size(e->properties[j].type);
+    }
+    e->stride = offset;
+  }
+  ok = has_format;
+
+done:
+  g_strfreev(lines);
+  return ok;
+}
+
+static int ply_type_size(ply_type_t type) {
+  switch (type) {
+    case PLY_INT8:
+    case PLY_UINT8:
+      return 1;
+    case PLY_INT16:
+    case PLY_UINT16:
+      return 2;
+    case PLY_INT32:
+    case PLY_UINT32:
+    case PLY_FLOAT32:
+      return 4;
+    case PLY_FLOAT64:
+      return 8;
+  }
+  return 0;
+}
+
+static gboolean ply_type_from_name(const char* name, ply_type_t* type) {
+  const struct {
+    const char* name;
+    ply_type_t type;
+  } names[] = {
+      {"char", PLY_INT8}, {"int8", PLY_INT8},
+      {"uchar", PLY_UINT8}, {"uint8", PLY_UINT8},
+      {"short", PLY_INT16}, {"int16", PLY_INT16},
+      {"ushort", PLY_UINT16}, {"uint16", PLY_UINT16},
+      {"int", PLY_INT32}, {"int32", PLY_INT32},
+      {"uint", PLY_UINT32}, {"uint32", PLY_UINT32},
+      {"float", PLY_FLOAT32}, {"float32", PLY_FLOAT32},
+      {"double", PLY_FLOAT64}, {"float64", PLY_FLOAT64},
+  };
+  for (int i = 0; i < G_N_ELEMENTS(names); ++i) {
+    if (!strcmp(name, names[i].name)) {
+      *type = names[i].type;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static double ply_read(const guchar* p, ply_type_t type, gboolean swap) {
+  guchar bytes[8];
+  int size = ply_type_size(type);
+  if (swap) {
+    for (int i = 0; i < size; ++i) {
+      bytes[i] = p[size - 1 - i];
+    }
+    p = bytes;
+  }
+  union {
+    gint8 i8;
+    guint8 u8;
+    gint16 i16;
+    guint16 u16;
+    gint32 i32;
+    guint32 u32;
+    float f32;
+    double f64;
+  } value;
+  memcpy(&value, p, size);
+  switch (type) {
+    case PLY_INT8:
+      return value.i8;
+    case PLY_UINT8:
+      return value.u8;
+    case PLY_INT16:
+      return value.i16;
+    case PLY_UINT16:
+      return value.u16;
+    case PLY_INT32:
+      return value.i32;
+    case PLY_UINT32:
+      return value.u32;
+    case PLY_FLOAT32:
+      return value.f32;
+    case PLY_FLOAT64:
+      return value.f64;
+  }
+  return 0;
+}
+
+static int ply_find(const ply_element_t* element, const char* name) {
+  for (int i = 0; i < element->num_properties; ++i) {
+    if (!strcmp(element->properties[i].name, name)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void* ply_vertex_thread(void* arg) {
+  ply_vertex_chunk_t* c = (ply_vertex_chunk_t*)arg;
+  const ply_element_t* e = c->element;
+  for (int i = c->start; i < c->end; ++i) {
+    const guchar* item = c->data + (gsize)i * e->stride;
+    float* out = &c->vertices[(gsize)i * 6];
+    for (int j = 0; j < 6; ++j) {
+      if (c->props[j] >= 0) {
+        const ply_property_t* prop = &e->properties[c->props[j]];
+        out[j] = ply_read(item + prop->offset, prop->type, c->swap);
+      }
+    }
+  }
+  return NULL;
+}
+
+static void* ply_face_thread(void* arg) {
+  ply_face_chunk_t* c = (ply_face_chunk_t*)arg;
+  int index_size = ply_type_size(c->index_type);
+  for (gint64 i = c->start; i < c->end; ++i) {
+    const guchar* item = c->data + i * c->stride;
+    if (ply_read(item + c->count_offset, c->count_type, c->swap) != 3) {
+      c->failed = TRUE;
+      return NULL;
+    }
+    for (int j = 0; j < 3; ++j) {
+      double index = ply_read(item + c->index_offset + j * index_size,
+                              c->index_type, c->swap);
+      if (index < 0 || index >= c->num_vertices) {
+        c->failed = TRUE;
+        return NULL;
+      }
+      c->indices[i * 3 + j] = (guint32)index;
+    }
+  }
+  return NULL;
+}
+
+// Walk faces of any number of sides, splitting each into a
+// fan of triangles.
+static gboolean ply_read_faces(const guchar* data,
+                               const guchar* end,
+                               const ply_element_t* element,
+                               int list,
+                               gboolean swap,
+                               int num_vertices,
+                               GArray* indices) {
+  const ply_property_t* list_prop = &element->properties[list];
+  int count_size = ply_type_size(list_prop->count_type);
+  int index_size = ply_type_size(list_prop->type);
+  int before = list_prop->offset;
+  int after = 0;
+  for (int i = list + 1; i < element->num_properties; ++i) {
+    after += ply_type_size(element->properties[i].type);
+  }
+  const guchar* p = data;
+  for (gint64 i = 0; i < element->count; ++i) {
+    if (end - p < before + count_size) {
+      return FALSE;
+    }
+    p += before;
+    double sides = ply_read(p, list_prop->count_type, swap);
+    p += count_size;
+    if (sides < 0 || (double)(end - p) < sides * index_size + after) {
+      return FALSE;
+    }
+    guint32 first = 0;
+    guint32 last = 0;
+    for (int j = 0; j < (int)sides; ++j) {
+      double value = ply_read(p + j * index_size, list_prop->type, swap);
+      if (value < 0 || value >= num_vertices) {
+        return FALSE;
+      }
+      guint32 index = (guint32)value;
+      if (j == 0) {
+        first = index;
+      } else if (j >= 2) {
+        g_array_append_val(indices, first);
+        g_array_append_val(indices, last);
+        g_array_append_val(indices, index);
+      }
+      last = index;
+    }
+    p += (int)sides * index_size + after;
+  }
+  return TRUE;
+}
+
+// Average the normals of the faces around each vertex,
+// weighted by area.
+static void compute_normals(model_t* model) {
+  float* v = model->vertices;
+  for (int i = 0; i < model->num_vertices; ++i) {
+    v[i * 6 + 3] = v[i * 6 + 4] = v[i * 6 + 5] = 0;
+  }
+  for (int i = 0; i + 2 < model->num_indices; i += 3) {
+    const float* a = &v[model->indices[i] * 6];
+    const float* b = &v[model->indices[i + 1] * 6];
+    const float* c = &v[model->indices[i + 2] * 6];
+    float ab[3];
+    float ac[3];
+    for (int j = 0; j < 3; ++j) {
+      ab[j] = b[j] - a[j];
+      ac[j] = c[j] - a[j];
+    }
+    float n[3] = {
+        ab[1] * ac[2] - ab[2] * ac[1],
+        ab[2] * ac[0] - ab[0] * ac[2],
+        ab[0] * ac[1] - ab[1] * ac[0],
+    };
+    for (int j = 0; j < 3; ++j) {
+      float* normal = &v[model->indices[i + j] * 6 + 3];
+      normal[0] += n[0];
+      normal[1] += n[1];
+      normal[2] += n[2];
+    }
+  }
+  for (int i = 0; i < model->num_vertices; ++i) {
+    float* normal = &v[i * 6 + 3];
+    float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] +
+                         normal[2] * normal[2]);
+    if (length > 0) {
+      normal[0] /= length;
+      normal[1] /= length;
+      normal[2] /= length;
+    } else {
+      normal[2] = 1;
+    }
+  }
+}
+
+static const char* skip_space(const char* p, const char* end) {
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    p++;
+  }
+  return p;
+}
+
+// A faster strtof for the plain decimals OBJ files use,
+// which also ignores the locale. Returns NULL if there is
+// no number at p.
+static const char* parse_float(const char* p, const char* end, float* out) {
+  static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                  1e18, 1e19, 1e20, 1e21, 1e22};
+  if (!p) {
+    return NULL;
+  }
+  gboolean negative = FALSE;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  guint64 mantissa = 0;
+  int exponent = 0;
+  int digits = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+    if (mantissa < 100000000000000000ULL) {
+      mantissa = mantissa * 10 + (*p - '0');
+    } else {
+      exponent++;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && *p >= '0' && *p <= '9'; ++p, ++digits) {
+      if (mantissa < 100000000000000000ULL) {
+        mantissa = mantissa * 10 + (*p - '0');
+        exponent--;
+      }
+    }
+  }
+  if (!digits) {
+    return NULL;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    int e;
+    p = parse_int(p + 1, end, &e);
+    if (!p) {
+      return NULL;
+    }
+    exponent += e;
+  }
+  double value = mantissa;
+  if (exponent < 0) {
+    value /= -exponent < (int)G_N_ELEMENTS(powers) ? powers[-exponent]
+                                                    : pow(10, -exponent);
+  } else if (exponent > 0) {
+    value *= exponent < (int)G_N_ELEMENTS(powers) ? powers[exponent]
+                                                   : pow(10, exponent);
+  }
+  *out = negative ? -value : value;
+  return p;
+}
+
+static const char* parse_int(const char* p, const char* end, int* out) {
+  gboolean negative = FALSE;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  const char* start = p;
+  gint64 value = 0;
+  for (; p < end && *p >= '0' && *p <= '9'; ++p) {
+    value = MIN(value * 10 + (*p - '0'), G_MAXINT32);
+  }
+  if (p == start) {
+    return NULL;
+  }
+  *out = negative ? -value : value;
+  return p;
+}
+
+static void model_bounds(const model_t* model, float* min, float* max) {
+  memcpy(min, model->vertices, sizeof(float) * 3);
+  memcpy(max, model->vertices, sizeof(float) * 3);
+  for (int i = 0; i < model->num_vertices; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      min[j] = MIN(min[j], model->vertices[i * 6 + j]);
+      max[j] = MAX(max[j], model->vertices[i * 6 + j]);
+    }
+  }
+}
+
+static guint vertex_hash(gconstpointer key) {
+  const guint32* words = (const guint32*)key;
+  guint hash = 2166136261u;
+  for (int i = 0; i < 6; ++i) {
+    hash = (hash ^ words[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static gboolean vertex_equal(gconstpointer a, gconstpointer b) {
+  return !memcmp(a, b, sizeof(float) * 6);
+}
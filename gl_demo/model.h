@@ -0,0 +1,49 @@
+#ifndef __MODEL_H__
+#define __MODEL_H__
+
+#include <glib.h>
+
+// Indexed triangles, with one interleaved position and
+// normal per vertex.
+typedef struct {
+  // x, y, z, nx, ny, nz for each vertex.
+  float* vertices;
+  int num_vertices;
+  guint32* indices;
+  int num_indices;
+} model_t;
+
+// Microseconds spent in each phase of model_load.
+typedef struct {
+  gint64 map_time;
+  gint64 parse_time;
+  gint64 index_time;
+  gint64 normal_time;
+} model_timing_t;
+
+// Index unindexed triangles, merging identical vertices.
+model_t* model_new(const float* positions, const float* normals, int count);
+
+// Load a Wavefront OBJ or binary PLY file. The file is
+// mapped and split into chunks parsed by threads, or by
+// all cores if threads is 0. Vertices that share both a
+// position and a normal are merged, and normals missing
+// from the file are averaged from the faces. Returns NULL
+// if the file can't be read, isn't understood or has no
+// faces.
+model_t* model_load(const char* path, int threads, model_timing_t* timing);
+
+// Move and scale the model to fit a cube of side size
+// centered on the origin.
+void model_fit(model_t* model, float size);
+
+// The distance of the furthest vertex from the origin.
+float model_radius(const model_t* model);
+
+// A coarser copy of the model, made by merging all the
+// vertices in each cell of a grid of cells per side over
+// its bounds and dropping triangles that collapse.
+model_t* model_simplify(const model_t* model, int cells);
+void model_free(model_t* model);
+
+#endif
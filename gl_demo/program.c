@@ -0,0 +1,184 @@
+#include "program.h"
+#include <stdio.h>
+#include <string.h>
+
+#define PROGRAM_CACHE_MAGIC 0x50424c47
+
+// Cache files hold this header followed by the binary.
+typedef struct {
+  guint32 magic;
+  guint32 format;
+  gint64 compile_time;
+} cache_header_t;
+
+static char* cache_path(const char* vertex_source,
+                        const char* fragment_source);
+static gboolean load_cached(program_t* program, const char* path);
+static void save_cached(program_t* program, const char* path);
+static gboolean compile_program(program_t* program,
+                                const char* vertex_source,
+                                const char* fragment_source);
+static gboolean compile_shader(GLuint shader, const char* source);
+
+gboolean program_load(program_t* program,
+                      const char* vertex_source,
+                      const char* fragment_source,
+                      const char* const* uniform_names,
+                      int num_uniforms) {
+  g_assert(num_uniforms <= PROGRAM_MAX_UNIFORMS);
+  memset(program, 0, sizeof(*program));
+
+  gint64 start = g_get_monotonic_time();
+  char* path = cache_path(vertex_source, fragment_source);
+  if (path && load_cached(program, path)) {
+    program->cached = TRUE;
+  } else if (compile_program(program, vertex_source, fragment_source)) {
+    program->compile_time = g_get_monotonic_time() - start;
+    if (path) {
+      save_cached(program, path);
+    }
+  } else {
+    g_free(path);
+    return FALSE;
+  }
+  g_free(path);
+
+  for (int i = 0; i < num_uniforms; ++i) {
+    program->uniforms[i] = glGetUniformLocation(program->id, uniform_names[i]);
+  }
+  program->load_time = g_get_monotonic_time() - start;
+  return TRUE;
+}
+
+void program_delete(program_t* program) {
+  glDeleteProgram(program->id);
+  program->id = 0;
+}
+
+// Binaries only load on the driver that made them, so the
+// driver's identity is part of the key along with the
+// sources. Returns NULL if the driver can't save binaries.
+static char* cache_path(const char* vertex_source,
+                        const char* fragment_source) {
+  GLint num_formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+  if (num_formats < 1) {
+    return NULL;
+  }
+  const char* parts[] = {
+      (const char*)glGetString(GL_VENDOR),
+      (const char*)glGetString(GL_RENDERER),
+      (const char*)glGetString(GL_VERSION),
+      vertex_source,
+      fragment_source,
+  };
+  GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA1);
+  for (int i = 0; i < G_N_ELEMENTS(parts); ++i) {
+    const char* part = parts[i] ? parts[i] : "";
+    // Include the terminator so parts can't run together.
+    g_checksum_update(checksum, (const guchar*)part, strlen(part) + 1);
+  }
+  char* name = g_strdup_printf("%s.program", g_checksum_get_string(checksum));
+  char* path = g_build_filename(g_get_user_cache_dir(), "gl_demo", name, NULL);
+  g_free(name);
+  g_checksum_free(checksum);
+  return path;
+}
+
+static gboolean load_cached(program_t* program, const char* path) {
+  gchar* data = NULL;
+  gsize size = 0;
+  if (!g_file_get_contents(path, &data, &size, NULL)) {
+    return FALSE;
+  }
+  cache_header_t header;
+  if (size <= sizeof(header)) {
+    goto fail;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != PROGRAM_CACHE_MAGIC) {
+    goto fail;
+  }
+
+  // A driver update can reject a binary it made before;
+  // that just means compiling again.
+  program->id = glCreateProgram();
+  glProgramBinary(program->id, header.format, data + sizeof(header),
+                  size - sizeof(header));
+  GLint result = GL_FALSE;
+  glGetProgramiv(program->id, GL_LINK_STATUS, &result);
+  if (!result) {
+    glDeleteProgram(program->id);
+    program->id = 0;
+    goto fail;
+  }
+  program->compile_time = header.compile_time;
+  g_free(data);
+  return TRUE;
+
+fail:
+  g_free(data);
+  return FALSE;
+}
+
+static void save_cached(program_t* program, const char* path) {
+  GLint length = 0;
+  glGetProgramiv(program->id, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0) {
+    return;
+  }
+  cache_header_t header;
+  header.magic = PROGRAM_CACHE_MAGIC;
+  header.compile_time = program->compile_time;
+  gchar* data = g_malloc(sizeof(header) + length);
+  GLenum format = 0;
+  glGetProgramBinary(program->id, length, NULL, &format,
+                     data + sizeof(header));
+  header.format = format;
+  memcpy(data, &header, sizeof(header));
+
+  char* dir = g_path_get_dirname(path);
+  g_mkdir_with_parents(dir, 0755);
+  g_file_set_contents(path, data, sizeof(header) + length, NULL);
+  g_free(dir);
+  g_free(data);
+}
+
+static gboolean compile_program(program_t* program,
+                                const char* vertex_source,
+                                const char* fragment_source) {
+  GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+  GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+  program->id = glCreateProgram();
+  glAttachShader(program->id, vertex_shader);
+  glAttachShader(program->id, fragment_shader);
+  glProgramParameteri(program->id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT,
+                      GL_TRUE);
+
+  GLint result = GL_FALSE;
+  if (!compile_shader(vertex_shader, vertex_source) ||
+      !compile_shader(fragment_shader, fragment_source)) {
+    goto done;
+  }
+  glLinkProgram(program->id);
+  glGetProgramiv(program->id, GL_LINK_STATUS, &result);
+
+done:
+  glDetachShader(program->id, vertex_shader);
+  glDetachShader(program->id, fragment_shader);
+  glDeleteShader(vertex_shader);
+  glDeleteShader(fragment_shader);
+  if (!result) {
+    glDeleteProgram(program->id);
+    program->id = 0;
+  }
+  return result;
+}
+
+static gboolean compile_shader(GLuint shader, const char* source) {
+  GLint result = GL_FALSE;
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &result);
+  return result;
+}
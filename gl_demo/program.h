@@ -0,0 +1,38 @@
+#ifndef __PROGRAM_H__
+#define __PROGRAM_H__
+
+#define GL_GLEXT_PROTOTYPES 1
+
+#include <GL/gl.h>
+#include <glib.h>
+
+#define PROGRAM_MAX_UNIFORMS 8
+
+// A linked shader program, and the locations of its
+// uniforms in the order their names were given, looked up
+// once at link time.
+typedef struct {
+  GLuint id;
+  GLint uniforms[PROGRAM_MAX_UNIFORMS];
+
+  // Whether the program was loaded from the binary cache,
+  // how long loading it took, and how long compiling it
+  // from source took, either just now or when the cached
+  // binary was made. Times are in microseconds.
+  gboolean cached;
+  gint64 load_time;
+  gint64 compile_time;
+} program_t;
+
+// Link a program from GLSL sources, or reload the binary
+// that was saved the last time the same sources were
+// linked by the same driver. Returns FALSE if the sources
+// fail to compile or link.
+gboolean program_load(program_t* program,
+                      const char* vertex_source,
+                      const char* fragment_source,
+                      const char* const* uniform_names,
+                      int num_uniforms);
+void program_delete(program_t* program);
+
+#endif
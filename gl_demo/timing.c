@@ -0,0 +1,55 @@
+#include "timing.h"
+
+static int bucket_index(float ms);
+
+void timing_history_add(timing_history_t* h, float ms) {
+  if (h->count == TIMING_FRAMES) {
+    h->buckets[bucket_index(h->samples[h->next])]--;
+  } else {
+    h->count++;
+  }
+  h->samples[h->next] = ms;
+  h->buckets[bucket_index(ms)]++;
+  h->next = (h->next + 1) % TIMING_FRAMES;
+}
+
+float timing_history_mean(const timing_history_t* h) {
+  if (!h->count) {
+    return 0;
+  }
+  float sum = 0;
+  for (int i = 0; i < h->count; ++i) {
+    sum += h->samples[i];
+  }
+  return sum / h->count;
+}
+
+float timing_history_percentile(const timing_history_t* h, float p) {
+  int target = (int)(p * h->count + 0.5f);
+  int seen = 0;
+  for (int i = 0; i < TIMING_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen >= target) {
+      return (i + 1) * TIMING_BUCKET_MS;
+    }
+  }
+  return TIMING_BUCKETS * TIMING_BUCKET_MS;
+}
+
+int timing_history_max_bucket(const timing_history_t* h) {
+  int max = 0;
+  for (int i = 0; i < TIMING_BUCKETS; ++i) {
+    if (h->buckets[i] > max) {
+      max = h->buckets[i];
+    }
+  }
+  return max;
+}
+
+static int bucket_index(float ms) {
+  int index = (int)(ms / TIMING_BUCKET_MS);
+  if (index < 0) {
+    return 0;
+  }
+  return index < TIMING_BUCKETS ? index : TIMING_BUCKETS - 1;
+}
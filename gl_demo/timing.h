@@ -0,0 +1,28 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+// Frames a history covers, and its histogram's buckets.
+// The last bucket also counts every slower frame.
+#define TIMING_FRAMES 240
+#define TIMING_BUCKETS 40
+#define TIMING_BUCKET_MS 1.0f
+
+// The durations of the last TIMING_FRAMES frames, and a
+// histogram of them that is kept up to date as old frames
+// drop out.
+typedef struct {
+  float samples[TIMING_FRAMES];
+  int next;
+  int count;
+  int buckets[TIMING_BUCKETS];
+} timing_history_t;
+
+void timing_history_add(timing_history_t* h, float ms);
+float timing_history_mean(const timing_history_t* h);
+
+// The longest a fraction p (0 to 1) of the frames took,
+// rounded up to the end of a bucket.
+float timing_history_percentile(const timing_history_t* h, float p);
+int timing_history_max_bucket(const timing_history_t* h);
+
+#endif
@@ -0,0 +1,238 @@
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <math.h>
+#include <stdio.h>
+#include "downscale.h"
+#include "solver.h"
+
+#define BENCH_SOURCE_SIZE 4096
+#define BENCH_TARGET_SIZE 640
+#define BENCH_RUNS 3
+
+// The solver cuts this image into ever smaller pieces.
+#define BENCH_PUZZLE_SIZE 640
+#define BENCH_WAVES 12
+
+// The zone plate's frequency grows linearly from zero at
+// the center to the source's Nyquist limit at this radius.
+#define BENCH_NYQUIST_RADIUS (BENCH_SOURCE_SIZE / 2)
+
+typedef struct {
+  const char* name;
+  GdkInterpType interp;
+  downscale_filter_t filter;
+  int threads;
+} method_t;
+
+static GdkPixbuf* zone_plate(int size);
+static double zone_plate_value(double x, double y);
+static GdkPixbuf* run_method(const method_t* method,
+                             GdkPixbuf* src,
+                             double* seconds);
+static void measure(GdkPixbuf* out, double* alias_rms, double* pass_rms);
+static GdkPixbuf* smooth_image(int size);
+static void run_solver(GdkPixbuf* image, int n);
+
+int main(int argc, char** argv) {
+  const method_t methods[] = {
+      {"gdk bilinear", GDK_INTERP_BILINEAR, 0, -1},
+      {"gdk hyper", GDK_INTERP_HYPER, 0, -1},
+      {"area, 1 thread", 0, DOWNSCALE_AREA, 1},
+      {"area", 0, DOWNSCALE_AREA, 0},
+      {"lanczos3, 1 thread", 0, DOWNSCALE_LANCZOS3, 1},
+      {"lanczos3", 0, DOWNSCALE_LANCZOS3, 0},
+  };
+
+  GdkPixbuf* src = zone_plate(BENCH_SOURCE_SIZE);
+  printf("%dx%d zone plate to %dx%d, %d cores\n", BENCH_SOURCE_SIZE,
+         BENCH_SOURCE_SIZE, BENCH_TARGET_SIZE, BENCH_TARGET_SIZE,
+         g_get_num_processors());
+  printf("%-20s %10s %12s %12s\n", "method", "ms", "alias RMS",
+         "passband RMS");
+  for (int i = 0; i < G_N_ELEMENTS(methods); ++i) {
+    double seconds;
+    GdkPixbuf* out = run_method(&methods[i], src, &seconds);
+    double alias_rms, pass_rms;
+    measure(out, &alias_rms, &pass_rms);
+    printf("%-20s %10.1f %12.2f %12.2f\n", methods[i].name, seconds * 1000,
+           alias_rms, pass_rms);
+    g_object_unref(out);
+  }
+  g_object_unref(src);
+
+  GdkPixbuf* image = smooth_image(BENCH_PUZZLE_SIZE);
+  printf("\nsolving a shuffled %dx%d image\n", BENCH_PUZZLE_SIZE,
+         BENCH_PUZZLE_SIZE);
+  printf("%-20s %10s %12s\n", "pieces", "ms", "neighbors %");
+  for (int n = 8; n <= 64; n *= 2) {
+    run_solver(image, n);
+  }
+  g_object_unref(image);
+  return 0;
+}
+
+static GdkPixbuf* zone_plate(int size) {
+  GdkPixbuf* pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, size, size);
+  guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
+  int stride = gdk_pixbuf_get_rowstride(pixbuf);
+  for (int y = 0; y < size; ++y) {
+    guchar* row = pixels + (gsize)y * stride;
+    for (int x = 0; x < size; ++x) {
+      guchar value = (guchar)round(zone_plate_value(x + 0.5, y + 0.5));
+      row[x * 3] = row[x * 3 + 1] = row[x * 3 + 2] = value;
+    }
+  }
+  return pixbuf;
+}
+
+// The source value at (x, y), in source pixels.
+static double zone_plate_value(double x, double y) {
+  double dx = x - BENCH_SOURCE_SIZE / 2.0;
+  double dy = y - BENCH_SOURCE_SIZE / 2.0;
+  double k = 0.5 / BENCH_NYQUIST_RADIUS;
+  return 127.5 + 127.5 * cos(M_PI * k * (dx * dx + dy * dy));
+}
+
+// Return the fastest of several runs of one method.
+static GdkPixbuf* run_method(const method_t* method,
+                             GdkPixbuf* src,
+                             double* seconds) {
+  GdkPixbuf* out = NULL;
+  *seconds = INFINITY;
+  for (int i = 0; i < BENCH_RUNS; ++i) {
+    if (out) {
+      g_object_unref(out);
+    }
+    gint64 start = g_get_monotonic_time();
+    if (method->threads < 0) {
+      out = gdk_pixbuf_scale_simple(src, BENCH_TARGET_SIZE, BENCH_TARGET_SIZE,
+                                    method->interp);
+    } else {
+      out = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, BENCH_TARGET_SIZE,
+                           BENCH_TARGET_SIZE);
+      downscale_image_t s;
+      downscale_image_t d;
+      downscale_image_from_pixbuf(src, &s);
+      downscale_image_from_pixbuf(out, &d);
+      downscale(&s, &d, method->filter, method->threads);
+    }
+    *seconds = MIN(*seconds, (g_get_monotonic_time() - start) / 1e6);
+  }
+  return out;
+}
+
+// Where the zone plate is well above the output's Nyquist
+// limit, an ideal downscale is flat gray, and anything
+// else is aliasing. Well below the limit, it should match
+// the zone plate itself.
+static void measure(GdkPixbuf* out, double* alias_rms, double* pass_rms) {
+  double scale = (double)BENCH_SOURCE_SIZE / BENCH_TARGET_SIZE;
+  double cutoff_radius = BENCH_NYQUIST_RADIUS / scale;
+  const guchar* pixels = gdk_pixbuf_get_pixels(out);
+  int stride = gdk_pixbuf_get_rowstride(out);
+  int channels = gdk_pixbuf_get_n_channels(out);
+  double alias_sum = 0;
+  double pass_sum = 0;
+  int alias_count = 0;
+  int pass_count = 0;
+  for (int y = 0; y < BENCH_TARGET_SIZE; ++y) {
+    for (int x = 0; x < BENCH_TARGET_SIZE; ++x) {
+      double sx = (x + 0.5) * scale;
+      double sy = (y + 0.5) * scale;
+      double r = hypot(sx - BENCH_SOURCE_SIZE / 2.0,
+                       sy - BENCH_SOURCE_SIZE / 2.0);
+      double value = pixels[(gsize)y * stride + x * channels];
+      if (r > cutoff_radius * 1.5 && r < BENCH_NYQUIST_RADIUS) {
+        alias_sum += (value - 127.5) * (value - 127.5);
+        alias_count++;
+      } else if (r < cutoff_radius * 0.25) {
+        double expected = zone_plate_value(sx, sy);
+        pass_sum += (value - expected) * (value - expected);
+        pass_count++;
+      }
+    }
+  }
+  *alias_rms = sqrt(alias_sum / MAX(1, alias_count));
+  *pass_rms = sqrt(pass_sum / MAX(1, pass_count));
+}
+
+// A sum of random plane waves, with no repeated structure
+// for the solver to confuse.
+static GdkPixbuf* smooth_image(int size) {
+  GRand* rand = g_rand_new_with_seed(1);
+  double fx[BENCH_WAVES];
+  double fy[BENCH_WAVES];
+  double phase[BENCH_WAVES];
+  for (int k = 0; k < BENCH_WAVES; ++k) {
+    fx[k] = g_rand_double_range(rand, -0.05, 0.05);
+    fy[k] = g_rand_double_range(rand, -0.05, 0.05);
+    phase[k] = g_rand_double_range(rand, 0, 2 * M_PI);
+  }
+  g_rand_free(rand);
+
+  GdkPixbuf* pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, size, size);
+  guchar* pixels = gdk_pixbuf_get_pixels(pixbuf);
+  int stride = gdk_pixbuf_get_rowstride(pixbuf);
+  for (int y = 0; y < size; ++y) {
+    guchar* row = pixels + (gsize)y * stride;
+    for (int x = 0; x < size; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        double value = 127.5;
+        for (int k = c; k < BENCH_WAVES; k += 3) {
+          value += 40 * sin(fx[k] * x + fy[k] * y + phase[k]);
+        }
+        row[x * 3 + c] = (guchar)CLAMP(round(value), 0, 255);
+      }
+    }
+  }
+  return pixbuf;
+}
+
+// Hand the solver the pieces of an n x n cut in a random
+// order, and count the neighbors it puts back together.
+static void run_solver(GdkPixbuf* image, int n) {
+  int count = n * n;
+  int size = gdk_pixbuf_get_width(image) / n;
+  const guchar* pixels = gdk_pixbuf_get_pixels(image);
+  int stride = gdk_pixbuf_get_rowstride(image);
+  int* order = g_new(int, count);
+  for (int i = 0; i < count; ++i) {
+    order[i] = i;
+  }
+  for (int i = count - 1; i > 0; --i) {
+    int j = g_random_int_range(0, i + 1);
+    int home = order[i];
+    order[i] = order[j];
+    order[j] = home;
+  }
+
+  solver_t* solver = solver_new(count, size);
+  for (int i = 0; i < count; ++i) {
+    int x = order[i] % n * size;
+    int y = order[i] / n * size;
+    solver_set_piece(solver, i, pixels + (gsize)y * stride + x * 3, stride, 3);
+  }
+  int* placement = g_new(int, count);
+  gint64 start = g_get_monotonic_time();
+  solver_solve(solver, n, n, 0, placement);
+  double seconds = (g_get_monotonic_time() - start) / 1e6;
+
+  int correct = 0;
+  for (int cell = 0; cell < count; ++cell) {
+    int home = order[placement[cell]];
+    if (cell % n < n - 1 && order[placement[cell + 1]] == home + 1 &&
+        home % n < n - 1) {
+      correct++;
+    }
+    if (cell + n < count && order[placement[cell + n]] == home + n) {
+      correct++;
+    }
+  }
+  char name[32];
+  g_snprintf(name, sizeof(name), "%dx%d", n, n);
+  printf("%-20s %10.1f %12.1f\n", name, seconds * 1000,
+         100.0 * correct / (2 * n * (n - 1)));
+
+  solver_free(solver);
+  g_free(placement);
+  g_free(order);
+}
@@ -0,0 +1,339 @@
+#include "downscale.h"
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Output position i takes count taps starting at source
+// position first, with weights at i * max_taps.
+typedef struct {
+  int* first;
+  int* count;
+  float* weights;
+  int max_taps;
+} filter_table_t;
+
+typedef struct {
+  const downscale_image_t* src;
+  const downscale_image_t* dst;
+  const filter_table_t* x_table;
+  const filter_table_t* y_table;
+  int row_start;
+  int row_end;
+} band_t;
+
+static void build_table(int src_size,
+                        int dst_size,
+                        downscale_filter_t filter,
+                        filter_table_t* table);
+static void free_table(filter_table_t* table);
+static double lanczos3(double x);
+static void* band_thread(void* arg);
+static void load_row(const downscale_image_t* src, int y, float* out);
+static void filter_row(const float* in,
+                       const filter_table_t* table,
+                       int width,
+                       float* out);
+static void accumulate_row(float* acc, const float* row, float weight, int n);
+static void store_row(const float* acc, const downscale_image_t* dst, int y);
+
+void downscale_image_from_pixbuf(GdkPixbuf* pixbuf, downscale_image_t* image) {
+  image->pixels = gdk_pixbuf_get_pixels(pixbuf);
+  image->width = gdk_pixbuf_get_width(pixbuf);
+  image->height = gdk_pixbuf_get_height(pixbuf);
+  image->stride = gdk_pixbuf_get_rowstride(pixbuf);
+  image->format =
+      gdk_pixbuf_get_has_alpha(pixbuf) ? DOWNSCALE_RGBA : DOWNSCALE_RGB;
+}
+
+void downscale_image_from_surface(cairo_surface_t* surface,
+                                  downscale_image_t* image) {
+  cairo_surface_flush(surface);
+  image->pixels = cairo_image_surface_get_data(surface);
+  image->width = cairo_image_surface_get_width(surface);
+  image->height = cairo_image_surface_get_height(surface);
+  image->stride = cairo_image_surface_get_stride(surface);
+  image->format = DOWNSCALE_CAIRO;
+}
+
+void downscale(const downscale_image_t* src,
+               const downscale_image_t* dst,
+               downscale_filter_t filter,
+               int threads) {
+  filter_table_t x_table;
+  filter_table_t y_table;
+  build_table(src->width, dst->width, filter, &x_table);
+  build_table(src->height, dst->height, filter, &y_table);
+
+  if (threads <= 0) {
+    threads = g_get_num_processors();
+  }
+  threads = MAX(1, MIN(threads, dst->height / DOWNSCALE_CHUNK_ROWS));
+  band_t* bands = g_new(band_t, threads);
+  pthread_t* ids = g_new(pthread_t, threads);
+  for (int i = 0; i < threads; ++i) {
+    bands[i].src = src;
+    bands[i].dst = dst;
+    bands[i].x_table = &x_table;
+    bands[i].y_table = &y_table;
+    bands[i].row_start = (int)((gint64)dst->height * i / threads);
+    bands[i].row_end = (int)((gint64)dst->height * (i + 1) / threads);
+    if (i > 0) {
+      pthread_create(&ids[i], NULL, band_thread, &bands[i]);
+    }
+  }
+  band_thread(&bands[0]);
+  for (int i = 1; i < threads; ++i) {
+    pthread_join(ids[i], NULL);
+  }
+  g_free(ids);
+  g_free(bands);
+  free_table(&x_table);
+  free_table(&y_table);
+}
+
+static void build_table(int src_size,
+                        int dst_size,
+                        downscale_filter_t filter,
+                        filter_table_t* table) {
+  // When shrinking, the filter is stretched to cover every
+  // source pixel that maps into an output pixel.
+  double scale = (double)src_size / dst_size;
+  double support = MAX(1.0, scale);
+  double radius = (filter == DOWNSCALE_AREA ? 0.5 : 3.0) * support;
+  table->max_taps = (int)ceil(radius * 2) + 2;
+  table->first = g_new(int, dst_size);
+  table->count = g_new(int, dst_size);
+  table->weights = g_new0(float, (gsize)dst_size * table->max_taps);
+
+  for (int i = 0; i < dst_size; ++i) {
+    double center = (i + 0.5) * scale;
+    int first = MAX(0, (int)floor(center - radius));
+    int last = MIN(src_size, (int)ceil(center + radius));
+    float* weights = table->weights + (gsize)i * table->max_taps;
+    double sum = 0;
+    int count = 0;
+    for (int j = first; j < last && count < table->max_taps; ++j) {
+      double w;
+      if (filter == DOWNSCALE_AREA) {
+        // How much of source pixel j lies under the output
+        // pixel's footprint.
+        w = MIN(j + 1, center + radius) - MAX(j, center - radius);
+        w = MAX(0, w);
+      } else {
+        w = lanczos3((j + 0.5 - center) / support);
+      }
+      weights[count++] = w;
+      sum += w;
+    }
+    if (sum == 0) {
+      first = MIN(src_size - 1, (int)center);
+      weights[0] = 1;
+      count = 1;
+      sum = 1;
+    }
+    for (int k = 0; k < count; ++k) {
+      weights[k] /= sum;
+    }
+    table->first[i] = first;
+    table->count[i] = count;
+  }
+}
+
+static void free_table(filter_table_t* table) {
+  g_free(table->first);
+  g_free(table->count);
+  g_free(table->weights);
+}
+
+static double lanczos3(double x) {
+  if (x == 0) {
+    return 1;
+  }
+  if (fabs(x) >= 3) {
+    return 0;
+  }
+  double px = M_PI * x;
+  return 3 * sin(px) * sin(px / 3) / (px * px);
+}
+
+static void* band_thread(void* arg) {
+  band_t* band = (band_t*)arg;
+  const downscale_image_t* src = band->src;
+  const downscale_image_t* dst = band->dst;
+  const filter_table_t* y_table = band->y_table;
+
+  // Source rows are widened to four floats per pixel and
+  // filtered horizontally; output rows are then sums of
+  // those rows.
+  gsize row_floats = (gsize)dst->width * 4;
+  float* src_row = g_new(float, (gsize)src->width * 4);
+  float* acc = g_new(float, row_floats);
+  float* rows = NULL;
+  int rows_capacity = 0;
+
+  for (int y0 = band->row_start; y0 < band->row_end;
+       y0 += DOWNSCALE_CHUNK_ROWS) {
+    int y1 = MIN(y0 + DOWNSCALE_CHUNK_ROWS, band->row_end);
+    int first = y_table->first[y0];
+    int last = first;
+    for (int y = y0; y < y1; ++y) {
+      first = MIN(first, y_table->first[y]);
+      last = MAX(last, y_table->first[y] + y_table->count[y]);
+    }
+    if (last - first > rows_capacity) {
+      rows_capacity = last - first;
+      rows = g_renew(float, rows, row_floats * rows_capacity);
+    }
+    for (int y = first; y < last; ++y) {
+      load_row(src, y, src_row);
+      filter_row(src_row, band->x_table, dst->width,
+                 rows + (y - first) * row_floats);
+    }
+
+    for (int y = y0; y < y1; ++y) {
+      const float* weights =
+          y_table->weights + (gsize)y * y_table->max_taps;
+      memset(acc, 0, row_floats * sizeof(float));
+      for (int k = 0; k < y_table->count[y]; ++k) {
+        int row = y_table->first[y] + k - first;
+        accumulate_row(acc, rows + row * row_floats, weights[k], row_floats);
+      }
+      store_row(acc, dst, y);
+    }
+  }
+
+  g_free(rows);
+  g_free(acc);
+  g_free(src_row);
+  return NULL;
+}
+
+// Widen a row to premultiplied RGBA floats, so that
+// transparent pixels do not bleed their color.
+static void load_row(const downscale_image_t* src, int y, float* out) {
+  const guchar* p = src->pixels + (gsize)y * src->stride;
+  switch (src->format) {
+    case DOWNSCALE_RGB:
+      for (int x = 0; x < src->width; ++x, p += 3, out += 4) {
+        out[0] = p[0];
+        out[1] = p[1];
+        out[2] = p[2];
+        out[3] = 255;
+      }
+      break;
+    case DOWNSCALE_RGBA:
+      for (int x = 0; x < src->width; ++x, p += 4, out += 4) {
+        float alpha = p[3] / 255.0f;
+        out[0] = p[0] * alpha;
+        out[1] = p[1] * alpha;
+        out[2] = p[2] * alpha;
+        out[3] = p[3];
+      }
+      break;
+    case DOWNSCALE_CAIRO:
+      for (int x = 0; x < src->width; ++x, p += 4, out += 4) {
+        uint32_t pixel = *(const uint32_t*)p;
+        out[0] = (pixel >> 16) & 0xff;
+        out[1] = (pixel >> 8) & 0xff;
+        out[2] = pixel & 0xff;
+        out[3] = pixel >> 24;
+      }
+      break;
+  }
+}
+
+static void filter_row(const float* in,
+                       const filter_table_t* table,
+                       int width,
+                       float* out) {
+  for (int x = 0; x < width; ++x, out += 4) {
+    const float* p = in + table->first[x] * 4;
+    const float* weights = table->weights + (gsize)x * table->max_taps;
+    int count = table->count[x];
+#ifdef __SSE2__
+    __m128 sum = _mm_setzero_ps();
+    for (int k = 0; k < count; ++k) {
+      sum = _mm_add_ps(
+          sum, _mm_mul_ps(_mm_loadu_ps(p + k * 4), _mm_set1_ps(weights[k])));
+    }
+    _mm_storeu_ps(out, sum);
+#else
+    float sum[4] = {0, 0, 0, 0};
+    for (int k = 0; k < count; ++k) {
+      for (int c = 0; c < 4; ++c) {
+        sum[c] += p[k * 4 + c] * weights[k];
+      }
+    }
+    memcpy(out, sum, sizeof(sum));
+#endif
+  }
+}
+
+// acc += row * weight over n floats, a multiple of four.
+static void accumulate_row(float* acc, const float* row, float weight, int n) {
+  int i = 0;
+#ifdef __SSE2__
+  __m128 w = _mm_set1_ps(weight);
+  for (; i + 16 <= n; i += 16) {
+    __m128 a0 = _mm_loadu_ps(acc + i);
+    __m128 a1 = _mm_loadu_ps(acc + i + 4);
+    __m128 a2 = _mm_loadu_ps(acc + i + 8);
+    __m128 a3 = _mm_loadu_ps(acc + i + 12);
+    a0 = _mm_add_ps(a0, _mm_mul_ps(_mm_loadu_ps(row + i), w));
+    a1 = _mm_add_ps(a1, _mm_mul_ps(_mm_loadu_ps(row + i + 4), w));
+    a2 = _mm_add_ps(a2, _mm_mul_ps(_mm_loadu_ps(row + i + 8), w));
+    a3 = _mm_add_ps(a3, _mm_mul_ps(_mm_loadu_ps(row + i + 12), w));
+    _mm_storeu_ps(acc + i, a0);
+    _mm_storeu_ps(acc + i + 4, a1);
+    _mm_storeu_ps(acc + i + 8, a2);
+    _mm_storeu_ps(acc + i + 12, a3);
+  }
+  for (; i < n; i += 4) {
+    _mm_storeu_ps(acc + i,
+                  _mm_add_ps(_mm_loadu_ps(acc + i),
+                             _mm_mul_ps(_mm_loadu_ps(row + i), w)));
+  }
+#endif
+  for (; i < n; ++i) {
+    acc[i] += row[i] * weight;
+  }
+}
+
+static void store_row(const float* acc, const downscale_image_t* dst, int y) {
+  guchar* p = dst->pixels + (gsize)y * dst->stride;
+  int bytes = dst->format == DOWNSCALE_RGB ? 3 : 4;
+  for (int x = 0; x < dst->width; ++x, acc += 4, p += bytes) {
+    // Lanczos overshoots; keep colors within [0, alpha].
+    float alpha = MIN(255.0f, MAX(0.0f, acc[3]));
+    float rgba[4];
+    for (int c = 0; c < 3; ++c) {
+      rgba[c] = MIN(alpha, MAX(0.0f, acc[c]));
+    }
+    rgba[3] = alpha;
+    switch (dst->format) {
+      case DOWNSCALE_RGB:
+        for (int c = 0; c < 3; ++c) {
+          p[c] = (guchar)(rgba[c] + 0.5f);
+        }
+        break;
+      case DOWNSCALE_RGBA: {
+        float scale = alpha > 0 ? 255.0f / alpha : 0;
+        for (int c = 0; c < 3; ++c) {
+          p[c] = (guchar)(rgba[c] * scale + 0.5f);
+        }
+        p[3] = (guchar)(alpha + 0.5f);
+        break;
+      }
+      case DOWNSCALE_CAIRO:
+        *(uint32_t*)p = ((uint32_t)(rgba[3] + 0.5f) << 24) |
+                        ((uint32_t)(rgba[0] + 0.5f) << 16) |
+                        ((uint32_t)(rgba[1] + 0.5f) << 8) |
+                        (uint32_t)(rgba[2] + 0.5f);
+        break;
+    }
+  }
+}
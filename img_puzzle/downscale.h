@@ -0,0 +1,47 @@
+#ifndef __DOWNSCALE_H__
+#define __DOWNSCALE_H__
+
+#include <cairo.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+// Output rows filtered per pass. Each pass re-filters the
+// few source rows it shares with the previous one.
+#define DOWNSCALE_CHUNK_ROWS 32
+
+typedef enum {
+  // Average of the source pixels under each output pixel.
+  DOWNSCALE_AREA,
+  DOWNSCALE_LANCZOS3,
+} downscale_filter_t;
+
+typedef enum {
+  DOWNSCALE_RGB,
+  DOWNSCALE_RGBA,
+
+  // Premultiplied, native-endian CAIRO_FORMAT_ARGB32.
+  DOWNSCALE_CAIRO,
+} downscale_format_t;
+
+typedef struct {
+  guchar* pixels;
+  int width;
+  int height;
+  int stride;
+  downscale_format_t format;
+} downscale_image_t;
+
+void downscale_image_from_pixbuf(GdkPixbuf* pixbuf, downscale_image_t* image);
+void downscale_image_from_surface(cairo_surface_t* surface,
+                                  downscale_image_t* image);
+
+// Resample src into dst with a separable filter, working
+// on premultiplied colors. Output rows are split between
+// threads, or between all cores if threads is 0, and are
+// written straight into dst, which may be a region of a
+// larger buffer. Mark cairo surfaces dirty afterwards.
+void downscale(const downscale_image_t* src,
+               const downscale_image_t* dst,
+               downscale_filter_t filter,
+               int threads);
+
+#endif
@@ -0,0 +1,362 @@
+#include "loader.h"
+#include <pthread.h>
+#include <stdio.h>
+#include "downscale.h"
+#include "pyramid.h"
+
+// Progress is reported in steps of this many thousandths.
+#define PROGRESS_STEP 10
+
+struct puzzle_loader {
+  char* path;
+  int num_pieces;
+  int piece_size;
+  gboolean atlas;
+  gint64 tile_cache_bytes;
+  puzzle_progress_cb progress_cb;
+  puzzle_loaded_cb cb;
+  gpointer user_data;
+  puzzle_image_t* result;
+  int progress;
+  int cancelled;
+  int ref_count;
+};
+
+// A pyramid build in progress, shared by every load of the
+// same image. Builds are never stopped once started, so a
+// load that is cancelled and restarted with another piece
+// count or view picks up where the conversion has got to.
+typedef struct {
+  // The load whose thread runs the build.
+  puzzle_loader_t* owner;
+  int ref_count;
+  gboolean done;
+  gboolean success;
+  double fraction;
+} shared_build_t;
+
+// Builds in progress by cache path, guarded by builds_lock.
+static pthread_mutex_t builds_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t builds_cond = PTHREAD_COND_INITIALIZER;
+static GHashTable* builds = NULL;
+
+static void* load_thread(void* arg);
+static gboolean deliver_image(gpointer data);
+static gboolean deliver_progress(gpointer data);
+static void unref_loader(gpointer data);
+static GdkPixbuf* decode_image(puzzle_loader_t* l);
+static void size_prepared(GdkPixbufLoader* loader,
+                          int width,
+                          int height,
+                          gpointer userData);
+static void report_progress(puzzle_loader_t* l, double fraction);
+static gboolean build_progress(double fraction, gpointer user_data);
+static gboolean build_pyramid(puzzle_loader_t* l, const char* cache_path);
+static puzzle_image_t* cut_image(puzzle_loader_t* l, GdkPixbuf* image);
+static puzzle_image_t* cut_pyramid(puzzle_loader_t* l);
+static void slice_pieces(puzzle_image_t* result);
+
+puzzle_loader_t* puzzle_load(const char* path,
+                             int num_pieces,
+                             int piece_size,
+                             gboolean atlas,
+                             gint64 tile_cache_bytes,
+                             puzzle_progress_cb progress_cb,
+                             puzzle_loaded_cb cb,
+                             gpointer user_data) {
+  puzzle_loader_t* l = g_new0(puzzle_loader_t, 1);
+  l->path = g_strdup(path);
+  l->num_pieces = num_pieces;
+  l->piece_size = piece_size;
+  l->atlas = atlas;
+  l->tile_cache_bytes = tile_cache_bytes;
+  l->progress_cb = progress_cb;
+  l->cb = cb;
+  l->user_data = user_data;
+
+  // One reference for the caller and one for the thread.
+  l->ref_count = 2;
+  pthread_t thread;
+  pthread_create(&thread, NULL, load_thread, l);
+  pthread_detach(thread);
+  return l;
+}
+
+void puzzle_loader_cancel(puzzle_loader_t* l) {
+  if (!l) {
+    return;
+  }
+  g_atomic_int_set(&l->cancelled, TRUE);
+  unref_loader(l);
+}
+
+void puzzle_image_free(puzzle_image_t* image) {
+  if (!image) {
+    return;
+  }
+  if (image->pieces) {
+    for (int i = 0; i < image->num_pieces * image->num_pieces; ++i) {
+      g_object_unref(image->pieces[i]);
+    }
+    g_free(image->pieces);
+  }
+  if (image->atlas) {
+    cairo_surface_destroy(image->atlas);
+  }
+  if (image->image) {
+    g_object_unref(image->image);
+  }
+  g_free(image);
+}
+
+static void* load_thread(void* arg) {
+  puzzle_loader_t* l = (puzzle_loader_t*)arg;
+  int width, height;
+  if (gdk_pixbuf_get_file_info(l->path, &width, &height) &&
+      (gint64)width * height > PYRAMID_MIN_PIXELS) {
+    l->result = cut_pyramid(l);
+    g_main_context_invoke_full(NULL, 0, deliver_image, l, unref_loader);
+    return NULL;
+  }
+
+  GdkPixbuf* image = decode_image(l);
+  if (image) {
+    if (!g_atomic_int_get(&l->cancelled)) {
+      l->result = cut_image(l, image);
+    }
+    g_object_unref(image);
+  }
+  g_main_context_invoke_full(NULL, 0, deliver_image, l, unref_loader);
+  return NULL;
+}
+
+static gboolean deliver_image(gpointer data) {
+  puzzle_loader_t* l = (puzzle_loader_t*)data;
+  if (!g_atomic_int_get(&l->cancelled)) {
+    l->cb(l->result, l->user_data);
+    l->result = NULL;
+  }
+  return FALSE;
+}
+
+static gboolean deliver_progress(gpointer data) {
+  puzzle_loader_t* l = (puzzle_loader_t*)data;
+  if (!g_atomic_int_get(&l->cancelled)) {
+    l->progress_cb(g_atomic_int_get(&l->progress) / 1000.0, l->user_data);
+  }
+  return FALSE;
+}
+
+static void unref_loader(gpointer data) {
+  puzzle_loader_t* l = (puzzle_loader_t*)data;
+  if (g_atomic_int_dec_and_test(&l->ref_count)) {
+    puzzle_image_free(l->result);
+    g_free(l->path);
+    g_free(l);
+  }
+}
+
+static GdkPixbuf* decode_image(puzzle_loader_t* l) {
+  FILE* file = fopen(l->path, "rb");
+  if (!file) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  GdkPixbufLoader* loader = gdk_pixbuf_loader_new();
+  g_signal_connect(loader, "size-prepared", G_CALLBACK(size_prepared), l);
+
+  guchar* buffer = g_malloc(LOADER_CHUNK_SIZE);
+  gboolean ok = TRUE;
+  long total = 0;
+  size_t n;
+  while (ok && (n = fread(buffer, 1, LOADER_CHUNK_SIZE, file)) > 0) {
+    if (g_atomic_int_get(&l->cancelled)) {
+      ok = FALSE;
+      break;
+    }
+    ok = gdk_pixbuf_loader_write(loader, buffer, n, NULL);
+    total += n;
+    report_progress(l, size > 0 ? (double)total / size : 0);
+  }
+  g_free(buffer);
+  fclose(file);
+
+  // The loader has to be closed even after a failure.
+  ok = gdk_pixbuf_loader_close(loader, NULL) && ok;
+  GdkPixbuf* image = NULL;
+  if (ok && gdk_pixbuf_loader_get_pixbuf(loader)) {
+    image = g_object_ref(gdk_pixbuf_loader_get_pixbuf(loader));
+  }
+  g_object_unref(loader);
+  return image;
+}
+
+static void size_prepared(GdkPixbufLoader* loader,
+                          int width,
+                          int height,
+                          gpointer userData) {
+  // Let the decoder shrink large images most of the way,
+  // and leave the last step to the filtered downscaler.
+  puzzle_loader_t* l = (puzzle_loader_t*)userData;
+  int limit = l->num_pieces * l->piece_size * LOADER_DECODE_HEADROOM;
+  if (width > limit || height > limit) {
+    gdk_pixbuf_loader_set_size(loader, MIN(width, limit),
+                               MIN(height, limit));
+  }
+}
+
+static void report_progress(puzzle_loader_t* l, double fraction) {
+  int progress = (int)(fraction * 1000);
+  if (!l->progress_cb ||
+      progress - g_atomic_int_get(&l->progress) < PROGRESS_STEP) {
+    return;
+  }
+  g_atomic_int_set(&l->progress, progress);
+  g_atomic_int_inc(&l->ref_count);
+  g_main_context_invoke_full(NULL, 0, deliver_progress, l, unref_loader);
+}
+
+static puzzle_image_t* cut_image(puzzle_loader_t* l, GdkPixbuf* image) {
+  int grid_size = l->num_pieces * l->piece_size;
+  puzzle_image_t* result = g_new0(puzzle_image_t, 1);
+  result->num_pieces = l->num_pieces;
+  result->piece_size = l->piece_size;
+
+  // Scale straight into the buffer the pieces are cut from.
+  downscale_image_t src;
+  downscale_image_t dst;
+  downscale_image_from_pixbuf(image, &src);
+  if (l->atlas) {
+    result->atlas = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, grid_size,
+                                               grid_size);
+    downscale_image_from_surface(result->atlas, &dst);
+    downscale(&src, &dst, DOWNSCALE_LANCZOS3, 0);
+    cairo_surface_mark_dirty(result->atlas);
+    return result;
+  }
+  result->image = gdk_pixbuf_new(GDK_COLORSPACE_RGB,
+                                 gdk_pixbuf_get_has_alpha(image), 8,
+                                 grid_size, grid_size);
+  downscale_image_from_pixbuf(result->image, &dst);
+  downscale(&src, &dst, DOWNSCALE_LANCZOS3, 0);
+  slice_pieces(result);
+  return result;
+}
+
+static gboolean build_progress(double fraction, gpointer user_data) {
+  shared_build_t* build = (shared_build_t*)user_data;
+  pthread_mutex_lock(&builds_lock);
+  build->fraction = fraction;
+  pthread_cond_broadcast(&builds_cond);
+  pthread_mutex_unlock(&builds_lock);
+  report_progress(build->owner, fraction);
+  return TRUE;
+}
+
+// Build the pyramid at cache_path, or wait for the build
+// another load already started, reporting its progress.
+static gboolean build_pyramid(puzzle_loader_t* l, const char* cache_path) {
+  pthread_mutex_lock(&builds_lock);
+  if (!builds) {
+    builds = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  }
+  shared_build_t* build = g_hash_table_lookup(builds, cache_path);
+  gboolean owner = !build;
+  if (owner) {
+    build = g_new0(shared_build_t, 1);
+    build->owner = l;
+    g_hash_table_insert(builds, g_strdup(cache_path), build);
+  }
+  build->ref_count++;
+
+  if (owner) {
+    pthread_mutex_unlock(&builds_lock);
+    gboolean success =
+        pyramid_build(l->path, cache_path, build_progress, build);
+    pthread_mutex_lock(&builds_lock);
+    build->done = TRUE;
+    build->success = success;
+    g_hash_table_remove(builds, cache_path);
+    pthread_cond_broadcast(&builds_cond);
+  }
+  while (!build->done && !g_atomic_int_get(&l->cancelled)) {
+    double fraction = build->fraction;
+    pthread_mutex_unlock(&builds_lock);
+    report_progress(l, fraction);
+    pthread_mutex_lock(&builds_lock);
+    if (!build->done && build->fraction == fraction) {
+      pthread_cond_wait(&builds_cond, &builds_lock);
+    }
+  }
+  gboolean success = build->done && build->success;
+  if (--build->ref_count == 0) {
+    g_free(build);
+  }
+  pthread_mutex_unlock(&builds_lock);
+  return success;
+}
+
+static puzzle_image_t* cut_pyramid(puzzle_loader_t* l) {
+  char* cache_path = pyramid_cache_path(l->path);
+  if (!cache_path) {
+    return NULL;
+  }
+  pyramid_t* p = pyramid_open(cache_path, l->tile_cache_bytes);
+  if (!p && build_pyramid(l, cache_path)) {
+    p = pyramid_open(cache_path, l->tile_cache_bytes);
+  }
+  g_free(cache_path);
+  if (!p) {
+    return NULL;
+  }
+
+  // Draw each piece from the part of the source it covers,
+  // so only the tiles under it are read.
+  int width, height;
+  pyramid_size(p, &width, &height);
+  int grid_size = l->num_pieces * l->piece_size;
+  double src_width = (double)width / l->num_pieces;
+  double src_height = (double)height / l->num_pieces;
+  cairo_surface_t* atlas =
+      cairo_image_surface_create(CAIRO_FORMAT_ARGB32, grid_size, grid_size);
+  cairo_t* cr = cairo_create(atlas);
+  int count = l->num_pieces * l->num_pieces;
+  for (int i = 0; i < count && !g_atomic_int_get(&l->cancelled); ++i) {
+    int col = i % l->num_pieces;
+    int row = i / l->num_pieces;
+    cairo_save(cr);
+    cairo_translate(cr, col * l->piece_size, row * l->piece_size);
+    pyramid_render(p, cr, col * src_width, row * src_height, src_width,
+                   src_height, l->piece_size, l->piece_size);
+    cairo_restore(cr);
+  }
+  cairo_destroy(cr);
+  pyramid_close(p);
+
+  puzzle_image_t* result = g_new0(puzzle_image_t, 1);
+  result->num_pieces = l->num_pieces;
+  result->piece_size = l->piece_size;
+  if (l->atlas) {
+    result->atlas = atlas;
+    return result;
+  }
+  result->image =
+      gdk_pixbuf_get_from_surface(atlas, 0, 0, grid_size, grid_size);
+  cairo_surface_destroy(atlas);
+  slice_pieces(result);
+  return result;
+}
+
+static void slice_pieces(puzzle_image_t* result) {
+  int count = result->num_pieces * result->num_pieces;
+  result->pieces = g_new(GdkPixbuf*, count);
+  for (int i = 0; i < count; ++i) {
+    int x = (i % result->num_pieces) * result->piece_size;
+    int y = (i / result->num_pieces) * result->piece_size;
+    result->pieces[i] = gdk_pixbuf_new_subpixbuf(
+        result->image, x, y, result->piece_size, result->piece_size);
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef __LOADER_H__
+#define __LOADER_H__
+
+#include <gtk/gtk.h>
+
+// Bytes handed to the image decoder at a time.
+#define LOADER_CHUNK_SIZE (256 * 1024)
+
+// Large images are decoded at up to this multiple of the
+// grid size before being filtered down to it.
+#define LOADER_DECODE_HEADROOM 2
+
+// An image decoded at the size of the puzzle grid and cut
+// into pieces, either as one shared surface or as one
+// sub-pixbuf per piece in row order.
+typedef struct {
+  GdkPixbuf* image;
+  cairo_surface_t* atlas;
+  GdkPixbuf** pieces;
+  int num_pieces;
+  int piece_size;
+} puzzle_image_t;
+
+// Called on the main thread with the fraction of the file
+// decoded so far.
+typedef void (*puzzle_progress_cb)(double fraction, gpointer user_data);
+
+// Called on the main thread once the pieces are ready, or
+// with NULL if the file could not be read. The callee owns
+// the image.
+typedef void (*puzzle_loaded_cb)(puzzle_image_t* image, gpointer user_data);
+
+typedef struct puzzle_loader puzzle_loader_t;
+
+// Decode and cut an image on a worker thread. The decoder
+// is asked for a size close to the grid up front, so that
+// formats which support it never hold the full-size image.
+//
+// Images too large to decode at all are first built into
+// a tiled pyramid on disk (see pyramid.h), and each piece
+// is drawn from the tiles it covers, holding at most
+// tile_cache_bytes of decoded tiles.
+puzzle_loader_t* puzzle_load(const char* path,
+                             int num_pieces,
+                             int piece_size,
+                             gboolean atlas,
+                             gint64 tile_cache_bytes,
+                             puzzle_progress_cb progress_cb,
+                             puzzle_loaded_cb cb,
+                             gpointer user_data);
+
+// Stop a load. Neither callback will be invoked again.
+void puzzle_loader_cancel(puzzle_loader_t* l);
+
+void puzzle_image_free(puzzle_image_t* image);
+
+#endif
@@ -1,19 +1,76 @@
 #include <gtk/gtk.h>
 #include <math.h>
+#include <pthread.h>
+#include "loader.h"
+#include "pyramid.h"
+#include "solver.h"
 
 #define PIECE_SIZE 64
-#define NUM_PIECES 5
+#define MAX_GRID_SIZE 640
+#define DEFAULT_PIECES 5
+#define MAX_PIECES 320
+
+// Solving scores every pair of pieces, so its time grows
+// with the fourth power of the pieces per side: about two
+// seconds at this size, and minutes not far beyond it.
+#define MAX_SOLVE_PIECES 64
 #define EXTRA_ROWS 2
-#define GRID_SIZE (PIECE_SIZE * NUM_PIECES)
 #define BUTTON_SPACE 80
-#define NUM_SWAPS 100
+
+// A piece's home cell is its index. Pieces only have a
+// widget in the widget view.
+typedef struct {
+  GtkWidget* widget;
+  int cell;
+} piece_t;
 
 GtkWidget* puzzle_contents = NULL;
+GtkWidget* puzzle_canvas = NULL;
+GtkWidget* progress_bar = NULL;
 GtkWidget* window = NULL;
 
-GtkWidget* drag_widget = NULL;
-int drag_start_x = 0;
-int drag_start_y = 0;
+// The image being shown, and the load of its pieces if
+// one is in progress.
+gchar* puzzle_path = NULL;
+puzzle_loader_t* loader = NULL;
+
+// The board is num_pieces cells square, followed by spare
+// rows to park pieces in. Cells are numbered row by row.
+int num_pieces = DEFAULT_PIECES;
+int piece_size = PIECE_SIZE;
+int grid_cols = 0;
+int grid_rows = 0;
+
+// The index of the piece in each cell, or -1, kept up to
+// date on every move so drops never search the pieces.
+int* grid = NULL;
+piece_t* pieces = NULL;
+
+piece_t* drag_piece = NULL;
+
+// Bumped whenever the pieces are replaced, so that a solve
+// started on the old ones is ignored.
+int puzzle_generation = 0;
+GtkWidget* solve_button = NULL;
+gboolean solving = FALSE;
+
+typedef struct {
+  solver_t* solver;
+  int* placement;
+  int size;
+  int generation;
+} solve_job_t;
+
+gint tile_cache_mb = PYRAMID_DEFAULT_CACHE_MB;
+
+// The canvas view draws every piece from one surface
+// holding the whole scaled image. Placed pieces never
+// overlap, so the only stacking to track is the dragged
+// piece, which is drawn last at (drag_x, drag_y).
+gboolean canvas_view = FALSE;
+cairo_surface_t* atlas = NULL;
+int drag_x = 0;
+int drag_y = 0;
 
 static void close_key_press(GtkWidget* widget,
                             GdkEventKey* event,
@@ -24,15 +81,31 @@ static void close_key_press(GtkWidget* widget,
   }
 }
 
+static void cell_position(int cell, int* x, int* y) {
+  *x = (cell % grid_cols) * piece_size;
+  *y = (cell / grid_cols) * piece_size;
+}
+
+// Move the dragged piece to the cell nearest (x, y),
+// unless another piece is already there.
+static void drop_piece(int x, int y) {
+  int col = (int)round((float)x / piece_size);
+  int row = (int)round((float)y / piece_size);
+  int dest = row * grid_cols + col;
+  if (grid[dest] < 0) {
+    grid[drag_piece->cell] = -1;
+    grid[dest] = drag_piece - pieces;
+    drag_piece->cell = dest;
+  }
+}
+
 static void piece_mouse_press(GtkWidget* widget,
                               GdkEventButton* event,
                               gpointer userData) {
-  drag_widget = widget;
+  drag_piece = (piece_t*)userData;
 
   GtkAllocation rect;
   gtk_widget_get_allocation(widget, &rect);
-  drag_start_x = rect.x;
-  drag_start_y = rect.y;
 
   // Bring the piece to the front.
   g_object_ref(widget);
@@ -44,95 +117,329 @@ static void piece_mouse_press(GtkWidget* widget,
 static void piece_mouse_motion(GtkWidget* widget,
                                GdkEventMotion* event,
                                gpointer userData) {
+  if (!drag_piece) {
+    return;
+  }
   GtkAllocation rect;
   gtk_widget_get_allocation(widget, &rect);
-  int new_x = rect.x + event->x - PIECE_SIZE / 2;
-  int new_y = rect.y + event->y - PIECE_SIZE / 2;
-  new_x = MAX(0, MIN(new_x, PIECE_SIZE * (NUM_PIECES - 1)));
-  new_y = MAX(0, MIN(new_y, PIECE_SIZE * (NUM_PIECES - 1 + EXTRA_ROWS)));
-  gtk_fixed_move(GTK_FIXED(puzzle_contents), drag_widget, new_x, new_y);
+  int new_x = rect.x + event->x - piece_size / 2;
+  int new_y = rect.y + event->y - piece_size / 2;
+  new_x = MAX(0, MIN(new_x, piece_size * (grid_cols - 1)));
+  new_y = MAX(0, MIN(new_y, piece_size * (grid_rows - 1)));
+  gtk_fixed_move(GTK_FIXED(puzzle_contents), drag_piece->widget, new_x,
+                 new_y);
 }
 
 static void piece_mouse_release(GtkWidget* widget,
                                 GdkEventButton* event,
                                 gpointer userData) {
-  if (!drag_widget) {
+  if (!drag_piece) {
     return;
   }
   GtkAllocation rect;
-  gtk_widget_get_allocation(drag_widget, &rect);
-  int dest_x = (int)round((float)rect.x / PIECE_SIZE) * PIECE_SIZE;
-  int dest_y = (int)round((float)rect.y / PIECE_SIZE) * PIECE_SIZE;
-
-  GList* children = gtk_container_get_children(GTK_CONTAINER(puzzle_contents));
-  for (guint i = 0; i < g_list_length(children); ++i) {
-    GtkWidget* widget = (GtkWidget*)g_list_nth_data(children, i);
-    gtk_widget_get_allocation(widget, &rect);
-    if (rect.x == dest_x && rect.y == dest_y) {
-      dest_x = drag_start_x;
-      dest_y = drag_start_y;
-      break;
+  gtk_widget_get_allocation(drag_piece->widget, &rect);
+  drop_piece(rect.x, rect.y);
+
+  int x, y;
+  cell_position(drag_piece->cell, &x, &y);
+  gtk_fixed_move(GTK_FIXED(puzzle_contents), drag_piece->widget, x, y);
+
+  drag_piece = NULL;
+}
+
+static void draw_piece(cairo_t* cr, int index, int x, int y) {
+  int src_x, src_y;
+  cell_position(index, &src_x, &src_y);
+  cairo_set_source_surface(cr, atlas, x - src_x, y - src_y);
+  cairo_rectangle(cr, x, y, piece_size, piece_size);
+  cairo_fill(cr);
+}
+
+static gboolean canvas_draw(GtkWidget* widget, cairo_t* cr, gpointer userData) {
+  if (!atlas) {
+    return FALSE;
+  }
+  // Only visit the cells inside the damaged area.
+  double x1, y1, x2, y2;
+  cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+  int col1 = MAX(0, (int)x1 / piece_size);
+  int row1 = MAX(0, (int)y1 / piece_size);
+  int col2 = MIN(grid_cols, (int)ceil(x2 / piece_size));
+  int row2 = MIN(grid_rows, (int)ceil(y2 / piece_size));
+  for (int row = row1; row < row2; ++row) {
+    for (int col = col1; col < col2; ++col) {
+      int index = grid[row * grid_cols + col];
+      if (index >= 0 && &pieces[index] != drag_piece) {
+        draw_piece(cr, index, col * piece_size, row * piece_size);
+      }
     }
   }
+  if (drag_piece) {
+    draw_piece(cr, drag_piece - pieces, drag_x, drag_y);
+  }
+  return FALSE;
+}
+
+static void queue_piece_draw(int x, int y) {
+  gtk_widget_queue_draw_area(puzzle_canvas, x, y, piece_size, piece_size);
+}
+
+static gboolean canvas_mouse_press(GtkWidget* widget,
+                                   GdkEventButton* event,
+                                   gpointer userData) {
+  int col = (int)event->x / piece_size;
+  int row = (int)event->y / piece_size;
+  if (!grid || event->x < 0 || event->y < 0 || col >= grid_cols ||
+      row >= grid_rows) {
+    return FALSE;
+  }
+  int index = grid[row * grid_cols + col];
+  if (index < 0) {
+    return FALSE;
+  }
+  drag_piece = &pieces[index];
+  cell_position(drag_piece->cell, &drag_x, &drag_y);
+  return TRUE;
+}
 
-  gtk_fixed_move(GTK_FIXED(puzzle_contents), drag_widget, dest_x, dest_y);
+static gboolean canvas_mouse_motion(GtkWidget* widget,
+                                    GdkEventMotion* event,
+                                    gpointer userData) {
+  if (!drag_piece) {
+    return FALSE;
+  }
+  queue_piece_draw(drag_x, drag_y);
+  drag_x = (int)event->x - piece_size / 2;
+  drag_y = (int)event->y - piece_size / 2;
+  drag_x = MAX(0, MIN(drag_x, piece_size * (grid_cols - 1)));
+  drag_y = MAX(0, MIN(drag_y, piece_size * (grid_rows - 1)));
+  queue_piece_draw(drag_x, drag_y);
+  return TRUE;
+}
 
-  drag_widget = NULL;
+static gboolean canvas_mouse_release(GtkWidget* widget,
+                                     GdkEventButton* event,
+                                     gpointer userData) {
+  if (!drag_piece) {
+    return FALSE;
+  }
+  queue_piece_draw(drag_x, drag_y);
+  drop_piece(drag_x, drag_y);
+  int x, y;
+  cell_position(drag_piece->cell, &x, &y);
+  queue_piece_draw(x, y);
+  drag_piece = NULL;
+  return TRUE;
 }
 
 static void remove_existing_puzzle() {
-  GList* children = gtk_container_get_children(GTK_CONTAINER(puzzle_contents));
-  for (guint i = 0; i < g_list_length(children); i++) {
-    gtk_container_remove(GTK_CONTAINER(puzzle_contents),
-                         (GtkWidget*)g_list_nth_data(children, i));
+  drag_piece = NULL;
+  puzzle_generation++;
+  if (atlas) {
+    cairo_surface_destroy(atlas);
+    atlas = NULL;
+    gtk_widget_queue_draw(puzzle_canvas);
+  }
+  if (!pieces) {
+    return;
+  }
+  for (int i = 0; i < num_pieces * num_pieces; ++i) {
+    if (pieces[i].widget) {
+      gtk_widget_destroy(pieces[i].widget);
+    }
+  }
+  g_free(pieces);
+  g_free(grid);
+  pieces = NULL;
+  grid = NULL;
+}
+
+// Rebuild the grid from the cells of the pieces and move
+// them there.
+static void place_pieces() {
+  int count = num_pieces * num_pieces;
+  for (int i = 0; i < grid_cols * grid_rows; ++i) {
+    grid[i] = -1;
+  }
+  for (int i = 0; i < count; ++i) {
+    grid[pieces[i].cell] = i;
+  }
+  if (canvas_view) {
+    gtk_widget_queue_draw(puzzle_canvas);
+    return;
+  }
+  for (int i = 0; i < count; ++i) {
+    int x, y;
+    cell_position(pieces[i].cell, &x, &y);
+    gtk_fixed_move(GTK_FIXED(puzzle_contents), pieces[i].widget, x, y);
   }
-  g_list_free(children);
 }
 
 static void scramble_puzzle(GtkWidget* button, gpointer userData) {
-  GList* children = gtk_container_get_children(GTK_CONTAINER(puzzle_contents));
-  if (!g_list_length(children)) {
+  if (!pieces) {
     return;
   }
-  GtkAllocation* rects =
-      (GtkAllocation*)malloc(sizeof(GtkAllocation) * g_list_length(children));
-  for (guint i = 0; i < g_list_length(children); ++i) {
-    GtkWidget* widget = (GtkWidget*)g_list_nth_data(children, i);
-    gtk_widget_get_allocation(widget, &rects[i]);
-  }
-  for (int i = 0; i < NUM_SWAPS; ++i) {
-    int idx1 = rand() % g_list_length(children);
-    int idx2 = rand() % g_list_length(children);
-    if (idx1 == idx2) {
-      --i;
-      continue;
+  // Shuffle the cells the pieces occupy; the set of
+  // occupied cells stays the same.
+  int count = num_pieces * num_pieces;
+  for (int i = count - 1; i > 0; --i) {
+    int j = g_random_int_range(0, i + 1);
+    int cell = pieces[i].cell;
+    pieces[i].cell = pieces[j].cell;
+    pieces[j].cell = cell;
+  }
+  drag_piece = NULL;
+  place_pieces();
+}
+
+static void update_solve_button() {
+  gtk_widget_set_sensitive(solve_button,
+                           !solving && num_pieces <= MAX_SOLVE_PIECES);
+}
+
+static gboolean deliver_solution(gpointer data) {
+  solve_job_t* job = (solve_job_t*)data;
+  solving = FALSE;
+  update_solve_button();
+  if (job->generation != puzzle_generation || !pieces) {
+    return G_SOURCE_REMOVE;
+  }
+  // The solved board goes in the top rows, which is where
+  // the pieces started.
+  drag_piece = NULL;
+  for (int cell = 0; cell < job->size * job->size; ++cell) {
+    pieces[job->placement[cell]].cell = cell;
+  }
+  place_pieces();
+  return G_SOURCE_REMOVE;
+}
+
+static void free_solve_job(gpointer data) {
+  solve_job_t* job = (solve_job_t*)data;
+  solver_free(job->solver);
+  g_free(job->placement);
+  g_free(job);
+}
+
+static void* solve_thread(void* arg) {
+  solve_job_t* job = (solve_job_t*)arg;
+  solver_solve(job->solver, job->size, job->size, 0, job->placement);
+  g_main_context_invoke_full(NULL, 0, deliver_solution, job, free_solve_job);
+  return NULL;
+}
+
+// Copy the pieces' borders into a solver and reassemble
+// them on a worker thread, using only their pixels.
+static void solve_puzzle(GtkWidget* button, gpointer userData) {
+  if (!pieces || solving || num_pieces > MAX_SOLVE_PIECES) {
+    return;
+  }
+  int count = num_pieces * num_pieces;
+  solve_job_t* job = g_new0(solve_job_t, 1);
+  job->solver = solver_new(count, piece_size);
+  job->placement = g_new(int, count);
+  job->size = num_pieces;
+  job->generation = puzzle_generation;
+  if (canvas_view) {
+    cairo_surface_flush(atlas);
+    guchar* data = cairo_image_surface_get_data(atlas);
+    int stride = cairo_image_surface_get_stride(atlas);
+    for (int i = 0; i < count; ++i) {
+      int x, y;
+      cell_position(i, &x, &y);
+      solver_set_piece(job->solver, i, data + (gsize)y * stride + x * 4,
+                       stride, 4);
+    }
+  } else {
+    for (int i = 0; i < count; ++i) {
+      GtkWidget* image = gtk_bin_get_child(GTK_BIN(pieces[i].widget));
+      GdkPixbuf* pixbuf = gtk_image_get_pixbuf(GTK_IMAGE(image));
+      solver_set_piece(job->solver, i, gdk_pixbuf_get_pixels(pixbuf),
+                       gdk_pixbuf_get_rowstride(pixbuf),
+                       gdk_pixbuf_get_n_channels(pixbuf));
     }
-    GtkAllocation r1 = rects[idx1];
-    rects[idx1] = rects[idx2];
-    rects[idx2] = r1;
   }
-  for (guint i = 0; i < g_list_length(children); ++i) {
-    GtkWidget* widget = (GtkWidget*)g_list_nth_data(children, i);
-    gtk_fixed_move(GTK_FIXED(puzzle_contents), widget, rects[i].x, rects[i].y);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, solve_thread, job) != 0) {
+    free_solve_job(job);
+    return;
   }
-  g_list_free(children);
+  pthread_detach(thread);
+  solving = TRUE;
+  update_solve_button();
 }
 
-static GtkWidget* register_piece_events(GtkWidget* piece) {
+static GtkWidget* register_piece_events(GtkWidget* piece, piece_t* data) {
   GtkWidget* box = gtk_event_box_new();
   gtk_container_add(GTK_CONTAINER(box), piece);
   g_signal_connect(box, "button_press_event", G_CALLBACK(piece_mouse_press),
-                   NULL);
+                   data);
   g_signal_connect(box, "motion_notify_event", G_CALLBACK(piece_mouse_motion),
-                   NULL);
+                   data);
   g_signal_connect(box, "button_release_event", G_CALLBACK(piece_mouse_release),
-                   NULL);
+                   data);
   return box;
 }
 
-static void open_file(const char* filename) {
-  GdkPixbuf* pixbuf = gdk_pixbuf_new_from_file(filename, NULL);
-  if (!pixbuf) {
+// Lay out the board for the current number of pieces. The
+// spare rows grow with the board so that there is always
+// room to set pieces aside, and pieces shrink so that the
+// whole board, spare rows included, fits MAX_GRID_SIZE.
+static void set_puzzle_size() {
+  grid_cols = num_pieces;
+  grid_rows = num_pieces + MAX(EXTRA_ROWS,
+                               num_pieces * EXTRA_ROWS / DEFAULT_PIECES);
+  piece_size = MIN(PIECE_SIZE, MAX_GRID_SIZE / grid_rows);
+  gtk_widget_set_size_request(puzzle_contents, grid_cols * piece_size,
+                              grid_rows * piece_size);
+  gtk_widget_set_size_request(puzzle_canvas, grid_cols * piece_size,
+                              grid_rows * piece_size);
+}
+
+static void create_puzzle(puzzle_image_t* image) {
+  remove_existing_puzzle();
+  set_puzzle_size();
+
+  int count = num_pieces * num_pieces;
+  pieces = g_new(piece_t, count);
+  grid = g_new(int, grid_cols * grid_rows);
+  for (int i = 0; i < grid_cols * grid_rows; ++i) {
+    grid[i] = i < count ? i : -1;
+  }
+  for (int i = 0; i < count; ++i) {
+    pieces[i].widget = NULL;
+    pieces[i].cell = i;
+  }
+
+  if (canvas_view) {
+    atlas = image->atlas;
+    image->atlas = NULL;
+    gtk_widget_queue_draw(puzzle_canvas);
+    return;
+  }
+
+  for (int i = 0; i < count; ++i) {
+    int x, y;
+    cell_position(i, &x, &y);
+    GtkWidget* image_widget = gtk_image_new_from_pixbuf(image->pieces[i]);
+    GtkWidget* piece = register_piece_events(image_widget, &pieces[i]);
+    gtk_fixed_put(GTK_FIXED(puzzle_contents), piece, x, y);
+    gtk_widget_show(image_widget);
+    gtk_widget_show(piece);
+    pieces[i].widget = piece;
+  }
+}
+
+static void puzzle_progress(double fraction, gpointer userData) {
+  gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress_bar), fraction);
+}
+
+static void puzzle_loaded(puzzle_image_t* image, gpointer userData) {
+  loader = NULL;
+  gtk_widget_hide(progress_bar);
+  if (!image) {
+    g_clear_pointer(&puzzle_path, g_free);
     GtkWidget* dialog =
         gtk_message_dialog_new(GTK_WINDOW(window), 0, GTK_MESSAGE_ERROR,
                                GTK_BUTTONS_CLOSE, "Error reading image.");
@@ -140,24 +447,50 @@ static void open_file(const char* filename) {
     gtk_widget_destroy(dialog);
     return;
   }
+  create_puzzle(image);
+  puzzle_image_free(image);
+}
 
-  remove_existing_puzzle();
+// Start cutting the current image for the current size and
+// view, dropping any load that is still running.
+static void load_puzzle() {
+  puzzle_loader_cancel(loader);
+  loader = NULL;
+  set_puzzle_size();
+  if (!puzzle_path) {
+    gtk_widget_hide(progress_bar);
+    return;
+  }
+  gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress_bar), 0);
+  gtk_widget_show(progress_bar);
+  loader = puzzle_load(puzzle_path, num_pieces, piece_size, canvas_view,
+                       (gint64)tile_cache_mb << 20, puzzle_progress,
+                       puzzle_loaded, NULL);
+}
 
-  GdkPixbuf* scaled = gdk_pixbuf_scale_simple(pixbuf, GRID_SIZE, GRID_SIZE,
-                                              GDK_INTERP_BILINEAR);
-  g_object_unref(pixbuf);
-  for (int x = 0; x < GRID_SIZE; x += PIECE_SIZE) {
-    for (int y = 0; y < GRID_SIZE; y += PIECE_SIZE) {
-      GdkPixbuf* sub_buf =
-          gdk_pixbuf_new_subpixbuf(scaled, x, y, PIECE_SIZE, PIECE_SIZE);
-      GtkWidget* image = gtk_image_new_from_pixbuf(sub_buf);
-      GtkWidget* piece = register_piece_events(image);
-      gtk_fixed_put(GTK_FIXED(puzzle_contents), piece, x, y);
-      gtk_widget_show(image);
-      gtk_widget_show(piece);
-    }
+static void open_file(const char* filename) {
+  g_free(puzzle_path);
+  puzzle_path = g_strdup(filename);
+  load_puzzle();
+}
+
+static void pieces_changed(GtkSpinButton* button, gpointer userData) {
+  int value = gtk_spin_button_get_value_as_int(button);
+  if (value == num_pieces) {
+    return;
   }
-  g_object_unref(scaled);
+  remove_existing_puzzle();
+  num_pieces = value;
+  update_solve_button();
+  load_puzzle();
+}
+
+static void view_changed(GtkToggleButton* button, gpointer userData) {
+  remove_existing_puzzle();
+  canvas_view = gtk_toggle_button_get_active(button);
+  gtk_widget_set_visible(puzzle_contents, !canvas_view);
+  gtk_widget_set_visible(puzzle_canvas, canvas_view);
+  load_puzzle();
 }
 
 static void choose_file(GtkWidget* button, gpointer userData) {
@@ -180,8 +513,20 @@ static void choose_file(GtkWidget* button, gpointer userData) {
 
 static void activate(GtkApplication* app, gpointer userData) {
   puzzle_contents = gtk_fixed_new();
-  gtk_widget_set_size_request(puzzle_contents, GRID_SIZE,
-                              GRID_SIZE + PIECE_SIZE * EXTRA_ROWS);
+
+  puzzle_canvas = gtk_drawing_area_new();
+  gtk_widget_set_no_show_all(puzzle_canvas, TRUE);
+  gtk_widget_add_events(puzzle_canvas, GDK_BUTTON_PRESS_MASK |
+                                           GDK_BUTTON_RELEASE_MASK |
+                                           GDK_BUTTON1_MOTION_MASK);
+  g_signal_connect(puzzle_canvas, "draw", G_CALLBACK(canvas_draw), NULL);
+  g_signal_connect(puzzle_canvas, "button_press_event",
+                   G_CALLBACK(canvas_mouse_press), NULL);
+  g_signal_connect(puzzle_canvas, "motion_notify_event",
+                   G_CALLBACK(canvas_mouse_motion), NULL);
+  g_signal_connect(puzzle_canvas, "button_release_event",
+                   G_CALLBACK(canvas_mouse_release), NULL);
+  set_puzzle_size();
 
   GtkWidget* choose_button = gtk_button_new_with_label("Choose Image...");
   g_signal_connect(choose_button, "clicked", G_CALLBACK(choose_file), NULL);
@@ -190,21 +535,43 @@ static void activate(GtkApplication* app, gpointer userData) {
   g_signal_connect(scramble_button, "clicked", G_CALLBACK(scramble_puzzle),
                    NULL);
 
+  solve_button = gtk_button_new_with_label("Solve");
+  g_signal_connect(solve_button, "clicked", G_CALLBACK(solve_puzzle), NULL);
+  gchar* solve_tooltip = g_strdup_printf("Available up to %d pieces per side",
+                                         MAX_SOLVE_PIECES);
+  gtk_widget_set_tooltip_text(solve_button, solve_tooltip);
+  g_free(solve_tooltip);
+
+  GtkWidget* pieces_button =
+      gtk_spin_button_new_with_range(2, MAX_PIECES, 1);
+  gtk_spin_button_set_value(GTK_SPIN_BUTTON(pieces_button), num_pieces);
+  gtk_widget_set_tooltip_text(pieces_button, "Pieces per side");
+  g_signal_connect(pieces_button, "value-changed", G_CALLBACK(pieces_changed),
+                   NULL);
+
+  GtkWidget* view_button = gtk_check_button_new_with_label("Single canvas");
+  g_signal_connect(view_button, "toggled", G_CALLBACK(view_changed), NULL);
+
+  progress_bar = gtk_progress_bar_new();
+  gtk_widget_set_no_show_all(progress_bar, TRUE);
+
   GtkWidget* button_box = gtk_button_box_new(GTK_ORIENTATION_HORIZONTAL);
   gtk_button_box_set_layout(GTK_BUTTON_BOX(button_box), GTK_BUTTONBOX_CENTER);
-  gtk_widget_set_size_request(button_box, GRID_SIZE, BUTTON_SPACE);
+  gtk_widget_set_size_request(button_box, -1, BUTTON_SPACE);
   gtk_container_add(GTK_CONTAINER(button_box), choose_button);
   gtk_container_add(GTK_CONTAINER(button_box), scramble_button);
+  gtk_container_add(GTK_CONTAINER(button_box), solve_button);
+  gtk_container_add(GTK_CONTAINER(button_box), pieces_button);
+  gtk_container_add(GTK_CONTAINER(button_box), view_button);
 
   GtkWidget* root_container = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
   gtk_container_add(GTK_CONTAINER(root_container), puzzle_contents);
+  gtk_container_add(GTK_CONTAINER(root_container), puzzle_canvas);
+  gtk_container_add(GTK_CONTAINER(root_container), progress_bar);
   gtk_container_add(GTK_CONTAINER(root_container), button_box);
 
   window = gtk_application_window_new(app);
   gtk_window_set_title(GTK_WINDOW(window), "Image Puzzle");
-  gtk_window_set_default_size(
-      GTK_WINDOW(window), GRID_SIZE,
-      GRID_SIZE + PIECE_SIZE * EXTRA_ROWS + BUTTON_SPACE);
   gtk_window_set_resizable(GTK_WINDOW(window), FALSE);
   gtk_window_set_position(GTK_WINDOW(window), GTK_WIN_POS_CENTER);
   gtk_widget_add_events(window, GDK_KEY_PRESS_MASK | GDK_BUTTON_PRESS_MASK |
@@ -216,8 +583,14 @@ static void activate(GtkApplication* app, gpointer userData) {
 }
 
 int main(int argc, char** argv) {
+  GOptionEntry entries[] = {
+      {"tile-cache", 0, 0, G_OPTION_ARG_INT, &tile_cache_mb,
+       "Memory for decoded tiles of very large images", "MB"},
+      {NULL}};
+
   GtkApplication* app =
       gtk_application_new("com.aqnichol.img_puzzle", G_APPLICATION_FLAGS_NONE);
+  g_application_add_main_option_entries(G_APPLICATION(app), entries);
   g_signal_connect(app, "activate", G_CALLBACK(activate), NULL);
   int status = g_application_run(G_APPLICATION(app), argc, argv);
   g_object_unref(app);
@@ -0,0 +1,697 @@
+#include "pyramid.h"
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <jpeglib.h>
+#include <math.h>
+#include <png.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PYRAMID_MAGIC 0x59505049
+#define PYRAMID_VERSION 1
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  int32_t width;
+  int32_t height;
+  int32_t tile_size;
+  int32_t num_levels;
+} file_header_t;
+
+typedef struct {
+  int64_t offset;
+  int32_t size;
+  int32_t reserved;
+} tile_entry_t;
+
+typedef struct {
+  int width;
+  int height;
+  int cols;
+  int rows;
+
+  // Index of the level's first tile in the tile table.
+  int first_tile;
+} level_t;
+
+typedef struct {
+  uint64_t key;
+  cairo_surface_t* surface;
+  gint64 bytes;
+} cached_tile_t;
+
+struct pyramid {
+  int fd;
+  int width;
+  int height;
+  int num_levels;
+  level_t levels[PYRAMID_MAX_LEVELS];
+  tile_entry_t* tiles;
+
+  // Decoded tiles, most recently used at the head.
+  pthread_mutex_t lock;
+  GHashTable* cache;
+  GQueue lru;
+  gint64 cache_bytes;
+  gint64 max_cache_bytes;
+};
+
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+} jpeg_error_t;
+
+// Produces an image one RGB row at a time.
+typedef struct {
+  int width;
+  int height;
+  FILE* file;
+  struct jpeg_decompress_struct* jpeg;
+  jpeg_error_t jpeg_error;
+  png_structp png;
+  png_infop png_info;
+  GdkPixbuf* pixbuf;
+  int row;
+} source_t;
+
+// One level of a pyramid being built. Rows arrive from the
+// level below; once a strip of a tile's height is full, it
+// is cut into tiles.
+typedef struct {
+  guchar* strip;
+  int strip_rows;
+  int rows_done;
+  guchar* pending;
+  gboolean has_pending;
+} build_level_t;
+
+typedef struct {
+  FILE* file;
+  int num_levels;
+  level_t levels[PYRAMID_MAX_LEVELS];
+  build_level_t build[PYRAMID_MAX_LEVELS];
+  tile_entry_t* tiles;
+  gboolean failed;
+} builder_t;
+
+static int compute_levels(int width, int height, level_t* levels);
+static gboolean source_open(source_t* s, const char* path);
+static gboolean source_open_jpeg(source_t* s);
+static gboolean source_open_png(source_t* s);
+static gboolean source_read_row(source_t* s, guchar* row);
+static void source_close(source_t* s);
+static void jpeg_error_exit(j_common_ptr info);
+static void push_row(builder_t* b, int level, const guchar* row);
+static void reduce_rows(const guchar* a,
+                        const guchar* b,
+                        int width,
+                        guchar* out);
+static void flush_strip(builder_t* b, int level);
+static gboolean encode_tile(const guchar* pixels,
+                            int stride,
+                            int width,
+                            int height,
+                            unsigned char** data,
+                            unsigned long* size);
+static cairo_surface_t* decode_tile(const unsigned char* data, int size);
+static cairo_surface_t* get_tile(pyramid_t* p, int level, int col, int row);
+static void free_cached_tile(gpointer data);
+
+char* pyramid_cache_path(const char* image_path) {
+  GStatBuf info;
+  if (g_stat(image_path, &info) < 0) {
+    return NULL;
+  }
+  char* key = g_strdup_printf("%s:%lld:%lld", image_path,
+                              (long long)info.st_size,
+                              (long long)info.st_mtime);
+  char* digest = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+  char* name = g_strdup_printf("%s.pyramid", digest);
+  char* path =
+      g_build_filename(g_get_user_cache_dir(), "img_puzzle", name, NULL);
+  g_free(name);
+  g_free(digest);
+  g_free(key);
+  return path;
+}
+
+gboolean pyramid_build(const char* image_path,
+                       const char* out_path,
+                       pyramid_progress_cb progress_cb,
+                       gpointer user_data) {
+  source_t source;
+  if (!source_open(&source, image_path)) {
+    return FALSE;
+  }
+
+  builder_t b;
+  memset(&b, 0, sizeof(b));
+  b.num_levels = compute_levels(source.width, source.height, b.levels);
+  level_t* last = &b.levels[b.num_levels - 1];
+  int num_tiles = last->first_tile + last->cols * last->rows;
+  b.tiles = g_new0(tile_entry_t, num_tiles);
+  for (int i = 0; i < b.num_levels; ++i) {
+    b.build[i].strip =
+        g_malloc((gsize)b.levels[i].width * 3 * PYRAMID_TILE_SIZE);
+    b.build[i].pending = g_malloc((gsize)b.levels[i].width * 3);
+  }
+  guchar* row = g_malloc((gsize)source.width * 3);
+
+  // Tiles are appended after the header and the table,
+  // which is filled in once every tile has been written.
+  file_header_t header = {PYRAMID_MAGIC,     PYRAMID_VERSION,
+                          source.width,      source.height,
+                          PYRAMID_TILE_SIZE, b.num_levels};
+  // Every build writes its own temporary file, so a build
+  // that fails or stops can't remove another's.
+  char* dir = g_path_get_dirname(out_path);
+  char* tmp_path = g_strdup_printf("%s.XXXXXX", out_path);
+  gboolean success = FALSE;
+  int fd = -1;
+  if (g_mkdir_with_parents(dir, 0755) < 0 ||
+      (fd = g_mkstemp(tmp_path)) < 0) {
+    goto done;
+  }
+  if (!(b.file = fdopen(fd, "wb"))) {
+    close(fd);
+    g_unlink(tmp_path);
+    goto done;
+  }
+  fwrite(&header, sizeof(header), 1, b.file);
+  fwrite(b.tiles, sizeof(tile_entry_t), num_tiles, b.file);
+
+  for (int y = 0; y < source.height && !b.failed; ++y) {
+    if (!source_read_row(&source, row)) {
+      goto done;
+    }
+    push_row(&b, 0, row);
+    if (progress_cb && (y + 1) % PYRAMID_TILE_SIZE == 0 &&
+        !progress_cb((double)(y + 1) / source.height, user_data)) {
+      goto done;
+    }
+  }
+
+  fseek(b.file, sizeof(header), SEEK_SET);
+  fwrite(b.tiles, sizeof(tile_entry_t), num_tiles, b.file);
+  success = !b.failed && !ferror(b.file);
+
+done:
+  if (b.file) {
+    success = fclose(b.file) == 0 && success;
+    if (success) {
+      success = g_rename(tmp_path, out_path) == 0;
+    } else {
+      g_unlink(tmp_path);
+    }
+  }
+  source_close(&source);
+  for (int i = 0; i < b.num_levels; ++i) {
+    g_free(b.build[i].strip);
+    g_free(b.build[i].pending);
+  }
+  g_free(b.tiles);
+  g_free(row);
+  g_free(tmp_path);
+  g_free(dir);
+  return success;
+}
+
+pyramid_t* pyramid_open(const char* path, gint64 cache_bytes) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  file_header_t header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != PYRAMID_MAGIC || header.version != PYRAMID_VERSION ||
+      header.tile_size != PYRAMID_TILE_SIZE || header.width <= 0 ||
+      header.height <= 0) {
+    close(fd);
+    return NULL;
+  }
+
+  pyramid_t* p = g_new0(pyramid_t, 1);
+  p->fd = fd;
+  p->width = header.width;
+  p->height = header.height;
+  p->num_levels = compute_levels(p->width, p->height, p->levels);
+  level_t* last = &p->levels[p->num_levels - 1];
+  int num_tiles = last->first_tile + last->cols * last->rows;
+  gsize table_size = sizeof(tile_entry_t) * num_tiles;
+  p->tiles = g_malloc(table_size);
+  if (header.num_levels != p->num_levels ||
+      pread(fd, p->tiles, table_size, sizeof(header)) != (gssize)table_size) {
+    pyramid_close(p);
+    return NULL;
+  }
+
+  pthread_mutex_init(&p->lock, NULL);
+  p->cache = g_hash_table_new(g_int64_hash, g_int64_equal);
+  g_queue_init(&p->lru);
+  p->max_cache_bytes = cache_bytes;
+  return p;
+}
+
+void pyramid_size(pyramid_t* p, int* width, int* height) {
+  *width = p->width;
+  *height = p->height;
+}
+
+void pyramid_render(pyramid_t* p,
+                    cairo_t* cr,
+                    double x,
+                    double y,
+                    double width,
+                    double height,
+                    int dst_width,
+                    int dst_height) {
+  // Use the smallest level that still has at least one
+  // pixel per destination pixel.
+  int level = 0;
+  while (level + 1 < p->num_levels &&
+         width / (2 << level) >= dst_width &&
+         height / (2 << level) >= dst_height) {
+    level++;
+  }
+  level_t* lv = &p->levels[level];
+  double scale = ldexp(1, -level);
+  double x1 = x * scale;
+  double y1 = y * scale;
+  double x2 = (x + width) * scale;
+  double y2 = (y + height) * scale;
+  int col1 = MAX(0, (int)floor(x1) / PYRAMID_TILE_SIZE);
+  int row1 = MAX(0, (int)floor(y1) / PYRAMID_TILE_SIZE);
+  int col2 = MIN(lv->cols, (int)ceil(x2 / PYRAMID_TILE_SIZE));
+  int row2 = MIN(lv->rows, (int)ceil(y2 / PYRAMID_TILE_SIZE));
+
+  cairo_save(cr);
+  cairo_rectangle(cr, 0, 0, dst_width, dst_height);
+  cairo_clip(cr);
+  cairo_scale(cr, dst_width / (x2 - x1), dst_height / (y2 - y1));
+  cairo_translate(cr, -x1, -y1);
+
+  // Tile edges land between device pixels, and
+  // antialiasing them would leave seams.
+  cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+  for (int row = row1; row < row2; ++row) {
+    for (int col = col1; col < col2; ++col) {
+      cairo_surface_t* tile = get_tile(p, level, col, row);
+      if (!tile) {
+        continue;
+      }
+      int tile_x = col * PYRAMID_TILE_SIZE;
+      int tile_y = row * PYRAMID_TILE_SIZE;
+      cairo_set_source_surface(cr, tile, tile_x, tile_y);
+      cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_PAD);
+      cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_GOOD);
+      cairo_rectangle(cr, tile_x, tile_y, cairo_image_surface_get_width(tile),
+                      cairo_image_surface_get_height(tile));
+      cairo_fill(cr);
+      cairo_surface_destroy(tile);
+    }
+  }
+  cairo_restore(cr);
+}
+
+void pyramid_close(pyramid_t* p) {
+  if (!p) {
+    return;
+  }
+  if (p->cache) {
+    g_hash_table_destroy(p->cache);
+    cached_tile_t* tile;
+    while ((tile = g_queue_pop_head(&p->lru))) {
+      free_cached_tile(tile);
+    }
+    pthread_mutex_destroy(&p->lock);
+  }
+  close(p->fd);
+  g_free(p->tiles);
+  g_free(p);
+}
+
+static int compute_levels(int width, int height, level_t* levels) {
+  int num_levels = 0;
+  int first_tile = 0;
+  while (num_levels < PYRAMID_MAX_LEVELS) {
+    level_t* lv = &levels[num_levels++];
+    lv->width = width;
+    lv->height = height;
+    lv->cols = (width + PYRAMID_TILE_SIZE - 1) / PYRAMID_TILE_SIZE;
+    lv->rows = (height + PYRAMID_TILE_SIZE - 1) / PYRAMID_TILE_SIZE;
+    lv->first_tile = first_tile;
+    first_tile += lv->cols * lv->rows;
+    if (width <= PYRAMID_TILE_SIZE && height <= PYRAMID_TILE_SIZE) {
+      break;
+    }
+    width = (width + 1) / 2;
+    height = (height + 1) / 2;
+  }
+  return num_levels;
+}
+
+static gboolean source_open(source_t* s, const char* path) {
+  memset(s, 0, sizeof(*s));
+  s->file = fopen(path, "rb");
+  if (!s->file) {
+    return FALSE;
+  }
+  unsigned char magic[8] = {0};
+  fread(magic, 1, sizeof(magic), s->file);
+  rewind(s->file);
+  if (magic[0] == 0xff && magic[1] == 0xd8 && source_open_jpeg(s)) {
+    return TRUE;
+  }
+  if (!png_sig_cmp(magic, 0, sizeof(magic)) && source_open_png(s)) {
+    return TRUE;
+  }
+
+  // Anything else has to be decoded whole.
+  fclose(s->file);
+  s->file = NULL;
+  s->pixbuf = gdk_pixbuf_new_from_file(path, NULL);
+  if (!s->pixbuf) {
+    return FALSE;
+  }
+  s->width = gdk_pixbuf_get_width(s->pixbuf);
+  s->height = gdk_pixbuf_get_height(s->pixbuf);
+  return TRUE;
+}
+
+static gboolean source_open_jpeg(source_t* s) {
+  s->jpeg = g_new0(struct jpeg_decompress_struct, 1);
+  s->jpeg->err = jpeg_std_error(&s->jpeg_error.pub);
+  s->jpeg_error.pub.error_exit = jpeg_error_exit;
+  if (setjmp(s->jpeg_error.jump)) {
+    jpeg_destroy_decompress(s->jpeg);
+    g_free(s->jpeg);
+    s->jpeg = NULL;
+    rewind(s->file);
+    return FALSE;
+  }
+  jpeg_create_decompress(s->jpeg);
+  jpeg_stdio_src(s->jpeg, s->file);
+  jpeg_read_header(s->jpeg, TRUE);
+  s->jpeg->out_color_space = JCS_RGB;
+  jpeg_start_decompress(s->jpeg);
+  s->width = s->jpeg->output_width;
+  s->height = s->jpeg->output_height;
+  return TRUE;
+}
+
+static gboolean source_open_png(source_t* s) {
+  s->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  s->png_info = png_create_info_struct(s->png);
+  if (setjmp(png_jmpbuf(s->png))) {
+    png_destroy_read_struct(&s->png, &s->png_info, NULL);
+    rewind(s->file);
+    return FALSE;
+  }
+  png_init_io(s->png, s->file);
+  png_read_info(s->png, s->png_info);
+
+  // Interlaced images only come together after the last
+  // pass, so those are left to the whole-image path.
+  if (png_get_interlace_type(s->png, s->png_info) != PNG_INTERLACE_NONE) {
+    png_destroy_read_struct(&s->png, &s->png_info, NULL);
+    rewind(s->file);
+    return FALSE;
+  }
+  png_set_expand(s->png);
+  png_set_strip_16(s->png);
+  png_set_strip_alpha(s->png);
+  png_set_gray_to_rgb(s->png);
+  png_read_update_info(s->png, s->png_info);
+  s->width = png_get_image_width(s->png, s->png_info);
+  s->height = png_get_image_height(s->png, s->png_info);
+  return TRUE;
+}
+
+static gboolean source_read_row(source_t* s, guchar* row) {
+  if (s->jpeg) {
+    if (setjmp(s->jpeg_error.jump)) {
+      return FALSE;
+    }
+    JSAMPROW rows[1] = {row};
+    return jpeg_read_scanlines(s->jpeg, rows, 1) == 1;
+  }
+  if (s->png) {
+    if (setjmp(png_jmpbuf(s->png))) {
+      return FALSE;
+    }
+    png_read_row(s->png, row, NULL);
+    return TRUE;
+  }
+
+  int channels = gdk_pixbuf_get_n_channels(s->pixbuf);
+  const guchar* pixels = gdk_pixbuf_get_pixels(s->pixbuf) +
+                         (gsize)s->row++ * gdk_pixbuf_get_rowstride(s->pixbuf);
+  for (int x = 0; x < s->width; ++x) {
+    memcpy(row + x * 3, pixels + x * channels, 3);
+  }
+  return TRUE;
+}
+
+static void source_close(source_t* s) {
+  if (s->jpeg) {
+    // Skip jpeg_finish_decompress(), which complains about
+    // unread scanlines after a cancelled build.
+    jpeg_destroy_decompress(s->jpeg);
+    g_free(s->jpeg);
+  }
+  if (s->png) {
+    png_destroy_read_struct(&s->png, &s->png_info, NULL);
+  }
+  if (s->pixbuf) {
+    g_object_unref(s->pixbuf);
+  }
+  if (s->file) {
+    fclose(s->file);
+  }
+}
+
+static void jpeg_error_exit(j_common_ptr info) {
+  jpeg_error_t* error = (jpeg_error_t*)info->err;
+  longjmp(error->jump, 1);
+}
+
+static void push_row(builder_t* b, int level, const guchar* row) {
+  level_t* lv = &b->levels[level];
+  build_level_t* bl = &b->build[level];
+  gsize stride = (gsize)lv->width * 3;
+  memcpy(bl->strip + bl->strip_rows * stride, row, stride);
+  bl->strip_rows++;
+  bl->rows_done++;
+  gboolean last_row = bl->rows_done == lv->height;
+  if (bl->strip_rows == PYRAMID_TILE_SIZE || last_row) {
+    flush_strip(b, level);
+  }
+
+  if (level + 1 == b->num_levels) {
+    return;
+  }
+  // Every pair of rows becomes one row of the next level;
+  // an odd last row is paired with itself.
+  if (!bl->has_pending) {
+    memcpy(bl->pending, row, stride);
+    bl->has_pending = TRUE;
+    if (!last_row) {
+      return;
+    }
+    row = bl->pending;
+  }
+  guchar* next = g_malloc((gsize)b->levels[level + 1].width * 3);
+  reduce_rows(bl->pending, row, lv->width, next);
+  bl->has_pending = FALSE;
+  push_row(b, level + 1, next);
+  g_free(next);
+}
+
+static void reduce_rows(const guchar* a,
+                        const guchar* b,
+                        int width,
+                        guchar* out) {
+  int out_width = (width + 1) / 2;
+  for (int x = 0; x < out_width; ++x) {
+    int x0 = x * 2 * 3;
+    int x1 = MIN(x * 2 + 1, width - 1) * 3;
+    for (int c = 0; c < 3; ++c) {
+      out[x * 3 + c] =
+          (a[x0 + c] + a[x1 + c] + b[x0 + c] + b[x1 + c] + 2) >> 2;
+    }
+  }
+}
+
+static void flush_strip(builder_t* b, int level) {
+  level_t* lv = &b->levels[level];
+  build_level_t* bl = &b->build[level];
+  int row = (bl->rows_done - 1) / PYRAMID_TILE_SIZE;
+  int stride = lv->width * 3;
+  for (int col = 0; col < lv->cols && !b->failed; ++col) {
+    int x = col * PYRAMID_TILE_SIZE;
+    unsigned char* data = NULL;
+    unsigned long size = 0;
+    if (!encode_tile(bl->strip + x * 3, stride,
+                     MIN(PYRAMID_TILE_SIZE, lv->width - x), bl->strip_rows,
+                     &data, &size)) {
+      b->failed = TRUE;
+      break;
+    }
+    tile_entry_t* entry = &b->tiles[lv->first_tile + row * lv->cols + col];
+    entry->offset = ftell(b->file);
+    entry->size = size;
+    if (fwrite(data, 1, size, b->file) != size) {
+      b->failed = TRUE;
+    }
+    free(data);
+  }
+  bl->strip_rows = 0;
+}
+
+static gboolean encode_tile(const guchar* pixels,
+                            int stride,
+                            int width,
+                            int height,
+                            unsigned char** data,
+                            unsigned long* size) {
+  struct jpeg_compress_struct info;
+  jpeg_error_t error;
+  info.err = jpeg_std_error(&error.pub);
+  error.pub.error_exit = jpeg_error_exit;
+  if (setjmp(error.jump)) {
+    jpeg_destroy_compress(&info);
+    free(*data);
+    *data = NULL;
+    return FALSE;
+  }
+  jpeg_create_compress(&info);
+  jpeg_mem_dest(&info, data, size);
+  info.image_width = width;
+  info.image_height = height;
+  info.input_components = 3;
+  info.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&info);
+  jpeg_set_quality(&info, PYRAMID_TILE_QUALITY, TRUE);
+  jpeg_start_compress(&info, TRUE);
+  while (info.next_scanline < height) {
+    JSAMPROW rows[1] = {(JSAMPROW)(pixels + info.next_scanline * stride)};
+    jpeg_write_scanlines(&info, rows, 1);
+  }
+  jpeg_finish_compress(&info);
+  jpeg_destroy_compress(&info);
+  return TRUE;
+}
+
+static cairo_surface_t* decode_tile(const unsigned char* data, int size) {
+  struct jpeg_decompress_struct info;
+  jpeg_error_t error;
+  // Both are set after setjmp() and freed after a jump.
+  cairo_surface_t* volatile surface = NULL;
+  guchar* volatile row = NULL;
+  info.err = jpeg_std_error(&error.pub);
+  error.pub.error_exit = jpeg_error_exit;
+  if (setjmp(error.jump)) {
+    jpeg_destroy_decompress(&info);
+    if (surface) {
+      cairo_surface_destroy(surface);
+    }
+    g_free(row);
+    return NULL;
+  }
+  jpeg_create_decompress(&info);
+  jpeg_mem_src(&info, (unsigned char*)data, size);
+  jpeg_read_header(&info, TRUE);
+  info.out_color_space = JCS_RGB;
+  jpeg_start_decompress(&info);
+
+  surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, info.output_width,
+                                       info.output_height);
+  guchar* pixels = cairo_image_surface_get_data(surface);
+  int stride = cairo_image_surface_get_stride(surface);
+  row = g_malloc(info.output_width * 3);
+  while (info.output_scanline < info.output_height) {
+    uint32_t* out = (uint32_t*)(pixels + info.output_scanline * stride);
+    JSAMPROW rows[1] = {row};
+    jpeg_read_scanlines(&info, rows, 1);
+    for (int x = 0; x < info.output_width; ++x) {
+      out[x] = 0xff000000 | (row[x * 3] << 16) | (row[x * 3 + 1] << 8) |
+               row[x * 3 + 2];
+    }
+  }
+  cairo_surface_mark_dirty(surface);
+  jpeg_finish_decompress(&info);
+  jpeg_destroy_decompress(&info);
+  g_free(row);
+  return surface;
+}
+
+// Return a new reference to a decoded tile, reading it
+// from disk if it is not cached.
+static cairo_surface_t* get_tile(pyramid_t* p, int level, int col, int row) {
+  uint64_t key = ((uint64_t)level << 48) | ((uint64_t)row << 24) | col;
+  pthread_mutex_lock(&p->lock);
+  GList* link = g_hash_table_lookup(p->cache, &key);
+  if (link) {
+    g_queue_unlink(&p->lru, link);
+    g_queue_push_head_link(&p->lru, link);
+    cairo_surface_t* surface =
+        cairo_surface_reference(((cached_tile_t*)link->data)->surface);
+    pthread_mutex_unlock(&p->lock);
+    return surface;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  // Decode without the lock; if another thread races us to
+  // the same tile, the first one in wins.
+  level_t* lv = &p->levels[level];
+  tile_entry_t* entry = &p->tiles[lv->first_tile + row * lv->cols + col];
+  if (entry->size <= 0) {
+    return NULL;
+  }
+  unsigned char* data = g_malloc(entry->size);
+  cairo_surface_t* surface = NULL;
+  if (pread(p->fd, data, entry->size, entry->offset) == entry->size) {
+    surface = decode_tile(data, entry->size);
+  }
+  g_free(data);
+  if (!surface) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  link = g_hash_table_lookup(p->cache, &key);
+  if (link) {
+    cairo_surface_destroy(surface);
+    surface = cairo_surface_reference(((cached_tile_t*)link->data)->surface);
+    pthread_mutex_unlock(&p->lock);
+    return surface;
+  }
+  cached_tile_t* tile = g_new(cached_tile_t, 1);
+  tile->key = key;
+  tile->surface = cairo_surface_reference(surface);
+  tile->bytes = (gint64)cairo_image_surface_get_stride(surface) *
+                cairo_image_surface_get_height(surface);
+  g_queue_push_head(&p->lru, tile);
+  g_hash_table_insert(p->cache, &tile->key, p->lru.head);
+  p->cache_bytes += tile->bytes;
+
+  // Always keep the tile just read, even over budget.
+  while (p->cache_bytes > p->max_cache_bytes && p->lru.length > 1) {
+    cached_tile_t* old = g_queue_pop_tail(&p->lru);
+    g_hash_table_remove(p->cache, &old->key);
+    p->cache_bytes -= old->bytes;
+    free_cached_tile(old);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return surface;
+}
+
+static void free_cached_tile(gpointer data) {
+  cached_tile_t* tile = (cached_tile_t*)data;
+  cairo_surface_destroy(tile->surface);
+  g_free(tile);
+}
@@ -0,0 +1,59 @@
+#ifndef __PYRAMID_H__
+#define __PYRAMID_H__
+
+#include <gtk/gtk.h>
+
+#define PYRAMID_TILE_SIZE 256
+#define PYRAMID_MAX_LEVELS 24
+#define PYRAMID_TILE_QUALITY 90
+
+// Sources larger than this are cut from a pyramid rather
+// than decoded whole.
+#define PYRAMID_MIN_PIXELS (8192 * 8192)
+
+#define PYRAMID_DEFAULT_CACHE_MB 256
+
+// A tiled image pyramid stored on disk. Each level halves
+// the one before it, and every level is split into JPEG
+// tiles, so any region can be drawn at any scale by
+// reading only the tiles of one level that cover it.
+// Recently used tiles are kept decoded in memory, up to a
+// fixed budget.
+typedef struct pyramid pyramid_t;
+
+// Called during a build with the fraction of the source
+// read so far. Return FALSE to stop the build.
+typedef gboolean (*pyramid_progress_cb)(double fraction, gpointer user_data);
+
+// Where the pyramid of an image is cached. The name
+// changes whenever the image file does.
+char* pyramid_cache_path(const char* image_path);
+
+// Build the pyramid of an image at out_path. JPEG and
+// non-interlaced PNG sources are decoded a strip of rows
+// at a time, so they never have to fit in memory; other
+// formats are decoded whole.
+gboolean pyramid_build(const char* image_path,
+                       const char* out_path,
+                       pyramid_progress_cb progress_cb,
+                       gpointer user_data);
+
+// Open a built pyramid, or return NULL if there is none.
+pyramid_t* pyramid_open(const char* path, gint64 cache_bytes);
+void pyramid_size(pyramid_t* p, int* width, int* height);
+
+// Draw the region of the full-resolution image at
+// (x, y, width, height) into the rectangle (0, 0,
+// dst_width, dst_height) of cr. Safe to call from several
+// threads at once.
+void pyramid_render(pyramid_t* p,
+                    cairo_t* cr,
+                    double x,
+                    double y,
+                    double width,
+                    double height,
+                    int dst_width,
+                    int dst_height);
+void pyramid_close(pyramid_t* p);
+
+#endif
@@ -0,0 +1,494 @@
+#include "solver.h"
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define SIDE_TOP 0
+#define SIDE_RIGHT 1
+#define SIDE_BOTTOM 2
+#define SIDE_LEFT 3
+#define OPPOSITE(side) (((side) + 2) % 4)
+
+typedef struct {
+  int piece;
+  float distance;
+} candidate_t;
+
+struct solver {
+  int count;
+  int piece_size;
+
+  // Floats per border: four per pixel, the last unused.
+  int length;
+
+  // For each piece and side, the border pixels followed by
+  // the colors the piece predicts just beyond the border,
+  // extrapolated from the last two rows or columns.
+  float* borders;
+
+  // For each piece and side, the best matching pieces,
+  // closest first. Unused entries have piece -1.
+  candidate_t* candidates;
+};
+
+// Each job keeps its own candidate lists for every piece,
+// which are merged once all jobs are done.
+typedef struct {
+  solver_t* s;
+  int start;
+  int end;
+  candidate_t* candidates;
+} score_job_t;
+
+// The partial solution. Coordinates are relative to the
+// seed, which sits in the middle of a board big enough for
+// the solution to grow in any direction.
+typedef struct {
+  int cols;
+  int rows;
+  int board_cols;
+  int board_rows;
+  int* board;
+  int* best_piece;
+  float* best_score;
+  gboolean* in_frontier;
+  GArray* frontier;
+  gboolean* placed;
+  int min_row;
+  int max_row;
+  int min_col;
+  int max_col;
+} layout_t;
+
+static const int side_rows[4] = {-1, 0, 1, 0};
+static const int side_cols[4] = {0, 1, 0, -1};
+
+static float* border(const solver_t* s, int piece, int side);
+static float* prediction(const solver_t* s, int piece, int side);
+static candidate_t* candidates(const solver_t* s, int piece, int side);
+static void clear_candidates(candidate_t* list, int count);
+static float distance(const solver_t* s, int a, int side, int b);
+static float border_distance(const float* a, const float* b, int n);
+static void* score_thread(void* arg);
+static void insert_candidate(candidate_t* list, int piece, float distance);
+static gboolean best_buddies(const solver_t* s, int a, int side, int b);
+static int choose_seed(const solver_t* s);
+static void place_piece(layout_t* l, int slot, int piece);
+static gboolean slot_fits(const layout_t* l, int row, int col);
+static float slot_score(const solver_t* s,
+                        const layout_t* l,
+                        int slot,
+                        int piece);
+static void find_best_piece(const solver_t* s, layout_t* l, int slot);
+
+solver_t* solver_new(int count, int piece_size) {
+  solver_t* s = g_new0(solver_t, 1);
+  s->count = count;
+  s->piece_size = piece_size;
+  s->length = piece_size * 4;
+  s->borders = g_new0(float, (gsize)count * 4 * 2 * s->length);
+  s->candidates = g_new(candidate_t, (gsize)count * 4 * SOLVER_CANDIDATES);
+  return s;
+}
+
+void solver_set_piece(solver_t* s,
+                      int index,
+                      const guchar* pixels,
+                      int stride,
+                      int bytes_per_pixel) {
+  int last = s->piece_size - 1;
+  int inner = MAX(0, last - 1);
+  for (int side = 0; side < 4; ++side) {
+    float* edge = border(s, index, side);
+    float* predicted = prediction(s, index, side);
+    for (int k = 0; k < s->piece_size; ++k) {
+      // Borders run left to right or top to bottom, so
+      // that opposite sides line up.
+      int x, y, x_in, y_in;
+      switch (side) {
+        case SIDE_TOP:
+          x = x_in = k;
+          y = 0;
+          y_in = MIN(1, last);
+          break;
+        case SIDE_RIGHT:
+          x = last;
+          x_in = inner;
+          y = y_in = k;
+          break;
+        case SIDE_BOTTOM:
+          x = x_in = k;
+          y = last;
+          y_in = inner;
+          break;
+        default:
+          x = 0;
+          x_in = MIN(1, last);
+          y = y_in = k;
+          break;
+      }
+      const guchar* p = pixels + y * stride + x * bytes_per_pixel;
+      const guchar* q = pixels + y_in * stride + x_in * bytes_per_pixel;
+      for (int c = 0; c < 3; ++c) {
+        edge[k * 4 + c] = p[c];
+        predicted[k * 4 + c] = 2.0f * p[c] - q[c];
+      }
+    }
+  }
+}
+
+void solver_solve(solver_t* s,
+                  int cols,
+                  int rows,
+                  int threads,
+                  int* placement) {
+  if (threads <= 0) {
+    threads = g_get_num_processors();
+  }
+  threads = MAX(1, MIN(threads, s->count));
+  score_job_t* jobs = g_new(score_job_t, threads);
+  pthread_t* ids = g_new(pthread_t, threads);
+  for (int i = 0; i < threads; ++i) {
+    jobs[i].s = s;
+    jobs[i].start = (int)((gint64)s->count * i / threads);
+    jobs[i].end = (int)((gint64)s->count * (i + 1) / threads);
+    jobs[i].candidates =
+        g_new(candidate_t, (gsize)s->count * 4 * SOLVER_CANDIDATES);
+    clear_candidates(jobs[i].candidates, s->count * 4);
+    if (i > 0) {
+      pthread_create(&ids[i], NULL, score_thread, &jobs[i]);
+    }
+  }
+  score_thread(&jobs[0]);
+  clear_candidates(s->candidates, s->count * 4);
+  for (int i = 0; i < threads; ++i) {
+    if (i > 0) {
+      pthread_join(ids[i], NULL);
+    }
+    for (int list = 0; list < s->count * 4; ++list) {
+      const candidate_t* from = jobs[i].candidates + list * SOLVER_CANDIDATES;
+      for (int k = 0; k < SOLVER_CANDIDATES && from[k].piece >= 0; ++k) {
+        insert_candidate(s->candidates + list * SOLVER_CANDIDATES,
+                         from[k].piece, from[k].distance);
+      }
+    }
+    g_free(jobs[i].candidates);
+  }
+  g_free(ids);
+  g_free(jobs);
+
+  layout_t l;
+  l.cols = cols;
+  l.rows = rows;
+  l.board_cols = cols * 2 - 1;
+  l.board_rows = rows * 2 - 1;
+  int slots = l.board_cols * l.board_rows;
+  l.board = g_new(int, slots);
+  l.best_piece = g_new(int, slots);
+  l.best_score = g_new(float, slots);
+  l.in_frontier = g_new0(gboolean, slots);
+  l.frontier = g_array_new(FALSE, FALSE, sizeof(int));
+  l.placed = g_new0(gboolean, s->count);
+  for (int i = 0; i < slots; ++i) {
+    l.board[i] = -1;
+    l.best_piece[i] = -1;
+  }
+  l.min_row = l.max_row = rows - 1;
+  l.min_col = l.max_col = cols - 1;
+  place_piece(&l, (rows - 1) * l.board_cols + cols - 1, choose_seed(s));
+
+  for (int placed = 1; placed < s->count; ++placed) {
+    int best_slot = -1;
+    float best_score = INFINITY;
+    for (int i = 0; i < l.frontier->len; ++i) {
+      int slot = g_array_index(l.frontier, int, i);
+      int row = slot / l.board_cols;
+      int col = slot % l.board_cols;
+
+      // The solution only grows, so a slot that is taken or
+      // would make it too big is never usable again.
+      if (l.board[slot] >= 0 || !slot_fits(&l, row, col)) {
+        l.in_frontier[slot] = FALSE;
+        g_array_remove_index_fast(l.frontier, i--);
+        continue;
+      }
+      if (l.best_piece[slot] < 0 || l.placed[l.best_piece[slot]]) {
+        find_best_piece(s, &l, slot);
+      }
+      if (l.best_score[slot] < best_score) {
+        best_score = l.best_score[slot];
+        best_slot = slot;
+      }
+    }
+    place_piece(&l, best_slot, l.best_piece[best_slot]);
+  }
+
+  for (int row = l.min_row; row <= l.max_row; ++row) {
+    for (int col = l.min_col; col <= l.max_col; ++col) {
+      placement[(row - l.min_row) * cols + col - l.min_col] =
+          l.board[row * l.board_cols + col];
+    }
+  }
+
+  g_free(l.board);
+  g_free(l.best_piece);
+  g_free(l.best_score);
+  g_free(l.in_frontier);
+  g_array_free(l.frontier, TRUE);
+  g_free(l.placed);
+}
+
+void solver_free(solver_t* s) {
+  if (!s) {
+    return;
+  }
+  g_free(s->borders);
+  g_free(s->candidates);
+  g_free(s);
+}
+
+static float* border(const solver_t* s, int piece, int side) {
+  return s->borders + ((gsize)piece * 4 + side) * 2 * s->length;
+}
+
+static float* prediction(const solver_t* s, int piece, int side) {
+  return border(s, piece, side) + s->length;
+}
+
+static candidate_t* candidates(const solver_t* s, int piece, int side) {
+  return s->candidates + ((gsize)piece * 4 + side) * SOLVER_CANDIDATES;
+}
+
+// How badly b fits against the given side of a: how far
+// each piece's border is from what the other predicts.
+static float distance(const solver_t* s, int a, int side, int b) {
+  int other = OPPOSITE(side);
+  return border_distance(prediction(s, a, side), border(s, b, other),
+                         s->length) +
+         border_distance(prediction(s, b, other), border(s, a, side),
+                         s->length);
+}
+
+// Sum of absolute differences over n floats, a multiple
+// of four.
+static float border_distance(const float* a, const float* b, int n) {
+#ifdef __SSE2__
+  __m128 sign = _mm_set1_ps(-0.0f);
+  __m128 sum0 = _mm_setzero_ps();
+  __m128 sum1 = _mm_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+    sum0 = _mm_add_ps(sum0, _mm_andnot_ps(sign, d0));
+    sum1 = _mm_add_ps(sum1, _mm_andnot_ps(sign, d1));
+  }
+  if (i < n) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    sum0 = _mm_add_ps(sum0, _mm_andnot_ps(sign, d0));
+  }
+  float sums[4];
+  _mm_storeu_ps(sums, _mm_add_ps(sum0, sum1));
+  return sums[0] + sums[1] + sums[2] + sums[3];
+#else
+  float sum = 0;
+  for (int i = 0; i < n; ++i) {
+    sum += fabsf(a[i] - b[i]);
+  }
+  return sum;
+#endif
+}
+
+static void clear_candidates(candidate_t* list, int count) {
+  for (int i = 0; i < count * SOLVER_CANDIDATES; ++i) {
+    list[i].piece = -1;
+    list[i].distance = INFINITY;
+  }
+}
+
+// Score the pieces in [start, end) against every piece to
+// their right and below. The distance is symmetric, so
+// each score also goes to the other piece's left or top.
+static void* score_thread(void* arg) {
+  score_job_t* job = (score_job_t*)arg;
+  solver_t* s = job->s;
+  candidate_t* lists = job->candidates;
+  for (int a = job->start; a < job->end; ++a) {
+    for (int b = 0; b < s->count; ++b) {
+      if (b == a) {
+        continue;
+      }
+      float d = distance(s, a, SIDE_RIGHT, b);
+      insert_candidate(lists + (a * 4 + SIDE_RIGHT) * SOLVER_CANDIDATES, b,
+                       d);
+      insert_candidate(lists + (b * 4 + SIDE_LEFT) * SOLVER_CANDIDATES, a, d);
+      d = distance(s, a, SIDE_BOTTOM, b);
+      insert_candidate(lists + (a * 4 + SIDE_BOTTOM) * SOLVER_CANDIDATES, b,
+                       d);
+      insert_candidate(lists + (b * 4 + SIDE_TOP) * SOLVER_CANDIDATES, a, d);
+    }
+  }
+  return NULL;
+}
+
+static void insert_candidate(candidate_t* list, int piece, float distance) {
+  if (distance >= list[SOLVER_CANDIDATES - 1].distance) {
+    return;
+  }
+  int k = SOLVER_CANDIDATES - 1;
+  while (k > 0 && list[k - 1].distance > distance) {
+    list[k] = list[k - 1];
+    k--;
+  }
+  list[k].piece = piece;
+  list[k].distance = distance;
+}
+
+// Whether b is the best fit for a's side and a is the best
+// fit for b's opposite side.
+static gboolean best_buddies(const solver_t* s, int a, int side, int b) {
+  return candidates(s, a, side)[0].piece == b &&
+         candidates(s, b, OPPOSITE(side))[0].piece == a;
+}
+
+// Start from the piece with the most best buddies, which is
+// the one most likely to have its neighbors placed right.
+static int choose_seed(const solver_t* s) {
+  int seed = 0;
+  int most = -1;
+  for (int a = 0; a < s->count; ++a) {
+    int buddies = 0;
+    for (int side = 0; side < 4; ++side) {
+      int b = candidates(s, a, side)[0].piece;
+      buddies += b >= 0 && best_buddies(s, a, side, b);
+    }
+    if (buddies > most) {
+      most = buddies;
+      seed = a;
+    }
+  }
+  return seed;
+}
+
+static void place_piece(layout_t* l, int slot, int piece) {
+  int row = slot / l->board_cols;
+  int col = slot % l->board_cols;
+  l->board[slot] = piece;
+  l->placed[piece] = TRUE;
+  l->min_row = MIN(l->min_row, row);
+  l->max_row = MAX(l->max_row, row);
+  l->min_col = MIN(l->min_col, col);
+  l->max_col = MAX(l->max_col, col);
+
+  // The empty neighbors now have another side to match.
+  for (int side = 0; side < 4; ++side) {
+    int r = row + side_rows[side];
+    int c = col + side_cols[side];
+    if (r < 0 || c < 0 || r >= l->board_rows || c >= l->board_cols) {
+      continue;
+    }
+    int next = r * l->board_cols + c;
+    if (l->board[next] >= 0) {
+      continue;
+    }
+    l->best_piece[next] = -1;
+    if (!l->in_frontier[next]) {
+      l->in_frontier[next] = TRUE;
+      g_array_append_val(l->frontier, next);
+    }
+  }
+}
+
+static gboolean slot_fits(const layout_t* l, int row, int col) {
+  return MAX(l->max_row, row) - MIN(l->min_row, row) < l->rows &&
+         MAX(l->max_col, col) - MIN(l->min_col, col) < l->cols;
+}
+
+// Lower is better. Each placed neighbor's distance is
+// divided by the distance to its second-best match, so a
+// fit counts for more when the neighbor has no close
+// alternative. Slots where every neighbor agrees on the
+// piece as a best buddy go first.
+static float slot_score(const solver_t* s,
+                        const layout_t* l,
+                        int slot,
+                        int piece) {
+  int row = slot / l->board_cols;
+  int col = slot % l->board_cols;
+  float score = 0;
+  int neighbors = 0;
+  int buddies = 0;
+  for (int side = 0; side < 4; ++side) {
+    int r = row + side_rows[side];
+    int c = col + side_cols[side];
+    if (r < 0 || c < 0 || r >= l->board_rows || c >= l->board_cols) {
+      continue;
+    }
+    int neighbor = l->board[r * l->board_cols + c];
+    if (neighbor < 0) {
+      continue;
+    }
+    int facing = OPPOSITE(side);
+    const candidate_t* list = candidates(s, neighbor, facing);
+    float norm = isfinite(list[1].distance) ? list[1].distance
+                                             : list[0].distance;
+    score += distance(s, neighbor, facing, piece) / (norm + 1e-3f);
+    buddies += best_buddies(s, neighbor, facing, piece);
+    neighbors++;
+  }
+  score /= neighbors;
+  return buddies == neighbors ? score - 1 : score;
+}
+
+static void find_best_piece(const solver_t* s, layout_t* l, int slot) {
+  int row = slot / l->board_cols;
+  int col = slot % l->board_cols;
+  int best = -1;
+  float best_score = INFINITY;
+
+  // Only the pieces that fit some neighbor well are worth
+  // scoring.
+  for (int side = 0; side < 4; ++side) {
+    int r = row + side_rows[side];
+    int c = col + side_cols[side];
+    if (r < 0 || c < 0 || r >= l->board_rows || c >= l->board_cols) {
+      continue;
+    }
+    int neighbor = l->board[r * l->board_cols + c];
+    if (neighbor < 0) {
+      continue;
+    }
+    const candidate_t* list = candidates(s, neighbor, OPPOSITE(side));
+    for (int k = 0; k < SOLVER_CANDIDATES; ++k) {
+      int piece = list[k].piece;
+      if (piece < 0 || l->placed[piece]) {
+        continue;
+      }
+      float score = slot_score(s, l, slot, piece);
+      if (score < best_score) {
+        best_score = score;
+        best = piece;
+      }
+    }
+  }
+
+  // Late in the solve, every candidate may be used up.
+  if (best < 0) {
+    for (int piece = 0; piece < s->count; ++piece) {
+      if (l->placed[piece]) {
+        continue;
+      }
+      float score = slot_score(s, l, slot, piece);
+      if (score < best_score) {
+        best_score = score;
+        best = piece;
+      }
+    }
+  }
+  l->best_piece[slot] = best;
+  l->best_score[slot] = best_score;
+}
@@ -0,0 +1,37 @@
+#ifndef __SOLVER_H__
+#define __SOLVER_H__
+
+#include <glib.h>
+
+// Best matches kept for each side of each piece.
+#define SOLVER_CANDIDATES 8
+
+// Reassembles an image from square pieces using nothing
+// but their pixels. Every pair of pieces is scored on how
+// well each side of one continues into the opposite side
+// of the other, and pieces are then placed greedily,
+// growing out from a seed and taking the most confident
+// fit first.
+typedef struct solver solver_t;
+
+solver_t* solver_new(int count, int piece_size);
+
+// Copy the border pixels of a piece. bytes_per_pixel is 3
+// or 4; any fourth channel is ignored.
+void solver_set_piece(solver_t* s,
+                      int index,
+                      const guchar* pixels,
+                      int stride,
+                      int bytes_per_pixel);
+
+// Arrange the pieces on a cols x rows board, which must
+// hold exactly as many pieces as there are, and write the
+// index of the piece in each cell, row by row. The scoring
+// is split between threads, or all cores if threads is 0.
+// Does not touch anything outside the solver, so it may run
+// on any thread. Scoring is quadratic in the number of
+// pieces.
+void solver_solve(solver_t* s, int cols, int rows, int threads, int* placement);
+void solver_free(solver_t* s);
+
+#endif
@@ -0,0 +1,460 @@
+#include <glib.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "split.h"
+#include "video_info.h"
+
+#define BENCH_WIDTH 640
+#define BENCH_HEIGHT 360
+#define BENCH_FPS 25
+#define BENCH_BITRATE 8000000
+
+static gboolean accurate = FALSE;
+static gint buffer_size = 0;
+static gboolean bench = FALSE;
+static gchar* bench_dir = NULL;
+static gchar* stream_list = NULL;
+static gchar* format = NULL;
+static gboolean primary = FALSE;
+static gboolean concat = FALSE;
+static gdouble split_seconds = 0;
+static gint threads = 0;
+
+static GOptionEntry entries[] = {
+    {"accurate", 'a', 0, G_OPTION_ARG_NONE, &accurate,
+     "Re-encode boundary GOPs for frame-accurate cuts", NULL},
+    {"buffer", 'b', 0, G_OPTION_ARG_INT, &buffer_size,
+     "Output buffer size in bytes", "BYTES"},
+    {"streams", 's', 0, G_OPTION_ARG_STRING, &stream_list,
+     "Comma-separated input stream indices to keep", "LIST"},
+    {"primary", 'p', 0, G_OPTION_ARG_NONE, &primary,
+     "Only keep the main video and audio streams", NULL},
+    {"format", 'f', 0, G_OPTION_ARG_STRING, &format,
+     "Output format, e.g. mpegts (required when OUTPUT is -)", "NAME"},
+    {"concat", 'c', 0, G_OPTION_ARG_NONE, &concat,
+     "Join the INPUT files into OUTPUT instead of cutting",
+     NULL},
+    {"split", 0, 0, G_OPTION_ARG_DOUBLE, &split_seconds,
+     "Split INPUT into OUTPUT_001, OUTPUT_002, ... at the first keyframe "
+     "after every SECONDS",
+     "SECONDS"},
+    {"threads", 'j', 0, G_OPTION_ARG_INT, &threads,
+     "Chunks to split at once (default: one per core)", "N"},
+    {"bench", 0, 0, G_OPTION_ARG_NONE, &bench,
+     "Benchmark stream-copy cuts of generated media", NULL},
+    {"bench-dir", 0, 0, G_OPTION_ARG_FILENAME, &bench_dir,
+     "Directory for benchmark media", "DIR"},
+    {NULL}};
+
+static int run_cuts(int argc, char** argv);
+static int run_concat(int argc, char** argv);
+static int run_split(int argc, char** argv);
+static int run_bench();
+static void bench_split(const char* dir, const char* in_path);
+static void print_stats(const char* action, const cut_stats_t* stats);
+static gboolean parse_range(const char* str, double* start, double* end);
+static char* range_output_path(const char* out_path, int index, int count);
+static gboolean generate_media(const char* path, int seconds);
+static int write_frames(AVCodecContext* encoder, AVFormatContext* format);
+
+int main(int argc, char** argv) {
+  av_register_all();
+  // A reader of stdout going away should fail the write,
+  // not kill the process.
+  signal(SIGPIPE, SIG_IGN);
+
+  GError* error = NULL;
+  GOptionContext* context =
+      g_option_context_new("INPUT OUTPUT START-END [START-END...]");
+  g_option_context_set_summary(context,
+                               "Cut time ranges out of a video without "
+                               "re-encoding.\n\n"
+                               "With --concat: OUTPUT INPUT [INPUT...]\n"
+                               "With --split: INPUT OUTPUT");
+  g_option_context_add_main_entries(context, entries, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    fprintf(stderr, "%s\n", error->message);
+    g_error_free(error);
+    return 1;
+  }
+
+  int status;
+  if (bench) {
+    status = run_bench();
+  } else if (concat && argc >= 3) {
+    status = run_concat(argc, argv);
+  } else if (split_seconds > 0 && argc == 3) {
+    status = run_split(argc, argv);
+  } else if (argc < 4) {
+    gchar* help = g_option_context_get_help(context, TRUE, NULL);
+    fprintf(stderr, "%s", help);
+    g_free(help);
+    status = 1;
+  } else {
+    status = run_cuts(argc, argv);
+  }
+  g_option_context_free(context);
+  return status;
+}
+
+static int run_cuts(int argc, char** argv) {
+  media_t* media = media_open(argv[1], TRUE);
+  if (!media) {
+    fprintf(stderr, "failed to open: %s\n", argv[1]);
+    return 1;
+  }
+
+  int streams[64];
+  int num_streams = 0;
+  if (primary) {
+    num_streams = media_primary_streams(media, streams);
+  } else if (stream_list) {
+    gchar** parts = g_strsplit(stream_list, ",", -1);
+    for (int i = 0; parts[i] && num_streams < G_N_ELEMENTS(streams); ++i) {
+      streams[num_streams++] = atoi(parts[i]);
+    }
+    g_strfreev(parts);
+  }
+
+  int status = 0;
+  int count = argc - 3;
+  if (count > 1 && strcmp(argv[2], "-") == 0) {
+    fprintf(stderr, "only one range can be written to stdout\n");
+    media_unref(media);
+    return 1;
+  }
+  for (int i = 0; i < count; ++i) {
+    cut_stats_t stats;
+    cut_options_t options = {0};
+    options.smart_render = accurate;
+    options.io_buffer_size = buffer_size;
+    options.format = format;
+    options.stats = &stats;
+    if (primary || stream_list) {
+      options.streams = streams;
+      options.num_streams = num_streams;
+    }
+    if (!parse_range(argv[i + 3], &options.start, &options.end)) {
+      fprintf(stderr, "invalid range: %s\n", argv[i + 3]);
+      status = 1;
+      break;
+    }
+    char* out_path = range_output_path(argv[2], i, count);
+    if (!cut_video_sync(media, out_path, &options, NULL)) {
+      fprintf(stderr, "failed to cut: %s\n", out_path);
+      status = 1;
+    } else {
+      print_stats("cut", &stats);
+      if (stats.keyframe_cuts) {
+        fprintf(stderr,
+                "%s: cut on keyframes, not exact frames; re-encoded frames "
+                "would not match the stream's codec parameters\n",
+                out_path);
+      }
+    }
+    g_free(out_path);
+  }
+
+  media_unref(media);
+  return status;
+}
+
+static int run_concat(int argc, char** argv) {
+  // argv holds OUTPUT INPUT [INPUT...].
+  const char* out_path = argv[1];
+  int count = argc - 2;
+  media_t** inputs = g_new0(media_t*, count);
+  int status = 0;
+  for (int i = 0; i < count; ++i) {
+    const char* path = argv[i + 2];
+    if (strcmp(path, out_path) == 0) {
+      fprintf(stderr, "OUTPUT is also an INPUT: %s\n", path);
+      status = 1;
+      goto done;
+    }
+    inputs[i] = media_open(path, TRUE);
+    if (!inputs[i]) {
+      fprintf(stderr, "failed to open: %s\n", path);
+      status = 1;
+      goto done;
+    }
+    if (!media_compatible(inputs[0], inputs[i])) {
+      fprintf(stderr, "%s does not match the streams of %s\n", path,
+              argv[2]);
+      status = 1;
+      goto done;
+    }
+  }
+
+  cut_stats_t stats;
+  concat_options_t options = {0};
+  options.io_buffer_size = buffer_size;
+  options.format = format;
+  options.stats = &stats;
+  if (!concat_videos(inputs, count, out_path, &options)) {
+    fprintf(stderr, "failed to join: %s\n", out_path);
+    status = 1;
+  } else {
+    print_stats("concat", &stats);
+  }
+
+done:
+  for (int i = 0; i < count; ++i) {
+    media_unref(inputs[i]);
+  }
+  g_free(inputs);
+  return status;
+}
+
+static int run_split(int argc, char** argv) {
+  media_t* media = media_open(argv[1], TRUE);
+  if (!media) {
+    fprintf(stderr, "failed to open: %s\n", argv[1]);
+    return 1;
+  }
+  split_options_t options = {0};
+  options.chunk_seconds = split_seconds;
+  options.threads = threads;
+  options.io_buffer_size = buffer_size;
+  int64_t start_usec = g_get_monotonic_time();
+  int count = split_video(media, argv[2], &options);
+  media_unref(media);
+  if (count < 0) {
+    fprintf(stderr, "failed to split: %s\n", argv[1]);
+    return 1;
+  }
+  printf("split into %d chunks in %.2f s\n", count,
+         (double)(g_get_monotonic_time() - start_usec) / 1e6);
+  return 0;
+}
+
+static int run_bench() {
+  static const int durations[] = {15, 60, 240};
+  const char* dir = bench_dir ? bench_dir : g_get_tmp_dir();
+
+  // Throughput is of the input read, and the last column
+  // is the time until the first packet is demuxed.
+  printf("%8s %10s %10s %12s %13s\n", "source", "MB read", "read MB/s",
+         "packets/s", "first pkt ms");
+  for (int i = 0; i < G_N_ELEMENTS(durations); ++i) {
+    char name[64];
+    snprintf(name, sizeof(name), "video_trim_bench_%d.mp4", durations[i]);
+    char* in_path = g_build_filename(dir, name, NULL);
+    snprintf(name, sizeof(name), "video_trim_bench_%d_cut.mp4", durations[i]);
+    char* out_path = g_build_filename(dir, name, NULL);
+
+    if (!g_file_test(in_path, G_FILE_TEST_EXISTS) &&
+        !generate_media(in_path, durations[i])) {
+      fprintf(stderr, "failed to generate: %s\n", in_path);
+      return 1;
+    }
+
+    // Cut the middle half so that both the seek and the
+    // stop condition are exercised.
+    media_t* media = media_open(in_path, TRUE);
+    cut_stats_t stats;
+    cut_options_t options = {0};
+    options.start = media ? media->duration / 4 : 0;
+    options.end = media ? media->duration * 3 / 4 : 0;
+    options.io_buffer_size = buffer_size;
+    options.stats = &stats;
+    if (!media || !cut_video_sync(media, out_path, &options, NULL)) {
+      fprintf(stderr, "failed to cut: %s\n", in_path);
+      media_unref(media);
+      return 1;
+    }
+    media_unref(media);
+
+    char label[16];
+    snprintf(label, sizeof(label), "%ds", durations[i]);
+    double seconds = MAX(stats.seconds, 1e-6);
+    printf("%8s %10.1f %10.1f %12.0f %13.2f\n", label,
+           (double)stats.bytes_read / 1e6,
+           (double)stats.bytes_read / 1e6 / seconds,
+           (double)stats.packets / seconds,
+           stats.first_packet_seconds * 1e3);
+
+    remove(out_path);
+    if (i == G_N_ELEMENTS(durations) - 1) {
+      bench_split(dir, in_path);
+    }
+    g_free(in_path);
+    g_free(out_path);
+  }
+  return 0;
+}
+
+static void bench_split(const char* dir, const char* in_path) {
+  int cores = (int)g_get_num_processors();
+  int counts[] = {1, cores};
+  for (int i = 0; i < G_N_ELEMENTS(counts); ++i) {
+    media_t* media = media_open(in_path, TRUE);
+    if (!media) {
+      return;
+    }
+    char* out_path = g_build_filename(dir, "video_trim_bench_split.mp4", NULL);
+    split_options_t options = {0};
+    options.chunk_seconds = 10;
+    options.threads = counts[i];
+    options.io_buffer_size = buffer_size;
+    int64_t start_usec = g_get_monotonic_time();
+    int count = split_video(media, out_path, &options);
+    double seconds = (double)(g_get_monotonic_time() - start_usec) / 1e6;
+    media_unref(media);
+    printf("split into %d chunks with %d threads: %.2f s\n", count,
+           counts[i], seconds);
+
+    for (int j = 0; j < count; ++j) {
+      char name[64];
+      snprintf(name, sizeof(name), "video_trim_bench_split_%03d.mp4", j + 1);
+      char* chunk = g_build_filename(dir, name, NULL);
+      remove(chunk);
+      g_free(chunk);
+    }
+    g_free(out_path);
+  }
+}
+
+// Statistics go to stderr, so that they stay out of an
+// output written to stdout.
+static void print_stats(const char* action, const cut_stats_t* stats) {
+  double seconds = MAX(stats->seconds, 1e-6);
+  if (stats->frames) {
+    fprintf(stderr, "%s: transcoded %d frames in %.2f s (%.1f frames/s)\n",
+            action, stats->frames, stats->seconds, stats->frames / seconds);
+    return;
+  }
+  fprintf(stderr,
+          "%s: read %.1f MB, wrote %.1f MB in %.2f s (%.1f MB/s read)\n",
+          action, stats->bytes_read / 1e6, stats->bytes_written / 1e6,
+          stats->seconds, stats->bytes_read / 1e6 / seconds);
+}
+
+static gboolean parse_range(const char* str, double* start, double* end) {
+  char* dash = NULL;
+  *start = g_ascii_strtod(str, &dash);
+  if (dash == str || *dash != '-') {
+    return FALSE;
+  }
+  char* tail = NULL;
+  *end = g_ascii_strtod(dash + 1, &tail);
+  return tail != dash + 1 && !*tail && *end > *start;
+}
+
+static char* range_output_path(const char* out_path, int index, int count) {
+  if (count == 1) {
+    return g_strdup(out_path);
+  }
+  const char* dot = strrchr(out_path, '.');
+  if (!dot) {
+    return g_strdup_printf("%s_%d", out_path, index + 1);
+  }
+  return g_strdup_printf("%.*s_%d%s", (int)(dot - out_path), out_path,
+                         index + 1, dot);
+}
+
+static gboolean generate_media(const char* path, int seconds) {
+  AVFormatContext* format = NULL;
+  if (avformat_alloc_output_context2(&format, NULL, NULL, path) < 0) {
+    return FALSE;
+  }
+  AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
+  AVCodecContext* encoder = avcodec_alloc_context3(codec);
+  encoder->width = BENCH_WIDTH;
+  encoder->height = BENCH_HEIGHT;
+  encoder->pix_fmt = AV_PIX_FMT_YUV420P;
+  encoder->time_base = (AVRational){1, BENCH_FPS};
+  encoder->framerate = (AVRational){BENCH_FPS, 1};
+  encoder->gop_size = BENCH_FPS * 2;
+  encoder->bit_rate = BENCH_BITRATE;
+  if (format->oformat->flags & AVFMT_GLOBALHEADER) {
+    encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  AVStream* stream = avformat_new_stream(format, NULL);
+  AVFrame* frame = av_frame_alloc();
+  gboolean success = FALSE;
+  if (avcodec_open2(encoder, codec, NULL) < 0) {
+    goto done;
+  }
+  avcodec_parameters_from_context(stream->codecpar, encoder);
+  stream->time_base = encoder->time_base;
+  if (avio_open(&format->pb, path, AVIO_FLAG_WRITE) < 0) {
+    goto done;
+  }
+  if (avformat_write_header(format, NULL) < 0) {
+    goto done;
+  }
+
+  frame->format = encoder->pix_fmt;
+  frame->width = encoder->width;
+  frame->height = encoder->height;
+  if (av_frame_get_buffer(frame, 32) < 0) {
+    goto done;
+  }
+
+  // Moving gradients plus noise, so that the encoder can't
+  // shrink the frames below the target bitrate.
+  uint32_t seed = 1;
+  for (int i = 0; i < seconds * BENCH_FPS; ++i) {
+    av_frame_make_writable(frame);
+    for (int y = 0; y < frame->height; ++y) {
+      uint8_t* row = frame->data[0] + y * frame->linesize[0];
+      for (int x = 0; x < frame->width; ++x) {
+        seed = seed * 1664525 + 1013904223;
+        row[x] = (uint8_t)(x + y + i * 3 + (seed >> 28));
+      }
+    }
+    for (int y = 0; y < frame->height / 2; ++y) {
+      memset(frame->data[1] + y * frame->linesize[1], (i + y) & 0xff,
+             frame->width / 2);
+      memset(frame->data[2] + y * frame->linesize[2], (i * 2) & 0xff,
+             frame->width / 2);
+    }
+    frame->pts = i;
+    if (avcodec_send_frame(encoder, frame) < 0 ||
+        write_frames(encoder, format) < 0) {
+      goto done;
+    }
+  }
+  avcodec_send_frame(encoder, NULL);
+  if (write_frames(encoder, format) < 0) {
+    goto done;
+  }
+  success = av_write_trailer(format) >= 0;
+
+done:
+  av_frame_free(&frame);
+  avcodec_free_context(&encoder);
+  if (format->pb) {
+    avio_closep(&format->pb);
+  }
+  avformat_free_context(format);
+  return success;
+}
+
+static int write_frames(AVCodecContext* encoder, AVFormatContext* format) {
+  AVPacket packet;
+  av_init_packet(&packet);
+  packet.data = NULL;
+  packet.size = 0;
+  while (1) {
+    int res = avcodec_receive_packet(encoder, &packet);
+    if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) {
+      return 0;
+    } else if (res < 0) {
+      return res;
+    }
+    av_packet_rescale_ts(&packet, encoder->time_base,
+                         format->streams[0]->time_base);
+    packet.stream_index = 0;
+    res = av_interleaved_write_frame(format, &packet);
+    if (res < 0) {
+      return res;
+    }
+  }
+}
@@ -1,14 +1,50 @@
 #include <gtk/gtk.h>
 #include <libavformat/avformat.h>
+#include <math.h>
+#include "preview.h"
+#include "scene.h"
+#include "thumbnails.h"
 #include "video_info.h"
+#include "waveform.h"
+
+#define FILMSTRIP_HEIGHT 48
+#define FILMSTRIP_ASPECT (16.0 / 9.0)
+#define PREVIEW_WIDTH 480
+#define WAVEFORM_HEIGHT 48
+
+// Sliders snap to a scene change or keyframe within this
+// many pixels of the pointer.
+#define SNAP_PIXELS 6
 
 static GtkWidget* file_chooser;
 static GtkWidget* start_scale;
 static GtkWidget* end_scale;
 static GtkWidget* times_grid;
+static GtkWidget* filmstrip;
+static GtkWidget* waveform_area;
+static GtkWidget* preview_image;
+static GtkWidget* preview_label;
 static GtkWidget* trim_button;
+static GtkWidget* accurate_check;
+static GtkWidget* primary_check;
+static GtkWidget* snap_check;
 static GtkWidget* progress_bar;
 static GtkWidget* window;
+static media_t* current_media;
+static cut_stats_t cut_stats;
+static int64_t cut_start_usec;
+
+static thumbnailer_t* thumbnailer;
+static GdkPixbuf** filmstrip_thumbs;
+static int filmstrip_count;
+
+static preview_t* preview;
+
+static waveform_loader_t* waveform_loader;
+static waveform_t* waveform;
+
+static scene_detector_t* scene_detector;
+static scene_list_t* scenes;
 
 static void activate(GtkApplication* app, gpointer user_data);
 static void handle_key_event(GtkWidget* widget,
@@ -17,6 +53,26 @@ static void handle_key_event(GtkWidget* widget,
 static void handle_file_set(GtkWidget* widget, gpointer user_data);
 static void handle_trim_clicked(GtkWidget* widget, gpointer user_data);
 static void toggle_controls(gboolean enabled);
+static void refresh_filmstrip();
+static void handle_filmstrip_thumbnail(int index,
+                                       GdkPixbuf* pixbuf,
+                                       gpointer user_data);
+static void handle_filmstrip_resize(GtkWidget* widget,
+                                    GdkRectangle* allocation,
+                                    gpointer user_data);
+static gboolean draw_filmstrip(GtkWidget* widget, cairo_t* cr, gpointer data);
+static void refresh_waveform();
+static void handle_waveform(waveform_t* result, gpointer user_data);
+static gboolean draw_waveform(GtkWidget* widget, cairo_t* cr, gpointer data);
+static void refresh_scenes();
+static void handle_scenes(scene_list_t* result, gpointer user_data);
+static gboolean handle_scale_change_value(GtkRange* range,
+                                          GtkScrollType scroll,
+                                          gdouble value,
+                                          gpointer user_data);
+static double snap_time(GtkWidget* scale, double time);
+static void handle_scale_changed(GtkRange* range, gpointer user_data);
+static void handle_preview_frame(GdkPixbuf* frame, gpointer user_data);
 static gboolean cut_video_callback(gpointer progressPtr);
 
 int main(int argc, char** argv) {
@@ -41,6 +97,14 @@ static void activate(GtkApplication* app, gpointer user_data) {
   end_scale = gtk_scale_new_with_range(GTK_ORIENTATION_HORIZONTAL, 0, 1, 0.01);
   gtk_widget_set_hexpand(start_scale, TRUE);
   gtk_widget_set_hexpand(end_scale, TRUE);
+  g_signal_connect(start_scale, "value-changed",
+                   G_CALLBACK(handle_scale_changed), NULL);
+  g_signal_connect(end_scale, "value-changed",
+                   G_CALLBACK(handle_scale_changed), NULL);
+  g_signal_connect(start_scale, "change-value",
+                   G_CALLBACK(handle_scale_change_value), NULL);
+  g_signal_connect(end_scale, "change-value",
+                   G_CALLBACK(handle_scale_change_value), NULL);
 
   times_grid = gtk_grid_new();
   gtk_grid_set_row_spacing(GTK_GRID(times_grid), 10);
@@ -51,6 +115,32 @@ static void activate(GtkApplication* app, gpointer user_data) {
   gtk_grid_attach(GTK_GRID(times_grid), end_scale, 1, 1, 1, 1);
   gtk_widget_set_sensitive(times_grid, FALSE);
 
+  thumbnailer = thumbnailer_new(THUMBNAIL_THREADS, THUMBNAIL_CACHE_BYTES);
+  filmstrip = gtk_drawing_area_new();
+  gtk_widget_set_size_request(filmstrip, -1, FILMSTRIP_HEIGHT);
+  g_signal_connect(filmstrip, "draw", G_CALLBACK(draw_filmstrip), NULL);
+  g_signal_connect(filmstrip, "size-allocate",
+                   G_CALLBACK(handle_filmstrip_resize), NULL);
+
+  waveform_area = gtk_drawing_area_new();
+  gtk_widget_set_size_request(waveform_area, -1, WAVEFORM_HEIGHT);
+  g_signal_connect(waveform_area, "draw", G_CALLBACK(draw_waveform), NULL);
+
+  preview_image = gtk_image_new();
+  preview_label = gtk_label_new(NULL);
+
+  accurate_check = gtk_check_button_new_with_label(
+      "Frame accurate (re-encode boundary GOPs)");
+  gtk_widget_set_sensitive(accurate_check, FALSE);
+
+  primary_check =
+      gtk_check_button_new_with_label("Only keep main video and audio tracks");
+  gtk_widget_set_sensitive(primary_check, FALSE);
+
+  snap_check =
+      gtk_check_button_new_with_label("Snap to scene changes and keyframes");
+  gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(snap_check), TRUE);
+
   trim_button = gtk_button_new_with_label("Trim Video");
   g_signal_connect(trim_button, "clicked", G_CALLBACK(handle_trim_clicked),
                    NULL);
@@ -65,7 +155,14 @@ static void activate(GtkApplication* app, gpointer user_data) {
   gtk_widget_set_margin_end(root_container, 10);
   gtk_box_set_spacing(GTK_BOX(root_container), 10);
   gtk_container_add(GTK_CONTAINER(root_container), file_chooser);
+  gtk_container_add(GTK_CONTAINER(root_container), preview_image);
+  gtk_container_add(GTK_CONTAINER(root_container), preview_label);
   gtk_container_add(GTK_CONTAINER(root_container), times_grid);
+  gtk_container_add(GTK_CONTAINER(root_container), filmstrip);
+  gtk_container_add(GTK_CONTAINER(root_container), waveform_area);
+  gtk_container_add(GTK_CONTAINER(root_container), snap_check);
+  gtk_container_add(GTK_CONTAINER(root_container), accurate_check);
+  gtk_container_add(GTK_CONTAINER(root_container), primary_check);
   gtk_container_add(GTK_CONTAINER(root_container), trim_button);
   gtk_container_add(GTK_CONTAINER(root_container), progress_bar);
 
@@ -91,14 +188,27 @@ static void handle_key_event(GtkWidget* widget,
 }
 
 static void handle_file_set(GtkWidget* widget, gpointer user_data) {
-  double duration;
   gchar* path = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(widget));
-  if (video_duration(path, &duration)) {
+  media_unref(current_media);
+  preview_free(preview);
+  preview = NULL;
+  gtk_image_clear(GTK_IMAGE(preview_image));
+  gtk_label_set_text(GTK_LABEL(preview_label), NULL);
+  current_media = media_open(path, TRUE);
+  if (current_media) {
+    preview =
+        preview_new(current_media, PREVIEW_WIDTH, handle_preview_frame, NULL);
     toggle_controls(TRUE);
-    gtk_range_set_range(GTK_RANGE(start_scale), 0, duration);
-    gtk_range_set_range(GTK_RANGE(end_scale), 0, duration);
+    gtk_range_set_range(GTK_RANGE(start_scale), 0, current_media->duration);
+    gtk_range_set_range(GTK_RANGE(end_scale), 0, current_media->duration);
+    refresh_filmstrip();
+    refresh_waveform();
+    refresh_scenes();
   } else {
     toggle_controls(FALSE);
+    refresh_filmstrip();
+    refresh_waveform();
+    refresh_scenes();
     GtkWidget* dialog = gtk_message_dialog_new(
         GTK_WINDOW(window), 0, GTK_MESSAGE_ERROR, GTK_BUTTONS_CLOSE,
         "Failed to get video length.");
@@ -128,13 +238,28 @@ static void handle_trim_clicked(GtkWidget* widget, gpointer user_data) {
   gtk_file_chooser_set_filename(GTK_FILE_CHOOSER(dialog), outputName);
 
   if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+    // Stream indices are copied into the cut, so the
+    // selection can live on the stack.
+    int streams[2];
+    cut_options_t options = {0};
+    options.start = (double)gtk_range_get_value(GTK_RANGE(start_scale));
+    options.end = (double)gtk_range_get_value(GTK_RANGE(end_scale));
+    options.smart_render =
+        gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(accurate_check));
+    options.stats = &cut_stats;
+    cut_stats.frames = 0;
+    cut_start_usec = g_get_monotonic_time();
+    if (gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(primary_check))) {
+      options.streams = streams;
+      options.num_streams = media_primary_streams(current_media, streams);
+    }
+
     toggle_controls(FALSE);
     gtk_widget_set_sensitive(file_chooser, FALSE);
-    cut_video(gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(file_chooser)),
+    gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(progress_bar), FALSE);
+    cut_video(current_media,
               gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog)),
-              (double)gtk_range_get_value(GTK_RANGE(start_scale)),
-              (double)gtk_range_get_value(GTK_RANGE(end_scale)),
-              cut_video_callback);
+              &options, cut_video_callback);
   }
 
   gtk_widget_destroy(dialog);
@@ -143,6 +268,8 @@ static void handle_trim_clicked(GtkWidget* widget, gpointer user_data) {
 static void toggle_controls(gboolean enabled) {
   gtk_widget_set_sensitive(times_grid, enabled);
   gtk_widget_set_sensitive(trim_button, enabled);
+  gtk_widget_set_sensitive(accurate_check, enabled);
+  gtk_widget_set_sensitive(primary_check, enabled);
 }
 
 static gboolean cut_video_callback(gpointer progressPtr) {
@@ -156,10 +283,271 @@ static gboolean cut_video_callback(gpointer progressPtr) {
                                  GTK_BUTTONS_CLOSE, "Failed to trim video.");
       gtk_dialog_run(GTK_DIALOG(dialog));
       gtk_widget_destroy(dialog);
+    } else {
+      char text[128];
+      if (cut_stats.frames) {
+        snprintf(text, sizeof(text), "Transcoded in %.1f s (%.0f frames/s)",
+                 cut_stats.seconds,
+                 cut_stats.frames / MAX(cut_stats.seconds, 1e-3));
+      } else {
+        snprintf(text, sizeof(text), "Done in %.1f s (%.1f MB/s read)",
+                 cut_stats.seconds,
+                 cut_stats.bytes_read / 1e6 / MAX(cut_stats.seconds, 1e-3));
+      }
+      gtk_progress_bar_set_text(GTK_PROGRESS_BAR(progress_bar), text);
+      gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(progress_bar), TRUE);
+      if (cut_stats.keyframe_cuts) {
+        GtkWidget* dialog = gtk_message_dialog_new(
+            GTK_WINDOW(window), 0, GTK_MESSAGE_WARNING, GTK_BUTTONS_CLOSE,
+            "The video was cut on keyframes, not on exact frames: "
+            "re-encoded frames would not match the codec parameters of "
+            "the rest of the stream in this container.");
+        gtk_dialog_run(GTK_DIALOG(dialog));
+        gtk_widget_destroy(dialog);
+      }
     }
   } else {
     gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(progress_bar),
                                   (gdouble)progress);
+
+    // Transcodes count frames as they go.
+    int frames = g_atomic_int_get(&cut_stats.frames);
+    if (frames) {
+      double seconds =
+          (double)(g_get_monotonic_time() - cut_start_usec) / 1e6;
+      char text[64];
+      snprintf(text, sizeof(text), "Transcoding: %.0f frames/s",
+               frames / MAX(seconds, 1e-3));
+      gtk_progress_bar_set_text(GTK_PROGRESS_BAR(progress_bar), text);
+      gtk_progress_bar_set_show_text(GTK_PROGRESS_BAR(progress_bar), TRUE);
+    }
+  }
+  return FALSE;
+}
+
+static void refresh_filmstrip() {
+  for (int i = 0; i < filmstrip_count; ++i) {
+    if (filmstrip_thumbs[i]) {
+      g_object_unref(filmstrip_thumbs[i]);
+    }
+  }
+  g_free(filmstrip_thumbs);
+  filmstrip_thumbs = NULL;
+  filmstrip_count = 0;
+  thumbnailer_cancel(thumbnailer);
+
+  int width = gtk_widget_get_allocated_width(filmstrip);
+  if (current_media && width > 0) {
+    filmstrip_count =
+        MAX(1, (int)(width / (FILMSTRIP_HEIGHT * FILMSTRIP_ASPECT)));
+    filmstrip_thumbs = g_new0(GdkPixbuf*, filmstrip_count);
+    thumbnailer_request(thumbnailer, current_media, filmstrip_count,
+                        FILMSTRIP_HEIGHT, handle_filmstrip_thumbnail, NULL);
+  }
+  gtk_widget_queue_draw(filmstrip);
+}
+
+static void handle_filmstrip_thumbnail(int index,
+                                       GdkPixbuf* pixbuf,
+                                       gpointer user_data) {
+  if (index >= filmstrip_count) {
+    return;
+  }
+  if (filmstrip_thumbs[index]) {
+    g_object_unref(filmstrip_thumbs[index]);
+  }
+  filmstrip_thumbs[index] = g_object_ref(pixbuf);
+  gtk_widget_queue_draw(filmstrip);
+}
+
+static void handle_filmstrip_resize(GtkWidget* widget,
+                                    GdkRectangle* allocation,
+                                    gpointer user_data) {
+  static int last_width = 0;
+  if (allocation->width != last_width) {
+    last_width = allocation->width;
+    refresh_filmstrip();
+  }
+}
+
+static gboolean draw_filmstrip(GtkWidget* widget, cairo_t* cr, gpointer data) {
+  int width = gtk_widget_get_allocated_width(widget);
+  int height = gtk_widget_get_allocated_height(widget);
+  cairo_set_source_rgb(cr, 0.1, 0.1, 0.1);
+  cairo_paint(cr);
+  for (int i = 0; i < filmstrip_count; ++i) {
+    if (!filmstrip_thumbs[i]) {
+      continue;
+    }
+    double slot_x = (double)width * i / filmstrip_count;
+    double slot_width = (double)width / filmstrip_count;
+    int thumb_width = gdk_pixbuf_get_width(filmstrip_thumbs[i]);
+    int thumb_height = gdk_pixbuf_get_height(filmstrip_thumbs[i]);
+    cairo_save(cr);
+    cairo_rectangle(cr, slot_x, 0, slot_width, height);
+    cairo_clip(cr);
+    gdk_cairo_set_source_pixbuf(cr, filmstrip_thumbs[i],
+                                slot_x + (slot_width - thumb_width) / 2,
+                                (height - thumb_height) / 2);
+    cairo_paint(cr);
+    cairo_restore(cr);
+  }
+  return FALSE;
+}
+
+static void refresh_waveform() {
+  waveform_loader_cancel(waveform_loader);
+  waveform_loader = NULL;
+  waveform_free(waveform);
+  waveform = NULL;
+  if (current_media) {
+    waveform_loader = waveform_load(current_media, handle_waveform, NULL);
+  }
+  gtk_widget_queue_draw(waveform_area);
+}
+
+static void handle_waveform(waveform_t* result, gpointer user_data) {
+  waveform_loader_cancel(waveform_loader);
+  waveform_loader = NULL;
+  waveform = result;
+  gtk_widget_queue_draw(waveform_area);
+}
+
+static gboolean draw_waveform(GtkWidget* widget, cairo_t* cr, gpointer data) {
+  int width = gtk_widget_get_allocated_width(widget);
+  int height = gtk_widget_get_allocated_height(widget);
+  cairo_set_source_rgb(cr, 0.1, 0.1, 0.1);
+  cairo_paint(cr);
+  if (!waveform || !current_media || width <= 0) {
+    return FALSE;
+  }
+
+  waveform_peak_t* columns = g_new(waveform_peak_t, width);
+  waveform_columns(waveform, 0, current_media->duration, width, columns);
+  double mid = height / 2.0;
+  double scale = height / 2.0 / G_MAXINT16;
+  cairo_set_line_width(cr, 1);
+  cairo_set_source_rgb(cr, 0.3, 0.5, 0.7);
+  for (int x = 0; x < width; ++x) {
+    cairo_move_to(cr, x + 0.5, mid - columns[x].max * scale);
+    cairo_line_to(cr, x + 0.5, mid - columns[x].min * scale + 1);
   }
+  cairo_stroke(cr);
+  cairo_set_source_rgb(cr, 0.5, 0.8, 1.0);
+  for (int x = 0; x < width; ++x) {
+    cairo_move_to(cr, x + 0.5, mid - columns[x].rms * scale);
+    cairo_line_to(cr, x + 0.5, mid + columns[x].rms * scale + 1);
+  }
+  cairo_stroke(cr);
+  g_free(columns);
+
+  if (scenes) {
+    cairo_set_source_rgb(cr, 1.0, 0.8, 0.2);
+    for (int i = 0; i < scenes->count; ++i) {
+      double x = floor(width * scenes->times[i] / current_media->duration);
+      cairo_move_to(cr, x + 0.5, 0);
+      cairo_line_to(cr, x + 0.5, height);
+    }
+    cairo_stroke(cr);
+  }
+
+  // Dim everything outside of the selected range.
+  double start = gtk_range_get_value(GTK_RANGE(start_scale));
+  double end = gtk_range_get_value(GTK_RANGE(end_scale));
+  double start_x = width * start / MAX(current_media->duration, 1e-6);
+  double end_x = width * end / MAX(current_media->duration, 1e-6);
+  cairo_set_source_rgba(cr, 0, 0, 0, 0.5);
+  cairo_rectangle(cr, 0, 0, start_x, height);
+  cairo_rectangle(cr, end_x, 0, width - end_x, height);
+  cairo_fill(cr);
   return FALSE;
 }
+
+static void refresh_scenes() {
+  scene_detector_cancel(scene_detector);
+  scene_detector = NULL;
+  scene_list_free(scenes);
+  scenes = NULL;
+  gtk_widget_set_tooltip_text(waveform_area, NULL);
+  if (current_media) {
+    scene_detector = scene_detect(current_media, 0, handle_scenes, NULL);
+  }
+}
+
+static void handle_scenes(scene_list_t* result, gpointer user_data) {
+  scene_detector_cancel(scene_detector);
+  scene_detector = NULL;
+  scenes = result;
+  if (scenes && scenes->seconds > 0) {
+    gchar* text = g_strdup_printf(
+        "%d scene changes, found in %.1f s (%.1fx real time)", scenes->count,
+        scenes->seconds, scenes->analyzed / MAX(scenes->seconds, 1e-3));
+    gtk_widget_set_tooltip_text(waveform_area, text);
+    g_free(text);
+  }
+  gtk_widget_queue_draw(waveform_area);
+}
+
+static gboolean handle_scale_change_value(GtkRange* range,
+                                          GtkScrollType scroll,
+                                          gdouble value,
+                                          gpointer user_data) {
+  if (!current_media ||
+      !gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(snap_check))) {
+    return FALSE;
+  }
+  gtk_range_set_value(range, snap_time(GTK_WIDGET(range), value));
+  return TRUE;
+}
+
+static double snap_time(GtkWidget* scale, double time) {
+  int width = MAX(1, gtk_widget_get_allocated_width(scale));
+  double best = time;
+  double best_distance = SNAP_PIXELS * current_media->duration / width;
+  for (int i = 0; scenes && i < scenes->count; ++i) {
+    double distance = fabs(scenes->times[i] - time);
+    if (distance < best_distance) {
+      best = scenes->times[i];
+      best_distance = distance;
+    }
+  }
+
+  // The index belongs to the demuxer, which a running cut
+  // may be using. Skip keyframes rather than block the UI.
+  if (current_media->video_stream >= 0 && media_trylock(current_media)) {
+    AVStream* stream =
+        current_media->format->streams[current_media->video_stream];
+    double time_base = av_q2d(stream->time_base);
+    for (int i = 0; i < stream->nb_index_entries; ++i) {
+      AVIndexEntry* entry = &stream->index_entries[i];
+      double keyframe = (double)entry->timestamp * time_base;
+      if ((entry->flags & AVINDEX_KEYFRAME) &&
+          fabs(keyframe - time) < best_distance) {
+        best = keyframe;
+        best_distance = fabs(keyframe - time);
+      }
+    }
+    media_unlock(current_media);
+  }
+  return best;
+}
+
+static void handle_scale_changed(GtkRange* range, gpointer user_data) {
+  gtk_widget_queue_draw(waveform_area);
+  if (preview) {
+    preview_seek(preview, gtk_range_get_value(range));
+  }
+}
+
+static void handle_preview_frame(GdkPixbuf* frame, gpointer user_data) {
+  gtk_image_set_from_pixbuf(GTK_IMAGE(preview_image), frame);
+
+  preview_stats_t stats;
+  preview_get_stats(preview, &stats);
+  char text[128];
+  snprintf(text, sizeof(text),
+           "Cache hits: %.0f%%   Seek latency: %.1f ms (mean %.1f ms)",
+           100.0 * stats.cache_hits / MAX(1, stats.requests),
+           stats.last_latency_ms, stats.mean_latency_ms);
+  gtk_label_set_text(GTK_LABEL(preview_label), text);
+}
@@ -0,0 +1,52 @@
+#include "media_cache.h"
+#include <glib/gstdio.h>
+
+char* media_cache_path(const char* media_path, const char* kind) {
+  GStatBuf info;
+  if (g_stat(media_path, &info) < 0) {
+    return NULL;
+  }
+  char* key = g_strdup_printf("%s:%lld:%lld", media_path,
+                              (long long)info.st_size,
+                              (long long)info.st_mtime);
+  char* digest = g_compute_checksum_for_string(G_CHECKSUM_SHA1, key, -1);
+  char* name = g_strdup_printf("%s.%s", digest, kind);
+  char* path =
+      g_build_filename(g_get_user_cache_dir(), "video_trim", name, NULL);
+  g_free(name);
+  g_free(digest);
+  g_free(key);
+  return path;
+}
+
+gboolean media_cache_load(const char* media_path,
+                          const char* kind,
+                          gchar** data,
+                          gsize* size) {
+  char* path = media_cache_path(media_path, kind);
+  if (!path) {
+    return FALSE;
+  }
+  gboolean res = g_file_get_contents(path, data, size, NULL);
+  g_free(path);
+  return res;
+}
+
+gboolean media_cache_store(const char* media_path,
+                           const char* kind,
+                           const gchar* data,
+                           gsize size) {
+  char* path = media_cache_path(media_path, kind);
+  if (!path) {
+    return FALSE;
+  }
+
+  // g_file_set_contents() writes to a temporary file and
+  // renames it, so readers never see a partial entry.
+  char* dir = g_path_get_dirname(path);
+  gboolean res = g_mkdir_with_parents(dir, 0755) == 0 &&
+                 g_file_set_contents(path, data, size, NULL);
+  g_free(dir);
+  g_free(path);
+  return res;
+}
@@ -0,0 +1,20 @@
+#ifndef __MEDIA_CACHE_H__
+#define __MEDIA_CACHE_H__
+
+#include <glib.h>
+
+// Data derived from a media file, such as its waveform, is
+// cached on disk under the user's cache directory. Entries
+// are keyed by the file's path, size and modification time,
+// so replacing the file invalidates them.
+char* media_cache_path(const char* media_path, const char* kind);
+gboolean media_cache_load(const char* media_path,
+                          const char* kind,
+                          gchar** data,
+                          gsize* size);
+gboolean media_cache_store(const char* media_path,
+                           const char* kind,
+                           const gchar* data,
+                           gsize size);
+
+#endif
@@ -0,0 +1,281 @@
+#include "media_io.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static int reader_read(void* opaque, uint8_t* buf, int size);
+static int64_t reader_seek(void* opaque, int64_t offset, int whence);
+static int writer_write(void* opaque, uint8_t* buf, int size);
+static int64_t writer_seek(void* opaque, int64_t offset, int whence);
+static void* writer_thread(void* arg);
+
+media_reader_t* media_reader_open(const char* path, int buffer_size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  media_reader_t* r = g_new0(media_reader_t, 1);
+  r->fd = fd;
+  r->size = S_ISREG(info.st_mode) ? (int64_t)info.st_size : -1;
+  if (r->size > 0) {
+    void* map = mmap(NULL, (size_t)r->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      r->map = (uint8_t*)map;
+      madvise(map, (size_t)r->size, MADV_SEQUENTIAL);
+    }
+  }
+  if (!r->map) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+
+  uint8_t* buffer = (uint8_t*)av_malloc(buffer_size);
+  r->avio = avio_alloc_context(buffer, buffer_size, 0, r, reader_read, NULL,
+                               r->size >= 0 ? reader_seek : NULL);
+  return r;
+}
+
+void media_reader_close(media_reader_t* r) {
+  if (!r) {
+    return;
+  }
+  av_freep(&r->avio->buffer);
+  avio_context_free(&r->avio);
+  if (r->map) {
+    munmap(r->map, (size_t)r->size);
+  }
+  close(r->fd);
+  g_free(r);
+}
+
+media_writer_t* media_writer_open(const char* path, int buffer_size) {
+  int fd = strcmp(path, "-") ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                             : dup(STDOUT_FILENO);
+  if (fd < 0) {
+    return NULL;
+  }
+  return media_writer_open_fd(fd, buffer_size);
+}
+
+media_writer_t* media_writer_open_fd(int fd, int buffer_size) {
+  struct stat info;
+  if (fstat(fd, &info) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  media_writer_t* w = g_new0(media_writer_t, 1);
+  w->fd = fd;
+  w->streaming = !S_ISREG(info.st_mode);
+  if (!w->streaming) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  pthread_create(&w->thread, NULL, writer_thread, w);
+
+  uint8_t* buffer = (uint8_t*)av_malloc(buffer_size);
+  w->avio = avio_alloc_context(buffer, buffer_size, 1, w, NULL, writer_write,
+                               w->streaming ? NULL : writer_seek);
+  return w;
+}
+
+void media_writer_attach(media_writer_t* w,
+                         AVFormatContext* out_ctx,
+                         AVDictionary** options) {
+  out_ctx->pb = w->avio;
+  if (!w->streaming) {
+    return;
+  }
+  out_ctx->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+
+  // A regular MP4 has to seek back to write its index, so
+  // stream one self-contained fragment per keyframe.
+  const char* name = out_ctx->oformat->name;
+  if (strstr(name, "mp4") || strstr(name, "mov") || strstr(name, "ismv")) {
+    av_dict_set(options, "movflags",
+                "frag_keyframe+empty_moov+default_base_moof", 0);
+  }
+}
+
+int media_writer_close(media_writer_t* w) {
+  avio_flush(w->avio);
+
+  pthread_mutex_lock(&w->lock);
+  w->closing = TRUE;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+
+  int error = w->error;
+  if (close(w->fd) < 0 && !error) {
+    error = AVERROR(errno);
+  }
+  for (int i = 0; i < MEDIA_IO_WRITE_QUEUE; ++i) {
+    g_free(w->queue[i].data);
+  }
+  av_freep(&w->avio->buffer);
+  avio_context_free(&w->avio);
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+  g_free(w);
+  return error;
+}
+
+static int reader_read(void* opaque, uint8_t* buf, int size) {
+  media_reader_t* r = (media_reader_t*)opaque;
+  if (r->map) {
+    int64_t remaining = r->size - r->pos;
+    if (remaining <= 0) {
+      return AVERROR_EOF;
+    }
+    size = (int)MIN((int64_t)size, remaining);
+    memcpy(buf, r->map + r->pos, size);
+  } else {
+    ssize_t count = read(r->fd, buf, size);
+    if (count < 0) {
+      return AVERROR(errno);
+    } else if (count == 0) {
+      return AVERROR_EOF;
+    }
+    size = (int)count;
+  }
+  r->pos += size;
+  r->bytes_read += size;
+  return size;
+}
+
+static int64_t reader_seek(void* opaque, int64_t offset, int whence) {
+  media_reader_t* r = (media_reader_t*)opaque;
+  int64_t pos;
+  switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+      return r->size;
+    case SEEK_SET:
+      pos = offset;
+      break;
+    case SEEK_CUR:
+      pos = r->pos + offset;
+      break;
+    case SEEK_END:
+      pos = r->size + offset;
+      break;
+    default:
+      return AVERROR(EINVAL);
+  }
+  if (pos < 0) {
+    return AVERROR(EINVAL);
+  }
+  if (!r->map && lseek(r->fd, pos, SEEK_SET) < 0) {
+    return AVERROR(errno);
+  }
+  r->pos = pos;
+  return pos;
+}
+
+static int writer_write(void* opaque, uint8_t* buf, int size) {
+  media_writer_t* w = (media_writer_t*)opaque;
+  pthread_mutex_lock(&w->lock);
+  while (w->queue_len == MEDIA_IO_WRITE_QUEUE && !w->error) {
+    pthread_cond_wait(&w->cond, &w->lock);
+  }
+  if (w->error) {
+    pthread_mutex_unlock(&w->lock);
+    return w->error;
+  }
+  media_block_t* block =
+      &w->queue[(w->queue_start + w->queue_len) % MEDIA_IO_WRITE_QUEUE];
+  if (block->capacity < size) {
+    block->data = g_realloc(block->data, size);
+    block->capacity = size;
+  }
+  memcpy(block->data, buf, size);
+  block->size = size;
+  block->offset = w->pos;
+  w->queue_len++;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+
+  w->pos += size;
+  w->size = MAX(w->size, w->pos);
+  w->bytes_written += size;
+  return size;
+}
+
+static int64_t writer_seek(void* opaque, int64_t offset, int whence) {
+  media_writer_t* w = (media_writer_t*)opaque;
+  int64_t pos;
+  switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+      return w->size;
+    case SEEK_SET:
+      pos = offset;
+      break;
+    case SEEK_CUR:
+      pos = w->pos + offset;
+      break;
+    case SEEK_END:
+      pos = w->size + offset;
+      break;
+    default:
+      return AVERROR(EINVAL);
+  }
+  if (pos < 0) {
+    return AVERROR(EINVAL);
+  }
+
+  // Blocks carry their own offsets, so a seek never has to
+  // wait for the queue to drain.
+  w->pos = pos;
+  return pos;
+}
+
+static void* writer_thread(void* arg) {
+  media_writer_t* w = (media_writer_t*)arg;
+  pthread_mutex_lock(&w->lock);
+  while (1) {
+    while (!w->queue_len && !w->closing) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (!w->queue_len) {
+      break;
+    }
+    media_block_t* block = &w->queue[w->queue_start];
+    pthread_mutex_unlock(&w->lock);
+
+    int error = 0;
+    for (int done = 0; done < block->size;) {
+      ssize_t count =
+          w->streaming
+              ? write(w->fd, block->data + done, block->size - done)
+              : pwrite(w->fd, block->data + done, block->size - done,
+                       block->offset + done);
+      if (count < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        error = AVERROR(errno);
+        break;
+      }
+      done += (int)count;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (error && !w->error) {
+      w->error = error;
+    }
+    w->queue_start = (w->queue_start + 1) % MEDIA_IO_WRITE_QUEUE;
+    w->queue_len--;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return NULL;
+}
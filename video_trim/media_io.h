@@ -0,0 +1,73 @@
+#ifndef __MEDIA_IO_H__
+#define __MEDIA_IO_H__
+
+#include <glib.h>
+#include <libavformat/avformat.h>
+#include <pthread.h>
+
+#define MEDIA_IO_READ_BUFFER (256 * 1024)
+#define MEDIA_IO_WRITE_BUFFER (4 * 1024 * 1024)
+#define MEDIA_IO_WRITE_QUEUE 8
+
+// Reads a file through an mmap when possible, or through
+// large sequential read() calls otherwise.
+typedef struct {
+  AVIOContext* avio;
+  int fd;
+  uint8_t* map;
+  int64_t size;
+  int64_t pos;
+  int64_t bytes_read;
+} media_reader_t;
+
+typedef struct {
+  uint8_t* data;
+  int size;
+  int capacity;
+  int64_t offset;
+} media_block_t;
+
+// Writes a file from a background thread, so that the
+// muxer never blocks on the disk unless the queue of
+// pending blocks is full.
+//
+// Pipes, sockets and other outputs that are not regular
+// files are written strictly in order, and the AVIOContext
+// is not seekable.
+typedef struct {
+  AVIOContext* avio;
+  int fd;
+  gboolean streaming;
+  int64_t pos;
+  int64_t size;
+  int64_t bytes_written;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  media_block_t queue[MEDIA_IO_WRITE_QUEUE];
+  int queue_start;
+  int queue_len;
+  gboolean closing;
+  int error;
+} media_writer_t;
+
+media_reader_t* media_reader_open(const char* path, int buffer_size);
+void media_reader_close(media_reader_t* r);
+
+// A path of "-" writes to stdout.
+media_writer_t* media_writer_open(const char* path, int buffer_size);
+
+// Takes ownership of fd, e.g. one end of a socket pair.
+media_writer_t* media_writer_open_fd(int fd, int buffer_size);
+
+// Set up a muxer to write through w. Streaming outputs get
+// fragmented MP4, if applicable, and are flushed after
+// every packet so that readers see data as soon as
+// possible. Extra muxer options are added to options.
+void media_writer_attach(media_writer_t* w,
+                         AVFormatContext* out_ctx,
+                         AVDictionary** options);
+int media_writer_close(media_writer_t* w);
+
+#endif
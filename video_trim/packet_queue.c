@@ -0,0 +1,82 @@
+#include "packet_queue.h"
+
+packet_queue_t* packet_queue_new(int capacity) {
+  packet_queue_t* q = g_new0(packet_queue_t, 1);
+  q->packets = g_new0(AVPacket, capacity);
+  q->capacity = capacity;
+  for (int i = 0; i < capacity; ++i) {
+    av_init_packet(&q->packets[i]);
+  }
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->not_empty, NULL);
+  pthread_cond_init(&q->not_full, NULL);
+  return q;
+}
+
+// Blocks while the queue is full. Returns FALSE once the
+// consumer has aborted, in which case the producer should
+// stop reading.
+gboolean packet_queue_push(packet_queue_t* q, AVPacket* packet) {
+  pthread_mutex_lock(&q->lock);
+  while (q->len == q->capacity && !q->aborted) {
+    pthread_cond_wait(&q->not_full, &q->lock);
+  }
+  if (q->aborted) {
+    pthread_mutex_unlock(&q->lock);
+    return FALSE;
+  }
+  AVPacket* slot = &q->packets[(q->start + q->len) % q->capacity];
+  if (av_packet_ref(slot, packet) < 0) {
+    pthread_mutex_unlock(&q->lock);
+    return FALSE;
+  }
+  q->len++;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+  return TRUE;
+}
+
+// Blocks while the queue is empty. Returns FALSE when the
+// producer has finished and every packet has been taken.
+gboolean packet_queue_pop(packet_queue_t* q, AVPacket* packet) {
+  pthread_mutex_lock(&q->lock);
+  while (q->len == 0 && !q->finished && !q->aborted) {
+    pthread_cond_wait(&q->not_empty, &q->lock);
+  }
+  if (q->len == 0 || q->aborted) {
+    pthread_mutex_unlock(&q->lock);
+    return FALSE;
+  }
+  av_packet_move_ref(packet, &q->packets[q->start]);
+  q->start = (q->start + 1) % q->capacity;
+  q->len--;
+  pthread_cond_signal(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+  return TRUE;
+}
+
+void packet_queue_finish(packet_queue_t* q) {
+  pthread_mutex_lock(&q->lock);
+  q->finished = TRUE;
+  pthread_cond_signal(&q->not_empty);
+  pthread_mutex_unlock(&q->lock);
+}
+
+void packet_queue_abort(packet_queue_t* q) {
+  pthread_mutex_lock(&q->lock);
+  q->aborted = TRUE;
+  pthread_cond_signal(&q->not_empty);
+  pthread_cond_signal(&q->not_full);
+  pthread_mutex_unlock(&q->lock);
+}
+
+void packet_queue_free(packet_queue_t* q) {
+  for (int i = 0; i < q->len; ++i) {
+    av_packet_unref(&q->packets[(q->start + i) % q->capacity]);
+  }
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->not_empty);
+  pthread_cond_destroy(&q->not_full);
+  g_free(q->packets);
+  g_free(q);
+}
@@ -0,0 +1,31 @@
+#ifndef __PACKET_QUEUE_H__
+#define __PACKET_QUEUE_H__
+
+#include <glib.h>
+#include <libavformat/avformat.h>
+#include <pthread.h>
+
+// A bounded queue of packets between one producer and one
+// consumer thread. Packets are passed by reference, so the
+// payload of a refcounted packet is never copied.
+typedef struct {
+  AVPacket* packets;
+  int capacity;
+  int start;
+  int len;
+  gboolean finished;
+  gboolean aborted;
+
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} packet_queue_t;
+
+packet_queue_t* packet_queue_new(int capacity);
+gboolean packet_queue_push(packet_queue_t* q, AVPacket* packet);
+gboolean packet_queue_pop(packet_queue_t* q, AVPacket* packet);
+void packet_queue_finish(packet_queue_t* q);
+void packet_queue_abort(packet_queue_t* q);
+void packet_queue_free(packet_queue_t* q);
+
+#endif
@@ -0,0 +1,443 @@
+#include "preview.h"
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+
+typedef struct {
+  double start;
+  double end;
+  GdkPixbuf* pixbuf;
+  int64_t last_used;
+} cached_frame_t;
+
+struct preview {
+  char* path;
+  int width;
+  preview_cb cb;
+  gpointer user_data;
+
+  // Only touched by the decoder thread.
+  media_t* media;
+  AVCodecContext* decoder;
+  AVFrame* frame;
+  struct SwsContext* sws;
+  double position;
+  double position_end;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  gboolean quit;
+  gboolean has_request;
+  double request_time;
+  int64_t request_usec;
+  gboolean has_ahead;
+  double ahead_time;
+  double last_time;
+  int direction;
+
+  cached_frame_t cache[PREVIEW_CACHE_FRAMES];
+  int64_t use_clock;
+  preview_stats_t stats;
+  int latency_samples;
+
+  // Deliveries still queued on the main loop. The preview
+  // is only destroyed once all of these have run.
+  int pending;
+  gboolean closed;
+};
+
+typedef struct {
+  preview_t* p;
+  GdkPixbuf* pixbuf;
+} preview_delivery_t;
+
+static void* preview_thread(void* arg);
+static gboolean open_decoder(preview_t* p);
+static gboolean request_pending(preview_t* p);
+static gboolean seek_to(preview_t* p, double time);
+static GdkPixbuf* decode_next(preview_t* p);
+static GdkPixbuf* decode_at(preview_t* p, double time);
+static void decode_ahead(preview_t* p, double time, int direction);
+static void deliver(preview_t* p, GdkPixbuf* pixbuf);
+static gboolean deliver_frame(gpointer data);
+static void free_delivery(gpointer data);
+static void destroy_preview(preview_t* p);
+static cached_frame_t* cache_find(preview_t* p, double time);
+static void cache_insert(preview_t* p,
+                         double start,
+                         double end,
+                         GdkPixbuf* pixbuf);
+
+preview_t* preview_new(media_t* media,
+                       int width,
+                       preview_cb cb,
+                       gpointer user_data) {
+  preview_t* p = g_new0(preview_t, 1);
+  p->path = g_strdup(media->path);
+  p->width = width;
+  p->cb = cb;
+  p->user_data = user_data;
+  p->position = -1;
+  p->direction = 1;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  pthread_create(&p->thread, NULL, preview_thread, p);
+  return p;
+}
+
+void preview_seek(preview_t* p, double time) {
+  GdkPixbuf* pixbuf = NULL;
+
+  pthread_mutex_lock(&p->lock);
+  p->direction = time >= p->last_time ? 1 : -1;
+  p->last_time = time;
+  p->stats.requests++;
+  cached_frame_t* cached = cache_find(p, time);
+  if (cached) {
+    pixbuf = g_object_ref(cached->pixbuf);
+    p->stats.cache_hits++;
+    p->has_request = FALSE;
+    p->has_ahead = TRUE;
+    p->ahead_time = time;
+  } else {
+    // Only the latest request matters, so a burst of slider
+    // motion collapses into a single seek.
+    p->has_request = TRUE;
+    p->request_time = time;
+    p->request_usec = g_get_monotonic_time();
+  }
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+
+  if (pixbuf) {
+    p->cb(pixbuf, p->user_data);
+    g_object_unref(pixbuf);
+  }
+}
+
+void preview_get_stats(preview_t* p, preview_stats_t* stats) {
+  pthread_mutex_lock(&p->lock);
+  *stats = p->stats;
+  pthread_mutex_unlock(&p->lock);
+}
+
+void preview_free(preview_t* p) {
+  if (!p) {
+    return;
+  }
+  pthread_mutex_lock(&p->lock);
+  p->quit = TRUE;
+  pthread_cond_signal(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  pthread_join(p->thread, NULL);
+
+  p->closed = TRUE;
+  if (!g_atomic_int_get(&p->pending)) {
+    destroy_preview(p);
+  }
+}
+
+static void* preview_thread(void* arg) {
+  preview_t* p = (preview_t*)arg;
+  open_decoder(p);
+
+  pthread_mutex_lock(&p->lock);
+  while (!p->quit) {
+    if (p->has_request) {
+      double time = p->request_time;
+      int64_t request_usec = p->request_usec;
+      p->has_request = FALSE;
+      pthread_mutex_unlock(&p->lock);
+      GdkPixbuf* pixbuf = decode_at(p, time);
+      pthread_mutex_lock(&p->lock);
+      if (pixbuf) {
+        double latency = (double)(g_get_monotonic_time() - request_usec) / 1e3;
+        p->latency_samples++;
+        p->stats.last_latency_ms = latency;
+        p->stats.mean_latency_ms +=
+            (latency - p->stats.mean_latency_ms) / p->latency_samples;
+        deliver(p, pixbuf);
+        p->has_ahead = TRUE;
+        p->ahead_time = time;
+      }
+    } else if (p->has_ahead) {
+      double time = p->ahead_time;
+      int direction = p->direction;
+      p->has_ahead = FALSE;
+      pthread_mutex_unlock(&p->lock);
+      decode_ahead(p, time, direction);
+      pthread_mutex_lock(&p->lock);
+    } else {
+      pthread_cond_wait(&p->cond, &p->lock);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  avcodec_free_context(&p->decoder);
+  av_frame_free(&p->frame);
+  sws_freeContext(p->sws);
+  media_unref(p->media);
+  return NULL;
+}
+
+static gboolean open_decoder(preview_t* p) {
+  p->media = media_open(p->path, TRUE);
+  if (!p->media || p->media->video_stream < 0) {
+    return FALSE;
+  }
+  AVFormatContext* format = p->media->format;
+  for (int i = 0; i < format->nb_streams; ++i) {
+    if (i != p->media->video_stream) {
+      format->streams[i]->discard = AVDISCARD_ALL;
+    }
+  }
+
+  AVCodecParameters* par = format->streams[p->media->video_stream]->codecpar;
+  AVCodec* codec = avcodec_find_decoder(par->codec_id);
+  if (!codec) {
+    return FALSE;
+  }
+  p->decoder = avcodec_alloc_context3(codec);
+  avcodec_parameters_to_context(p->decoder, par);
+
+  // Frame threading delays every frame by a frame per
+  // thread, which is exactly what scrubbing can't afford.
+  p->decoder->thread_type = FF_THREAD_SLICE;
+  p->decoder->thread_count = 0;
+  if (avcodec_open2(p->decoder, codec, NULL) < 0) {
+    avcodec_free_context(&p->decoder);
+    return FALSE;
+  }
+  p->frame = av_frame_alloc();
+  return TRUE;
+}
+
+static gboolean request_pending(preview_t* p) {
+  pthread_mutex_lock(&p->lock);
+  gboolean pending = p->has_request || p->quit;
+  pthread_mutex_unlock(&p->lock);
+  return pending;
+}
+
+static gboolean seek_to(preview_t* p, double time) {
+  int stream_index = p->media->video_stream;
+  AVStream* stream = p->media->format->streams[stream_index];
+  int64_t ts = (int64_t)(time / av_q2d(stream->time_base));
+  if (av_seek_frame(p->media->format, stream_index, ts,
+                    AVSEEK_FLAG_BACKWARD) < 0) {
+    return FALSE;
+  }
+  avcodec_flush_buffers(p->decoder);
+  p->position = -1;
+  return TRUE;
+}
+
+static GdkPixbuf* decode_next(preview_t* p) {
+  AVFormatContext* format = p->media->format;
+  int stream_index = p->media->video_stream;
+  AVStream* stream = format->streams[stream_index];
+
+  while (1) {
+    int res = avcodec_receive_frame(p->decoder, p->frame);
+    if (res >= 0) {
+      break;
+    } else if (res != AVERROR(EAGAIN)) {
+      return NULL;
+    }
+    AVPacket packet;
+    av_init_packet(&packet);
+    if (av_read_frame(format, &packet) < 0) {
+      avcodec_send_packet(p->decoder, NULL);
+      continue;
+    }
+    if (packet.stream_index == stream_index) {
+      avcodec_send_packet(p->decoder, &packet);
+    }
+    av_packet_unref(&packet);
+  }
+
+  AVFrame* frame = p->frame;
+  double time_base = av_q2d(stream->time_base);
+  double start = (double)frame->best_effort_timestamp * time_base;
+  double duration = (double)frame->pkt_duration * time_base;
+  if (duration <= 0) {
+    double rate = av_q2d(stream->avg_frame_rate);
+    duration = rate > 0 ? 1.0 / rate : 1.0 / 25.0;
+  }
+
+  int height = MAX(2, (p->width * frame->height / MAX(1, frame->width)) & ~1);
+  p->sws = sws_getCachedContext(
+      p->sws, frame->width, frame->height, (enum AVPixelFormat)frame->format,
+      p->width, height, AV_PIX_FMT_RGB24, SWS_BILINEAR, NULL, NULL, NULL);
+  GdkPixbuf* pixbuf = NULL;
+  if (p->sws) {
+    pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, p->width, height);
+    uint8_t* dst_data[4] = {gdk_pixbuf_get_pixels(pixbuf), NULL, NULL, NULL};
+    int dst_linesize[4] = {gdk_pixbuf_get_rowstride(pixbuf), 0, 0, 0};
+    sws_scale(p->sws, (const uint8_t* const*)frame->data, frame->linesize, 0,
+              frame->height, dst_data, dst_linesize);
+  }
+  av_frame_unref(frame);
+  if (!pixbuf) {
+    return NULL;
+  }
+
+  p->position = start;
+  p->position_end = start + duration;
+  pthread_mutex_lock(&p->lock);
+  p->stats.decoded_frames++;
+  cache_insert(p, start, start + duration, pixbuf);
+  pthread_mutex_unlock(&p->lock);
+  return pixbuf;
+}
+
+static GdkPixbuf* decode_at(preview_t* p, double time) {
+  if (!p->decoder) {
+    return NULL;
+  }
+  if (p->position < 0 || time < p->position ||
+      time > p->position + PREVIEW_SKIP_SECONDS) {
+    if (!seek_to(p, time)) {
+      return NULL;
+    }
+  }
+
+  GdkPixbuf* last = NULL;
+  while (1) {
+    GdkPixbuf* pixbuf = decode_next(p);
+    if (!pixbuf) {
+      // Past the last frame, show the last frame.
+      return last;
+    }
+    if (last) {
+      g_object_unref(last);
+    }
+    last = pixbuf;
+    if (p->position_end > time) {
+      return last;
+    }
+    if (request_pending(p)) {
+      g_object_unref(last);
+      return NULL;
+    }
+  }
+}
+
+static void decode_ahead(preview_t* p, double time, int direction) {
+  if (!p->decoder) {
+    return;
+  }
+  if (direction > 0) {
+    double window_end = time + PREVIEW_AHEAD_SECONDS;
+    if (p->position > window_end) {
+      return;
+    }
+    // When an earlier read-ahead already got past the slider,
+    // carry on from there; decode_at would seek back to the
+    // keyframe and decode the cached frames again.
+    GdkPixbuf* pixbuf = p->position >= 0 && p->position >= time
+                            ? decode_next(p)
+                            : decode_at(p, time);
+    for (int i = 0;
+         pixbuf && i < PREVIEW_AHEAD_FRAMES && p->position <= window_end;
+         ++i) {
+      g_object_unref(pixbuf);
+      pixbuf = request_pending(p) ? NULL : decode_next(p);
+    }
+    if (pixbuf) {
+      g_object_unref(pixbuf);
+    }
+    return;
+  }
+
+  // Decoding can only run forwards, so cover the window
+  // behind the slider by decoding up to it from a keyframe.
+  double target = MAX(0, time - PREVIEW_BEHIND_SECONDS);
+  pthread_mutex_lock(&p->lock);
+  gboolean cached = cache_find(p, target) != NULL;
+  pthread_mutex_unlock(&p->lock);
+  if (cached) {
+    return;
+  }
+  GdkPixbuf* pixbuf = decode_at(p, target);
+  while (pixbuf && p->position < time) {
+    g_object_unref(pixbuf);
+    pixbuf = request_pending(p) ? NULL : decode_next(p);
+  }
+  if (pixbuf) {
+    g_object_unref(pixbuf);
+  }
+}
+
+static void deliver(preview_t* p, GdkPixbuf* pixbuf) {
+  preview_delivery_t* delivery = g_new(preview_delivery_t, 1);
+  delivery->p = p;
+  delivery->pixbuf = pixbuf;
+  g_atomic_int_inc(&p->pending);
+  g_main_context_invoke_full(NULL, 0, deliver_frame, delivery, free_delivery);
+}
+
+static gboolean deliver_frame(gpointer data) {
+  preview_delivery_t* delivery = (preview_delivery_t*)data;
+  if (!delivery->p->closed) {
+    delivery->p->cb(delivery->pixbuf, delivery->p->user_data);
+  }
+  return FALSE;
+}
+
+static void free_delivery(gpointer data) {
+  preview_delivery_t* delivery = (preview_delivery_t*)data;
+  preview_t* p = delivery->p;
+  g_object_unref(delivery->pixbuf);
+  g_free(delivery);
+  if (g_atomic_int_dec_and_test(&p->pending) && p->closed) {
+    destroy_preview(p);
+  }
+}
+
+static void destroy_preview(preview_t* p) {
+  for (int i = 0; i < PREVIEW_CACHE_FRAMES; ++i) {
+    if (p->cache[i].pixbuf) {
+      g_object_unref(p->cache[i].pixbuf);
+    }
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->cond);
+  g_free(p->path);
+  g_free(p);
+}
+
+static cached_frame_t* cache_find(preview_t* p, double time) {
+  for (int i = 0; i < PREVIEW_CACHE_FRAMES; ++i) {
+    cached_frame_t* frame = &p->cache[i];
+    if (frame->pixbuf && frame->start <= time && time < frame->end) {
+      frame->last_used = ++p->use_clock;
+      return frame;
+    }
+  }
+  return NULL;
+}
+
+static void cache_insert(preview_t* p,
+                         double start,
+                         double end,
+                         GdkPixbuf* pixbuf) {
+  cached_frame_t* slot = &p->cache[0];
+  for (int i = 0; i < PREVIEW_CACHE_FRAMES; ++i) {
+    cached_frame_t* frame = &p->cache[i];
+    if (frame->pixbuf && frame->start == start) {
+      return;
+    }
+    if (!frame->pixbuf ||
+        (slot->pixbuf && frame->last_used < slot->last_used)) {
+      slot = frame;
+    }
+  }
+  if (slot->pixbuf) {
+    g_object_unref(slot->pixbuf);
+  }
+  slot->start = start;
+  slot->end = end;
+  slot->pixbuf = g_object_ref(pixbuf);
+  slot->last_used = ++p->use_clock;
+}
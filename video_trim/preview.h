@@ -0,0 +1,41 @@
+#ifndef __PREVIEW_H__
+#define __PREVIEW_H__
+
+#include <gtk/gtk.h>
+#include "video_info.h"
+
+#define PREVIEW_CACHE_FRAMES 64
+#define PREVIEW_AHEAD_FRAMES 24
+#define PREVIEW_AHEAD_SECONDS 1.0
+#define PREVIEW_BEHIND_SECONDS 1.0
+
+// If a seek lands this far past the decoder's position,
+// decoding forward is cheaper than seeking.
+#define PREVIEW_SKIP_SECONDS 2.0
+
+// Called on the main thread with the frame to display.
+typedef void (*preview_cb)(GdkPixbuf* frame, gpointer user_data);
+
+typedef struct {
+  int requests;
+  int cache_hits;
+  int decoded_frames;
+  double last_latency_ms;
+  double mean_latency_ms;
+} preview_stats_t;
+
+// A preview decodes frames for scrubbing on a background
+// thread with its own copy of the media. Recently decoded
+// frames are cached, and while idle the thread decodes
+// ahead in whichever direction the user is scrubbing.
+typedef struct preview preview_t;
+
+preview_t* preview_new(media_t* media,
+                       int width,
+                       preview_cb cb,
+                       gpointer user_data);
+void preview_seek(preview_t* p, double time);
+void preview_get_stats(preview_t* p, preview_stats_t* stats);
+void preview_free(preview_t* p);
+
+#endif
@@ -0,0 +1,393 @@
+#include "scene.h"
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#include <stdlib.h>
+#include <string.h>
+#include "media_cache.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define SCENE_CACHE_KIND "scenes"
+#define SCENE_CACHE_MAGIC 0x53435456
+#define SCENE_CACHE_VERSION 1
+
+// Segments start decoding this long before their range,
+// so that their first frame has one to compare against.
+#define SCENE_PREROLL_SECONDS 1.0
+
+#define SCENE_PIXELS (SCENE_WIDTH * SCENE_HEIGHT)
+
+struct scene_detector {
+  char* path;
+  double duration;
+  int threads;
+  scene_cb cb;
+  gpointer user_data;
+  scene_list_t* result;
+  int cancelled;
+  int ref_count;
+};
+
+typedef struct {
+  scene_detector_t* d;
+  double start;
+  double end;
+  double analyzed;
+  gboolean complete;
+  GArray* times;
+  pthread_t thread;
+} scene_segment_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  int32_t count;
+} cache_header_t;
+
+static void* detector_thread(void* arg);
+static scene_list_t* detect_scenes(scene_detector_t* d, gboolean* complete);
+static void* segment_thread(void* arg);
+static AVCodecContext* open_decoder(AVStream* stream);
+static void luma_histogram(const uint8_t* luma, int32_t* histogram);
+static double mean_difference(const uint8_t* a, const uint8_t* b);
+static double histogram_distance(const int32_t* a, const int32_t* b);
+static gboolean deliver_scenes(gpointer data);
+static void unref_detector(gpointer data);
+static scene_list_t* load_cached(const char* path);
+static void store_cached(const char* path, const scene_list_t* scenes);
+
+scene_detector_t* scene_detect(media_t* media,
+                               int threads,
+                               scene_cb cb,
+                               gpointer user_data) {
+  scene_detector_t* d = g_new0(scene_detector_t, 1);
+  d->path = g_strdup(media->path);
+  d->duration = media->duration;
+  d->threads = threads > 0 ? threads : (int)g_get_num_processors();
+  d->cb = cb;
+  d->user_data = user_data;
+
+  // One reference for the caller and one for the thread.
+  d->ref_count = 2;
+  pthread_t thread;
+  pthread_create(&thread, NULL, detector_thread, d);
+  pthread_detach(thread);
+  return d;
+}
+
+void scene_detector_cancel(scene_detector_t* d) {
+  if (!d) {
+    return;
+  }
+  g_atomic_int_set(&d->cancelled, TRUE);
+  unref_detector(d);
+}
+
+void scene_list_free(scene_list_t* scenes) {
+  if (!scenes) {
+    return;
+  }
+  g_free(scenes->times);
+  g_free(scenes);
+}
+
+static void* detector_thread(void* arg) {
+  scene_detector_t* d = (scene_detector_t*)arg;
+  scene_list_t* scenes = load_cached(d->path);
+  if (!scenes) {
+    // A list missing the scenes of a segment that failed is
+    // still shown, but not cached.
+    gboolean complete;
+    scenes = detect_scenes(d, &complete);
+    if (scenes && complete) {
+      store_cached(d->path, scenes);
+    }
+  }
+  d->result = scenes;
+  g_main_context_invoke_full(NULL, 0, deliver_scenes, d, unref_detector);
+  return NULL;
+}
+
+static scene_list_t* detect_scenes(scene_detector_t* d, gboolean* complete) {
+  int64_t start_usec = g_get_monotonic_time();
+  int count = (int)MIN(d->threads, d->duration / SCENE_MIN_SEGMENT_SECONDS);
+  count = MAX(1, count);
+  scene_segment_t* segments = g_new0(scene_segment_t, count);
+  for (int i = 0; i < count; ++i) {
+    segments[i].d = d;
+    segments[i].start = d->duration * i / count;
+    segments[i].end = i + 1 < count ? d->duration * (i + 1) / count
+                                    : G_MAXDOUBLE;
+    segments[i].times = g_array_new(FALSE, FALSE, sizeof(double));
+    pthread_create(&segments[i].thread, NULL, segment_thread, &segments[i]);
+  }
+
+  // Segments are in order, so their boundaries only need
+  // to be spaced out where two segments meet.
+  GArray* times = g_array_new(FALSE, FALSE, sizeof(double));
+  double analyzed = 0;
+  *complete = TRUE;
+  for (int i = 0; i < count; ++i) {
+    pthread_join(segments[i].thread, NULL);
+    analyzed += segments[i].analyzed;
+    *complete &= segments[i].complete;
+    for (int j = 0; j < segments[i].times->len; ++j) {
+      double time = g_array_index(segments[i].times, double, j);
+      if (times->len &&
+          time - g_array_index(times, double, times->len - 1) <
+              SCENE_MIN_SECONDS) {
+        continue;
+      }
+      g_array_append_val(times, time);
+    }
+    g_array_free(segments[i].times, TRUE);
+  }
+  g_free(segments);
+
+  if (g_atomic_int_get(&d->cancelled) || analyzed <= 0) {
+    g_array_free(times, TRUE);
+    return NULL;
+  }
+  scene_list_t* scenes = g_new0(scene_list_t, 1);
+  scenes->count = times->len;
+  scenes->times = (double*)g_array_free(times, FALSE);
+  scenes->analyzed = analyzed;
+  scenes->seconds = (double)(g_get_monotonic_time() - start_usec) / 1e6;
+  return scenes;
+}
+
+static void* segment_thread(void* arg) {
+  scene_segment_t* s = (scene_segment_t*)arg;
+  media_t* media = media_open(s->d->path, TRUE);
+  if (!media || media->video_stream < 0) {
+    media_unref(media);
+    return NULL;
+  }
+  AVFormatContext* format = media->format;
+  int stream_index = media->video_stream;
+  AVStream* stream = format->streams[stream_index];
+  for (int i = 0; i < format->nb_streams; ++i) {
+    if (i != stream_index) {
+      format->streams[i]->discard = AVDISCARD_ALL;
+    }
+  }
+  AVCodecContext* decoder = open_decoder(stream);
+  if (!decoder) {
+    media_unref(media);
+    return NULL;
+  }
+
+  double time_base = av_q2d(stream->time_base);
+  if (s->start > 0) {
+    int64_t ts = (int64_t)((s->start - SCENE_PREROLL_SECONDS) / time_base);
+    av_seek_frame(format, stream_index, ts, AVSEEK_FLAG_BACKWARD);
+  }
+
+  AVFrame* frame = av_frame_alloc();
+  struct SwsContext* sws = NULL;
+  uint8_t* luma[2] = {g_malloc(SCENE_PIXELS), g_malloc(SCENE_PIXELS)};
+  int32_t histograms[2][SCENE_HISTOGRAM_BINS];
+  int current = 0;
+  gboolean has_previous = FALSE;
+  double first_time = -1;
+  double last_time = -1;
+  double last_cut = -G_MAXDOUBLE;
+
+  while (!g_atomic_int_get(&s->d->cancelled)) {
+    int res = avcodec_receive_frame(decoder, frame);
+    if (res == AVERROR(EAGAIN)) {
+      AVPacket packet;
+      av_init_packet(&packet);
+      if (av_read_frame(format, &packet) < 0) {
+        avcodec_send_packet(decoder, NULL);
+        continue;
+      }
+      if (packet.stream_index == stream_index) {
+        avcodec_send_packet(decoder, &packet);
+      }
+      av_packet_unref(&packet);
+      continue;
+    } else if (res < 0) {
+      s->complete = res == AVERROR_EOF;
+      break;
+    }
+
+    double time = (double)frame->best_effort_timestamp * time_base;
+    if (time >= s->end) {
+      s->complete = TRUE;
+      break;
+    }
+
+    // Scaling to gray only reads the luma plane of YUV
+    // frames, and the thumbnail is all the metrics need.
+    sws = sws_getCachedContext(sws, frame->width, frame->height,
+                               (enum AVPixelFormat)frame->format,
+                               SCENE_WIDTH, SCENE_HEIGHT, AV_PIX_FMT_GRAY8,
+                               SWS_AREA, NULL, NULL, NULL);
+    if (!sws) {
+      break;
+    }
+    uint8_t* dst_data[4] = {luma[current], NULL, NULL, NULL};
+    int dst_linesize[4] = {SCENE_WIDTH, 0, 0, 0};
+    sws_scale(sws, (const uint8_t* const*)frame->data, frame->linesize, 0,
+              frame->height, dst_data, dst_linesize);
+    av_frame_unref(frame);
+    luma_histogram(luma[current], histograms[current]);
+
+    if (has_previous && time >= s->start) {
+      int previous = 1 - current;
+      double difference = mean_difference(luma[current], luma[previous]);
+      double distance =
+          histogram_distance(histograms[current], histograms[previous]);
+      if (difference > SCENE_DIFFERENCE_THRESHOLD &&
+          distance > SCENE_HISTOGRAM_THRESHOLD &&
+          time - last_cut >= SCENE_MIN_SECONDS) {
+        g_array_append_val(s->times, time);
+        last_cut = time;
+      }
+    }
+    if (time >= s->start) {
+      first_time = first_time < 0 ? time : first_time;
+      last_time = time;
+    }
+    has_previous = TRUE;
+    current = 1 - current;
+  }
+  s->analyzed = first_time >= 0 ? last_time - first_time : 0;
+
+  g_free(luma[0]);
+  g_free(luma[1]);
+  sws_freeContext(sws);
+  av_frame_free(&frame);
+  avcodec_free_context(&decoder);
+  media_unref(media);
+  return NULL;
+}
+
+static AVCodecContext* open_decoder(AVStream* stream) {
+  AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
+  if (!codec) {
+    return NULL;
+  }
+  AVCodecContext* decoder = avcodec_alloc_context3(codec);
+  avcodec_parameters_to_context(decoder, stream->codecpar);
+
+  // Segments already keep every core busy. Within each, the
+  // decoder trades quality for speed wherever it can, since
+  // only a thumbnail of each frame is used.
+  decoder->thread_count = 1;
+  decoder->lowres = MIN(codec->max_lowres, 2);
+  decoder->skip_loop_filter = AVDISCARD_ALL;
+  decoder->flags2 |= AV_CODEC_FLAG2_FAST;
+  if (avcodec_open2(decoder, codec, NULL) < 0) {
+    avcodec_free_context(&decoder);
+    return NULL;
+  }
+  return decoder;
+}
+
+static void luma_histogram(const uint8_t* luma, int32_t* histogram) {
+  memset(histogram, 0, sizeof(int32_t) * SCENE_HISTOGRAM_BINS);
+  for (int i = 0; i < SCENE_PIXELS; ++i) {
+    histogram[luma[i] * SCENE_HISTOGRAM_BINS / 256]++;
+  }
+}
+
+static double mean_difference(const uint8_t* a, const uint8_t* b) {
+  uint64_t sum = 0;
+  int i = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= SCENE_PIXELS; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i*)(b + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i*)lanes, acc);
+  sum = lanes[0] + lanes[1];
+#endif
+  for (; i < SCENE_PIXELS; ++i) {
+    sum += (uint64_t)abs(a[i] - b[i]);
+  }
+  return (double)sum / SCENE_PIXELS;
+}
+
+static double histogram_distance(const int32_t* a, const int32_t* b) {
+  int64_t sum = 0;
+  int i = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 4 <= SCENE_HISTOGRAM_BINS; i += 4) {
+    __m128i d = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(a + i)),
+                              _mm_loadu_si128((const __m128i*)(b + i)));
+    __m128i sign = _mm_srai_epi32(d, 31);
+    acc = _mm_add_epi32(acc, _mm_sub_epi32(_mm_xor_si128(d, sign), sign));
+  }
+  int32_t lanes[4];
+  _mm_storeu_si128((__m128i*)lanes, acc);
+  sum = (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for (; i < SCENE_HISTOGRAM_BINS; ++i) {
+    sum += abs(a[i] - b[i]);
+  }
+
+  // Every pixel that changes bins is counted twice.
+  return (double)sum / (2.0 * SCENE_PIXELS);
+}
+
+static gboolean deliver_scenes(gpointer data) {
+  scene_detector_t* d = (scene_detector_t*)data;
+  if (!g_atomic_int_get(&d->cancelled)) {
+    d->cb(d->result, d->user_data);
+    d->result = NULL;
+  }
+  return FALSE;
+}
+
+static void unref_detector(gpointer data) {
+  scene_detector_t* d = (scene_detector_t*)data;
+  if (g_atomic_int_dec_and_test(&d->ref_count)) {
+    scene_list_free(d->result);
+    g_free(d->path);
+    g_free(d);
+  }
+}
+
+static scene_list_t* load_cached(const char* path) {
+  gchar* data = NULL;
+  gsize size = 0;
+  if (!media_cache_load(path, SCENE_CACHE_KIND, &data, &size)) {
+    return NULL;
+  }
+  scene_list_t* scenes = NULL;
+  cache_header_t header;
+  if (size >= sizeof(header)) {
+    memcpy(&header, data, sizeof(header));
+    if (header.magic == SCENE_CACHE_MAGIC &&
+        header.version == SCENE_CACHE_VERSION && header.count >= 0 &&
+        size == sizeof(header) + sizeof(double) * (gsize)header.count) {
+      scenes = g_new0(scene_list_t, 1);
+      scenes->count = header.count;
+      scenes->times = (double*)g_memdup(data + sizeof(header),
+                                        sizeof(double) * header.count);
+    }
+  }
+  g_free(data);
+  return scenes;
+}
+
+static void store_cached(const char* path, const scene_list_t* scenes) {
+  cache_header_t header;
+  header.magic = SCENE_CACHE_MAGIC;
+  header.version = SCENE_CACHE_VERSION;
+  header.count = scenes->count;
+  gsize size = sizeof(header) + sizeof(double) * scenes->count;
+  gchar* data = g_malloc(size);
+  memcpy(data, &header, sizeof(header));
+  memcpy(data + sizeof(header), scenes->times, sizeof(double) * scenes->count);
+  media_cache_store(path, SCENE_CACHE_KIND, data, size);
+  g_free(data);
+}
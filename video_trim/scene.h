@@ -0,0 +1,54 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+#include <glib.h>
+#include "video_info.h"
+
+// Frames are compared as luma thumbnails of this size.
+#define SCENE_WIDTH 128
+#define SCENE_HEIGHT 72
+#define SCENE_HISTOGRAM_BINS 64
+
+// A frame starts a new scene when it differs from the one
+// before by more than both thresholds: the mean absolute
+// luma difference (0-255) and the fraction of pixels that
+// moved between histogram bins.
+#define SCENE_DIFFERENCE_THRESHOLD 24.0
+#define SCENE_HISTOGRAM_THRESHOLD 0.35
+#define SCENE_MIN_SECONDS 0.5
+
+// Segments analyzed in parallel are at least this long, so
+// that short clips don't pay for many seeks.
+#define SCENE_MIN_SEGMENT_SECONDS 10.0
+
+typedef struct {
+  double* times;
+  int count;
+
+  // Seconds of video decoded and seconds taken, both 0 for
+  // a list from the cache.
+  double analyzed;
+  double seconds;
+} scene_list_t;
+
+// Called on the main thread with the scene boundaries, or
+// NULL if the media has no video. The callee owns the list.
+typedef void (*scene_cb)(scene_list_t* scenes, gpointer user_data);
+
+typedef struct scene_detector scene_detector_t;
+
+// Find scene boundaries in the background, from the disk
+// cache if possible. The video is split into segments that
+// are decoded in parallel by up to threads workers, or one
+// per core if threads is 0.
+scene_detector_t* scene_detect(media_t* media,
+                               int threads,
+                               scene_cb cb,
+                               gpointer user_data);
+
+// Stop a detection. The callback will not be invoked.
+void scene_detector_cancel(scene_detector_t* d);
+
+void scene_list_free(scene_list_t* scenes);
+
+#endif
@@ -0,0 +1,342 @@
+#include "smart_render.h"
+#include <libavcodec/avcodec.h>
+#include <string.h>
+
+typedef enum {
+  RENDER_HEAD,
+  RENDER_COPY,
+  RENDER_DONE,
+} render_state_t;
+
+struct smart_render {
+  AVStream* in_stream;
+  AVFormatContext* out_ctx;
+  int out_index;
+  int64_t start_pts;
+  int64_t end_pts;
+
+  render_state_t state;
+  int64_t last_dts;
+
+  // Set when re-encoded packets would not decode against
+  // the copied stream's parameter sets, in which case the
+  // ends are cut on keyframes like a plain copy.
+  gboolean keyframe_cuts;
+
+  AVCodecContext* decoder;
+  AVCodecContext* encoder;
+  AVFrame* frame;
+
+  // Packets of the GOP currently being read. We only know
+  // whether a GOP can be copied once we reach its end.
+  AVPacket** gop;
+  int gop_len;
+  int gop_cap;
+};
+
+static int write_packet(smart_render_t* r, AVPacket* packet);
+static AVCodecContext* open_encoder(smart_render_t* r);
+static gboolean encoder_matches(smart_render_t* r);
+static int drain_encoder(smart_render_t* r, gboolean flush);
+static int decode_packet(smart_render_t* r, AVPacket* packet);
+static int finish_segment(smart_render_t* r);
+static void buffer_packet(smart_render_t* r, AVPacket* packet);
+static int flush_gop(smart_render_t* r, gboolean copy);
+static int64_t gop_max_pts(smart_render_t* r);
+
+smart_render_t* smart_render_new(AVStream* in_stream,
+                                 AVFormatContext* out_ctx,
+                                 int out_index,
+                                 double start,
+                                 double end) {
+  AVCodec* codec = avcodec_find_decoder(in_stream->codecpar->codec_id);
+  if (!codec || !avcodec_find_encoder(in_stream->codecpar->codec_id)) {
+    return NULL;
+  }
+  AVCodecContext* decoder = avcodec_alloc_context3(codec);
+  if (avcodec_parameters_to_context(decoder, in_stream->codecpar) < 0) {
+    avcodec_free_context(&decoder);
+    return NULL;
+  }
+  decoder->pkt_timebase = in_stream->time_base;
+  decoder->thread_count = 0;
+  if (avcodec_open2(decoder, codec, NULL) < 0) {
+    avcodec_free_context(&decoder);
+    return NULL;
+  }
+
+  smart_render_t* r = g_new0(smart_render_t, 1);
+  r->in_stream = in_stream;
+  r->out_ctx = out_ctx;
+  r->out_index = out_index;
+  r->start_pts = (int64_t)(start / av_q2d(in_stream->time_base));
+  r->end_pts = (int64_t)(end / av_q2d(in_stream->time_base));
+  r->state = RENDER_HEAD;
+  r->last_dts = AV_NOPTS_VALUE;
+  r->decoder = decoder;
+  r->frame = av_frame_alloc();
+  r->keyframe_cuts = !encoder_matches(r);
+  return r;
+}
+
+int smart_render_packet(smart_render_t* r, AVPacket* packet) {
+  gboolean key = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+  int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+  int res = 0;
+
+  if (r->state == RENDER_HEAD) {
+    // Until the first keyframe inside the range, we are in
+    // the partial GOP that the seek landed in.
+    if (!key || pts < r->start_pts) {
+      return r->keyframe_cuts ? 0 : decode_packet(r, packet);
+    }
+    if ((res = finish_segment(r)) < 0) {
+      return res;
+    }
+    r->state = RENDER_COPY;
+  }
+
+  if (r->state != RENDER_COPY) {
+    return 0;
+  }
+  if (key && r->gop_len) {
+    if (pts <= r->end_pts) {
+      res = flush_gop(r, TRUE);
+    } else {
+      res = flush_gop(r, gop_max_pts(r) <= r->end_pts);
+      r->state = RENDER_DONE;
+    }
+    if (res < 0 || r->state == RENDER_DONE) {
+      return res;
+    }
+  }
+  if (pts > r->end_pts && key) {
+    r->state = RENDER_DONE;
+    return 0;
+  }
+  buffer_packet(r, packet);
+  return 0;
+}
+
+int smart_render_finish(smart_render_t* r, gboolean at_eof) {
+  int res = 0;
+  if (r->state == RENDER_HEAD) {
+    res = finish_segment(r);
+  } else if (r->state == RENDER_COPY && r->gop_len) {
+    // At EOF the last GOP is complete; otherwise we stopped
+    // reading in the middle of it and must cut it precisely.
+    res = flush_gop(r, at_eof && gop_max_pts(r) <= r->end_pts);
+  }
+  r->state = RENDER_DONE;
+  return res;
+}
+
+gboolean smart_render_keyframe_cuts(smart_render_t* r) {
+  return r->keyframe_cuts;
+}
+
+void smart_render_free(smart_render_t* r) {
+  for (int i = 0; i < r->gop_len; ++i) {
+    av_packet_free(&r->gop[i]);
+  }
+  g_free(r->gop);
+  avcodec_free_context(&r->decoder);
+  avcodec_free_context(&r->encoder);
+  av_frame_free(&r->frame);
+  g_free(r);
+}
+
+static int write_packet(smart_render_t* r, AVPacket* packet) {
+  AVRational in_tb = r->in_stream->time_base;
+  AVRational out_tb = r->out_ctx->streams[r->out_index]->time_base;
+  if (packet->pts == AV_NOPTS_VALUE) {
+    packet->pts = packet->dts;
+  }
+  if (packet->dts == AV_NOPTS_VALUE) {
+    packet->dts = packet->pts;
+  }
+  packet->pts = av_rescale_q(packet->pts - r->start_pts, in_tb, out_tb);
+  packet->dts = av_rescale_q(packet->dts - r->start_pts, in_tb, out_tb);
+  packet->duration = av_rescale_q(packet->duration, in_tb, out_tb);
+
+  // Re-encoded and copied segments have different decoder
+  // delays, so keep DTS strictly increasing across splices.
+  if (r->last_dts != AV_NOPTS_VALUE && packet->dts <= r->last_dts) {
+    packet->dts = r->last_dts + 1;
+  }
+  if (packet->pts < packet->dts) {
+    packet->pts = packet->dts;
+  }
+  r->last_dts = packet->dts;
+
+  packet->stream_index = r->out_index;
+  packet->pos = -1;
+  return av_interleaved_write_frame(r->out_ctx, packet);
+}
+
+// The encoder is set up from the stream's parameters rather
+// than from decoded frames, so that it can be checked
+// before any frame is encoded.
+static AVCodecContext* open_encoder(smart_render_t* r) {
+  AVCodecParameters* par = r->in_stream->codecpar;
+  AVCodec* codec = avcodec_find_encoder(par->codec_id);
+  AVCodecContext* encoder = avcodec_alloc_context3(codec);
+  encoder->width = par->width;
+  encoder->height = par->height;
+  encoder->pix_fmt = (enum AVPixelFormat)par->format;
+  encoder->sample_aspect_ratio = par->sample_aspect_ratio;
+  encoder->color_range = par->color_range;
+  encoder->color_primaries = par->color_primaries;
+  encoder->color_trc = par->color_trc;
+  encoder->colorspace = par->color_space;
+  encoder->time_base = r->in_stream->time_base;
+  encoder->framerate = r->in_stream->avg_frame_rate;
+  encoder->bit_rate = par->bit_rate;
+  encoder->profile = par->profile;
+  encoder->level = par->level;
+  encoder->thread_count = 0;
+
+  // Without B-frames the encoder's DTS equals its PTS, which
+  // lets the segment butt up against the copied GOPs.
+  encoder->max_b_frames = 0;
+  encoder->gop_size = G_MAXINT / 2;
+
+  if (r->out_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+    encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+  if (avcodec_open2(encoder, codec, NULL) < 0) {
+    avcodec_free_context(&encoder);
+    return NULL;
+  }
+  return encoder;
+}
+
+// Containers with global headers keep the parameter sets
+// (SPS/PPS for H.264) only in the track's extradata, which
+// is copied from the input. Re-encoded packets can only be
+// spliced in if the encoder's extradata is identical, in
+// the same bitstream format. Other containers carry the
+// parameter sets in band, so the encoder only has to open.
+static gboolean encoder_matches(smart_render_t* r) {
+  AVCodecContext* encoder = open_encoder(r);
+  if (!encoder) {
+    return FALSE;
+  }
+  AVCodecParameters* par = r->in_stream->codecpar;
+  gboolean matches = TRUE;
+  if (r->out_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+    matches = encoder->extradata_size == par->extradata_size &&
+              (!par->extradata_size ||
+               !memcmp(encoder->extradata, par->extradata,
+                       par->extradata_size));
+  }
+  avcodec_free_context(&encoder);
+  return matches;
+}
+
+static int drain_encoder(smart_render_t* r, gboolean flush) {
+  if (flush) {
+    avcodec_send_frame(r->encoder, NULL);
+  }
+  AVPacket packet;
+  av_init_packet(&packet);
+  packet.data = NULL;
+  packet.size = 0;
+  while (1) {
+    int res = avcodec_receive_packet(r->encoder, &packet);
+    if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) {
+      return 0;
+    } else if (res < 0) {
+      return res;
+    }
+    res = write_packet(r, &packet);
+    av_packet_unref(&packet);
+    if (res < 0) {
+      return res;
+    }
+  }
+}
+
+static int decode_packet(smart_render_t* r, AVPacket* packet) {
+  int res = avcodec_send_packet(r->decoder, packet);
+  if (res < 0) {
+    return res;
+  }
+  while (1) {
+    res = avcodec_receive_frame(r->decoder, r->frame);
+    if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) {
+      return 0;
+    } else if (res < 0) {
+      return res;
+    }
+    int64_t pts = r->frame->best_effort_timestamp;
+    if (pts != AV_NOPTS_VALUE && pts >= r->start_pts && pts <= r->end_pts) {
+      if (!r->encoder && !(r->encoder = open_encoder(r))) {
+        res = AVERROR(EINVAL);
+      } else {
+        r->frame->pts = pts;
+        r->frame->pict_type = AV_PICTURE_TYPE_NONE;
+        res = avcodec_send_frame(r->encoder, r->frame);
+        if (res >= 0) {
+          res = drain_encoder(r, FALSE);
+        }
+      }
+    }
+    av_frame_unref(r->frame);
+    if (res < 0) {
+      return res;
+    }
+  }
+}
+
+static int finish_segment(smart_render_t* r) {
+  int res = decode_packet(r, NULL);
+  avcodec_flush_buffers(r->decoder);
+  if (r->encoder) {
+    if (res >= 0) {
+      res = drain_encoder(r, TRUE);
+    }
+    avcodec_free_context(&r->encoder);
+  }
+  return res;
+}
+
+static void buffer_packet(smart_render_t* r, AVPacket* packet) {
+  if (r->gop_len == r->gop_cap) {
+    r->gop_cap = MAX(16, r->gop_cap * 2);
+    r->gop = g_renew(AVPacket*, r->gop, r->gop_cap);
+  }
+  r->gop[r->gop_len++] = av_packet_clone(packet);
+}
+
+// Copy the buffered GOP, or re-encode the part of it inside
+// the range. When the ends are cut on keyframes, the packets
+// up to the end are copied instead, as a plain copy would.
+static int flush_gop(smart_render_t* r, gboolean copy) {
+  int res = 0;
+  for (int i = 0; i < r->gop_len; ++i) {
+    AVPacket* packet = r->gop[i];
+    int64_t dts = packet->dts != AV_NOPTS_VALUE ? packet->dts : packet->pts;
+    if (res >= 0 && (copy || (r->keyframe_cuts && dts <= r->end_pts))) {
+      res = write_packet(r, packet);
+    } else if (res >= 0 && !r->keyframe_cuts) {
+      res = decode_packet(r, packet);
+    }
+    av_packet_free(&r->gop[i]);
+  }
+  r->gop_len = 0;
+  if (res >= 0 && !copy && !r->keyframe_cuts) {
+    res = finish_segment(r);
+  }
+  return res;
+}
+
+static int64_t gop_max_pts(smart_render_t* r) {
+  int64_t max_pts = G_MININT64;
+  for (int i = 0; i < r->gop_len; ++i) {
+    AVPacket* packet = r->gop[i];
+    int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    max_pts = MAX(max_pts, pts);
+  }
+  return max_pts;
+}
@@ -0,0 +1,27 @@
+#ifndef __SMART_RENDER_H__
+#define __SMART_RENDER_H__
+
+#include <glib.h>
+#include <libavformat/avformat.h>
+
+// A smart renderer produces a frame-accurate cut of one
+// video stream. Only the partial GOPs at either end of the
+// range are decoded and re-encoded; every GOP that lies
+// entirely inside the range is stream-copied.
+typedef struct smart_render smart_render_t;
+
+smart_render_t* smart_render_new(AVStream* in_stream,
+                                 AVFormatContext* out_ctx,
+                                 int out_index,
+                                 double start,
+                                 double end);
+int smart_render_packet(smart_render_t* r, AVPacket* packet);
+int smart_render_finish(smart_render_t* r, gboolean at_eof);
+
+// Whether the renderer cuts on keyframes instead, because
+// re-encoded frames would not match the parameter sets of
+// the copied stream in a container that stores them once.
+gboolean smart_render_keyframe_cuts(smart_render_t* r);
+void smart_render_free(smart_render_t* r);
+
+#endif
@@ -0,0 +1,114 @@
+#include "split.h"
+#include <string.h>
+
+typedef struct {
+  double start;
+  double end;
+} split_chunk_t;
+
+typedef struct {
+  char* path;
+  char* out_path;
+  cut_options_t options;
+} split_job_t;
+
+static GArray* plan_chunks(media_t* media, double chunk_seconds);
+static char* chunk_path(const char* out_path, int index);
+static void run_job(gpointer data, gpointer user_data);
+
+int split_video(media_t* media,
+                const char* out_path,
+                const split_options_t* options) {
+  if (options->chunk_seconds <= 0) {
+    return -1;
+  }
+  media_lock(media);
+  GArray* chunks = plan_chunks(media, options->chunk_seconds);
+  media_unlock(media);
+
+  int threads =
+      options->threads > 0 ? options->threads : (int)g_get_num_processors();
+  int failures = 0;
+  GThreadPool* pool =
+      g_thread_pool_new(run_job, &failures, threads, TRUE, NULL);
+  for (int i = 0; i < chunks->len; ++i) {
+    split_chunk_t* chunk = &g_array_index(chunks, split_chunk_t, i);
+    split_job_t* job = g_new0(split_job_t, 1);
+    job->path = g_strdup(media->path);
+    job->out_path = chunk_path(out_path, i);
+    job->options.start = chunk->start;
+    job->options.end = chunk->end;
+    job->options.io_buffer_size = options->io_buffer_size;
+    g_thread_pool_push(pool, job, NULL);
+  }
+
+  // Waits for every queued chunk to finish.
+  g_thread_pool_free(pool, FALSE, TRUE);
+  int count = chunks->len;
+  g_array_free(chunks, TRUE);
+  return failures ? -1 : count;
+}
+
+static GArray* plan_chunks(media_t* media, double chunk_seconds) {
+  GArray* chunks = g_array_new(FALSE, FALSE, sizeof(split_chunk_t));
+  split_chunk_t chunk = {0, G_MAXDOUBLE};
+  AVStream* stream = media->video_stream >= 0
+                         ? media->format->streams[media->video_stream]
+                         : NULL;
+
+  if (stream && stream->nb_index_entries > 0) {
+    double time_base = av_q2d(stream->time_base);
+    chunk.start = (double)stream->index_entries[0].timestamp * time_base;
+    for (int i = 1; i < stream->nb_index_entries; ++i) {
+      AVIndexEntry* entry = &stream->index_entries[i];
+      double time = (double)entry->timestamp * time_base;
+      if (!(entry->flags & AVINDEX_KEYFRAME) ||
+          time < chunk.start + chunk_seconds) {
+        continue;
+      }
+      // End one tick before the keyframe, so that it only
+      // lands in the chunk it starts.
+      chunk.end = (double)(entry->timestamp - 1) * time_base;
+      g_array_append_val(chunks, chunk);
+      chunk.start = time;
+      chunk.end = G_MAXDOUBLE;
+    }
+  } else {
+    // Without an index, fall back to fixed times. Each cut
+    // still starts at the first keyframe after its start.
+    for (double t = chunk_seconds; t < media->duration; t += chunk_seconds) {
+      chunk.end = t;
+      g_array_append_val(chunks, chunk);
+      chunk.start = t;
+    }
+    chunk.end = G_MAXDOUBLE;
+  }
+  g_array_append_val(chunks, chunk);
+  return chunks;
+}
+
+static char* chunk_path(const char* out_path, int index) {
+  const char* dot = strrchr(out_path, '.');
+  if (!dot) {
+    return g_strdup_printf("%s_%03d", out_path, index + 1);
+  }
+  return g_strdup_printf("%.*s_%03d%s", (int)(dot - out_path), out_path,
+                         index + 1, dot);
+}
+
+static void run_job(gpointer data, gpointer user_data) {
+  split_job_t* job = (split_job_t*)data;
+  int* failures = (int*)user_data;
+
+  // A private media gives each worker its own demuxer and
+  // file position, so its seek goes straight to the byte
+  // offset of its chunk.
+  media_t* media = media_open(job->path, TRUE);
+  if (!media || !cut_video_sync(media, job->out_path, &job->options, NULL)) {
+    g_atomic_int_inc(failures);
+  }
+  media_unref(media);
+  g_free(job->path);
+  g_free(job->out_path);
+  g_free(job);
+}
@@ -0,0 +1,28 @@
+#ifndef __SPLIT_H__
+#define __SPLIT_H__
+
+#include "video_info.h"
+
+typedef struct {
+  // Minimum length of each chunk. Chunks end at the first
+  // keyframe after this much time.
+  double chunk_seconds;
+
+  // Chunks to cut at once, or 0 for one per core.
+  int threads;
+
+  // Size of the output write-behind buffers, or 0 for the
+  // default.
+  int io_buffer_size;
+} split_options_t;
+
+// Cut the whole media into consecutive stream-copied chunks
+// named after out_path, e.g. out_001.mp4. Every worker
+// opens the input on its own, so chunks are demuxed in
+// parallel. Returns the number of chunks, or -1 if any of
+// them failed.
+int split_video(media_t* media,
+                const char* out_path,
+                const split_options_t* options);
+
+#endif
@@ -0,0 +1,328 @@
+#include "thumbnails.h"
+#include <inttypes.h>
+#include <libavcodec/avcodec.h>
+#include <libswscale/swscale.h>
+#include <string.h>
+
+typedef struct {
+  char* key;
+  GdkPixbuf* pixbuf;
+  size_t bytes;
+  GList* link;
+} cache_entry_t;
+
+struct thumbnailer {
+  GThreadPool* pool;
+  int generation;
+
+  // The cache is only touched from the main thread, so it
+  // needs no locking.
+  GHashTable* cache;
+  GQueue lru;
+  size_t cache_bytes;
+  size_t max_cache_bytes;
+
+  // The key of the keyframe each requested time turned out
+  // to show. Thumbnails are cached by keyframe, so strips of
+  // different lengths share them, but which keyframe a time
+  // maps to is only known once a worker has decoded it.
+  GHashTable* aliases;
+};
+
+typedef struct {
+  thumbnailer_t* t;
+  media_t* media;
+  int generation;
+  int index;
+  double time;
+  int height;
+  char* request_key;
+  char* key;
+  GdkPixbuf* pixbuf;
+  thumbnail_cb cb;
+  gpointer user_data;
+} thumb_task_t;
+
+// Decoding state owned by one pool thread. Each thread
+// opens its own copy of the media so that seeks never
+// contend with the UI or with other threads.
+typedef struct {
+  media_t* media;
+  AVCodecContext* decoder;
+  AVFrame* frame;
+  struct SwsContext* sws;
+} thumb_worker_t;
+
+static void worker_free(gpointer data);
+static GPrivate worker_key = G_PRIVATE_INIT(worker_free);
+
+static void run_task(gpointer data, gpointer user_data);
+static thumb_worker_t* get_worker(const char* path);
+static GdkPixbuf* decode_thumbnail(thumb_worker_t* w,
+                                   double time,
+                                   int height,
+                                   int64_t* keyframe_ts);
+static gboolean deliver_task(gpointer data);
+static void free_task(gpointer data);
+static char* thumbnail_key(const char* path, int64_t ts, int height);
+static int64_t time_to_ts(media_t* media, double time);
+static GdkPixbuf* cache_lookup(thumbnailer_t* t, const char* key);
+static void cache_insert(thumbnailer_t* t, const char* key, GdkPixbuf* pixbuf);
+static void free_entry(gpointer data);
+
+thumbnailer_t* thumbnailer_new(int num_threads, size_t max_cache_bytes) {
+  thumbnailer_t* t = g_new0(thumbnailer_t, 1);
+  t->pool = g_thread_pool_new(run_task, t, num_threads, FALSE, NULL);
+  t->cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_entry);
+  t->aliases = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  g_queue_init(&t->lru);
+  t->max_cache_bytes = max_cache_bytes;
+  return t;
+}
+
+void thumbnailer_request(thumbnailer_t* t,
+                         media_t* media,
+                         int count,
+                         int height,
+                         thumbnail_cb cb,
+                         gpointer user_data) {
+  thumbnailer_cancel(t);
+  if (media->video_stream < 0) {
+    return;
+  }
+  for (int i = 0; i < count; ++i) {
+    double time = media->duration * ((double)i + 0.5) / (double)count;
+    char* request_key =
+        thumbnail_key(media->path, time_to_ts(media, time), height);
+    const char* key = g_hash_table_lookup(t->aliases, request_key);
+    GdkPixbuf* cached = key ? cache_lookup(t, key) : NULL;
+    if (cached) {
+      cb(i, cached, user_data);
+      g_free(request_key);
+      continue;
+    }
+    thumb_task_t* task = g_new0(thumb_task_t, 1);
+    task->t = t;
+    task->media = media_ref(media);
+    task->generation = t->generation;
+    task->index = i;
+    task->time = time;
+    task->height = height;
+    task->request_key = request_key;
+    task->cb = cb;
+    task->user_data = user_data;
+    g_thread_pool_push(t->pool, task, NULL);
+  }
+}
+
+void thumbnailer_cancel(thumbnailer_t* t) {
+  g_atomic_int_inc(&t->generation);
+}
+
+static void run_task(gpointer data, gpointer user_data) {
+  thumb_task_t* task = (thumb_task_t*)data;
+  if (task->generation != g_atomic_int_get(&task->t->generation)) {
+    free_task(task);
+    return;
+  }
+  thumb_worker_t* w = get_worker(task->media->path);
+  int64_t keyframe_ts;
+  if (w) {
+    task->pixbuf =
+        decode_thumbnail(w, task->time, task->height, &keyframe_ts);
+  }
+  if (task->pixbuf) {
+    task->key = thumbnail_key(task->media->path, keyframe_ts, task->height);
+  }
+  g_main_context_invoke_full(NULL, 0, deliver_task, task, free_task);
+}
+
+static thumb_worker_t* get_worker(const char* path) {
+  thumb_worker_t* w = (thumb_worker_t*)g_private_get(&worker_key);
+  if (w && !strcmp(w->media->path, path)) {
+    return w;
+  }
+  g_private_replace(&worker_key, NULL);
+
+  media_t* media = media_open(path, TRUE);
+  if (!media || media->video_stream < 0) {
+    media_unref(media);
+    return NULL;
+  }
+  AVFormatContext* format = media->format;
+  for (int i = 0; i < format->nb_streams; ++i) {
+    if (i != media->video_stream) {
+      format->streams[i]->discard = AVDISCARD_ALL;
+    }
+  }
+
+  AVCodecParameters* par = format->streams[media->video_stream]->codecpar;
+  AVCodec* codec = avcodec_find_decoder(par->codec_id);
+  if (!codec) {
+    media_unref(media);
+    return NULL;
+  }
+  AVCodecContext* decoder = avcodec_alloc_context3(codec);
+  avcodec_parameters_to_context(decoder, par);
+
+  // The pool already runs one decode per core, and frame
+  // threading would only add latency to single frames.
+  decoder->thread_count = 1;
+  decoder->skip_frame = AVDISCARD_NONKEY;
+  decoder->skip_loop_filter = AVDISCARD_ALL;
+  if (avcodec_open2(decoder, codec, NULL) < 0) {
+    avcodec_free_context(&decoder);
+    media_unref(media);
+    return NULL;
+  }
+
+  w = g_new0(thumb_worker_t, 1);
+  w->media = media;
+  w->decoder = decoder;
+  w->frame = av_frame_alloc();
+  g_private_set(&worker_key, w);
+  return w;
+}
+
+static void worker_free(gpointer data) {
+  thumb_worker_t* w = (thumb_worker_t*)data;
+  if (!w) {
+    return;
+  }
+  avcodec_free_context(&w->decoder);
+  av_frame_free(&w->frame);
+  sws_freeContext(w->sws);
+  media_unref(w->media);
+  g_free(w);
+}
+
+// Decode the keyframe at or before time, and return its
+// timestamp in keyframe_ts.
+static GdkPixbuf* decode_thumbnail(thumb_worker_t* w,
+                                   double time,
+                                   int height,
+                                   int64_t* keyframe_ts) {
+  AVFormatContext* format = w->media->format;
+  int stream_index = w->media->video_stream;
+  int64_t ts = time_to_ts(w->media, time);
+  if (av_seek_frame(format, stream_index, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+    return NULL;
+  }
+  avcodec_flush_buffers(w->decoder);
+
+  AVPacket packet;
+  av_init_packet(&packet);
+  gboolean decoded = FALSE;
+  while (!decoded && av_read_frame(format, &packet) >= 0) {
+    if (packet.stream_index == stream_index &&
+        (packet.flags & AV_PKT_FLAG_KEY)) {
+      // Draining right away gets the frame out of decoders
+      // that would otherwise hold it back for reordering.
+      if (avcodec_send_packet(w->decoder, &packet) >= 0) {
+        avcodec_send_packet(w->decoder, NULL);
+        decoded = avcodec_receive_frame(w->decoder, w->frame) >= 0;
+      }
+      *keyframe_ts = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+      if (*keyframe_ts == AV_NOPTS_VALUE) {
+        *keyframe_ts = ts;
+      }
+      avcodec_flush_buffers(w->decoder);
+    }
+    av_packet_unref(&packet);
+  }
+  if (!decoded) {
+    return NULL;
+  }
+
+  AVFrame* frame = w->frame;
+  int width = MAX(1, frame->width * height / MAX(1, frame->height));
+  w->sws = sws_getCachedContext(w->sws, frame->width, frame->height,
+                                (enum AVPixelFormat)frame->format, width,
+                                height, AV_PIX_FMT_RGB24, SWS_FAST_BILINEAR,
+                                NULL, NULL, NULL);
+  GdkPixbuf* pixbuf = NULL;
+  if (w->sws) {
+    pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+    uint8_t* dst_data[4] = {gdk_pixbuf_get_pixels(pixbuf), NULL, NULL, NULL};
+    int dst_linesize[4] = {gdk_pixbuf_get_rowstride(pixbuf), 0, 0, 0};
+    sws_scale(w->sws, (const uint8_t* const*)frame->data, frame->linesize, 0,
+              frame->height, dst_data, dst_linesize);
+  }
+  av_frame_unref(frame);
+  return pixbuf;
+}
+
+static gboolean deliver_task(gpointer data) {
+  thumb_task_t* task = (thumb_task_t*)data;
+  thumbnailer_t* t = task->t;
+  if (task->pixbuf) {
+    cache_insert(t, task->key, task->pixbuf);
+    if (g_hash_table_size(t->aliases) >= THUMBNAIL_MAX_ALIASES) {
+      g_hash_table_remove_all(t->aliases);
+    }
+    g_hash_table_replace(t->aliases, g_strdup(task->request_key),
+                         g_strdup(task->key));
+    if (task->generation == g_atomic_int_get(&t->generation)) {
+      task->cb(task->index, task->pixbuf, task->user_data);
+    }
+  }
+  return FALSE;
+}
+
+static void free_task(gpointer data) {
+  thumb_task_t* task = (thumb_task_t*)data;
+  if (task->pixbuf) {
+    g_object_unref(task->pixbuf);
+  }
+  media_unref(task->media);
+  g_free(task->request_key);
+  g_free(task->key);
+  g_free(task);
+}
+
+static char* thumbnail_key(const char* path, int64_t ts, int height) {
+  return g_strdup_printf("%s:%" PRId64 ":%d", path, ts, height);
+}
+
+static int64_t time_to_ts(media_t* media, double time) {
+  AVStream* stream = media->format->streams[media->video_stream];
+  return (int64_t)(time / av_q2d(stream->time_base));
+}
+
+static GdkPixbuf* cache_lookup(thumbnailer_t* t, const char* key) {
+  cache_entry_t* entry = (cache_entry_t*)g_hash_table_lookup(t->cache, key);
+  if (!entry) {
+    return NULL;
+  }
+  g_queue_unlink(&t->lru, entry->link);
+  g_queue_push_head_link(&t->lru, entry->link);
+  return entry->pixbuf;
+}
+
+static void cache_insert(thumbnailer_t* t, const char* key, GdkPixbuf* pixbuf) {
+  if (g_hash_table_contains(t->cache, key)) {
+    return;
+  }
+  cache_entry_t* entry = g_new0(cache_entry_t, 1);
+  entry->key = g_strdup(key);
+  entry->pixbuf = g_object_ref(pixbuf);
+  entry->bytes = (size_t)gdk_pixbuf_get_rowstride(pixbuf) *
+                 (size_t)gdk_pixbuf_get_height(pixbuf);
+  g_queue_push_head(&t->lru, entry);
+  entry->link = t->lru.head;
+  g_hash_table_insert(t->cache, entry->key, entry);
+  t->cache_bytes += entry->bytes;
+
+  while (t->cache_bytes > t->max_cache_bytes && t->lru.length > 1) {
+    cache_entry_t* oldest = (cache_entry_t*)g_queue_pop_tail(&t->lru);
+    t->cache_bytes -= oldest->bytes;
+    g_hash_table_remove(t->cache, oldest->key);
+  }
+}
+
+static void free_entry(gpointer data) {
+  cache_entry_t* entry = (cache_entry_t*)data;
+  g_object_unref(entry->pixbuf);
+  g_free(entry->key);
+  g_free(entry);
+}
@@ -0,0 +1,35 @@
+#ifndef __THUMBNAILS_H__
+#define __THUMBNAILS_H__
+
+#include <gtk/gtk.h>
+#include "video_info.h"
+
+#define THUMBNAIL_THREADS 4
+#define THUMBNAIL_CACHE_BYTES (64 * 1024 * 1024)
+
+// Requested times remembered along with the keyframe that
+// each one showed.
+#define THUMBNAIL_MAX_ALIASES 4096
+
+// Called on the main thread as each thumbnail of a strip
+// becomes available. The pixbuf is owned by the cache, so
+// callers must take their own reference to keep it.
+typedef void (*thumbnail_cb)(int index, GdkPixbuf* pixbuf, gpointer user_data);
+
+typedef struct thumbnailer thumbnailer_t;
+
+thumbnailer_t* thumbnailer_new(int num_threads, size_t max_cache_bytes);
+
+// Request a strip of count thumbnails evenly spaced across
+// the media. Cached thumbnails are delivered immediately;
+// the rest are decoded in the background. A new request
+// cancels any thumbnails still pending from the last one.
+void thumbnailer_request(thumbnailer_t* t,
+                         media_t* media,
+                         int count,
+                         int height,
+                         thumbnail_cb cb,
+                         gpointer user_data);
+void thumbnailer_cancel(thumbnailer_t* t);
+
+#endif
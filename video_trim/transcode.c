@@ -0,0 +1,822 @@
+#include "transcode.h"
+#include <libavcodec/avcodec.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
+#include <libswresample/swresample.h>
+#include <libswscale/swscale.h>
+#include <string.h>
+#include <unistd.h>
+
+// A bounded queue of frames between two pipeline stages.
+typedef struct {
+  AVFrame* frames[TRANSCODE_QUEUE_FRAMES];
+  int start;
+  int len;
+  gboolean finished;
+  gboolean aborted;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} frame_queue_t;
+
+typedef struct {
+  AVFormatContext* in_ctx;
+  AVFormatContext* out_ctx;
+  double start;
+  double end;
+  pthread_mutex_t mux_lock;
+  int error;
+  int* frames;
+
+  // The output index of each input stream that is copied
+  // rather than re-encoded, or -1.
+  int* copy_out;
+
+  int video_in;
+  int video_out;
+  gboolean video_copy;
+  gboolean video_started;
+  AVCodecContext* video_decoder;
+  AVCodecContext* video_encoder;
+  struct SwsContext* sws;
+  double frame_rate;
+  int64_t last_pts;
+  frame_queue_t decoded;
+  frame_queue_t scaled;
+
+  int audio_in;
+  int audio_out;
+  gboolean audio_copy;
+  AVCodecContext* audio_decoder;
+  AVCodecContext* audio_encoder;
+  struct SwrContext* swr;
+  AVAudioFifo* fifo;
+  int64_t audio_pts;
+} transcoder_t;
+
+static gboolean stream_selected(const cut_options_t* options, int index);
+static AVCodecContext* open_decoder(AVStream* stream);
+static int add_copy_stream(transcoder_t* t, int index);
+static gboolean open_video(transcoder_t* t);
+static gboolean open_audio(transcoder_t* t);
+static enum AVSampleFormat pick_sample_fmt(AVCodec* codec,
+                                           enum AVSampleFormat preferred);
+static int pick_sample_rate(AVCodec* codec, int preferred);
+static int decode_video(transcoder_t* t,
+                        AVPacket* packet,
+                        gboolean* done,
+                        GSourceFunc progress_cb);
+static int handle_audio(transcoder_t* t, AVPacket* packet, gboolean* done);
+static int queue_samples(transcoder_t* t, AVFrame* frame);
+static int copy_packet(transcoder_t* t,
+                       AVPacket* packet,
+                       gboolean* done,
+                       GSourceFunc progress_cb);
+static void report_progress(transcoder_t* t,
+                            double time,
+                            GSourceFunc progress_cb);
+static int encode_audio(transcoder_t* t, gboolean flush);
+static int drain_encoder(transcoder_t* t,
+                         AVCodecContext* encoder,
+                         int out_index);
+static int write_packet(transcoder_t* t, AVPacket* packet, int out_index);
+static void* scale_thread(void* arg);
+static void* encode_thread(void* arg);
+static void fail_pipeline(transcoder_t* t);
+static void queue_init(frame_queue_t* q);
+static gboolean queue_push(frame_queue_t* q, AVFrame* frame);
+static AVFrame* queue_pop(frame_queue_t* q);
+static void queue_finish(frame_queue_t* q);
+static void queue_abort(frame_queue_t* q);
+static void queue_destroy(frame_queue_t* q);
+
+gboolean transcode_can_copy(AVOutputFormat* format, enum AVCodecID codec_id) {
+  // Formats without a codec tag table can't tell, and
+  // report an error rather than 0.
+  return avformat_query_codec(format, codec_id, FF_COMPLIANCE_NORMAL) != 0;
+}
+
+gboolean transcode_video(media_t* media,
+                         const char* out_path,
+                         const cut_options_t* options,
+                         GSourceFunc progress_cb) {
+  transcoder_t t;
+  memset(&t, 0, sizeof(t));
+  t.in_ctx = media->format;
+  t.start = options->start;
+  t.end = options->end;
+  t.last_pts = AV_NOPTS_VALUE;
+  t.video_in = -1;
+  t.audio_in = -1;
+  int frames = 0;
+  t.frames = options->stats ? &options->stats->frames : &frames;
+  g_atomic_int_set(t.frames, 0);
+  if (media->video_stream >= 0 &&
+      stream_selected(options, media->video_stream)) {
+    t.video_in = media->video_stream;
+  }
+  if (media->audio_stream >= 0 &&
+      stream_selected(options, media->audio_stream)) {
+    t.audio_in = media->audio_stream;
+  }
+
+  int64_t start_usec = g_get_monotonic_time();
+  int64_t start_bytes = media->reader->bytes_read;
+  media_writer_t* writer = NULL;
+  AVDictionary* muxer_options = NULL;
+  gboolean success = FALSE;
+
+  if (avformat_alloc_output_context2(&t.out_ctx, NULL, options->format,
+                                     out_path)) {
+    return FALSE;
+  }
+  pthread_mutex_init(&t.mux_lock, NULL);
+  queue_init(&t.decoded);
+  queue_init(&t.scaled);
+  t.copy_out = g_new(int, t.in_ctx->nb_streams);
+  for (int i = 0; i < t.in_ctx->nb_streams; ++i) {
+    t.copy_out[i] = -1;
+  }
+
+  if (t.video_in >= 0 &&
+      transcode_can_copy(t.out_ctx->oformat,
+                         t.in_ctx->streams[t.video_in]->codecpar->codec_id)) {
+    t.video_out = add_copy_stream(&t, t.video_in);
+    t.video_copy = TRUE;
+  } else if (t.video_in >= 0 && !open_video(&t)) {
+    goto fail;
+  }
+  // Audio is only dropped for a container without any,
+  // such as an image sequence. Otherwise a failure to set
+  // up its encoder fails the cut.
+  if (t.audio_in >= 0 &&
+      t.out_ctx->oformat->audio_codec == AV_CODEC_ID_NONE &&
+      !transcode_can_copy(t.out_ctx->oformat,
+                          t.in_ctx->streams[t.audio_in]->codecpar->codec_id)) {
+    t.audio_in = -1;
+  }
+  if (t.audio_in >= 0 && !open_audio(&t)) {
+    goto fail;
+  }
+  for (int i = 0; i < t.in_ctx->nb_streams; ++i) {
+    if (i != t.video_in && i != t.audio_in && stream_selected(options, i) &&
+        transcode_can_copy(t.out_ctx->oformat,
+                           t.in_ctx->streams[i]->codecpar->codec_id)) {
+      add_copy_stream(&t, i);
+    }
+  }
+  if (!t.out_ctx->nb_streams) {
+    goto fail;
+  }
+  for (int i = 0; i < t.in_ctx->nb_streams; ++i) {
+    if (i != t.video_in && i != t.audio_in && t.copy_out[i] < 0) {
+      t.in_ctx->streams[i]->discard = AVDISCARD_ALL;
+    }
+  }
+
+  int buffer_size = options->io_buffer_size ? options->io_buffer_size
+                                             : MEDIA_IO_WRITE_BUFFER;
+  writer = out_path ? media_writer_open(out_path, buffer_size)
+                    : media_writer_open_fd(dup(options->out_fd), buffer_size);
+  if (!writer) {
+    goto fail;
+  }
+  media_writer_attach(writer, t.out_ctx, &muxer_options);
+  if (avformat_write_header(t.out_ctx, &muxer_options) < 0) {
+    goto fail;
+  }
+  int64_t start_time = (int64_t)(t.start * (double)AV_TIME_BASE);
+  if (av_seek_frame(t.in_ctx, -1, start_time, AVSEEK_FLAG_BACKWARD) < 0) {
+    goto fail;
+  }
+
+  // This thread demuxes and decodes, and handles audio,
+  // which is cheap enough to not need a stage of its own.
+  pthread_t scaler;
+  pthread_t encoder;
+  gboolean pipeline = t.video_in >= 0 && !t.video_copy;
+  if (pipeline) {
+    pthread_create(&scaler, NULL, scale_thread, &t);
+    pthread_create(&encoder, NULL, encode_thread, &t);
+  }
+
+  gboolean video_done = t.video_in < 0;
+  gboolean audio_done = t.audio_in < 0;
+  int res = 0;
+  AVPacket packet;
+  av_init_packet(&packet);
+  while (res >= 0 && !(video_done && audio_done) &&
+         !g_atomic_int_get(&t.error)) {
+    if (av_read_frame(t.in_ctx, &packet) < 0) {
+      break;
+    }
+    if (packet.stream_index == t.video_in && !video_done) {
+      res = t.video_copy
+                ? copy_packet(&t, &packet, &video_done, progress_cb)
+                : decode_video(&t, &packet, &video_done, progress_cb);
+    } else if (packet.stream_index == t.audio_in && !audio_done) {
+      res = handle_audio(&t, &packet, &audio_done);
+    } else if (packet.stream_index != t.video_in &&
+               packet.stream_index != t.audio_in &&
+               t.copy_out[packet.stream_index] >= 0) {
+      // Sparse streams such as subtitles never end the read.
+      gboolean done;
+      res = copy_packet(&t, &packet, &done, NULL);
+    }
+    av_packet_unref(&packet);
+  }
+  if (res >= 0 && !video_done && !t.video_copy) {
+    res = decode_video(&t, NULL, &video_done, progress_cb);
+  }
+  if (res >= 0 && !audio_done && t.audio_decoder) {
+    res = handle_audio(&t, NULL, &audio_done);
+  }
+  if (res >= 0 && t.audio_encoder) {
+    res = encode_audio(&t, TRUE);
+  }
+
+  if (pipeline) {
+    if (res < 0) {
+      fail_pipeline(&t);
+    }
+    queue_finish(&t.decoded);
+    pthread_join(scaler, NULL);
+    pthread_join(encoder, NULL);
+  }
+  if (res < 0 || g_atomic_int_get(&t.error)) {
+    goto fail;
+  }
+  if (av_write_trailer(t.out_ctx) < 0) {
+    goto fail;
+  }
+
+  cut_stats_t stats = {0};
+  stats.bytes_read = media->reader->bytes_read - start_bytes;
+  stats.bytes_written = writer->bytes_written;
+  stats.frames = g_atomic_int_get(t.frames);
+  stats.keyframe_cuts = options->smart_render && t.video_copy;
+  success = media_writer_close(writer) >= 0;
+  writer = NULL;
+
+  stats.seconds = (double)(g_get_monotonic_time() - start_usec) / 1e6;
+  if (options->stats) {
+    *options->stats = stats;
+  }
+
+fail:
+  if (writer) {
+    media_writer_close(writer);
+  }
+  av_dict_free(&muxer_options);
+  queue_destroy(&t.decoded);
+  queue_destroy(&t.scaled);
+  pthread_mutex_destroy(&t.mux_lock);
+  avcodec_free_context(&t.video_decoder);
+  avcodec_free_context(&t.video_encoder);
+  avcodec_free_context(&t.audio_decoder);
+  avcodec_free_context(&t.audio_encoder);
+  sws_freeContext(t.sws);
+  swr_free(&t.swr);
+  if (t.fifo) {
+    av_audio_fifo_free(t.fifo);
+  }
+  for (int i = 0; i < t.in_ctx->nb_streams; ++i) {
+    t.in_ctx->streams[i]->discard = AVDISCARD_DEFAULT;
+  }
+  g_free(t.copy_out);
+  avformat_free_context(t.out_ctx);
+  return success;
+}
+
+static gboolean stream_selected(const cut_options_t* options, int index) {
+  if (!options->streams) {
+    return TRUE;
+  }
+  for (int i = 0; i < options->num_streams; ++i) {
+    if (options->streams[i] == index) {
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+static AVCodecContext* open_decoder(AVStream* stream) {
+  AVCodec* codec = avcodec_find_decoder(stream->codecpar->codec_id);
+  if (!codec) {
+    return NULL;
+  }
+  AVCodecContext* decoder = avcodec_alloc_context3(codec);
+  avcodec_parameters_to_context(decoder, stream->codecpar);
+  decoder->pkt_timebase = stream->time_base;
+  decoder->thread_count = 0;
+  decoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  if (avcodec_open2(decoder, codec, NULL) < 0) {
+    avcodec_free_context(&decoder);
+    return NULL;
+  }
+  return decoder;
+}
+
+static int add_copy_stream(transcoder_t* t, int index) {
+  AVStream* in_stream = t->in_ctx->streams[index];
+  AVStream* out_stream = avformat_new_stream(t->out_ctx, NULL);
+  avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
+  out_stream->codecpar->codec_tag = 0;
+  out_stream->time_base = in_stream->time_base;
+  t->copy_out[index] = out_stream->index;
+  return out_stream->index;
+}
+
+static gboolean open_video(transcoder_t* t) {
+  AVStream* in_stream = t->in_ctx->streams[t->video_in];
+  AVCodec* codec = avcodec_find_encoder(t->out_ctx->oformat->video_codec);
+  if (!codec || !(t->video_decoder = open_decoder(in_stream))) {
+    return FALSE;
+  }
+  AVCodecContext* decoder = t->video_decoder;
+  AVRational rate = av_guess_frame_rate(t->in_ctx, in_stream, NULL);
+  if (rate.num <= 0 || rate.den <= 0) {
+    rate = (AVRational){25, 1};
+  }
+  t->frame_rate = av_q2d(rate);
+
+  AVCodecContext* encoder = avcodec_alloc_context3(codec);
+  t->video_encoder = encoder;
+  encoder->width = decoder->width;
+  encoder->height = decoder->height;
+  encoder->sample_aspect_ratio = decoder->sample_aspect_ratio;
+  encoder->pix_fmt =
+      codec->pix_fmts ? avcodec_find_best_pix_fmt_of_list(
+                            codec->pix_fmts, decoder->pix_fmt, 0, NULL)
+                      : decoder->pix_fmt;
+  encoder->time_base = av_inv_q(rate);
+  encoder->framerate = rate;
+
+  // Without a source bitrate, aim for about four bits per
+  // pixel each second.
+  encoder->bit_rate = in_stream->codecpar->bit_rate > 0
+                          ? in_stream->codecpar->bit_rate
+                          : (int64_t)encoder->width * encoder->height * 4;
+  encoder->thread_count = 0;
+  encoder->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+  if (t->out_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+    encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+  if (avcodec_open2(encoder, codec, NULL) < 0) {
+    return FALSE;
+  }
+
+  AVStream* out_stream = avformat_new_stream(t->out_ctx, NULL);
+  avcodec_parameters_from_context(out_stream->codecpar, encoder);
+  out_stream->time_base = encoder->time_base;
+  t->video_out = out_stream->index;
+  return TRUE;
+}
+
+static gboolean open_audio(transcoder_t* t) {
+  AVStream* in_stream = t->in_ctx->streams[t->audio_in];
+  if (transcode_can_copy(t->out_ctx->oformat, in_stream->codecpar->codec_id)) {
+    t->audio_out = add_copy_stream(t, t->audio_in);
+    t->audio_copy = TRUE;
+    return TRUE;
+  }
+
+  AVCodec* codec = avcodec_find_encoder(t->out_ctx->oformat->audio_codec);
+  if (!codec || !(t->audio_decoder = open_decoder(in_stream)) ||
+      t->audio_decoder->sample_rate <= 0) {
+    return FALSE;
+  }
+  AVCodecContext* decoder = t->audio_decoder;
+  int64_t layout = decoder->channel_layout
+                       ? decoder->channel_layout
+                       : av_get_default_channel_layout(decoder->channels);
+  AVCodecContext* encoder = avcodec_alloc_context3(codec);
+  t->audio_encoder = encoder;
+  encoder->sample_fmt = pick_sample_fmt(codec, decoder->sample_fmt);
+  encoder->sample_rate = pick_sample_rate(codec, decoder->sample_rate);
+  encoder->channels = decoder->channels;
+  encoder->channel_layout = layout;
+  encoder->bit_rate = in_stream->codecpar->bit_rate > 0
+                          ? in_stream->codecpar->bit_rate
+                          : 128000;
+  encoder->time_base = (AVRational){1, encoder->sample_rate};
+  encoder->thread_count = 0;
+  if (t->out_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+    encoder->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+  if (avcodec_open2(encoder, codec, NULL) < 0) {
+    return FALSE;
+  }
+
+  // Samples the encoder can't take as they are go through
+  // a resampler on their way into the FIFO.
+  if (encoder->sample_fmt != decoder->sample_fmt ||
+      encoder->sample_rate != decoder->sample_rate) {
+    t->swr = swr_alloc_set_opts(NULL, layout, encoder->sample_fmt,
+                                encoder->sample_rate, layout,
+                                decoder->sample_fmt, decoder->sample_rate, 0,
+                                NULL);
+    if (!t->swr || swr_init(t->swr) < 0) {
+      return FALSE;
+    }
+  }
+  t->fifo = av_audio_fifo_alloc(encoder->sample_fmt, encoder->channels,
+                                MAX(1, encoder->frame_size));
+  if (!t->fifo) {
+    return FALSE;
+  }
+
+  AVStream* out_stream = avformat_new_stream(t->out_ctx, NULL);
+  avcodec_parameters_from_context(out_stream->codecpar, encoder);
+  out_stream->time_base = encoder->time_base;
+  t->audio_out = out_stream->index;
+  return TRUE;
+}
+
+// The source format if the encoder takes it, or else the
+// first one the encoder supports.
+static enum AVSampleFormat pick_sample_fmt(AVCodec* codec,
+                                           enum AVSampleFormat preferred) {
+  if (!codec->sample_fmts) {
+    return preferred;
+  }
+  for (const enum AVSampleFormat* f = codec->sample_fmts;
+       *f != AV_SAMPLE_FMT_NONE; ++f) {
+    if (*f == preferred) {
+      return preferred;
+    }
+  }
+  return codec->sample_fmts[0];
+}
+
+// The supported rate nearest to the source rate.
+static int pick_sample_rate(AVCodec* codec, int preferred) {
+  if (!codec->supported_samplerates) {
+    return preferred;
+  }
+  int best = codec->supported_samplerates[0];
+  for (const int* r = codec->supported_samplerates; *r; ++r) {
+    if (ABS(*r - preferred) < ABS(best - preferred)) {
+      best = *r;
+    }
+  }
+  return best;
+}
+
+static int decode_video(transcoder_t* t,
+                        AVPacket* packet,
+                        gboolean* done,
+                        GSourceFunc progress_cb) {
+  // A corrupt packet only costs its own frames.
+  int res = avcodec_send_packet(t->video_decoder, packet);
+  if (res < 0) {
+    return packet ? 0 : res;
+  }
+
+  double time_base = av_q2d(t->in_ctx->streams[t->video_in]->time_base);
+  while (1) {
+    AVFrame* frame = av_frame_alloc();
+    res = avcodec_receive_frame(t->video_decoder, frame);
+    if (res < 0) {
+      av_frame_free(&frame);
+      return res == AVERROR(EAGAIN) || res == AVERROR_EOF ? 0 : res;
+    }
+    if (frame->best_effort_timestamp == AV_NOPTS_VALUE) {
+      av_frame_free(&frame);
+      continue;
+    }
+    double time = (double)frame->best_effort_timestamp * time_base;
+    if (time > t->end) {
+      *done = TRUE;
+      av_frame_free(&frame);
+      return 0;
+    }
+
+    // Frames before the range only prime the decoder, and a
+    // variable frame rate may map two frames to one slot.
+    int64_t pts = llrint((time - t->start) * t->frame_rate);
+    if (time < t->start ||
+        (t->last_pts != AV_NOPTS_VALUE && pts <= t->last_pts)) {
+      av_frame_free(&frame);
+      continue;
+    }
+    t->last_pts = pts;
+    frame->pts = pts;
+
+    report_progress(t, time, progress_cb);
+    if (!queue_push(&t->decoded, frame)) {
+      av_frame_free(&frame);
+      return AVERROR_EXIT;
+    }
+  }
+}
+
+static int handle_audio(transcoder_t* t, AVPacket* packet, gboolean* done) {
+  if (t->audio_copy) {
+    return packet ? copy_packet(t, packet, done, NULL) : 0;
+  }
+  AVStream* in_stream = t->in_ctx->streams[t->audio_in];
+  double time_base = av_q2d(in_stream->time_base);
+  if (packet) {
+    int64_t ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+    double time = (double)ts * time_base;
+    if (time > t->end) {
+      *done = TRUE;
+      return 0;
+    } else if (time < t->start) {
+      return 0;
+    }
+  }
+
+  int res = avcodec_send_packet(t->audio_decoder, packet);
+  if (res < 0) {
+    return packet ? 0 : res;
+  }
+  AVFrame* frame = av_frame_alloc();
+  while ((res = avcodec_receive_frame(t->audio_decoder, frame)) >= 0) {
+    res = queue_samples(t, frame);
+    av_frame_unref(frame);
+    if (res < 0 || (res = encode_audio(t, FALSE)) < 0) {
+      break;
+    }
+  }
+  av_frame_free(&frame);
+  return res == AVERROR(EAGAIN) || res == AVERROR_EOF ? 0 : res;
+}
+
+// Add decoded samples to the FIFO, resampled to the
+// encoder's format and rate if need be. A NULL frame
+// flushes the resampler.
+static int queue_samples(transcoder_t* t, AVFrame* frame) {
+  if (!t->swr) {
+    if (frame && av_audio_fifo_write(t->fifo, (void**)frame->extended_data,
+                                     frame->nb_samples) < frame->nb_samples) {
+      return AVERROR(ENOMEM);
+    }
+    return 0;
+  }
+
+  AVCodecContext* encoder = t->audio_encoder;
+  int in_samples = frame ? frame->nb_samples : 0;
+  int count = swr_get_out_samples(t->swr, in_samples);
+  if (count <= 0) {
+    return count;
+  }
+  uint8_t** data = NULL;
+  int res = av_samples_alloc_array_and_samples(
+      &data, NULL, encoder->channels, count, encoder->sample_fmt, 0);
+  if (res < 0) {
+    return res;
+  }
+  res = swr_convert(t->swr, data, count,
+                    frame ? (const uint8_t**)frame->extended_data : NULL,
+                    in_samples);
+  if (res > 0 && av_audio_fifo_write(t->fifo, (void**)data, res) < res) {
+    res = AVERROR(ENOMEM);
+  }
+  av_freep(&data[0]);
+  av_freep(&data);
+  return res < 0 ? res : 0;
+}
+
+// Copy a packet of a stream the container can carry as it
+// is. A copied video stream starts at its first keyframe
+// inside the range, as in a plain cut.
+static int copy_packet(transcoder_t* t,
+                       AVPacket* packet,
+                       gboolean* done,
+                       GSourceFunc progress_cb) {
+  AVStream* in_stream = t->in_ctx->streams[packet->stream_index];
+  double time_base = av_q2d(in_stream->time_base);
+  int64_t pts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+  int64_t dts = packet->dts != AV_NOPTS_VALUE ? packet->dts : pts;
+  if ((double)dts * time_base > t->end) {
+    *done = TRUE;
+    return 0;
+  }
+  if ((double)pts * time_base < t->start) {
+    return 0;
+  }
+  if (packet->stream_index == t->video_in) {
+    if (!t->video_started && !(packet->flags & AV_PKT_FLAG_KEY)) {
+      return 0;
+    }
+    t->video_started = TRUE;
+    g_atomic_int_inc(t->frames);
+    report_progress(t, (double)pts * time_base, progress_cb);
+  }
+
+  int64_t offset = (int64_t)(t->start / time_base);
+  if (packet->pts != AV_NOPTS_VALUE) {
+    packet->pts -= offset;
+  }
+  if (packet->dts != AV_NOPTS_VALUE) {
+    packet->dts -= offset;
+  }
+  int out_index = t->copy_out[packet->stream_index];
+  av_packet_rescale_ts(packet, in_stream->time_base,
+                       t->out_ctx->streams[out_index]->time_base);
+  return write_packet(t, packet, out_index);
+}
+
+static void report_progress(transcoder_t* t,
+                            double time,
+                            GSourceFunc progress_cb) {
+  if (progress_cb) {
+    float* progress = (float*)g_malloc(sizeof(float));
+    double fraction = (time - t->start) / (t->end - t->start);
+    *progress = (float)MAX(0, MIN(fraction, 1));
+    g_main_context_invoke_full(NULL, 0, progress_cb, progress, g_free);
+  }
+}
+
+// Feed the encoder whole frames from the FIFO, or every
+// remaining sample when flushing, including the ones the
+// resampler holds back.
+static int encode_audio(transcoder_t* t, gboolean flush) {
+  AVCodecContext* encoder = t->audio_encoder;
+  int res = flush ? queue_samples(t, NULL) : 0;
+  int frame_size = encoder->frame_size > 0 ? encoder->frame_size
+                                           : av_audio_fifo_size(t->fifo);
+  while (res >= 0 && av_audio_fifo_size(t->fifo) > 0 &&
+         (flush || av_audio_fifo_size(t->fifo) >= frame_size)) {
+    AVFrame* frame = av_frame_alloc();
+    frame->nb_samples = MIN(frame_size, av_audio_fifo_size(t->fifo));
+    frame->format = encoder->sample_fmt;
+    frame->channels = encoder->channels;
+    frame->channel_layout = encoder->channel_layout;
+    frame->sample_rate = encoder->sample_rate;
+    res = av_frame_get_buffer(frame, 0);
+    if (res >= 0) {
+      av_audio_fifo_read(t->fifo, (void**)frame->data, frame->nb_samples);
+      frame->pts = t->audio_pts;
+      t->audio_pts += frame->nb_samples;
+      res = avcodec_send_frame(encoder, frame);
+    }
+    av_frame_free(&frame);
+    if (res >= 0) {
+      res = drain_encoder(t, encoder, t->audio_out);
+    }
+  }
+  if (res >= 0 && flush) {
+    avcodec_send_frame(encoder, NULL);
+    res = drain_encoder(t, encoder, t->audio_out);
+  }
+  return res;
+}
+
+static int drain_encoder(transcoder_t* t,
+                         AVCodecContext* encoder,
+                         int out_index) {
+  AVPacket packet;
+  av_init_packet(&packet);
+  packet.data = NULL;
+  packet.size = 0;
+  while (1) {
+    int res = avcodec_receive_packet(encoder, &packet);
+    if (res == AVERROR(EAGAIN) || res == AVERROR_EOF) {
+      return 0;
+    } else if (res < 0) {
+      return res;
+    }
+    av_packet_rescale_ts(&packet, encoder->time_base,
+                         t->out_ctx->streams[out_index]->time_base);
+    res = write_packet(t, &packet, out_index);
+    if (res < 0) {
+      return res;
+    }
+  }
+}
+
+// Video is muxed from the encoder thread and audio from
+// the demuxer thread, so the muxer needs a lock.
+static int write_packet(transcoder_t* t, AVPacket* packet, int out_index) {
+  packet->stream_index = out_index;
+  packet->pos = -1;
+  pthread_mutex_lock(&t->mux_lock);
+  int res = av_interleaved_write_frame(t->out_ctx, packet);
+  pthread_mutex_unlock(&t->mux_lock);
+  return res;
+}
+
+static void* scale_thread(void* arg) {
+  transcoder_t* t = (transcoder_t*)arg;
+  AVCodecContext* encoder = t->video_encoder;
+  AVFrame* frame;
+  while ((frame = queue_pop(&t->decoded))) {
+    AVFrame* scaled = frame;
+    if (frame->width != encoder->width || frame->height != encoder->height ||
+        frame->format != encoder->pix_fmt) {
+      scaled = av_frame_alloc();
+      scaled->format = encoder->pix_fmt;
+      scaled->width = encoder->width;
+      scaled->height = encoder->height;
+      t->sws = sws_getCachedContext(
+          t->sws, frame->width, frame->height,
+          (enum AVPixelFormat)frame->format, encoder->width, encoder->height,
+          encoder->pix_fmt, SWS_BICUBIC, NULL, NULL, NULL);
+      if (!t->sws || av_frame_get_buffer(scaled, 32) < 0) {
+        av_frame_free(&frame);
+        av_frame_free(&scaled);
+        fail_pipeline(t);
+        break;
+      }
+      sws_scale(t->sws, (const uint8_t* const*)frame->data, frame->linesize,
+                0, frame->height, scaled->data, scaled->linesize);
+      scaled->pts = frame->pts;
+      av_frame_free(&frame);
+    }
+    if (!queue_push(&t->scaled, scaled)) {
+      av_frame_free(&scaled);
+      break;
+    }
+  }
+  queue_finish(&t->scaled);
+  return NULL;
+}
+
+static void* encode_thread(void* arg) {
+  transcoder_t* t = (transcoder_t*)arg;
+  AVFrame* frame;
+  int res = 0;
+  while (res >= 0 && (frame = queue_pop(&t->scaled))) {
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+    res = avcodec_send_frame(t->video_encoder, frame);
+    av_frame_free(&frame);
+    if (res >= 0) {
+      res = drain_encoder(t, t->video_encoder, t->video_out);
+      g_atomic_int_inc(t->frames);
+    }
+  }
+  if (res >= 0 && !g_atomic_int_get(&t->error)) {
+    avcodec_send_frame(t->video_encoder, NULL);
+    res = drain_encoder(t, t->video_encoder, t->video_out);
+  }
+  if (res < 0) {
+    fail_pipeline(t);
+  }
+  return NULL;
+}
+
+static void fail_pipeline(transcoder_t* t) {
+  g_atomic_int_set(&t->error, TRUE);
+  queue_abort(&t->decoded);
+  queue_abort(&t->scaled);
+}
+
+static void queue_init(frame_queue_t* q) {
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+}
+
+static gboolean queue_push(frame_queue_t* q, AVFrame* frame) {
+  pthread_mutex_lock(&q->lock);
+  while (q->len == TRANSCODE_QUEUE_FRAMES && !q->aborted) {
+    pthread_cond_wait(&q->cond, &q->lock);
+  }
+  gboolean pushed = !q->aborted;
+  if (pushed) {
+    q->frames[(q->start + q->len) % TRANSCODE_QUEUE_FRAMES] = frame;
+    q->len++;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return pushed;
+}
+
+static AVFrame* queue_pop(frame_queue_t* q) {
+  pthread_mutex_lock(&q->lock);
+  while (!q->len && !q->finished && !q->aborted) {
+    pthread_cond_wait(&q->cond, &q->lock);
+  }
+  AVFrame* frame = NULL;
+  if (q->len && !q->aborted) {
+    frame = q->frames[q->start];
+    q->start = (q->start + 1) % TRANSCODE_QUEUE_FRAMES;
+    q->len--;
+    pthread_cond_broadcast(&q->cond);
+  }
+  pthread_mutex_unlock(&q->lock);
+  return frame;
+}
+
+static void queue_finish(frame_queue_t* q) {
+  pthread_mutex_lock(&q->lock);
+  q->finished = TRUE;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_abort(frame_queue_t* q) {
+  pthread_mutex_lock(&q->lock);
+  q->aborted = TRUE;
+  pthread_cond_broadcast(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void queue_destroy(frame_queue_t* q) {
+  for (int i = 0; i < q->len; ++i) {
+    av_frame_free(&q->frames[(q->start + i) % TRANSCODE_QUEUE_FRAMES]);
+  }
+  pthread_mutex_destroy(&q->lock);
+  pthread_cond_destroy(&q->cond);
+}
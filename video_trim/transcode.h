@@ -0,0 +1,27 @@
+#ifndef __TRANSCODE_H__
+#define __TRANSCODE_H__
+
+#include "video_info.h"
+
+#define TRANSCODE_QUEUE_FRAMES 8
+
+// Whether the output format can carry a stream of the
+// codec without re-encoding it.
+gboolean transcode_can_copy(AVOutputFormat* format, enum AVCodecID codec_id);
+
+// Cut by re-encoding whichever of the main video and audio
+// streams the container can't carry, with the output
+// format's default codecs, resampling audio to a sample
+// format and rate the audio codec supports. Every other
+// selected stream is copied if the container can carry it
+// and dropped if not. Decoding, scaling and encoding run as
+// pipelined stages on their own threads, and the codecs use
+// frame and slice threading within each stage.
+//
+// The caller must hold the media lock.
+gboolean transcode_video(media_t* media,
+                         const char* out_path,
+                         const cut_options_t* options,
+                         GSourceFunc progress_cb);
+
+#endif
@@ -1,46 +1,223 @@
 #include "video_info.h"
+#include "packet_queue.h"
+#include "smart_render.h"
+#include "transcode.h"
 #include <libavformat/avformat.h>
 #include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+// Limits used by the fast-open path. These are enough to
+// read the headers of any sane container without scanning
+// megabytes of packet data.
+#define FAST_PROBE_SIZE (512 * 1024)
+#define FAST_ANALYZE_DURATION (500 * 1000)
+
+// Packets the demuxer may read ahead of the muxer.
+#define CUT_QUEUE_PACKETS 256
 
 typedef struct {
-  char* in_path;
+  media_t* media;
   char* out_path;
-  double start;
-  double end;
+  cut_options_t options;
   GSourceFunc progress_cb;
 } cut_arguments_t;
 
+typedef struct {
+  AVFormatContext* in_ctx;
+  const int* stream_map;
+  packet_queue_t* queue;
+} demux_arguments_t;
+
+static gboolean headers_are_reliable(AVFormatContext* format);
+static double compute_duration(AVFormatContext* format);
 static void* cut_video_thread(void* arguments);
-static gboolean cut_video_internal(const char* in_path,
+static int* map_streams(AVFormatContext* in_ctx, const cut_options_t* options);
+static void number_streams(int* stream_map, int count);
+static void* demux_thread(void* arguments);
+static void stop_demux(packet_queue_t* queue, pthread_t thread);
+static gboolean concat_input(media_t* media,
+                             AVFormatContext* out_ctx,
+                             int64_t* offset,
+                             int64_t* packets);
+static int write_packet(AVFormatContext* in_ctx,
+                        AVFormatContext* out_ctx,
+                        AVPacket* packet,
+                        int out_index,
+                        double start);
+static gboolean cut_video_internal(media_t* media,
                                    const char* out_path,
-                                   double start,
-                                   double end,
+                                   const cut_options_t* options,
                                    GSourceFunc progress_cb);
 
-gboolean video_duration(const char* path, double* duration) {
+media_t* media_open(const char* path, gboolean fast_probe) {
+  media_reader_t* reader = media_reader_open(path, MEDIA_IO_READ_BUFFER);
+  if (!reader) {
+    return NULL;
+  }
   AVFormatContext* format = avformat_alloc_context();
-  if (avformat_open_input(&format, path, NULL, NULL) != 0) {
+  format->pb = reader->avio;
+  AVDictionary* options = NULL;
+  if (fast_probe) {
+    av_dict_set_int(&options, "probesize", FAST_PROBE_SIZE, 0);
+    av_dict_set_int(&options, "analyzeduration", FAST_ANALYZE_DURATION, 0);
+  }
+  int res = avformat_open_input(&format, path, NULL, &options);
+  av_dict_free(&options);
+  if (res != 0) {
+    media_reader_close(reader);
+    return NULL;
+  }
+
+  // Containers like MP4 and Matroska carry complete codec
+  // parameters in their headers, so there is no need to
+  // decode any packets before we can stream-copy them.
+  if (!fast_probe || !headers_are_reliable(format)) {
+    if (avformat_find_stream_info(format, NULL) < 0) {
+      avformat_close_input(&format);
+      media_reader_close(reader);
+      return NULL;
+    }
+  }
+
+  media_t* media = (media_t*)malloc(sizeof(media_t));
+  bzero(media, sizeof(media_t));
+  media->path = g_strdup(path);
+  media->reader = reader;
+  media->format = format;
+  media->duration = compute_duration(format);
+  media->video_stream =
+      av_find_best_stream(format, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+  media->audio_stream =
+      av_find_best_stream(format, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+  media->ref_count = 1;
+  pthread_mutex_init(&media->lock, NULL);
+  return media;
+}
+
+media_t* media_ref(media_t* media) {
+  g_atomic_int_inc(&media->ref_count);
+  return media;
+}
+
+void media_unref(media_t* media) {
+  if (!media || !g_atomic_int_dec_and_test(&media->ref_count)) {
+    return;
+  }
+  avformat_close_input(&media->format);
+  media_reader_close(media->reader);
+  pthread_mutex_destroy(&media->lock);
+  g_free(media->path);
+  free(media);
+}
+
+void media_lock(media_t* media) {
+  pthread_mutex_lock(&media->lock);
+}
+
+gboolean media_trylock(media_t* media) {
+  return pthread_mutex_trylock(&media->lock) == 0;
+}
+
+void media_unlock(media_t* media) {
+  pthread_mutex_unlock(&media->lock);
+}
+
+int media_primary_streams(media_t* media, int* streams) {
+  int count = 0;
+  if (media->video_stream >= 0) {
+    streams[count++] = media->video_stream;
+  }
+  if (media->audio_stream >= 0) {
+    streams[count++] = media->audio_stream;
+  }
+  return count;
+}
+
+gboolean media_compatible(media_t* a, media_t* b) {
+  // Codec parameters never change after media_open(), so
+  // this does not need the locks. Taking them could also
+  // deadlock when a file is joined with itself.
+  if (a->format->nb_streams != b->format->nb_streams) {
     return FALSE;
   }
-  if (avformat_find_stream_info(format, NULL) < 0) {
-    avformat_free_context(format);
+  for (int i = 0; i < a->format->nb_streams; ++i) {
+    AVCodecParameters* pa = a->format->streams[i]->codecpar;
+    AVCodecParameters* pb = b->format->streams[i]->codecpar;
+    if (pa->codec_type != pb->codec_type || pa->codec_id != pb->codec_id) {
+      return FALSE;
+    }
+    if (pa->extradata_size != pb->extradata_size ||
+        (pa->extradata_size &&
+         memcmp(pa->extradata, pb->extradata, pa->extradata_size))) {
+      return FALSE;
+    }
+    if (pa->codec_type == AVMEDIA_TYPE_VIDEO &&
+        (pa->width != pb->width || pa->height != pb->height ||
+         pa->format != pb->format)) {
+      return FALSE;
+    }
+    if (pa->codec_type == AVMEDIA_TYPE_AUDIO &&
+        (pa->sample_rate != pb->sample_rate ||
+         pa->channels != pb->channels || pa->format != pb->format)) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static gboolean headers_are_reliable(AVFormatContext* format) {
+  const char* name = format->iformat->name;
+  if (!strstr(name, "mp4") && !strstr(name, "matroska")) {
     return FALSE;
   }
-  *duration = ((double)format->duration) / (double)AV_TIME_BASE;
-  avformat_free_context(format);
+  for (int i = 0; i < format->nb_streams; ++i) {
+    AVCodecParameters* par = format->streams[i]->codecpar;
+    if (par->codec_id == AV_CODEC_ID_NONE) {
+      return FALSE;
+    }
+    if (par->codec_type == AVMEDIA_TYPE_VIDEO &&
+        (par->width <= 0 || par->height <= 0)) {
+      return FALSE;
+    }
+    if (par->codec_type == AVMEDIA_TYPE_AUDIO &&
+        (par->sample_rate <= 0 || par->channels <= 0)) {
+      return FALSE;
+    }
+  }
   return TRUE;
 }
 
-void cut_video(char* in_path,
+static double compute_duration(AVFormatContext* format) {
+  if (format->duration != AV_NOPTS_VALUE) {
+    return ((double)format->duration) / (double)AV_TIME_BASE;
+  }
+
+  // Without a full probe, the container duration may be
+  // unset even though every stream knows its own length.
+  double duration = 0;
+  for (int i = 0; i < format->nb_streams; ++i) {
+    AVStream* stream = format->streams[i];
+    if (stream->duration != AV_NOPTS_VALUE) {
+      duration = MAX(duration, (double)stream->duration *
+                                   av_q2d(stream->time_base));
+    }
+  }
+  return duration;
+}
+
+void cut_video(media_t* media,
                char* out_path,
-               double start,
-               double end,
+               const cut_options_t* options,
                GSourceFunc progress_cb) {
   cut_arguments_t* args = (cut_arguments_t*)malloc(sizeof(cut_arguments_t));
-  args->in_path = in_path;
+  args->media = media_ref(media);
   args->out_path = out_path;
-  args->start = start;
-  args->end = end;
+  args->options = *options;
+  args->options.streams =
+      g_memdup(options->streams, sizeof(int) * options->num_streams);
+  args->options.format = g_strdup(options->format);
   args->progress_cb = progress_cb;
 
   pthread_t thread;
@@ -52,62 +229,135 @@ static void* cut_video_thread(void* arguments) {
   cut_arguments_t* args = (cut_arguments_t*)arguments;
   float* value = (float*)g_malloc(sizeof(float));
   *value = PROGRESS_FAILURE;
-  if (cut_video_internal(args->in_path, args->out_path, args->start, args->end,
-                         args->progress_cb)) {
+  if (cut_video_sync(args->media, args->out_path, &args->options,
+                     args->progress_cb)) {
     *value = PROGRESS_SUCCESS;
   }
   g_main_context_invoke_full(NULL, 0, args->progress_cb, value, g_free);
-  g_free(args->in_path);
+  media_unref(args->media);
   g_free(args->out_path);
+  g_free((int*)args->options.streams);
+  g_free((char*)args->options.format);
   free(args);
   return NULL;
 }
 
-gboolean cut_video_internal(const char* in_path,
-                            const char* out_path,
-                            double start,
-                            double end,
-                            GSourceFunc progress_cb) {
-  AVFormatContext* in_ctx = avformat_alloc_context();
-  if (avformat_open_input(&in_ctx, in_path, NULL, NULL) != 0) {
-    return FALSE;
-  }
-  if (avformat_find_stream_info(in_ctx, NULL) < 0) {
-    avformat_free_context(in_ctx);
-    return FALSE;
-  }
+gboolean cut_video_sync(media_t* media,
+                        const char* out_path,
+                        const cut_options_t* options,
+                        GSourceFunc progress_cb) {
+  media_lock(media);
+  gboolean res = cut_video_internal(media, out_path, options, progress_cb);
+  media_unlock(media);
+  return res;
+}
+
+static gboolean cut_video_internal(media_t* media,
+                                   const char* out_path,
+                                   const cut_options_t* options,
+                                   GSourceFunc progress_cb) {
+  AVFormatContext* in_ctx = media->format;
+  double start = options->start;
+  double end = options->end;
+  smart_render_t* renderer = NULL;
+  media_writer_t* writer = NULL;
+  int64_t start_usec = g_get_monotonic_time();
+  int64_t start_bytes = media->reader->bytes_read;
+  int64_t first_packet_usec = 0;
+  int64_t packets = 0;
+  packet_queue_t* queue = NULL;
+  pthread_t demuxer;
+  AVDictionary* muxer_options = NULL;
+  gboolean success = FALSE;
 
   AVFormatContext* out_ctx;
-  if (avformat_alloc_output_context2(&out_ctx, NULL, NULL, out_path)) {
-    avformat_free_context(in_ctx);
+  if (avformat_alloc_output_context2(&out_ctx, NULL, options->format,
+                                     out_path)) {
     return FALSE;
   }
 
+  // Only the main video and audio streams are worth
+  // re-encoding for. Any other stream the container can't
+  // carry is dropped.
+  int* stream_map = map_streams(in_ctx, options);
+  for (int i = 0; i < in_ctx->nb_streams; ++i) {
+    if (stream_map[i] < 0 ||
+        transcode_can_copy(out_ctx->oformat,
+                           in_ctx->streams[i]->codecpar->codec_id)) {
+      continue;
+    }
+    if (i == media->video_stream || i == media->audio_stream) {
+      g_free(stream_map);
+      avformat_free_context(out_ctx);
+      return transcode_video(media, out_path, options, progress_cb);
+    }
+    stream_map[i] = -1;
+  }
+  number_streams(stream_map, in_ctx->nb_streams);
+
+  // Unselected streams are discarded by the demuxer, so
+  // their packets are never even read.
   for (int i = 0; i < in_ctx->nb_streams; ++i) {
     AVStream* in_stream = in_ctx->streams[i];
+    if (stream_map[i] < 0) {
+      in_stream->discard = AVDISCARD_ALL;
+      continue;
+    }
     AVStream* out_stream = avformat_new_stream(
         out_ctx, avcodec_find_encoder(in_stream->codecpar->codec_id));
     avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
     out_stream->codecpar->codec_tag = 0;
   }
 
-  if (avio_open(&out_ctx->pb, out_path, AVIO_FLAG_WRITE) < 0) {
+  int buffer_size = options->io_buffer_size ? options->io_buffer_size
+                                             : MEDIA_IO_WRITE_BUFFER;
+  writer = out_path ? media_writer_open(out_path, buffer_size)
+                    : media_writer_open_fd(dup(options->out_fd), buffer_size);
+  if (!writer) {
     goto fail;
   }
-  if (avformat_init_output(out_ctx, NULL) < 0) {
+  media_writer_attach(writer, out_ctx, &muxer_options);
+  if (avformat_init_output(out_ctx, &muxer_options) < 0) {
     goto fail;
   }
   if (avformat_write_header(out_ctx, NULL) < 0) {
     goto fail;
   }
 
+  // A smart render has to start decoding at the keyframe
+  // before the range, while a plain copy starts at the
+  // first keyframe inside it.
+  int seek_flags = 0;
+  if (options->smart_render && media->video_stream >= 0 &&
+      stream_map[media->video_stream] >= 0) {
+    renderer = smart_render_new(in_ctx->streams[media->video_stream], out_ctx,
+                                stream_map[media->video_stream], start, end);
+    if (!renderer) {
+      goto fail;
+    }
+    seek_flags = AVSEEK_FLAG_BACKWARD;
+  }
+
   int64_t start_time = (int64_t)(start * (double)AV_TIME_BASE);
-  if (av_seek_frame(in_ctx, -1, start_time, 0) < 0) {
+  if (av_seek_frame(in_ctx, -1, start_time, seek_flags) < 0) {
     goto fail;
   }
+
+  // Reading runs on its own thread, so that demuxing and
+  // muxing overlap instead of adding up.
+  queue = packet_queue_new(CUT_QUEUE_PACKETS);
+  demux_arguments_t demux = {in_ctx, stream_map, queue};
+  pthread_create(&demuxer, NULL, demux_thread, &demux);
+
   AVPacket packet;
   av_init_packet(&packet);
-  while (av_read_frame(in_ctx, &packet) >= 0) {
+  gboolean at_eof = FALSE;
+  while (1) {
+    if (!packet_queue_pop(queue, &packet)) {
+      at_eof = TRUE;
+      break;
+    }
+    int out_index = stream_map[packet.stream_index];
     AVRational time_base = in_ctx->streams[packet.stream_index]->time_base;
     if (packet.pts == AV_NOPTS_VALUE) {
       packet.pts = packet.dts;
@@ -117,34 +367,294 @@ gboolean cut_video_internal(const char* in_path,
     double pts =
         ((double)packet.pts * (double)time_base.num) / (double)time_base.den;
 
-    float* progress = (float*)g_malloc(sizeof(float));
-    *progress = (float)MAX(0, MIN((dts - start) / (end - start), 1));
-    g_main_context_invoke_full(NULL, 0, progress_cb, progress, g_free);
+    packets++;
+    if (progress_cb) {
+      float* progress = (float*)g_malloc(sizeof(float));
+      *progress = (float)MAX(0, MIN((dts - start) / (end - start), 1));
+      g_main_context_invoke_full(NULL, 0, progress_cb, progress, g_free);
+    }
+
+    if (!first_packet_usec) {
+      first_packet_usec = g_get_monotonic_time();
+    }
+
+    if (renderer) {
+      // Other streams may run past the end before the video
+      // stream does, so only the video stream stops the read.
+      int res = 0;
+      int stream_index = packet.stream_index;
+      if (stream_index == media->video_stream) {
+        res = smart_render_packet(renderer, &packet);
+      } else if (pts >= start && dts <= end) {
+        res = write_packet(in_ctx, out_ctx, &packet, out_index, start);
+      }
+      av_packet_unref(&packet);
+      if (res < 0) {
+        goto fail;
+      } else if (stream_index == media->video_stream && dts > end) {
+        break;
+      }
+      continue;
+    }
 
     if (dts > end) {
       break;
     }
+    int res = write_packet(in_ctx, out_ctx, &packet, out_index, start);
+    av_packet_unref(&packet);
+    if (res < 0) {
+      goto fail;
+    }
+  }
+  av_packet_unref(&packet);
+  stop_demux(queue, demuxer);
+  queue = NULL;
 
-    time_base = out_ctx->streams[packet.stream_index]->time_base;
-    packet.dts = (int64_t)((dts - start) * (double)time_base.den /
-                           (double)time_base.num);
-    packet.pts = (int64_t)((pts - start) * (double)time_base.den /
-                           (double)time_base.num);
-    av_write_frame(out_ctx, &packet);
+  if (renderer && smart_render_finish(renderer, at_eof) < 0) {
+    goto fail;
+  }
+  if (av_write_trailer(out_ctx) < 0) {
+    goto fail;
   }
 
-  av_write_trailer(out_ctx);
+  cut_stats_t stats = {0};
+  stats.bytes_read = media->reader->bytes_read - start_bytes;
+  stats.bytes_written = writer->bytes_written;
+  stats.packets = packets;
+  stats.keyframe_cuts = renderer && smart_render_keyframe_cuts(renderer);
+  stats.first_packet_seconds =
+      (double)(MAX(first_packet_usec, start_usec) - start_usec) / 1e6;
+  success = media_writer_close(writer) >= 0;
+  writer = NULL;
 
-  avio_close(out_ctx->pb);
-  avformat_free_context(in_ctx);
+  stats.seconds = (double)(g_get_monotonic_time() - start_usec) / 1e6;
+  if (options->stats) {
+    *options->stats = stats;
+  }
+
+fail:
+  if (queue) {
+    stop_demux(queue, demuxer);
+  }
+  if (renderer) {
+    smart_render_free(renderer);
+  }
+  if (writer) {
+    media_writer_close(writer);
+  }
+  for (int i = 0; i < in_ctx->nb_streams; ++i) {
+    in_ctx->streams[i]->discard = AVDISCARD_DEFAULT;
+  }
+  av_dict_free(&muxer_options);
+  g_free(stream_map);
   avformat_free_context(out_ctx);
-  return TRUE;
+  return success;
+}
+
+static int* map_streams(AVFormatContext* in_ctx,
+                        const cut_options_t* options) {
+  int* stream_map = g_new(int, in_ctx->nb_streams);
+  for (int i = 0; i < in_ctx->nb_streams; ++i) {
+    stream_map[i] = options->streams ? -1 : 0;
+  }
+  for (int i = 0; i < options->num_streams; ++i) {
+    int index = options->streams[i];
+    if (index >= 0 && index < in_ctx->nb_streams) {
+      stream_map[index] = 0;
+    }
+  }
+  number_streams(stream_map, in_ctx->nb_streams);
+  return stream_map;
+}
+
+// Output streams keep the relative order of the inputs.
+static void number_streams(int* stream_map, int count) {
+  int out_index = 0;
+  for (int i = 0; i < count; ++i) {
+    if (stream_map[i] >= 0) {
+      stream_map[i] = out_index++;
+    }
+  }
+}
+
+static void* demux_thread(void* arguments) {
+  demux_arguments_t* args = (demux_arguments_t*)arguments;
+  AVPacket packet;
+  av_init_packet(&packet);
+  while (av_read_frame(args->in_ctx, &packet) >= 0) {
+    gboolean pushed = (args->stream_map &&
+                       args->stream_map[packet.stream_index] < 0) ||
+                      packet_queue_push(args->queue, &packet);
+    av_packet_unref(&packet);
+    if (!pushed) {
+      break;
+    }
+  }
+  packet_queue_finish(args->queue);
+  return NULL;
+}
+
+static void stop_demux(packet_queue_t* queue, pthread_t thread) {
+  packet_queue_abort(queue);
+  pthread_join(thread, NULL);
+  packet_queue_free(queue);
+}
+
+gboolean concat_videos(media_t** inputs,
+                       int count,
+                       const char* out_path,
+                       const concat_options_t* options) {
+  if (count < 1) {
+    return FALSE;
+  }
+  for (int i = 1; i < count; ++i) {
+    if (!media_compatible(inputs[0], inputs[i])) {
+      return FALSE;
+    }
+  }
+
+  int64_t start_usec = g_get_monotonic_time();
+  int64_t start_bytes[count];
+  for (int i = 0; i < count; ++i) {
+    start_bytes[i] = inputs[i]->reader->bytes_read;
+  }
+  int64_t offset = 0;
+  int64_t packets = 0;
+  AVDictionary* muxer_options = NULL;
+  gboolean success = FALSE;
+
+  AVFormatContext* out_ctx;
+  if (avformat_alloc_output_context2(&out_ctx, NULL, options->format,
+                                     out_path)) {
+    return FALSE;
+  }
+  AVFormatContext* first = inputs[0]->format;
+  for (int i = 0; i < first->nb_streams; ++i) {
+    AVStream* in_stream = first->streams[i];
+    AVStream* out_stream = avformat_new_stream(
+        out_ctx, avcodec_find_encoder(in_stream->codecpar->codec_id));
+    avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar);
+    out_stream->codecpar->codec_tag = 0;
+  }
+
+  int buffer_size = options->io_buffer_size ? options->io_buffer_size
+                                             : MEDIA_IO_WRITE_BUFFER;
+  media_writer_t* writer =
+      out_path ? media_writer_open(out_path, buffer_size)
+               : media_writer_open_fd(dup(options->out_fd), buffer_size);
+  if (!writer) {
+    goto fail;
+  }
+  media_writer_attach(writer, out_ctx, &muxer_options);
+  if (avformat_write_header(out_ctx, &muxer_options) < 0) {
+    goto fail;
+  }
+
+  // Inputs are locked one at a time, so the same file may
+  // appear more than once.
+  for (int i = 0; i < count; ++i) {
+    media_lock(inputs[i]);
+    gboolean res = concat_input(inputs[i], out_ctx, &offset, &packets);
+    media_unlock(inputs[i]);
+    if (!res) {
+      goto fail;
+    }
+  }
+  if (av_write_trailer(out_ctx) < 0) {
+    goto fail;
+  }
+
+  cut_stats_t stats = {0};
+  for (int i = 0; i < count; ++i) {
+    stats.bytes_read += inputs[i]->reader->bytes_read - start_bytes[i];
+  }
+  stats.bytes_written = writer->bytes_written;
+  stats.packets = packets;
+  success = media_writer_close(writer) >= 0;
+  writer = NULL;
+
+  stats.seconds = (double)(g_get_monotonic_time() - start_usec) / 1e6;
+  if (options->stats) {
+    *options->stats = stats;
+  }
 
 fail:
-  if (out_ctx->pb) {
-    avio_close(out_ctx->pb);
+  if (writer) {
+    media_writer_close(writer);
   }
-  avformat_free_context(in_ctx);
+  av_dict_free(&muxer_options);
   avformat_free_context(out_ctx);
-  return FALSE;
+  return success;
+}
+
+// Copy every packet of one input, shifted by offset (in
+// AV_TIME_BASE units). On return offset holds the end of
+// the longest stream, where the next input will start.
+static gboolean concat_input(media_t* media,
+                             AVFormatContext* out_ctx,
+                             int64_t* offset,
+                             int64_t* packets) {
+  AVFormatContext* in_ctx = media->format;
+  int64_t start_time =
+      in_ctx->start_time != AV_NOPTS_VALUE ? in_ctx->start_time : 0;
+  if (av_seek_frame(in_ctx, -1, start_time, AVSEEK_FLAG_BACKWARD) < 0) {
+    return FALSE;
+  }
+
+  packet_queue_t* queue = packet_queue_new(CUT_QUEUE_PACKETS);
+  demux_arguments_t demux = {in_ctx, NULL, queue};
+  pthread_t demuxer;
+  pthread_create(&demuxer, NULL, demux_thread, &demux);
+
+  int64_t end = *offset;
+  int res = 0;
+  AVPacket packet;
+  av_init_packet(&packet);
+  while (res >= 0 && packet_queue_pop(queue, &packet)) {
+    AVStream* in_stream = in_ctx->streams[packet.stream_index];
+    AVStream* out_stream = out_ctx->streams[packet.stream_index];
+    int64_t shift = av_rescale_q(*offset - start_time, AV_TIME_BASE_Q,
+                                 out_stream->time_base);
+    av_packet_rescale_ts(&packet, in_stream->time_base,
+                         out_stream->time_base);
+    if (packet.dts != AV_NOPTS_VALUE) {
+      packet.dts += shift;
+    }
+    if (packet.pts != AV_NOPTS_VALUE) {
+      packet.pts += shift;
+    }
+    int64_t last = packet.pts != AV_NOPTS_VALUE ? packet.pts : packet.dts;
+    if (last != AV_NOPTS_VALUE) {
+      end = MAX(end, av_rescale_q(last + packet.duration,
+                                  out_stream->time_base, AV_TIME_BASE_Q));
+    }
+    packet.pos = -1;
+    res = av_interleaved_write_frame(out_ctx, &packet);
+    av_packet_unref(&packet);
+    (*packets)++;
+  }
+  stop_demux(queue, demuxer);
+
+  *offset = end;
+  return res >= 0;
+}
+
+static int write_packet(AVFormatContext* in_ctx,
+                        AVFormatContext* out_ctx,
+                        AVPacket* packet,
+                        int out_index,
+                        double start) {
+  AVRational time_base = in_ctx->streams[packet->stream_index]->time_base;
+  double dts =
+      ((double)packet->dts * (double)time_base.num) / (double)time_base.den;
+  double pts =
+      ((double)packet->pts * (double)time_base.num) / (double)time_base.den;
+  time_base = out_ctx->streams[out_index]->time_base;
+  packet->dts =
+      (int64_t)((dts - start) * (double)time_base.den / (double)time_base.num);
+  packet->pts =
+      (int64_t)((pts - start) * (double)time_base.den / (double)time_base.num);
+  packet->stream_index = out_index;
+  packet->pos = -1;
+  return av_interleaved_write_frame(out_ctx, packet);
 }
@@ -1,16 +1,141 @@
 #ifndef __VIDEO_INFO_H__
 #define __VIDEO_INFO_H__
 
-#include <gtk/gtk.h>
+#include <glib.h>
+#include <libavformat/avformat.h>
+#include <pthread.h>
+#include "media_io.h"
 
 #define PROGRESS_SUCCESS ((float)2.0)
 #define PROGRESS_FAILURE ((float)-1.0)
 
-gboolean video_duration(const char* path, double* duration);
-void cut_video(char* in_path,
+// An opened and probed input file.
+//
+// The demuxer context is kept alive so that the duration
+// query, previews and cuts do not each re-probe the file.
+// Anything that touches the context must hold the lock.
+typedef struct {
+  char* path;
+  media_reader_t* reader;
+  AVFormatContext* format;
+  double duration;
+  int video_stream;
+  int audio_stream;
+
+  pthread_mutex_t lock;
+  int ref_count;
+} media_t;
+
+media_t* media_open(const char* path, gboolean fast_probe);
+media_t* media_ref(media_t* media);
+void media_unref(media_t* media);
+void media_lock(media_t* media);
+gboolean media_trylock(media_t* media);
+void media_unlock(media_t* media);
+
+typedef struct {
+  int64_t bytes_read;
+  int64_t bytes_written;
+  int64_t packets;
+  double seconds;
+
+  // Time from the start of the cut until the first packet
+  // came out of the demuxer, before anything is written.
+  double first_packet_seconds;
+
+  // Frames encoded, if the cut had to transcode. This is
+  // updated atomically while the cut runs.
+  int frames;
+
+  // Set when a frame-accurate cut was asked for, but the
+  // video could only be cut on keyframes, because re-encoded
+  // frames would not decode against the copied stream's
+  // parameter sets.
+  gboolean keyframe_cuts;
+} cut_stats_t;
+
+typedef struct {
+  double start;
+  double end;
+
+  // Re-encode the partial GOPs at either end of the range
+  // so that the cut lands on exact frames instead of on
+  // the nearest keyframe.
+  gboolean smart_render;
+
+  // Size of the output write-behind buffers, or 0 for the
+  // default.
+  int io_buffer_size;
+
+  // Muxer to use, such as "mpegts", or NULL to guess from
+  // the output path. Required when writing to stdout.
+  const char* format;
+
+  // Input stream indices to keep, or NULL for all of them.
+  // Output streams are numbered in input order.
+  const int* streams;
+  int num_streams;
+
+  // Where to write when the output path is NULL, such as one
+  // end of a socket pair. The descriptor is duplicated, so
+  // the caller still owns it, but it has to stay open until
+  // the cut is done. format is required.
+  int out_fd;
+
+  // If set, receives I/O statistics once the cut is done.
+  cut_stats_t* stats;
+} cut_options_t;
+
+typedef struct {
+  // Size of the output write-behind buffers, or 0 for the
+  // default.
+  int io_buffer_size;
+
+  // Muxer to use, or NULL to guess from the output path.
+  const char* format;
+
+  // Where to write when the output path is NULL, as for
+  // cut_options_t.
+  int out_fd;
+
+  // If set, receives I/O statistics once the join is done.
+  cut_stats_t* stats;
+} concat_options_t;
+
+// Fill streams with the main video and audio streams and
+// return how many there are (at most two).
+int media_primary_streams(media_t* media, int* streams);
+
+// Whether packets of b can be stream-copied after those of
+// a: both need the same streams with the same codecs,
+// dimensions, sample formats and codec extradata.
+gboolean media_compatible(media_t* a, media_t* b);
+
+// An out_path of "-" writes to stdout, and a NULL one to
+// options->out_fd. Outputs that are not regular files are
+// streamed as they are muxed, and MP4 outputs become
+// fragmented MP4.
+void cut_video(media_t* media,
                char* out_path,
-               double start,
-               double end,
+               const cut_options_t* options,
                GSourceFunc progress_cb);
 
-#endif
\ No newline at end of file
+// Perform a cut on the calling thread. The progress
+// callback may be NULL; otherwise it is invoked on the
+// default main context as in cut_video().
+gboolean cut_video_sync(media_t* media,
+                        const char* out_path,
+                        const cut_options_t* options,
+                        GSourceFunc progress_cb);
+
+// Join the inputs, in order, into one output without
+// re-encoding. Timestamps of each input are shifted to
+// follow the end of the previous one. Fails before writing
+// anything if the inputs are not compatible. A NULL
+// out_path writes to options->out_fd.
+gboolean concat_videos(media_t** inputs,
+                       int count,
+                       const char* out_path,
+                       const concat_options_t* options);
+
+#endif
@@ -0,0 +1,491 @@
+#include "waveform.h"
+#include <libavcodec/avcodec.h>
+#include <libavutil/samplefmt.h>
+#include <math.h>
+#include <string.h>
+#include "media_cache.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define WAVEFORM_CACHE_KIND "waveform"
+#define WAVEFORM_CACHE_MAGIC 0x46575456
+#define WAVEFORM_CACHE_VERSION 1
+
+struct waveform_loader {
+  char* path;
+  waveform_cb cb;
+  gpointer user_data;
+  waveform_t* result;
+  int cancelled;
+  int ref_count;
+};
+
+// Running totals for the bucket being filled.
+typedef struct {
+  float min;
+  float max;
+  double sum_squares;
+  int64_t values;
+  int samples;
+} bucket_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  double rate;
+  int32_t num_levels;
+  int32_t lengths[WAVEFORM_MAX_LEVELS];
+} cache_header_t;
+
+static void* waveform_thread(void* arg);
+static gboolean deliver_waveform(gpointer data);
+static void unref_loader(gpointer data);
+static waveform_t* compute_waveform(waveform_loader_t* l);
+static gboolean reduce_frame(AVFrame* frame,
+                             int bucket_samples,
+                             bucket_t* bucket,
+                             GArray* peaks);
+static gboolean reduce_samples(enum AVSampleFormat format,
+                               const uint8_t* data,
+                               int count,
+                               bucket_t* bucket);
+static void reduce_float(const float* samples, int count, bucket_t* bucket);
+static void reduce_s16(const int16_t* samples, int count, bucket_t* bucket);
+static void reduce_value(float value, bucket_t* bucket);
+static void reset_bucket(bucket_t* bucket);
+static void emit_bucket(bucket_t* bucket, GArray* peaks);
+static void build_pyramid(waveform_t* w);
+static waveform_t* load_cached(const char* path);
+static void store_cached(const char* path, const waveform_t* w);
+
+waveform_loader_t* waveform_load(media_t* media,
+                                 waveform_cb cb,
+                                 gpointer user_data) {
+  waveform_loader_t* l = g_new0(waveform_loader_t, 1);
+  l->path = g_strdup(media->path);
+  l->cb = cb;
+  l->user_data = user_data;
+
+  // One reference for the caller and one for the thread.
+  l->ref_count = 2;
+  pthread_t thread;
+  pthread_create(&thread, NULL, waveform_thread, l);
+  pthread_detach(thread);
+  return l;
+}
+
+void waveform_loader_cancel(waveform_loader_t* l) {
+  if (!l) {
+    return;
+  }
+  g_atomic_int_set(&l->cancelled, TRUE);
+  unref_loader(l);
+}
+
+void waveform_columns(const waveform_t* w,
+                      double start,
+                      double end,
+                      int count,
+                      waveform_peak_t* columns) {
+  // Use the coarsest level that still has at least one
+  // bucket per column.
+  double span = (end - start) / count;
+  int level = 0;
+  while (level + 1 < w->num_levels &&
+         ldexp(w->rate, -(level + 1)) * span >= 1) {
+    level++;
+  }
+  double rate = ldexp(w->rate, -level);
+  const waveform_peak_t* peaks = w->levels[level];
+  int length = w->lengths[level];
+
+  for (int x = 0; x < count; ++x) {
+    int first = (int)floor((start + span * x) * rate);
+    int last = MAX(first + 1, (int)ceil((start + span * (x + 1)) * rate));
+    first = MAX(first, 0);
+    last = MIN(last, length);
+    waveform_peak_t column = {0, 0, 0};
+    for (int i = first; i < last; ++i) {
+      const waveform_peak_t* peak = &peaks[i];
+      column.min = i == first ? peak->min : MIN(column.min, peak->min);
+      column.max = i == first ? peak->max : MAX(column.max, peak->max);
+      column.rms = MAX(column.rms, peak->rms);
+    }
+    columns[x] = column;
+  }
+}
+
+void waveform_free(waveform_t* w) {
+  if (!w) {
+    return;
+  }
+  for (int i = 0; i < w->num_levels; ++i) {
+    g_free(w->levels[i]);
+  }
+  g_free(w);
+}
+
+static void* waveform_thread(void* arg) {
+  waveform_loader_t* l = (waveform_loader_t*)arg;
+  waveform_t* w = load_cached(l->path);
+  if (!w) {
+    w = compute_waveform(l);
+    if (w) {
+      store_cached(l->path, w);
+    }
+  }
+  l->result = w;
+  g_main_context_invoke_full(NULL, 0, deliver_waveform, l, unref_loader);
+  return NULL;
+}
+
+static gboolean deliver_waveform(gpointer data) {
+  waveform_loader_t* l = (waveform_loader_t*)data;
+  if (!g_atomic_int_get(&l->cancelled)) {
+    l->cb(l->result, l->user_data);
+    l->result = NULL;
+  }
+  return FALSE;
+}
+
+static void unref_loader(gpointer data) {
+  waveform_loader_t* l = (waveform_loader_t*)data;
+  if (g_atomic_int_dec_and_test(&l->ref_count)) {
+    waveform_free(l->result);
+    g_free(l->path);
+    g_free(l);
+  }
+}
+
+static waveform_t* compute_waveform(waveform_loader_t* l) {
+  media_t* media = media_open(l->path, TRUE);
+  if (!media) {
+    return NULL;
+  }
+  waveform_t* w = NULL;
+  AVCodecContext* decoder = NULL;
+  AVFrame* frame = av_frame_alloc();
+  GArray* peaks = g_array_new(FALSE, FALSE, sizeof(waveform_peak_t));
+  AVFormatContext* format = media->format;
+  int stream_index = media->audio_stream;
+  if (stream_index < 0) {
+    goto done;
+  }
+  for (int i = 0; i < format->nb_streams; ++i) {
+    if (i != stream_index) {
+      format->streams[i]->discard = AVDISCARD_ALL;
+    }
+  }
+
+  AVCodecParameters* par = format->streams[stream_index]->codecpar;
+  AVCodec* codec = avcodec_find_decoder(par->codec_id);
+  if (!codec) {
+    goto done;
+  }
+  decoder = avcodec_alloc_context3(codec);
+  avcodec_parameters_to_context(decoder, par);
+  if (avcodec_open2(decoder, codec, NULL) < 0 || decoder->sample_rate <= 0) {
+    goto done;
+  }
+
+  int bucket_samples = MAX(1, decoder->sample_rate / WAVEFORM_RATE);
+  bucket_t bucket;
+  reset_bucket(&bucket);
+  gboolean ok = TRUE;
+  while (ok && !g_atomic_int_get(&l->cancelled)) {
+    int res = avcodec_receive_frame(decoder, frame);
+    if (res >= 0) {
+      ok = reduce_frame(frame, bucket_samples, &bucket, peaks);
+      av_frame_unref(frame);
+      continue;
+    } else if (res != AVERROR(EAGAIN)) {
+      break;
+    }
+    AVPacket packet;
+    av_init_packet(&packet);
+    if (av_read_frame(format, &packet) < 0) {
+      avcodec_send_packet(decoder, NULL);
+      continue;
+    }
+    if (packet.stream_index == stream_index) {
+      avcodec_send_packet(decoder, &packet);
+    }
+    av_packet_unref(&packet);
+  }
+  if (!ok || g_atomic_int_get(&l->cancelled)) {
+    goto done;
+  }
+  if (bucket.samples) {
+    emit_bucket(&bucket, peaks);
+  }
+  if (!peaks->len) {
+    goto done;
+  }
+
+  w = g_new0(waveform_t, 1);
+  w->rate = (double)decoder->sample_rate / bucket_samples;
+  w->num_levels = 1;
+  w->lengths[0] = peaks->len;
+  w->levels[0] = (waveform_peak_t*)g_array_free(peaks, FALSE);
+  peaks = NULL;
+  build_pyramid(w);
+
+done:
+  if (peaks) {
+    g_array_free(peaks, TRUE);
+  }
+  av_frame_free(&frame);
+  avcodec_free_context(&decoder);
+  media_unref(media);
+  return w;
+}
+
+static gboolean reduce_frame(AVFrame* frame,
+                             int bucket_samples,
+                             bucket_t* bucket,
+                             GArray* peaks) {
+  enum AVSampleFormat format = (enum AVSampleFormat)frame->format;
+  gboolean planar = av_sample_fmt_is_planar(format);
+  int planes = planar ? frame->channels : 1;
+  int stride = planar ? 1 : frame->channels;
+  int bytes = av_get_bytes_per_sample(format);
+
+  // Every channel of a bucket is reduced together, so the
+  // strip shows the loudest channel.
+  int offset = 0;
+  while (offset < frame->nb_samples) {
+    int count =
+        MIN(frame->nb_samples - offset, bucket_samples - bucket->samples);
+    for (int i = 0; i < planes; ++i) {
+      const uint8_t* data =
+          frame->extended_data[i] + (size_t)offset * stride * bytes;
+      if (!reduce_samples(format, data, count * stride, bucket)) {
+        return FALSE;
+      }
+    }
+    bucket->samples += count;
+    offset += count;
+    if (bucket->samples == bucket_samples) {
+      emit_bucket(bucket, peaks);
+    }
+  }
+  return TRUE;
+}
+
+static gboolean reduce_samples(enum AVSampleFormat format,
+                               const uint8_t* data,
+                               int count,
+                               bucket_t* bucket) {
+  switch (av_get_packed_sample_fmt(format)) {
+    case AV_SAMPLE_FMT_FLT:
+      reduce_float((const float*)data, count, bucket);
+      return TRUE;
+    case AV_SAMPLE_FMT_S16:
+      reduce_s16((const int16_t*)data, count, bucket);
+      return TRUE;
+    case AV_SAMPLE_FMT_S32:
+      for (int i = 0; i < count; ++i) {
+        reduce_value((float)((const int32_t*)data)[i] / 2147483648.0f,
+                     bucket);
+      }
+      return TRUE;
+    case AV_SAMPLE_FMT_DBL:
+      for (int i = 0; i < count; ++i) {
+        reduce_value((float)((const double*)data)[i], bucket);
+      }
+      return TRUE;
+    default:
+      return FALSE;
+  }
+}
+
+static void reduce_float(const float* samples, int count, bucket_t* bucket) {
+  float min = bucket->min;
+  float max = bucket->max;
+  double sum = 0;
+  int i = 0;
+#ifdef __SSE2__
+  __m128 vmin = _mm_set1_ps(min);
+  __m128 vmax = _mm_set1_ps(max);
+  __m128 vsum = _mm_setzero_ps();
+  for (; i + 4 <= count; i += 4) {
+    __m128 v = _mm_loadu_ps(samples + i);
+    vmin = _mm_min_ps(vmin, v);
+    vmax = _mm_max_ps(vmax, v);
+    vsum = _mm_add_ps(vsum, _mm_mul_ps(v, v));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, vmin);
+  min = MIN(MIN(lanes[0], lanes[1]), MIN(lanes[2], lanes[3]));
+  _mm_storeu_ps(lanes, vmax);
+  max = MAX(MAX(lanes[0], lanes[1]), MAX(lanes[2], lanes[3]));
+  _mm_storeu_ps(lanes, vsum);
+  sum = (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+  for (; i < count; ++i) {
+    float v = samples[i];
+    min = MIN(min, v);
+    max = MAX(max, v);
+    sum += v * v;
+  }
+  bucket->min = min;
+  bucket->max = max;
+  bucket->sum_squares += sum;
+  bucket->values += count;
+}
+
+static void reduce_s16(const int16_t* samples, int count, bucket_t* bucket) {
+  if (count <= 0) {
+    return;
+  }
+  int min = G_MAXINT16;
+  int max = G_MININT16;
+  int64_t sum = 0;
+  int i = 0;
+#ifdef __SSE2__
+  __m128i vmin = _mm_set1_epi16(G_MAXINT16);
+  __m128i vmax = _mm_set1_epi16(G_MININT16);
+  __m128i vsum = _mm_setzero_si128();
+  __m128i zero = _mm_setzero_si128();
+  for (; i + 8 <= count; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(samples + i));
+    vmin = _mm_min_epi16(vmin, v);
+    vmax = _mm_max_epi16(vmax, v);
+
+    // A pair of squares is at most 2^31, which only fits a
+    // lane as unsigned, so widen to 64 bits to accumulate.
+    __m128i squares = _mm_madd_epi16(v, v);
+    vsum = _mm_add_epi64(vsum, _mm_unpacklo_epi32(squares, zero));
+    vsum = _mm_add_epi64(vsum, _mm_unpackhi_epi32(squares, zero));
+  }
+  int16_t mins[8];
+  int16_t maxs[8];
+  int64_t sums[2];
+  _mm_storeu_si128((__m128i*)mins, vmin);
+  _mm_storeu_si128((__m128i*)maxs, vmax);
+  _mm_storeu_si128((__m128i*)sums, vsum);
+  for (int j = 0; j < 8; ++j) {
+    min = MIN(min, mins[j]);
+    max = MAX(max, maxs[j]);
+  }
+  sum = sums[0] + sums[1];
+#endif
+  for (; i < count; ++i) {
+    int v = samples[i];
+    min = MIN(min, v);
+    max = MAX(max, v);
+    sum += v * v;
+  }
+  bucket->min = MIN(bucket->min, (float)min / 32768.0f);
+  bucket->max = MAX(bucket->max, (float)max / 32768.0f);
+  bucket->sum_squares += (double)sum / (32768.0 * 32768.0);
+  bucket->values += count;
+}
+
+static void reduce_value(float value, bucket_t* bucket) {
+  bucket->min = MIN(bucket->min, value);
+  bucket->max = MAX(bucket->max, value);
+  bucket->sum_squares += (double)value * value;
+  bucket->values++;
+}
+
+static void reset_bucket(bucket_t* bucket) {
+  bucket->min = G_MAXFLOAT;
+  bucket->max = -G_MAXFLOAT;
+  bucket->sum_squares = 0;
+  bucket->values = 0;
+  bucket->samples = 0;
+}
+
+static void emit_bucket(bucket_t* bucket, GArray* peaks) {
+  double rms = sqrt(bucket->sum_squares / MAX(1, bucket->values));
+  waveform_peak_t peak;
+  peak.min = (int16_t)lrintf(CLAMP(bucket->min, -1.0f, 1.0f) * G_MAXINT16);
+  peak.max = (int16_t)lrintf(CLAMP(bucket->max, -1.0f, 1.0f) * G_MAXINT16);
+  peak.rms = (int16_t)lrint(MIN(rms, 1.0) * G_MAXINT16);
+  g_array_append_val(peaks, peak);
+  reset_bucket(bucket);
+}
+
+static void build_pyramid(waveform_t* w) {
+  while (w->num_levels < WAVEFORM_MAX_LEVELS &&
+         w->lengths[w->num_levels - 1] > 1) {
+    const waveform_peak_t* src = w->levels[w->num_levels - 1];
+    int src_length = w->lengths[w->num_levels - 1];
+    int length = (src_length + 1) / 2;
+    waveform_peak_t* dst = g_new(waveform_peak_t, length);
+    for (int i = 0; i < length; ++i) {
+      const waveform_peak_t* a = &src[i * 2];
+      const waveform_peak_t* b = i * 2 + 1 < src_length ? a + 1 : a;
+      dst[i].min = MIN(a->min, b->min);
+      dst[i].max = MAX(a->max, b->max);
+      dst[i].rms = (int16_t)sqrt(
+          ((double)a->rms * a->rms + (double)b->rms * b->rms) / 2);
+    }
+    w->levels[w->num_levels] = dst;
+    w->lengths[w->num_levels] = length;
+    w->num_levels++;
+  }
+}
+
+static waveform_t* load_cached(const char* path) {
+  gchar* data = NULL;
+  gsize size = 0;
+  if (!media_cache_load(path, WAVEFORM_CACHE_KIND, &data, &size)) {
+    return NULL;
+  }
+
+  waveform_t* w = NULL;
+  cache_header_t header;
+  if (size < sizeof(header)) {
+    goto done;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.magic != WAVEFORM_CACHE_MAGIC ||
+      header.version != WAVEFORM_CACHE_VERSION || header.num_levels < 1 ||
+      header.num_levels > WAVEFORM_MAX_LEVELS) {
+    goto done;
+  }
+
+  w = g_new0(waveform_t, 1);
+  w->rate = header.rate;
+  w->num_levels = header.num_levels;
+  gsize offset = sizeof(header);
+  for (int i = 0; i < header.num_levels; ++i) {
+    gsize bytes = sizeof(waveform_peak_t) * (gsize)header.lengths[i];
+    if (header.lengths[i] <= 0 || offset + bytes > size) {
+      waveform_free(w);
+      w = NULL;
+      goto done;
+    }
+    w->lengths[i] = header.lengths[i];
+    w->levels[i] = (waveform_peak_t*)g_memdup(data + offset, bytes);
+    offset += bytes;
+  }
+
+done:
+  g_free(data);
+  return w;
+}
+
+static void store_cached(const char* path, const waveform_t* w) {
+  cache_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = WAVEFORM_CACHE_MAGIC;
+  header.version = WAVEFORM_CACHE_VERSION;
+  header.rate = w->rate;
+  header.num_levels = w->num_levels;
+  memcpy(header.lengths, w->lengths, sizeof(header.lengths));
+
+  GByteArray* bytes = g_byte_array_new();
+  g_byte_array_append(bytes, (const guint8*)&header, sizeof(header));
+  for (int i = 0; i < w->num_levels; ++i) {
+    g_byte_array_append(bytes, (const guint8*)w->levels[i],
+                        sizeof(waveform_peak_t) * w->lengths[i]);
+  }
+  media_cache_store(path, WAVEFORM_CACHE_KIND, (const gchar*)bytes->data,
+                    bytes->len);
+  g_byte_array_free(bytes, TRUE);
+}
@@ -0,0 +1,53 @@
+#ifndef __WAVEFORM_H__
+#define __WAVEFORM_H__
+
+#include <glib.h>
+#include "video_info.h"
+
+// Buckets per second at the finest level of the pyramid.
+#define WAVEFORM_RATE 200
+#define WAVEFORM_MAX_LEVELS 32
+
+// Sample range and RMS of a bucket, scaled to 16 bits.
+typedef struct {
+  int16_t min;
+  int16_t max;
+  int16_t rms;
+} waveform_peak_t;
+
+// A min/max pyramid of the main audio track. Each level
+// halves the number of buckets of the one before it, so a
+// strip of any width can be drawn by reading about one
+// bucket per pixel.
+typedef struct {
+  double rate;
+  int num_levels;
+  int lengths[WAVEFORM_MAX_LEVELS];
+  waveform_peak_t* levels[WAVEFORM_MAX_LEVELS];
+} waveform_t;
+
+// Called on the main thread once the waveform is ready,
+// or with NULL if the media has no usable audio. The
+// callee owns the waveform.
+typedef void (*waveform_cb)(waveform_t* waveform, gpointer user_data);
+
+typedef struct waveform_loader waveform_loader_t;
+
+// Load the waveform of the media in the background, from
+// the disk cache if possible.
+waveform_loader_t* waveform_load(media_t* media,
+                                 waveform_cb cb,
+                                 gpointer user_data);
+
+// Stop a load. The callback will not be invoked.
+void waveform_loader_cancel(waveform_loader_t* l);
+
+// Reduce the time range [start, end) into count columns.
+void waveform_columns(const waveform_t* w,
+                      double start,
+                      double end,
+                      int count,
+                      waveform_peak_t* columns);
+void waveform_free(waveform_t* w);
+
+#endif